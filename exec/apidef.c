@@ -140,7 +140,8 @@ static struct corosync_api_v1 apidef_corosync_api_v1 = {
 	.state_dump = corosync_state_dump,
 	.poll_handle_get = cs_poll_handle_get,
 	.poll_dispatch_add = cs_poll_dispatch_add,
-	.poll_dispatch_delete = cs_poll_dispatch_delete
+	.poll_dispatch_delete = cs_poll_dispatch_delete,
+	.ipc_credentials_get = cs_ipc_credentials_get
 };
 
 struct corosync_api_v1 *apidef_get (void)
@@ -132,6 +132,18 @@ struct cmap_conn_info {
 typedef uint64_t cmap_iter_handle_t;
 typedef uint64_t cmap_track_handle_t;
 
+/*
+ * Iterator stored in iter_db. Key which didn't fit into batch response
+ * is kept as pending and returned first by next iter_next(_batch) call.
+ */
+struct cmap_iter_inst {
+	icmap_iter_t iter;
+	int has_pending;
+	size_t pending_value_len;
+	icmap_value_types_t pending_type;
+	char pending_key[ICMAP_KEYNAME_MAXLEN + 1];
+};
+
 struct cmap_track_user_data {
 	void *conn;
 	cmap_track_handle_t track_handle;
@@ -165,6 +177,7 @@ static void message_handler_req_lib_cmap_iter_finalize(void *conn, const void *m
 static void message_handler_req_lib_cmap_track_add(void *conn, const void *message);
 static void message_handler_req_lib_cmap_track_delete(void *conn, const void *message);
 static void message_handler_req_lib_cmap_set_current_map(void *conn, const void *message);
+static void message_handler_req_lib_cmap_iter_next_batch(void *conn, const void *message);
 
 static void cmap_notify_fn(int32_t event,
 		const char *key_name,
@@ -250,6 +263,10 @@ static struct corosync_lib_handler cmap_lib_engine[] =
 		.lib_handler_fn				= message_handler_req_lib_cmap_set_current_map,
 		.flow_control				= CS_LIB_FLOW_CONTROL_NOT_REQUIRED
 	},
+	{ /* 10 */
+		.lib_handler_fn				= message_handler_req_lib_cmap_iter_next_batch,
+		.flow_control				= CS_LIB_FLOW_CONTROL_NOT_REQUIRED
+	},
 };
 
 static struct corosync_exec_handler cmap_exec_engine[] =
@@ -386,7 +403,7 @@ static int cmap_lib_exit_fn (void *conn)
 {
 	struct cmap_conn_info *conn_info = (struct cmap_conn_info *)api->ipc_private_data_get (conn);
 	hdb_handle_t iter_handle = 0;
-	icmap_iter_t *iter;
+	struct cmap_iter_inst *iter_inst;
 	hdb_handle_t track_handle = 0;
 	icmap_track_t *track;
 
@@ -394,9 +411,9 @@ static int cmap_lib_exit_fn (void *conn)
 
 	hdb_iterator_reset(&conn_info->iter_db);
         while (hdb_iterator_next(&conn_info->iter_db,
-                (void*)&iter, &iter_handle) == 0) {
+                (void*)&iter_inst, &iter_handle) == 0) {
 
-		conn_info->map_fns.map_iter_finalize(*iter);
+		conn_info->map_fns.map_iter_finalize(iter_inst->iter);
 
 		(void)hdb_handle_put (&conn_info->iter_db, iter_handle);
         }
@@ -617,7 +634,7 @@ static void message_handler_req_lib_cmap_iter_init(void *conn, const void *messa
 	struct res_lib_cmap_iter_init res_lib_cmap_iter_init;
 	cs_error_t ret;
 	icmap_iter_t iter;
-	icmap_iter_t *hdb_iter;
+	struct cmap_iter_inst *iter_inst;
 	cmap_iter_handle_t handle = 0ULL;
 	const char *prefix;
 	struct cmap_conn_info *conn_info = (struct cmap_conn_info *)api->ipc_private_data_get (conn);
@@ -634,17 +651,18 @@ static void message_handler_req_lib_cmap_iter_init(void *conn, const void *messa
 		goto reply_send;
 	}
 
-	ret = hdb_error_to_cs(hdb_handle_create(&conn_info->iter_db, sizeof(iter), &handle));
+	ret = hdb_error_to_cs(hdb_handle_create(&conn_info->iter_db, sizeof(*iter_inst), &handle));
 	if (ret != CS_OK) {
 		goto reply_send;
 	}
 
-	ret = hdb_error_to_cs(hdb_handle_get(&conn_info->iter_db, handle, (void *)&hdb_iter));
+	ret = hdb_error_to_cs(hdb_handle_get(&conn_info->iter_db, handle, (void *)&iter_inst));
 	if (ret != CS_OK) {
 		goto reply_send;
 	}
 
-	*hdb_iter = iter;
+	memset(iter_inst, 0, sizeof(*iter_inst));
+	iter_inst->iter = iter;
 
 	(void)hdb_handle_put (&conn_info->iter_db, handle);
 
@@ -658,24 +676,56 @@ reply_send:
 	api->ipc_response_send(conn, &res_lib_cmap_iter_init, sizeof(res_lib_cmap_iter_init));
 }
 
+static const char *cmap_iter_inst_next(struct cmap_conn_info *conn_info,
+	struct cmap_iter_inst *iter_inst,
+	size_t *value_len,
+	icmap_value_types_t *type)
+{
+
+	if (iter_inst->has_pending) {
+		iter_inst->has_pending = 0;
+		*value_len = iter_inst->pending_value_len;
+		*type = iter_inst->pending_type;
+
+		return (iter_inst->pending_key);
+	}
+
+	return (conn_info->map_fns.map_iter_next(iter_inst->iter, value_len, type));
+}
+
+static void cmap_iter_inst_push_back(struct cmap_iter_inst *iter_inst,
+	const char *key_name,
+	size_t value_len,
+	icmap_value_types_t type)
+{
+
+	if (key_name != iter_inst->pending_key) {
+		strncpy(iter_inst->pending_key, key_name, sizeof(iter_inst->pending_key) - 1);
+		iter_inst->pending_key[sizeof(iter_inst->pending_key) - 1] = '\0';
+	}
+	iter_inst->pending_value_len = value_len;
+	iter_inst->pending_type = type;
+	iter_inst->has_pending = 1;
+}
+
 static void message_handler_req_lib_cmap_iter_next(void *conn, const void *message)
 {
 	const struct req_lib_cmap_iter_next *req_lib_cmap_iter_next = message;
 	struct res_lib_cmap_iter_next res_lib_cmap_iter_next;
 	cs_error_t ret;
-	icmap_iter_t *iter;
+	struct cmap_iter_inst *iter_inst;
 	size_t value_len = 0;
 	icmap_value_types_t type = 0;
 	const char *res = NULL;
 	struct cmap_conn_info *conn_info = (struct cmap_conn_info *)api->ipc_private_data_get (conn);
 
 	ret = hdb_error_to_cs(hdb_handle_get(&conn_info->iter_db,
-				req_lib_cmap_iter_next->iter_handle, (void *)&iter));
+				req_lib_cmap_iter_next->iter_handle, (void *)&iter_inst));
 	if (ret != CS_OK) {
 		goto reply_send;
 	}
 
-	res = conn_info->map_fns.map_iter_next(*iter, &value_len, &type);
+	res = cmap_iter_inst_next(conn_info, iter_inst, &value_len, &type);
 	if (res == NULL) {
 		ret = CS_ERR_NO_SECTIONS;
 	}
@@ -704,16 +754,16 @@ static void message_handler_req_lib_cmap_iter_finalize(void *conn, const void *m
 	const struct req_lib_cmap_iter_finalize *req_lib_cmap_iter_finalize = message;
 	struct res_lib_cmap_iter_finalize res_lib_cmap_iter_finalize;
 	cs_error_t ret;
-	icmap_iter_t *iter;
+	struct cmap_iter_inst *iter_inst;
 	struct cmap_conn_info *conn_info = (struct cmap_conn_info *)api->ipc_private_data_get (conn);
 
 	ret = hdb_error_to_cs(hdb_handle_get(&conn_info->iter_db,
-				req_lib_cmap_iter_finalize->iter_handle, (void *)&iter));
+				req_lib_cmap_iter_finalize->iter_handle, (void *)&iter_inst));
 	if (ret != CS_OK) {
 		goto reply_send;
 	}
 
-	conn_info->map_fns.map_iter_finalize(*iter);
+	conn_info->map_fns.map_iter_finalize(iter_inst->iter);
 
 	(void)hdb_handle_destroy(&conn_info->iter_db, req_lib_cmap_iter_finalize->iter_handle);
 
@@ -728,6 +778,122 @@ reply_send:
 	api->ipc_response_send(conn, &res_lib_cmap_iter_finalize, sizeof(res_lib_cmap_iter_finalize));
 }
 
+/*
+ * Pack as many keys (with values) as fits into max_size bytes. Key which
+ * doesn't fit is kept as pending for next call. If not even first key fits,
+ * CS_ERR_TOO_BIG is returned and client is expected to fall back to
+ * iter_next + get for that key.
+ */
+static void message_handler_req_lib_cmap_iter_next_batch(void *conn, const void *message)
+{
+	const struct req_lib_cmap_iter_next_batch *req_lib_cmap_iter_next_batch = message;
+	struct res_lib_cmap_iter_next_batch *res_lib_cmap_iter_next_batch;
+	struct res_lib_cmap_iter_next_batch error_res_lib_cmap_iter_next_batch;
+	struct cmap_iter_batch_item *item;
+	struct cmap_iter_inst *iter_inst;
+	cs_error_t ret;
+	size_t max_size;
+	size_t res_size;
+	size_t item_size;
+	size_t key_len;
+	size_t value_len;
+	icmap_value_types_t type;
+	const char *key_name;
+	uint32_t entries;
+	struct cmap_conn_info *conn_info = (struct cmap_conn_info *)api->ipc_private_data_get (conn);
+
+	max_size = req_lib_cmap_iter_next_batch->max_size;
+	if (max_size > CMAP_ITER_BATCH_MAX_SIZE) {
+		max_size = CMAP_ITER_BATCH_MAX_SIZE;
+	}
+
+	if (max_size < sizeof(*res_lib_cmap_iter_next_batch)) {
+		ret = CS_ERR_INVALID_PARAM;
+		goto error_exit;
+	}
+
+	res_lib_cmap_iter_next_batch = malloc(max_size);
+	if (res_lib_cmap_iter_next_batch == NULL) {
+		ret = CS_ERR_NO_MEMORY;
+		goto error_exit;
+	}
+
+	ret = hdb_error_to_cs(hdb_handle_get(&conn_info->iter_db,
+				req_lib_cmap_iter_next_batch->iter_handle, (void *)&iter_inst));
+	if (ret != CS_OK) {
+		free(res_lib_cmap_iter_next_batch);
+		goto error_exit;
+	}
+
+	memset(res_lib_cmap_iter_next_batch, 0, sizeof(*res_lib_cmap_iter_next_batch));
+	res_size = sizeof(*res_lib_cmap_iter_next_batch);
+	entries = 0;
+
+	while ((key_name = cmap_iter_inst_next(conn_info, iter_inst, &value_len, &type)) != NULL) {
+		if (value_len == 0 && (type == ICMAP_VALUETYPE_STRING || type == ICMAP_VALUETYPE_BINARY) &&
+		    conn_info->map_fns.map_get(key_name, NULL, &value_len, &type) != CS_OK) {
+			/*
+			 * Stats map iterator doesn't know length of string values
+			 */
+			continue ;
+		}
+
+		key_len = strlen(key_name);
+		item_size = CMAP_ITER_BATCH_ITEM_SIZE(key_len, value_len);
+
+		if (res_size + item_size > max_size) {
+			cmap_iter_inst_push_back(iter_inst, key_name, value_len, type);
+			break;
+		}
+
+		item = (struct cmap_iter_batch_item *)((char *)res_lib_cmap_iter_next_batch + res_size);
+		memset(item, 0, item_size);
+		memcpy(item->data, key_name, key_len);
+
+		if (value_len > 0 &&
+		    conn_info->map_fns.map_get(key_name, item->data + CMAP_ITER_BATCH_ALIGN(key_len + 1),
+		    &value_len, &type) != CS_OK) {
+			/*
+			 * Key disappeared between iter_next and get
+			 */
+			continue ;
+		}
+
+		item->item_size = item_size;
+		item->key_len = key_len;
+		item->value_len = value_len;
+		item->type = type;
+
+		res_size += item_size;
+		entries++;
+	}
+
+	(void)hdb_handle_put (&conn_info->iter_db, req_lib_cmap_iter_next_batch->iter_handle);
+
+	if (entries == 0) {
+		ret = (key_name == NULL ? CS_ERR_NO_SECTIONS : CS_ERR_TOO_BIG);
+	}
+
+	res_lib_cmap_iter_next_batch->header.size = res_size;
+	res_lib_cmap_iter_next_batch->header.id = MESSAGE_RES_CMAP_ITER_NEXT_BATCH;
+	res_lib_cmap_iter_next_batch->header.error = ret;
+	res_lib_cmap_iter_next_batch->entries = entries;
+
+	api->ipc_response_send(conn, res_lib_cmap_iter_next_batch, res_size);
+	free(res_lib_cmap_iter_next_batch);
+
+	return ;
+
+error_exit:
+	memset(&error_res_lib_cmap_iter_next_batch, 0, sizeof(error_res_lib_cmap_iter_next_batch));
+	error_res_lib_cmap_iter_next_batch.header.size = sizeof(error_res_lib_cmap_iter_next_batch);
+	error_res_lib_cmap_iter_next_batch.header.id = MESSAGE_RES_CMAP_ITER_NEXT_BATCH;
+	error_res_lib_cmap_iter_next_batch.header.error = ret;
+
+	api->ipc_response_send(conn, &error_res_lib_cmap_iter_next_batch,
+	    sizeof(error_res_lib_cmap_iter_next_batch));
+}
+
 static void cmap_notify_fn(int32_t event,
 		const char *key_name,
 		struct icmap_notify_value new_val,
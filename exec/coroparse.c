@@ -615,6 +615,7 @@ static int main_config_parser_cb(const char *path,
 			    (strcmp(path, "totem.max_network_delay") == 0) ||
 			    (strcmp(path, "totem.window_size") == 0) ||
 			    (strcmp(path, "totem.max_messages") == 0) ||
+			    (strcmp(path, "totem.fcc_target_rotation") == 0) ||
 			    (strcmp(path, "totem.miss_count_const") == 0) ||
 			    (strcmp(path, "totem.knet_pmtud_interval") == 0) ||
 			    (strcmp(path, "totem.knet_compression_threshold") == 0) ||
@@ -695,6 +696,39 @@ static int main_config_parser_cb(const char *path,
 					return (0);
 				}
 			}
+			if (strcmp(path, "qb.stats_snapshot") == 0) {
+				if ((strcmp(value, "yes") != 0) &&
+				    (strcmp(value, "no") != 0)) {
+					*error_string = "Invalid qb stats_snapshot";
+
+					return (0);
+				}
+			}
+			if (strcmp(path, "qb.ipc_outq_policy") == 0) {
+				if ((strcmp(value, "disconnect") != 0) &&
+				    (strcmp(value, "drop_oldest") != 0) &&
+				    (strcmp(value, "backpressure") != 0)) {
+					*error_string = "Invalid qb ipc_outq_policy";
+
+					return (0);
+				}
+			}
+			if (strcmp(path, "qb.ipc_outq_max_size") == 0) {
+				val_type = ICMAP_VALUETYPE_UINT32;
+				if (safe_atoq(value, &val, val_type) != 0) {
+					goto atoi_error;
+				}
+				icmap_set_uint32_r(config_map, path, val);
+				add_as_string = 0;
+			}
+			if (strcmp(path, "qb.stats_notify_interval") == 0) {
+				val_type = ICMAP_VALUETYPE_UINT32;
+				if (safe_atoq(value, &val, val_type) != 0) {
+					goto atoi_error;
+				}
+				icmap_set_uint32_r(config_map, path, val);
+				add_as_string = 0;
+			}
 			break;
 
 		case MAIN_CP_CB_DATA_STATE_INTERFACE:
@@ -53,9 +53,11 @@
 #include <assert.h>
 #include <arpa/inet.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <qb/qblist.h>
 #include <qb/qbmap.h>
+#include <qb/qbutil.h>
 
 #include <corosync/corotypes.h>
 #include <qb/qbipc_common.h>
@@ -91,6 +93,62 @@ struct zcb_mapped {
 	void *addr;
 	size_t size;
 };
+
+/*
+ * Zero copy mcast messages bigger than this are sent as fragments. Same
+ * as fragment size of library, so every fragment fits dispatch buffer.
+ */
+#ifdef HAVE_SMALL_MEMORY_FOOTPRINT
+#define CPG_ZCB_FRAGMENT_SIZE		(1024 * 64 - 1024)
+#else
+#define CPG_ZCB_FRAGMENT_SIZE		(8192 * 128 - 1024)
+#endif
+
+/*
+ * Zero copy delivery pool
+ */
+#define CPG_ZC_DELIVER_MIN_SIZE		4096
+#ifdef HAVE_SMALL_MEMORY_FOOTPRINT
+#define CPG_ZC_POOL_SIZE		(1024 * 1024)
+#else
+#define CPG_ZC_POOL_SIZE		(16 * 1024 * 1024)
+#endif
+#define CPG_ZC_POOL_BLOCKS		(CPG_ZC_POOL_SIZE / CPG_ZC_DELIVER_MIN_SIZE + 2)
+#define CPG_ZC_ALIGN(len)		(((len) + 63) & ~63)
+
+struct cpg_zc_block {
+	size_t offset;
+	size_t size;
+	uint32_t refcnt;
+};
+
+/* Reference of connection to block of pool */
+struct cpg_zc_ref {
+	uint64_t seq;
+	uint32_t block_id;
+};
+
+struct cpg_zc_pool {
+	struct qb_list_head list;
+	mar_cpg_name_t group_name;
+	uid_t uid;
+	char path[CPG_ZC_PATH_LEN];
+	char *addr;
+	size_t size;
+	size_t head;
+	size_t tail;
+	size_t used;
+	uint32_t block_head;
+	uint32_t block_tail;
+	/* Block of message being delivered (identified by token) */
+	uint64_t token;
+	uint32_t token_block_id;
+	struct qb_list_head pd_list_head;
+	struct cpg_zc_block blocks[CPG_ZC_POOL_BLOCKS];
+};
+
+QB_LIST_DECLARE (cpg_zc_pool_list_head);
+static uint64_t cpg_zc_token;
 /*
  * state`		exec deliver
  * match group name, pid -> if matched deliver for YES:
@@ -152,6 +210,7 @@ static struct qb_list_head joinlist_messages_head;
 struct cpg_pd {
 	void *conn;
  	mar_cpg_name_t group_name;
+	struct group_info *group_info; /* Set while group_name is set */
 	uint32_t pid;
 	enum cpd_state cpd_state;
 	unsigned int flags;
@@ -159,8 +218,27 @@ struct cpg_pd {
 	uint64_t transition_counter; /* These two are used when sending fragmented messages */
 	uint64_t initial_transition_counter;
 	struct qb_list_head list;
+	struct qb_list_head group_list; /* on the group_info pd list */
 	struct qb_list_head iteration_instance_list_head;
 	struct qb_list_head zcb_mapped_list_head;
+	/*
+	 * Unfinished fragmented mcast, aborted before any other mcast of the
+	 * connection. Either zero copy mcast which didn't fit totem queue, or
+	 * message sent in fragments by the library (zcb_partial_sent is then
+	 * offset of the next fragment). Address is NULL for the library
+	 * message and while the abort of a freed buffer still has to be sent.
+	 */
+	void *zcb_partial_addr;
+	size_t zcb_partial_msg_len;
+	size_t zcb_partial_sent;
+	/* Zero copy delivery, zc_pool is NULL when not enabled */
+	struct cpg_zc_pool *zc_pool;
+	struct qb_list_head zc_pool_list;
+	struct cpg_zc_deliver_control *zc_ctrl;
+	uint64_t zc_seq;
+	struct cpg_zc_ref *zc_refs;
+	uint32_t zc_refs_head;
+	uint32_t zc_refs_tail;
 };
 
 struct cpg_iteration_instance {
@@ -192,10 +270,33 @@ struct process_info {
 	unsigned int nodeid;
 	uint32_t pid;
 	mar_cpg_name_t group;
-	struct qb_list_head list; /* on the group_info members list */
+	struct group_info *group_info;
+	struct qb_list_head list; /* on process_info_list_head */
+	struct qb_list_head group_list; /* on the group_info members list */
 };
 QB_LIST_DECLARE (process_info_list_head);
 
+/*
+ * Per group index of local connections and cluster wide members, so message
+ * delivery doesn't have to walk every connection and every process. Entries
+ * live in group_hash for as long as any cpg_pd or process_info refers to them.
+ */
+struct group_node {
+	unsigned int nodeid;
+	unsigned int members;
+	struct qb_list_head list;
+};
+
+struct group_info {
+	mar_cpg_name_t group;
+	struct qb_list_head members_list_head; /* process_info, sorted as process_info_list_head */
+	struct qb_list_head nodes_list_head; /* group_node */
+	struct qb_list_head pd_list_head; /* cpg_pd */
+	struct qb_list_head list; /* on group_hash */
+};
+
+static struct qb_list_head group_hash[GROUP_HASH_SIZE];
+
 struct join_list_entry {
 	uint32_t pid;
 	mar_cpg_name_t group_name;
@@ -260,6 +361,20 @@ static void message_handler_req_lib_cpg_mcast (void *conn, const void *message);
 
 static void message_handler_req_lib_cpg_partial_mcast (void *conn, const void *message);
 
+static void message_handler_req_lib_cpg_mcast_batch (void *conn, const void *message);
+
+static void message_handler_req_lib_cpg_zc_deliver_enable (
+	void *conn,
+	const void *message);
+
+static void cpg_zc_pd_detach (struct cpg_pd *cpd);
+
+static int cpg_zc_deliver (
+	struct cpg_pd *cpd,
+	const struct res_lib_cpg_deliver_callback *res_lib_cpg_mcast,
+	const void *msg,
+	uint64_t token);
+
 static void message_handler_req_lib_cpg_membership (void *conn,
 						    const void *message);
 
@@ -397,6 +512,14 @@ static struct corosync_lib_handler cpg_lib_engine[] =
 		.lib_handler_fn				= message_handler_req_lib_cpg_partial_mcast,
 		.flow_control				= CS_LIB_FLOW_CONTROL_REQUIRED
 	},
+	{ /* 13 */
+		.lib_handler_fn				= message_handler_req_lib_cpg_mcast_batch,
+		.flow_control				= CS_LIB_FLOW_CONTROL_REQUIRED
+	},
+	{ /* 14 */
+		.lib_handler_fn				= message_handler_req_lib_cpg_zc_deliver_enable,
+		.flow_control				= CS_LIB_FLOW_CONTROL_NOT_REQUIRED
+	},
 
 };
 
@@ -547,6 +670,179 @@ static char *cpg_print_group_name(const mar_cpg_name_t *group)
 	return (res);
 }
 
+static unsigned int group_hash_index (const mar_cpg_name_t *group)
+{
+	unsigned int hash = 0;
+	unsigned int i;
+
+	for (i = 0; i < group->length; i++) {
+		hash = hash * 31 + (unsigned char)group->value[i];
+	}
+
+	return (hash % GROUP_HASH_SIZE);
+}
+
+static struct group_info *group_info_find (const mar_cpg_name_t *group)
+{
+	struct qb_list_head *iter;
+	struct group_info *gi;
+
+	qb_list_for_each(iter, &group_hash[group_hash_index (group)]) {
+		gi = qb_list_entry (iter, struct group_info, list);
+
+		if (mar_name_compare (&gi->group, group) == 0) {
+			return (gi);
+		}
+	}
+
+	return (NULL);
+}
+
+/*
+ * Find group_info for group or create new one
+ */
+static struct group_info *group_info_get (const mar_cpg_name_t *group)
+{
+	struct group_info *gi;
+
+	gi = group_info_find (group);
+	if (gi != NULL) {
+		return (gi);
+	}
+
+	gi = malloc (sizeof (struct group_info));
+	if (!gi) {
+		return (NULL);
+	}
+	memcpy (&gi->group, group, sizeof (*group));
+	qb_list_init (&gi->members_list_head);
+	qb_list_init (&gi->nodes_list_head);
+	qb_list_init (&gi->pd_list_head);
+	qb_list_init (&gi->list);
+	qb_list_add (&gi->list, &group_hash[group_hash_index (group)]);
+
+	return (gi);
+}
+
+/*
+ * Free group_info if nothing refers to it anymore
+ */
+static void group_info_release (struct group_info *gi)
+{
+	if (qb_list_empty (&gi->members_list_head) && qb_list_empty (&gi->pd_list_head)) {
+		qb_list_del (&gi->list);
+		free (gi);
+	}
+}
+
+static struct group_node *group_info_node_find (
+	const struct group_info *gi,
+	unsigned int nodeid)
+{
+	struct qb_list_head *iter;
+	struct group_node *gn;
+
+	qb_list_for_each(iter, &gi->nodes_list_head) {
+		gn = qb_list_entry (iter, struct group_node, list);
+
+		if (gn->nodeid == nodeid) {
+			return (gn);
+		}
+	}
+
+	return (NULL);
+}
+
+static int group_info_member_add (struct group_info *gi, struct process_info *pi)
+{
+	struct group_node *gn;
+	struct process_info *pi_entry;
+	struct qb_list_head *list;
+	struct qb_list_head *list_to_add;
+
+	gn = group_info_node_find (gi, pi->nodeid);
+	if (gn == NULL) {
+		gn = malloc (sizeof (struct group_node));
+		if (!gn) {
+			return (-1);
+		}
+		gn->nodeid = pi->nodeid;
+		gn->members = 0;
+		qb_list_init (&gn->list);
+		qb_list_add (&gn->list, &gi->nodes_list_head);
+	}
+	gn->members++;
+
+	/*
+	 * Keep same order as process_info_list_head so membership is reported
+	 * consistently on all nodes
+	 */
+	list_to_add = &gi->members_list_head;
+	qb_list_for_each(list, &gi->members_list_head) {
+		pi_entry = qb_list_entry(list, struct process_info, group_list);
+		if (pi_entry->nodeid > pi->nodeid ||
+			(pi_entry->nodeid == pi->nodeid && pi_entry->pid > pi->pid)) {
+
+			break;
+		}
+		list_to_add = list;
+	}
+	qb_list_add (&pi->group_list, list_to_add);
+	pi->group_info = gi;
+
+	return (0);
+}
+
+static void group_info_member_del (struct process_info *pi)
+{
+	struct group_info *gi = pi->group_info;
+	struct group_node *gn;
+
+	qb_list_del (&pi->group_list);
+	pi->group_info = NULL;
+
+	gn = group_info_node_find (gi, pi->nodeid);
+	assert (gn != NULL);
+	if (--gn->members == 0) {
+		qb_list_del (&gn->list);
+		free (gn);
+	}
+
+	group_info_release (gi);
+}
+
+static void process_info_free (struct process_info *pi)
+{
+	qb_list_del (&pi->list);
+	group_info_member_del (pi);
+	free (pi);
+}
+
+/*
+ * Remove cpd from group index. Caller is responsible for calling
+ * group_info_release on previous group_info.
+ */
+static void cpg_pd_group_unlink (struct cpg_pd *cpd)
+{
+	if (cpd->group_info == NULL) {
+		return ;
+	}
+
+	qb_list_del (&cpd->group_list);
+	qb_list_init (&cpd->group_list);
+	cpd->group_info = NULL;
+}
+
+static void cpg_pd_group_unlink_and_release (struct cpg_pd *cpd)
+{
+	struct group_info *gi = cpd->group_info;
+
+	cpg_pd_group_unlink (cpd);
+	if (gi != NULL) {
+		group_info_release (gi);
+	}
+}
+
 static void cpg_sync_init (
 	const unsigned int *trans_list,
 	size_t trans_list_entries,
@@ -680,16 +976,19 @@ static int notify_lib_joinlist(
 {
 	int size;
 	char *buf;
-	struct qb_list_head *iter;
+	struct qb_list_head *iter, *tmp_iter;
+	struct group_info *gi;
 	int count;
 	struct res_lib_cpg_confchg_callback *res;
 	mar_cpg_address_t *retgi;
 
 	count = 0;
 
-	qb_list_for_each(iter, &process_info_list_head) {
-		struct process_info *pi = qb_list_entry (iter, struct process_info, list);
-		if (mar_name_compare (&pi->group, group_name) == 0) {
+	gi = group_info_find (group_name);
+
+	if (gi != NULL) {
+		qb_list_for_each(iter, &gi->members_list_head) {
+			struct process_info *pi = qb_list_entry (iter, struct process_info, group_list);
 			int i;
 			int founded = 0;
 
@@ -720,10 +1019,9 @@ static int notify_lib_joinlist(
 	res->header.error = CS_OK;
 	memcpy(&res->group_name, group_name, sizeof(mar_cpg_name_t));
 
-	qb_list_for_each(iter, &process_info_list_head) {
-		struct process_info *pi=qb_list_entry (iter, struct process_info, list);
-
-		if (mar_name_compare (&pi->group, group_name) == 0) {
+	if (gi != NULL) {
+		qb_list_for_each(iter, &gi->members_list_head) {
+			struct process_info *pi=qb_list_entry (iter, struct process_info, group_list);
 			int i;
 			int founded = 0;
 
@@ -753,35 +1051,35 @@ static int notify_lib_joinlist(
 
 	if (conn) {
 		api->ipc_dispatch_send (conn, buf, size);
-	} else {
-	qb_list_for_each(iter, &cpg_pd_list_head) {
-			struct cpg_pd *cpd = qb_list_entry (iter, struct cpg_pd, list);
-			if (mar_name_compare (&cpd->group_name, group_name) == 0) {
-				assert (joined_list_entries <= 1);
-				if (joined_list_entries) {
-					if (joined_list[0].pid == cpd->pid &&
-						joined_list[0].nodeid == api->totem_nodeid_get()) {
-						cpd->cpd_state = CPD_STATE_JOIN_COMPLETED;
-					}
+	} else if (gi != NULL) {
+		qb_list_for_each_safe(iter, tmp_iter, &gi->pd_list_head) {
+			struct cpg_pd *cpd = qb_list_entry (iter, struct cpg_pd, group_list);
+			assert (joined_list_entries <= 1);
+			if (joined_list_entries) {
+				if (joined_list[0].pid == cpd->pid &&
+					joined_list[0].nodeid == api->totem_nodeid_get()) {
+					cpd->cpd_state = CPD_STATE_JOIN_COMPLETED;
 				}
-				if (cpd->cpd_state == CPD_STATE_JOIN_COMPLETED ||
-					cpd->cpd_state == CPD_STATE_LEAVE_STARTED) {
+			}
+			if (cpd->cpd_state == CPD_STATE_JOIN_COMPLETED ||
+				cpd->cpd_state == CPD_STATE_LEAVE_STARTED) {
 
-					api->ipc_dispatch_send (cpd->conn, buf, size);
-					cpd->transition_counter++;
-				}
-				if (left_list_entries) {
-					if (left_list[0].pid == cpd->pid &&
-						left_list[0].nodeid == api->totem_nodeid_get() &&
-						left_list[0].reason == CONFCHG_CPG_REASON_LEAVE) {
-
-						cpd->pid = 0;
-						memset (&cpd->group_name, 0, sizeof(cpd->group_name));
-						cpd->cpd_state = CPD_STATE_UNJOINED;
-					}
+				api->ipc_dispatch_send (cpd->conn, buf, size);
+				cpd->transition_counter++;
+			}
+			if (left_list_entries) {
+				if (left_list[0].pid == cpd->pid &&
+					left_list[0].nodeid == api->totem_nodeid_get() &&
+					left_list[0].reason == CONFCHG_CPG_REASON_LEAVE) {
+
+					cpd->pid = 0;
+					cpg_pd_group_unlink (cpd);
+					memset (&cpd->group_name, 0, sizeof(cpd->group_name));
+					cpd->cpd_state = CPD_STATE_UNJOINED;
 				}
 			}
 		}
+		group_info_release (gi);
 	}
 
 
@@ -925,8 +1223,7 @@ static void downlist_master_choose_and_send (void)
 			pcd->left_list[size].pid = left_pi->pid;
 			pcd->left_list[size].reason = CONFCHG_CPG_REASON_NODEDOWN;
 			pcd->left_list_entries++;
-			qb_list_del (&left_pi->list);
-			free (left_pi);
+			process_info_free (left_pi);
 		}
 	}
 
@@ -1056,8 +1353,13 @@ static void joinlist_messages_delete (void)
 
 static char *cpg_exec_init_fn (struct corosync_api_v1 *corosync_api)
 {
+	int i;
+
 	qb_list_init (&downlist_messages_head);
 	qb_list_init (&joinlist_messages_head);
+	for (i = 0; i < GROUP_HASH_SIZE; i++) {
+		qb_list_init (&group_hash[i]);
+	}
 	api = corosync_api;
 	return (NULL);
 }
@@ -1083,12 +1385,14 @@ static void cpg_pd_finalize (struct cpg_pd *cpd)
 	struct cpg_iteration_instance *cpii;
 
 	zcb_all_free(cpd);
+	cpg_zc_pd_detach (cpd);
 	qb_list_for_each_safe(iter, tmp_iter, &(cpd->iteration_instance_list_head)) {
 		cpii = qb_list_entry (iter, struct cpg_iteration_instance, list);
 
 		cpg_iteration_instance_finalize (cpii);
 	}
 
+	cpg_pd_group_unlink_and_release (cpd);
 	qb_list_del (&cpd->list);
 }
 
@@ -1199,12 +1503,17 @@ static void exec_cpg_partial_mcast_endian_convert (void *msg)
 
 static struct process_info *process_info_find(const mar_cpg_name_t *group_name, uint32_t pid, unsigned int nodeid) {
 	struct qb_list_head *iter;
+	struct group_info *gi;
 
-	qb_list_for_each(iter, &process_info_list_head) {
-		struct process_info *pi = qb_list_entry (iter, struct process_info, list);
+	gi = group_info_find (group_name);
+	if (gi == NULL) {
+		return NULL;
+	}
 
-		if (pi->pid == pid && pi->nodeid == nodeid &&
-			mar_name_compare (&pi->group, group_name) == 0) {
+	qb_list_for_each(iter, &gi->members_list_head) {
+		struct process_info *pi = qb_list_entry (iter, struct process_info, group_list);
+
+		if (pi->pid == pid && pi->nodeid == nodeid) {
 				return pi;
 		}
 	}
@@ -1220,6 +1529,7 @@ static void do_proc_join(
 {
 	struct process_info *pi;
 	struct process_info *pi_entry;
+	struct group_info *gi;
 	mar_cpg_address_t notify_info;
 	struct qb_list_head *list;
 	struct qb_list_head *list_to_add = NULL;
@@ -1227,15 +1537,29 @@ static void do_proc_join(
 	if (process_info_find (name, pid, nodeid) != NULL) {
 		return ;
  	}
+	gi = group_info_get (name);
+	if (!gi) {
+		log_printf(LOGSYS_LEVEL_WARNING, "Unable to allocate group_info struct");
+		return;
+	}
 	pi = malloc (sizeof (struct process_info));
 	if (!pi) {
 		log_printf(LOGSYS_LEVEL_WARNING, "Unable to allocate process_info struct");
+		group_info_release (gi);
 		return;
 	}
 	pi->nodeid = nodeid;
 	pi->pid = pid;
 	memcpy(&pi->group, name, sizeof(*name));
 	qb_list_init(&pi->list);
+	qb_list_init(&pi->group_list);
+
+	if (group_info_member_add (gi, pi) == -1) {
+		log_printf(LOGSYS_LEVEL_WARNING, "Unable to allocate group_node struct");
+		free (pi);
+		group_info_release (gi);
+		return;
+	}
 
 	/*
 	 * Insert new process in sorted order so synchronization works properly
@@ -1269,7 +1593,6 @@ static void do_proc_leave(
 	int reason)
 {
 	struct process_info *pi;
-	struct qb_list_head *iter, *tmp_iter;
 	mar_cpg_address_t notify_info;
 
 	notify_info.pid = pid;
@@ -1281,14 +1604,9 @@ static void do_proc_leave(
 		1, &notify_info,
 		MESSAGE_RES_CPG_CONFCHG_CALLBACK);
 
-	qb_list_for_each_safe(iter, tmp_iter, &process_info_list_head) {
-		pi = qb_list_entry(iter, struct process_info, list);
-
-		if (pi->pid == pid && pi->nodeid == nodeid &&
-			mar_name_compare (&pi->group, name)==0) {
-			qb_list_del (&pi->list);
-			free (pi);
-		}
+	pi = process_info_find (name, pid, nodeid);
+	if (pi != NULL) {
+		process_info_free (pi);
 	}
 }
 
@@ -1408,10 +1726,12 @@ static void message_handler_req_exec_cpg_mcast (
 	const struct req_exec_cpg_mcast *req_exec_cpg_mcast = message;
 	struct res_lib_cpg_deliver_callback res_lib_cpg_mcast;
 	int msglen = req_exec_cpg_mcast->msglen;
-	struct qb_list_head *iter, *pi_iter, *tmp_iter;
+	struct qb_list_head *iter, *tmp_iter;
+	struct group_info *gi;
 	struct cpg_pd *cpd;
 	struct iovec iovec[2];
 	int known_node = 0;
+	uint64_t zc_token = 0;
 
 	res_lib_cpg_mcast.header.id = MESSAGE_RES_CPG_DELIVER_CALLBACK;
 	res_lib_cpg_mcast.header.size = sizeof(res_lib_cpg_mcast) + msglen;
@@ -1427,22 +1747,22 @@ static void message_handler_req_exec_cpg_mcast (
 	iovec[1].iov_base = (char*)message+sizeof(*req_exec_cpg_mcast);
 	iovec[1].iov_len = msglen;
 
-	qb_list_for_each_safe(iter, tmp_iter, &cpg_pd_list_head) {
-		cpd = qb_list_entry(iter, struct cpg_pd, list);
-		if ((cpd->cpd_state == CPD_STATE_LEAVE_STARTED || cpd->cpd_state == CPD_STATE_JOIN_COMPLETED)
-			&& (mar_name_compare (&cpd->group_name, &req_exec_cpg_mcast->group_name) == 0)) {
+	gi = group_info_find (&req_exec_cpg_mcast->group_name);
+	if (gi == NULL) {
+		return ;
+	}
+
+	if (msglen >= CPG_ZC_DELIVER_MIN_SIZE) {
+		zc_token = ++cpg_zc_token;
+	}
+
+	qb_list_for_each_safe(iter, tmp_iter, &gi->pd_list_head) {
+		cpd = qb_list_entry(iter, struct cpg_pd, group_list);
+		if (cpd->cpd_state == CPD_STATE_LEAVE_STARTED || cpd->cpd_state == CPD_STATE_JOIN_COMPLETED) {
 
 			if (!known_node) {
 				/* Try to find, if we know the node */
-				qb_list_for_each(pi_iter, &process_info_list_head) {
-					struct process_info *pi = qb_list_entry (pi_iter, struct process_info, list);
-
-					if (pi->nodeid == nodeid &&
-						mar_name_compare (&pi->group, &req_exec_cpg_mcast->group_name) == 0) {
-						known_node = 1;
-						break;
-					}
-				}
+				known_node = (group_info_node_find (gi, nodeid) != NULL);
 			}
 
 			if (!known_node) {
@@ -1450,6 +1770,11 @@ static void message_handler_req_exec_cpg_mcast (
 				return ;
 			}
 
+			if (zc_token != 0 &&
+			    cpg_zc_deliver (cpd, &res_lib_cpg_mcast, iovec[1].iov_base, zc_token) == 0) {
+				continue;
+			}
+
 			api->ipc_dispatch_iov_send (cpd->conn, iovec, 2);
 		}
 	}
@@ -1462,7 +1787,8 @@ static void message_handler_req_exec_cpg_partial_mcast (
 	const struct req_exec_cpg_partial_mcast *req_exec_cpg_mcast = message;
 	struct res_lib_cpg_partial_deliver_callback res_lib_cpg_mcast;
 	int msglen = req_exec_cpg_mcast->fraglen;
-	struct qb_list_head *iter, *pi_iter, *tmp_iter;
+	struct qb_list_head *iter, *tmp_iter;
+	struct group_info *gi;
 	struct cpg_pd *cpd;
 	struct iovec iovec[2];
 	int known_node = 0;
@@ -1485,23 +1811,19 @@ static void message_handler_req_exec_cpg_partial_mcast (
 	iovec[1].iov_base = (char*)message+sizeof(*req_exec_cpg_mcast);
 	iovec[1].iov_len = msglen;
 
-	qb_list_for_each_safe(iter, tmp_iter, &cpg_pd_list_head) {
-		cpd = qb_list_entry(iter, struct cpg_pd, list);
+	gi = group_info_find (&req_exec_cpg_mcast->group_name);
+	if (gi == NULL) {
+		return ;
+	}
+
+	qb_list_for_each_safe(iter, tmp_iter, &gi->pd_list_head) {
+		cpd = qb_list_entry(iter, struct cpg_pd, group_list);
 
-		if ((cpd->cpd_state == CPD_STATE_LEAVE_STARTED || cpd->cpd_state == CPD_STATE_JOIN_COMPLETED)
-		    && (mar_name_compare (&cpd->group_name, &req_exec_cpg_mcast->group_name) == 0)) {
+		if (cpd->cpd_state == CPD_STATE_LEAVE_STARTED || cpd->cpd_state == CPD_STATE_JOIN_COMPLETED) {
 
 			if (!known_node) {
 				/* Try to find, if we know the node */
-				qb_list_for_each(pi_iter, &process_info_list_head) {
-					struct process_info *pi = qb_list_entry (pi_iter, struct process_info, list);
-
-					if (pi->nodeid == nodeid &&
-					    mar_name_compare (&pi->group, &req_exec_cpg_mcast->group_name) == 0) {
-						known_node = 1;
-						break;
-					}
-				}
+				known_node = (group_info_node_find (gi, nodeid) != NULL);
 			}
 
 			if (!known_node) {
@@ -1585,9 +1907,13 @@ static int cpg_lib_init_fn (void *conn)
 	memset (cpd, 0, sizeof(struct cpg_pd));
 	cpd->conn = conn;
 	qb_list_add (&cpd->list, &cpg_pd_list_head);
+	qb_list_init (&cpd->group_list);
 
 	qb_list_init (&cpd->iteration_instance_list_head);
 	qb_list_init (&cpd->zcb_mapped_list_head);
+	cpd->zcb_partial_addr = NULL;
+	cpd->zcb_partial_msg_len = 0;
+	cpd->zcb_partial_sent = 0;
 
 	api->ipc_refcnt_inc (conn);
 	log_printf(LOGSYS_LEVEL_DEBUG, "lib_init_fn: conn=%p, cpd=%p", conn, cpd);
@@ -1602,32 +1928,34 @@ static void message_handler_req_lib_cpg_join (void *conn, const void *message)
 	struct res_lib_cpg_join res_lib_cpg_join;
 	cs_error_t error = CS_OK;
 	struct qb_list_head *iter;
+	struct group_info *gi;
 
-	/* Test, if we don't have same pid and group name joined */
-	qb_list_for_each(iter, &cpg_pd_list_head) {
-		struct cpg_pd *cpd_item = qb_list_entry (iter, struct cpg_pd, list);
+	gi = group_info_find (&req_lib_cpg_join->group_name);
 
-		if (cpd_item->pid == req_lib_cpg_join->pid &&
-			mar_name_compare(&req_lib_cpg_join->group_name, &cpd_item->group_name) == 0) {
+	if (gi != NULL) {
+		/* Test, if we don't have same pid and group name joined */
+		qb_list_for_each(iter, &gi->pd_list_head) {
+			struct cpg_pd *cpd_item = qb_list_entry (iter, struct cpg_pd, group_list);
 
-			/* We have same pid and group name joined -> return error */
-			error = CS_ERR_EXIST;
-			goto response_send;
+			if (cpd_item->pid == req_lib_cpg_join->pid) {
+				/* We have same pid and group name joined -> return error */
+				error = CS_ERR_EXIST;
+				goto response_send;
+			}
 		}
-	}
 
-	/*
-	 * Same check must be done in process info list, because there may be not yet delivered
-	 * leave of client.
-	 */
-	qb_list_for_each(iter, &process_info_list_head) {
-		struct process_info *pi = qb_list_entry (iter, struct process_info, list);
+		/*
+		 * Same check must be done in process info list, because there may be not yet delivered
+		 * leave of client.
+		 */
+		qb_list_for_each(iter, &gi->members_list_head) {
+			struct process_info *pi = qb_list_entry (iter, struct process_info, group_list);
 
-		if (pi->nodeid == api->totem_nodeid_get () && pi->pid == req_lib_cpg_join->pid &&
-		    mar_name_compare(&req_lib_cpg_join->group_name, &pi->group) == 0) {
-			/* We have same pid and group name joined -> return error */
-			error = CS_ERR_TRY_AGAIN;
-			goto response_send;
+			if (pi->nodeid == api->totem_nodeid_get () && pi->pid == req_lib_cpg_join->pid) {
+				/* We have same pid and group name joined -> return error */
+				error = CS_ERR_TRY_AGAIN;
+				goto response_send;
+			}
 		}
 	}
 
@@ -1638,6 +1966,14 @@ static void message_handler_req_lib_cpg_join (void *conn, const void *message)
 
 	switch (cpd->cpd_state) {
 	case CPD_STATE_UNJOINED:
+		gi = group_info_get (&req_lib_cpg_join->group_name);
+		if (gi == NULL) {
+			error = CS_ERR_NO_MEMORY;
+			break;
+		}
+		qb_list_add (&cpd->group_list, &gi->pd_list_head);
+		cpd->group_info = gi;
+
 		error = CS_OK;
 		cpd->cpd_state = CPD_STATE_JOIN_STARTED;
 		cpd->pid = req_lib_cpg_join->pid;
@@ -1721,6 +2057,7 @@ static void message_handler_req_lib_cpg_finalize (
 	 */
 	qb_list_del (&cpd->list);
 	qb_list_init (&cpd->list);
+	cpg_pd_group_unlink_and_release (cpd);
 
 	res_lib_cpg_finalize.header.size = sizeof (res_lib_cpg_finalize);
 	res_lib_cpg_finalize.header.id = MESSAGE_RES_CPG_FINALIZE;
@@ -1818,6 +2155,21 @@ static inline int zcb_free (struct zcb_mapped *zcb_mapped)
 	return (res);
 }
 
+static inline struct zcb_mapped *zcb_by_addr_find (struct cpg_pd *cpd, void *addr)
+{
+	struct qb_list_head *list;
+	struct zcb_mapped *zcb_mapped;
+
+	qb_list_for_each(list, &(cpd->zcb_mapped_list_head)) {
+		zcb_mapped = qb_list_entry (list, struct zcb_mapped, list);
+
+		if (zcb_mapped->addr == addr) {
+			return (zcb_mapped);
+		}
+	}
+	return (NULL);
+}
+
 static inline int zcb_by_addr_free (struct cpg_pd *cpd, void *addr)
 {
 	struct qb_list_head *list, *tmp_iter;
@@ -1836,6 +2188,44 @@ static inline int zcb_by_addr_free (struct cpg_pd *cpd, void *addr)
 	return (res);
 }
 
+/*
+ * Tell receivers to drop the fragments of an unfinished fragmented mcast.
+ * Returns -1 (and keeps the state) if totem doesn't accept the abort.
+ */
+static int zcb_partial_abort (void *conn, struct cpg_pd *cpd)
+{
+	struct iovec req_exec_cpg_iovec[1];
+	struct req_exec_cpg_partial_mcast req_exec_cpg_mcast;
+
+	if (cpd->zcb_partial_msg_len == 0) {
+		return (0);
+	}
+
+	req_exec_cpg_mcast.header.id = SERVICE_ID_MAKE(CPG_SERVICE,
+		MESSAGE_REQ_EXEC_CPG_PARTIAL_MCAST);
+	req_exec_cpg_mcast.header.size = sizeof(req_exec_cpg_mcast);
+	req_exec_cpg_mcast.pid = cpd->pid;
+	req_exec_cpg_mcast.msglen = cpd->zcb_partial_msg_len;
+	req_exec_cpg_mcast.type = LIBCPG_PARTIAL_ABORTED;
+	req_exec_cpg_mcast.fraglen = 0;
+	api->ipc_source_set (&req_exec_cpg_mcast.source, conn);
+	memcpy(&req_exec_cpg_mcast.group_name, &cpd->group_name,
+		sizeof(mar_cpg_name_t));
+
+	req_exec_cpg_iovec[0].iov_base = (char *)&req_exec_cpg_mcast;
+	req_exec_cpg_iovec[0].iov_len = sizeof(req_exec_cpg_mcast);
+
+	if (api->totem_mcast (req_exec_cpg_iovec, 1, TOTEM_AGREED) != 0) {
+		return (-1);
+	}
+
+	cpd->zcb_partial_addr = NULL;
+	cpd->zcb_partial_msg_len = 0;
+	cpd->zcb_partial_sent = 0;
+
+	return (0);
+}
+
 static inline int zcb_all_free (
 	struct cpg_pd *cpd)
 {
@@ -1850,6 +2240,374 @@ static inline int zcb_all_free (
 	return (0);
 }
 
+/*
+ * Zero copy delivery. Messages of at least CPG_ZC_DELIVER_MIN_SIZE bytes
+ * are written once into a shared memory pool per group and owner (uid)
+ * of connections, which get only descriptors of messages in their event
+ * rings. Connection is attached to the pool of the group it was joined to
+ * when zero copy delivery was enabled until it exits. Pool is allocated
+ * as a ring of blocks. Every connection holds a reference to blocks of
+ * descriptors it was sent and releases them (in order) by setting
+ * released_seq in its control file.
+ */
+static struct cpg_zc_pool *cpg_zc_pool_get (
+	const mar_cpg_name_t *group_name,
+	uid_t uid,
+	gid_t gid)
+{
+	struct cpg_zc_pool *pool;
+	struct qb_list_head *iter;
+	const char *dirs[] = { "/dev/shm", LOCALSTATEDIR "/run" };
+	mode_t old_umask;
+	int fd = -1;
+	int i;
+	void *addr;
+
+	qb_list_for_each(iter, &cpg_zc_pool_list_head) {
+		pool = qb_list_entry (iter, struct cpg_zc_pool, list);
+		if (pool->uid == uid && mar_name_compare (&pool->group_name, group_name) == 0) {
+			return (pool);
+		}
+	}
+
+	pool = malloc (sizeof (struct cpg_zc_pool));
+	if (pool == NULL) {
+		return (NULL);
+	}
+	memset (pool, 0, sizeof (struct cpg_zc_pool));
+
+	for (i = 0; i < sizeof (dirs) / sizeof (dirs[0]) && fd == -1; i++) {
+		snprintf (pool->path, sizeof (pool->path), "%s/corosync_zcdeliver-XXXXXX", dirs[i]);
+		old_umask = umask (077);
+		fd = mkstemp (pool->path);
+		(void)umask (old_umask);
+	}
+	if (fd == -1) {
+		LOGSYS_PERROR (errno, LOGSYS_LEVEL_WARNING, "Can't create zero copy delivery pool");
+		free (pool);
+		return (NULL);
+	}
+
+	if (ftruncate (fd, CPG_ZC_POOL_SIZE) == -1 ||
+	    fchown (fd, uid, gid) == -1) {
+		LOGSYS_PERROR (errno, LOGSYS_LEVEL_WARNING, "Can't create zero copy delivery pool");
+		goto error_close_unlink;
+	}
+
+	addr = mmap (NULL, CPG_ZC_POOL_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED) {
+		LOGSYS_PERROR (errno, LOGSYS_LEVEL_WARNING, "Can't map zero copy delivery pool");
+		goto error_close_unlink;
+	}
+	close (fd);
+
+	memcpy (&pool->group_name, group_name, sizeof (mar_cpg_name_t));
+	pool->uid = uid;
+	pool->addr = addr;
+	pool->size = CPG_ZC_POOL_SIZE;
+	qb_list_init (&pool->pd_list_head);
+	qb_list_add (&pool->list, &cpg_zc_pool_list_head);
+
+	log_printf (LOGSYS_LEVEL_DEBUG, "Created zero copy delivery pool %s for group %s",
+		pool->path, cpg_print_group_name (group_name));
+
+	return (pool);
+
+error_close_unlink:
+	close (fd);
+	unlink (pool->path);
+	free (pool);
+	return (NULL);
+}
+
+static void cpg_zc_pool_put (struct cpg_zc_pool *pool)
+{
+
+	if (!qb_list_empty (&pool->pd_list_head)) {
+		return ;
+	}
+
+	munmap (pool->addr, pool->size);
+	unlink (pool->path);
+	qb_list_del (&pool->list);
+	free (pool);
+}
+
+/*
+ * Drop references released by connections and free blocks at the tail
+ * of the pool which are no longer referenced
+ */
+static void cpg_zc_pool_collect (struct cpg_zc_pool *pool)
+{
+	struct qb_list_head *iter;
+	struct cpg_pd *cpd;
+	struct cpg_zc_block *block;
+	uint64_t released_seq;
+
+	qb_list_for_each(iter, &pool->pd_list_head) {
+		cpd = qb_list_entry (iter, struct cpg_pd, zc_pool_list);
+
+		released_seq = __atomic_load_n (&cpd->zc_ctrl->released_seq, __ATOMIC_ACQUIRE);
+		while (cpd->zc_refs_tail != cpd->zc_refs_head &&
+		    cpd->zc_refs[cpd->zc_refs_tail % CPG_ZC_POOL_BLOCKS].seq <= released_seq) {
+			block = &pool->blocks[cpd->zc_refs[cpd->zc_refs_tail % CPG_ZC_POOL_BLOCKS].block_id % CPG_ZC_POOL_BLOCKS];
+			block->refcnt--;
+			cpd->zc_refs_tail++;
+		}
+	}
+
+	while (pool->block_tail != pool->block_head &&
+	    pool->blocks[pool->block_tail % CPG_ZC_POOL_BLOCKS].refcnt == 0) {
+		block = &pool->blocks[pool->block_tail % CPG_ZC_POOL_BLOCKS];
+		pool->used -= block->size;
+		pool->tail = (block->offset + block->size) % pool->size;
+		pool->block_tail++;
+	}
+}
+
+static struct cpg_zc_block *cpg_zc_pool_block_add (
+	struct cpg_zc_pool *pool,
+	size_t size,
+	uint32_t *block_id)
+{
+	struct cpg_zc_block *block;
+
+	block = &pool->blocks[pool->block_head % CPG_ZC_POOL_BLOCKS];
+	block->offset = pool->head;
+	block->size = size;
+	block->refcnt = 0;
+	if (block_id != NULL) {
+		*block_id = pool->block_head;
+	}
+	pool->block_head++;
+	pool->head = (pool->head + size) % pool->size;
+	pool->used += size;
+
+	return (block);
+}
+
+static struct cpg_zc_block *cpg_zc_pool_alloc (
+	struct cpg_zc_pool *pool,
+	size_t len,
+	uint32_t *block_id)
+{
+	size_t size = CPG_ZC_ALIGN (len);
+
+	/*
+	 * One block is kept for padding at the end of the pool
+	 */
+	if (pool->used + size > pool->size ||
+	    pool->block_head - pool->block_tail >= CPG_ZC_POOL_BLOCKS - 1) {
+		return (NULL);
+	}
+
+	if (pool->used == 0) {
+		pool->head = pool->tail = 0;
+	}
+
+	if (pool->head >= pool->tail) {
+		if (pool->size - pool->head < size) {
+			/*
+			 * Doesn't fit at the end, wrap around
+			 */
+			if (pool->tail < size) {
+				return (NULL);
+			}
+			(void)cpg_zc_pool_block_add (pool, pool->size - pool->head, NULL);
+		}
+	} else if (pool->tail - pool->head < size) {
+		return (NULL);
+	}
+
+	return (cpg_zc_pool_block_add (pool, size, block_id));
+}
+
+static void cpg_zc_pd_detach (struct cpg_pd *cpd)
+{
+	struct cpg_zc_pool *pool = cpd->zc_pool;
+
+	if (pool == NULL) {
+		return ;
+	}
+
+	while (cpd->zc_refs_tail != cpd->zc_refs_head) {
+		pool->blocks[cpd->zc_refs[cpd->zc_refs_tail % CPG_ZC_POOL_BLOCKS].block_id % CPG_ZC_POOL_BLOCKS].refcnt--;
+		cpd->zc_refs_tail++;
+	}
+
+	qb_list_del (&cpd->zc_pool_list);
+	munmap (cpd->zc_ctrl, sizeof (struct cpg_zc_deliver_control));
+	free (cpd->zc_refs);
+	cpd->zc_ctrl = NULL;
+	cpd->zc_refs = NULL;
+	cpd->zc_pool = NULL;
+
+	cpg_zc_pool_collect (pool);
+	cpg_zc_pool_put (pool);
+}
+
+/*
+ * Send message to connection through its zero copy delivery pool. Message
+ * is written into pool only once for all connections sharing the pool
+ * (same token). Returns -1 if message must be sent the usual way.
+ */
+static int cpg_zc_deliver (
+	struct cpg_pd *cpd,
+	const struct res_lib_cpg_deliver_callback *res_lib_cpg_mcast,
+	const void *msg,
+	uint64_t token)
+{
+	struct cpg_zc_pool *pool = cpd->zc_pool;
+	struct res_lib_cpg_zc_deliver_callback res_lib_cpg_zc_deliver;
+	struct cpg_zc_block *block;
+	uint32_t block_id;
+
+	if (pool == NULL || !__atomic_load_n (&cpd->zc_ctrl->ready, __ATOMIC_ACQUIRE)) {
+		return (-1);
+	}
+
+	if (cpd->zc_refs_head - cpd->zc_refs_tail >= CPG_ZC_POOL_BLOCKS) {
+		cpg_zc_pool_collect (pool);
+		if (cpd->zc_refs_head - cpd->zc_refs_tail >= CPG_ZC_POOL_BLOCKS) {
+			return (-1);
+		}
+	}
+
+	if (pool->token != token) {
+		cpg_zc_pool_collect (pool);
+		block = cpg_zc_pool_alloc (pool, res_lib_cpg_mcast->msglen, &block_id);
+		if (block == NULL) {
+			return (-1);
+		}
+		memcpy (pool->addr + block->offset, msg, res_lib_cpg_mcast->msglen);
+		pool->token = token;
+		pool->token_block_id = block_id;
+	}
+	block_id = pool->token_block_id;
+	block = &pool->blocks[block_id % CPG_ZC_POOL_BLOCKS];
+
+	res_lib_cpg_zc_deliver.header.id = MESSAGE_RES_CPG_ZC_DELIVER_CALLBACK;
+	res_lib_cpg_zc_deliver.header.size = sizeof (res_lib_cpg_zc_deliver);
+	res_lib_cpg_zc_deliver.header.error = CS_OK;
+	memcpy (&res_lib_cpg_zc_deliver.group_name, &res_lib_cpg_mcast->group_name,
+		sizeof (mar_cpg_name_t));
+	res_lib_cpg_zc_deliver.msglen = res_lib_cpg_mcast->msglen;
+	res_lib_cpg_zc_deliver.nodeid = res_lib_cpg_mcast->nodeid;
+	res_lib_cpg_zc_deliver.pid = res_lib_cpg_mcast->pid;
+	res_lib_cpg_zc_deliver.offset = block->offset;
+	res_lib_cpg_zc_deliver.seq = ++cpd->zc_seq;
+
+	block->refcnt++;
+	cpd->zc_refs[cpd->zc_refs_head % CPG_ZC_POOL_BLOCKS].seq = res_lib_cpg_zc_deliver.seq;
+	cpd->zc_refs[cpd->zc_refs_head % CPG_ZC_POOL_BLOCKS].block_id = block_id;
+	cpd->zc_refs_head++;
+
+	api->ipc_dispatch_send (cpd->conn, &res_lib_cpg_zc_deliver,
+		sizeof (res_lib_cpg_zc_deliver));
+
+	return (0);
+}
+
+static void message_handler_req_lib_cpg_zc_deliver_enable (
+	void *conn,
+	const void *message)
+{
+	const struct req_lib_cpg_zc_deliver_enable *req_lib_cpg_zc_deliver_enable = message;
+	struct res_lib_cpg_zc_deliver_enable res_lib_cpg_zc_deliver_enable;
+	struct cpg_pd *cpd = (struct cpg_pd *)api->ipc_private_data_get (conn);
+	char path[CPG_ZC_PATH_LEN];
+	struct cpg_zc_pool *pool;
+	struct stat stat_buf;
+	void *ctrl = MAP_FAILED;
+	cs_error_t error = CS_OK;
+	uid_t euid;
+	gid_t egid;
+	int fd;
+
+	memset (&res_lib_cpg_zc_deliver_enable, 0, sizeof (res_lib_cpg_zc_deliver_enable));
+
+	/*
+	 * Connection stays attached to its pool until it exits, even after
+	 * leaving the group, because descriptors not yet dispatched refer to it
+	 */
+	if (cpd->zc_pool != NULL) {
+		pool = cpd->zc_pool;
+		goto send_pool;
+	}
+
+	if (cpd->group_info == NULL ||
+	    (cpd->cpd_state != CPD_STATE_JOIN_STARTED && cpd->cpd_state != CPD_STATE_JOIN_COMPLETED)) {
+		error = CS_ERR_NOT_EXIST;
+		goto send_response;
+	}
+
+	memcpy (path, req_lib_cpg_zc_deliver_enable->path_to_file, sizeof (path));
+	path[sizeof (path) - 1] = '\0';
+
+	/*
+	 * Control file is created (and unlinked) by library, server only
+	 * reads it. Pool is owned by the credentials of the connection and
+	 * the control file must belong to the same user.
+	 */
+	api->ipc_credentials_get (conn, &euid, &egid);
+
+	fd = open (path, O_RDONLY | O_NOFOLLOW);
+	if (fd == -1) {
+		error = CS_ERR_LIBRARY;
+		goto send_response;
+	}
+	if (fstat (fd, &stat_buf) == -1 || !S_ISREG (stat_buf.st_mode) ||
+	    stat_buf.st_size < sizeof (struct cpg_zc_deliver_control)) {
+		close (fd);
+		error = CS_ERR_INVALID_PARAM;
+		goto send_response;
+	}
+	if (stat_buf.st_uid != euid) {
+		close (fd);
+		error = CS_ERR_ACCESS;
+		goto send_response;
+	}
+	ctrl = mmap (NULL, sizeof (struct cpg_zc_deliver_control), PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+	if (ctrl == MAP_FAILED) {
+		error = CS_ERR_LIBRARY;
+		goto send_response;
+	}
+
+	cpd->zc_refs = malloc (CPG_ZC_POOL_BLOCKS * sizeof (struct cpg_zc_ref));
+	if (cpd->zc_refs == NULL) {
+		munmap (ctrl, sizeof (struct cpg_zc_deliver_control));
+		error = CS_ERR_NO_MEMORY;
+		goto send_response;
+	}
+
+	pool = cpg_zc_pool_get (&cpd->group_name, euid, egid);
+	if (pool == NULL) {
+		munmap (ctrl, sizeof (struct cpg_zc_deliver_control));
+		free (cpd->zc_refs);
+		cpd->zc_refs = NULL;
+		error = CS_ERR_NO_RESOURCES;
+		goto send_response;
+	}
+
+	cpd->zc_pool = pool;
+	cpd->zc_ctrl = ctrl;
+	cpd->zc_seq = 0;
+	cpd->zc_refs_head = cpd->zc_refs_tail = 0;
+	qb_list_add_tail (&cpd->zc_pool_list, &pool->pd_list_head);
+
+send_pool:
+	strcpy (res_lib_cpg_zc_deliver_enable.path_to_file, pool->path);
+	res_lib_cpg_zc_deliver_enable.pool_size = pool->size;
+
+send_response:
+	res_lib_cpg_zc_deliver_enable.header.size = sizeof (res_lib_cpg_zc_deliver_enable);
+	res_lib_cpg_zc_deliver_enable.header.id = MESSAGE_RES_CPG_ZC_DELIVER_ENABLE;
+	res_lib_cpg_zc_deliver_enable.header.error = error;
+	api->ipc_response_send (conn, &res_lib_cpg_zc_deliver_enable,
+		sizeof (res_lib_cpg_zc_deliver_enable));
+}
+
 union u {
 	uint64_t server_addr;
 	void *server_ptr;
@@ -1911,6 +2669,15 @@ static void message_handler_req_lib_cpg_zc_free (
 
 	addr = serveraddr2void (hdr->server_address);
 
+	/*
+	 * Unfinished mcast from this buffer can't be continued anymore. If
+	 * totem is full, abort is sent before the next mcast of the connection.
+	 */
+	if (cpd->zcb_partial_msg_len != 0 && cpd->zcb_partial_addr == addr) {
+		cpd->zcb_partial_addr = NULL;
+		(void)zcb_partial_abort (conn, cpd);
+	}
+
 	zcb_by_addr_free (cpd, addr);
 
 	res_header.size = sizeof (struct qb_ipc_response_header);
@@ -1954,11 +2721,32 @@ static void message_handler_req_lib_cpg_partial_mcast (void *conn, const void *m
 
 	res_lib_cpg_partial_send.header.size = sizeof(res_lib_cpg_partial_send);
 	res_lib_cpg_partial_send.header.id = MESSAGE_RES_CPG_PARTIAL_SEND;
+	res_lib_cpg_partial_send.offset = req_lib_cpg_mcast->offset;
 
-	if (req_lib_cpg_mcast->type == LIBCPG_PARTIAL_FIRST) {
-		cpd->initial_transition_counter = cpd->transition_counter;
+	if (error == CS_OK && req_lib_cpg_mcast->type == LIBCPG_PARTIAL_FIRST) {
+		/*
+		 * New message, receivers have to drop whatever was left
+		 * unfinished before
+		 */
+		if (req_lib_cpg_mcast->offset != 0) {
+			error = CS_ERR_MESSAGE_ERROR;
+		} else if (zcb_partial_abort (conn, cpd) != 0) {
+			error = CS_ERR_TRY_AGAIN;
+		} else {
+			cpd->initial_transition_counter = cpd->transition_counter;
+		}
+	} else if (error == CS_OK) {
+		/*
+		 * Only the fragment following the last accepted one is taken,
+		 * so fragments sent behind a rejected one never leave a gap
+		 */
+		if (cpd->zcb_partial_msg_len == 0 || cpd->zcb_partial_addr != NULL ||
+		    cpd->zcb_partial_msg_len != req_lib_cpg_mcast->msglen ||
+		    cpd->zcb_partial_sent != req_lib_cpg_mcast->offset) {
+			error = CS_ERR_MESSAGE_ERROR;
+		}
 	}
-	if (cpd->transition_counter != cpd->initial_transition_counter) {
+	if (error == CS_OK && cpd->transition_counter != cpd->initial_transition_counter) {
 		error = CS_ERR_INTERRUPT;
 	}
 
@@ -1980,7 +2768,16 @@ static void message_handler_req_lib_cpg_partial_mcast (void *conn, const void *m
 		req_exec_cpg_iovec[1].iov_len = msglen;
 
 		result = api->totem_mcast (req_exec_cpg_iovec, 2, TOTEM_AGREED);
-		assert(result == 0);
+		if (result != 0) {
+			error = CS_ERR_TRY_AGAIN;
+		} else if (req_lib_cpg_mcast->type == LIBCPG_PARTIAL_LAST) {
+			cpd->zcb_partial_msg_len = 0;
+			cpd->zcb_partial_sent = 0;
+		} else {
+			cpd->zcb_partial_addr = NULL;
+			cpd->zcb_partial_msg_len = req_lib_cpg_mcast->msglen;
+			cpd->zcb_partial_sent = req_lib_cpg_mcast->offset + msglen;
+		}
 	} else {
 		log_printf(LOGSYS_LEVEL_ERROR, "*** %p can't mcast to group %s state:%d, error:%d",
 			   conn, group_name.value, cpd->cpd_state, error);
@@ -2022,6 +2819,12 @@ static void message_handler_req_lib_cpg_mcast (void *conn, const void *message)
 	}
 
 	if (error == CS_OK) {
+		/*
+		 * There is no reply to tell the library to retry, so if the
+		 * abort doesn't fit it's sent before the next mcast
+		 */
+		(void)zcb_partial_abort (conn, cpd);
+
 		req_exec_cpg_mcast.header.size = sizeof(req_exec_cpg_mcast) + msglen;
 		req_exec_cpg_mcast.header.id = SERVICE_ID_MAKE(CPG_SERVICE,
 			MESSAGE_REQ_EXEC_CPG_MCAST);
@@ -2044,6 +2847,190 @@ static void message_handler_req_lib_cpg_mcast (void *conn, const void *message)
 	}
 }
 
+/*
+ * Batch of mcast messages from the library. Every message is sent to totem
+ * as a separate MESSAGE_REQ_EXEC_CPG_MCAST, exactly as if it was sent by
+ * cpg_mcast_joined, so ordering and delivery stay the same. Sending stops
+ * at the first message totem doesn't accept and the library is told how many
+ * messages were sent.
+ */
+static void message_handler_req_lib_cpg_mcast_batch (void *conn, const void *message)
+{
+	const struct req_lib_cpg_mcast_batch *req_lib_cpg_mcast_batch = message;
+	const struct req_lib_cpg_mcast_batch_item *item;
+	struct cpg_pd *cpd = (struct cpg_pd *)api->ipc_private_data_get (conn);
+	mar_cpg_name_t group_name = cpd->group_name;
+
+	struct iovec req_exec_cpg_iovec[2];
+	struct req_exec_cpg_mcast req_exec_cpg_mcast;
+	struct res_lib_cpg_mcast_batch res_lib_cpg_mcast_batch;
+	size_t pos;
+	size_t items_size;
+	uint32_t i;
+	int result;
+	cs_error_t error = CS_ERR_NOT_EXIST;
+
+	log_printf(LOGSYS_LEVEL_TRACE, "got mcast batch request on %p", conn);
+
+	switch (cpd->cpd_state) {
+	case CPD_STATE_UNJOINED:
+		error = CS_ERR_NOT_EXIST;
+		break;
+	case CPD_STATE_LEAVE_STARTED:
+		error = CS_ERR_NOT_EXIST;
+		break;
+	case CPD_STATE_JOIN_STARTED:
+		error = CS_OK;
+		break;
+	case CPD_STATE_JOIN_COMPLETED:
+		error = CS_OK;
+		break;
+	}
+
+	res_lib_cpg_mcast_batch.header.size = sizeof(res_lib_cpg_mcast_batch);
+	res_lib_cpg_mcast_batch.header.id = MESSAGE_RES_CPG_MCAST_BATCH;
+	res_lib_cpg_mcast_batch.msgs_sent = 0;
+
+	if (error != CS_OK) {
+		log_printf(LOGSYS_LEVEL_ERROR, "*** %p can't mcast to group %s state:%d, error:%d",
+			conn, group_name.value, cpd->cpd_state, error);
+		goto send_response;
+	}
+
+	if (req_lib_cpg_mcast_batch->header.size < sizeof(struct req_lib_cpg_mcast_batch)) {
+		error = CS_ERR_INVALID_PARAM;
+		goto send_response;
+	}
+
+	if (zcb_partial_abort (conn, cpd) != 0) {
+		error = CS_ERR_TRY_AGAIN;
+		goto send_response;
+	}
+	items_size = req_lib_cpg_mcast_batch->header.size - sizeof(struct req_lib_cpg_mcast_batch);
+
+	req_exec_cpg_mcast.header.id = SERVICE_ID_MAKE(CPG_SERVICE,
+		MESSAGE_REQ_EXEC_CPG_MCAST);
+	req_exec_cpg_mcast.pid = cpd->pid;
+	api->ipc_source_set (&req_exec_cpg_mcast.source, conn);
+	memcpy(&req_exec_cpg_mcast.group_name, &group_name,
+		sizeof(mar_cpg_name_t));
+
+	req_exec_cpg_iovec[0].iov_base = (char *)&req_exec_cpg_mcast;
+	req_exec_cpg_iovec[0].iov_len = sizeof(req_exec_cpg_mcast);
+
+	pos = 0;
+	for (i = 0; i < req_lib_cpg_mcast_batch->msg_count; i++) {
+		item = (const struct req_lib_cpg_mcast_batch_item *)(req_lib_cpg_mcast_batch->items + pos);
+		if (items_size - pos < sizeof(struct req_lib_cpg_mcast_batch_item) ||
+		    item->msglen > items_size ||
+		    items_size - pos < CPG_MCAST_BATCH_ITEM_SIZE(item->msglen)) {
+			log_printf(LOGSYS_LEVEL_ERROR, "*** %p sent malformed mcast batch", conn);
+			error = CS_ERR_INVALID_PARAM;
+			break;
+		}
+
+		req_exec_cpg_mcast.header.size = sizeof(req_exec_cpg_mcast) + item->msglen;
+		req_exec_cpg_mcast.msglen = item->msglen;
+		req_exec_cpg_iovec[1].iov_base = (char *)item->message;
+		req_exec_cpg_iovec[1].iov_len = item->msglen;
+
+		result = api->totem_mcast (req_exec_cpg_iovec, 2, TOTEM_AGREED);
+		if (result != 0) {
+			error = CS_ERR_TRY_AGAIN;
+			break;
+		}
+
+		res_lib_cpg_mcast_batch.msgs_sent++;
+		pos += CPG_MCAST_BATCH_ITEM_SIZE(item->msglen);
+	}
+
+send_response:
+	res_lib_cpg_mcast_batch.header.error = error;
+	api->ipc_response_send (conn, &res_lib_cpg_mcast_batch,
+		sizeof (res_lib_cpg_mcast_batch));
+}
+
+/*
+ * Send zero copy message too big for one dispatch as
+ * MESSAGE_REQ_EXEC_CPG_PARTIAL_MCAST fragments straight from the mapped
+ * buffer. When totem doesn't accept a fragment, position is kept and
+ * CS_ERR_TRY_AGAIN returned, so retry with the same buffer continues where
+ * this one stopped.
+ */
+static cs_error_t zcb_partial_mcast (
+	void *conn,
+	struct cpg_pd *cpd,
+	void *addr,
+	const char *msg,
+	size_t msglen)
+{
+	struct iovec req_exec_cpg_iovec[2];
+	struct req_exec_cpg_partial_mcast req_exec_cpg_mcast;
+	size_t sent = 0;
+	size_t fraglen;
+
+	if (cpd->zcb_partial_addr == addr && cpd->zcb_partial_msg_len == msglen) {
+		sent = cpd->zcb_partial_sent;
+	} else {
+		/*
+		 * Different message, previous one is not going to be finished
+		 */
+		if (zcb_partial_abort (conn, cpd) != 0) {
+			return (CS_ERR_TRY_AGAIN);
+		}
+		cpd->initial_transition_counter = cpd->transition_counter;
+	}
+	cpd->zcb_partial_addr = NULL;
+	cpd->zcb_partial_msg_len = 0;
+	cpd->zcb_partial_sent = 0;
+
+	if (cpd->transition_counter != cpd->initial_transition_counter) {
+		return (CS_ERR_INTERRUPT);
+	}
+
+	req_exec_cpg_mcast.header.id = SERVICE_ID_MAKE(CPG_SERVICE,
+		MESSAGE_REQ_EXEC_CPG_PARTIAL_MCAST);
+	req_exec_cpg_mcast.pid = cpd->pid;
+	req_exec_cpg_mcast.msglen = msglen;
+	api->ipc_source_set (&req_exec_cpg_mcast.source, conn);
+	memcpy(&req_exec_cpg_mcast.group_name, &cpd->group_name,
+		sizeof(mar_cpg_name_t));
+
+	req_exec_cpg_iovec[0].iov_base = (char *)&req_exec_cpg_mcast;
+	req_exec_cpg_iovec[0].iov_len = sizeof(req_exec_cpg_mcast);
+
+	while (sent < msglen) {
+		fraglen = msglen - sent;
+		if (fraglen > CPG_ZCB_FRAGMENT_SIZE) {
+			fraglen = CPG_ZCB_FRAGMENT_SIZE;
+		}
+
+		if (sent == 0) {
+			req_exec_cpg_mcast.type = LIBCPG_PARTIAL_FIRST;
+		} else if (sent + fraglen == msglen) {
+			req_exec_cpg_mcast.type = LIBCPG_PARTIAL_LAST;
+		} else {
+			req_exec_cpg_mcast.type = LIBCPG_PARTIAL_CONTINUED;
+		}
+		req_exec_cpg_mcast.header.size = sizeof(req_exec_cpg_mcast) + fraglen;
+		req_exec_cpg_mcast.fraglen = fraglen;
+
+		req_exec_cpg_iovec[1].iov_base = (char *)msg + sent;
+		req_exec_cpg_iovec[1].iov_len = fraglen;
+
+		if (api->totem_mcast (req_exec_cpg_iovec, 2, TOTEM_AGREED) != 0) {
+			cpd->zcb_partial_addr = addr;
+			cpd->zcb_partial_msg_len = msglen;
+			cpd->zcb_partial_sent = sent;
+
+			return (CS_ERR_TRY_AGAIN);
+		}
+		sent += fraglen;
+	}
+
+	return (CS_OK);
+}
+
 static void message_handler_req_lib_cpg_zc_execute (
 	void *conn,
 	const void *message)
@@ -2055,12 +3042,16 @@ static void message_handler_req_lib_cpg_zc_execute (
 	struct iovec req_exec_cpg_iovec[2];
 	struct req_exec_cpg_mcast req_exec_cpg_mcast;
 	struct req_lib_cpg_mcast *req_lib_cpg_mcast;
+	struct zcb_mapped *zcb_mapped;
+	void *addr;
+	size_t msglen = 0;
 	int result;
 	cs_error_t error = CS_ERR_NOT_EXIST;
 
 	log_printf(LOGSYS_LEVEL_TRACE, "got ZC mcast request on %p", conn);
 
-	header = (struct qb_ipc_request_header *)(((char *)serveraddr2void(hdr->server_address) + sizeof (struct coroipcs_zc_header)));
+	addr = serveraddr2void(hdr->server_address);
+	header = (struct qb_ipc_request_header *)(((char *)addr + sizeof (struct coroipcs_zc_header)));
 	req_lib_cpg_mcast = (struct req_lib_cpg_mcast *)header;
 
 	switch (cpd->cpd_state) {
@@ -2078,14 +3069,37 @@ static void message_handler_req_lib_cpg_zc_execute (
 		break;
 	}
 
+	/*
+	 * Buffer is shared with the library, so message length is read only
+	 * once and checked against size of the mapping
+	 */
+	if (error == CS_OK) {
+		zcb_mapped = zcb_by_addr_find (cpd, addr);
+		if (zcb_mapped == NULL ||
+		    zcb_mapped->size < sizeof (struct coroipcs_zc_header) + sizeof (struct req_lib_cpg_mcast)) {
+			error = CS_ERR_INVALID_PARAM;
+		} else {
+			msglen = req_lib_cpg_mcast->msglen;
+			if (msglen > zcb_mapped->size - sizeof (struct coroipcs_zc_header) -
+			    sizeof (struct req_lib_cpg_mcast)) {
+				error = CS_ERR_INVALID_PARAM;
+			}
+		}
+	}
+
 	res_lib_cpg_mcast.header.size = sizeof(res_lib_cpg_mcast);
 	res_lib_cpg_mcast.header.id = MESSAGE_RES_CPG_MCAST;
-	if (error == CS_OK) {
-		req_exec_cpg_mcast.header.size = sizeof(req_exec_cpg_mcast) + req_lib_cpg_mcast->msglen;
+	if (error == CS_OK && msglen > CPG_ZCB_FRAGMENT_SIZE) {
+		res_lib_cpg_mcast.header.error = zcb_partial_mcast (conn, cpd, addr,
+			(char *)header + sizeof(struct req_lib_cpg_mcast), msglen);
+	} else if (error == CS_OK && zcb_partial_abort (conn, cpd) != 0) {
+		res_lib_cpg_mcast.header.error = CS_ERR_TRY_AGAIN;
+	} else if (error == CS_OK) {
+		req_exec_cpg_mcast.header.size = sizeof(req_exec_cpg_mcast) + msglen;
 		req_exec_cpg_mcast.header.id = SERVICE_ID_MAKE(CPG_SERVICE,
 			MESSAGE_REQ_EXEC_CPG_MCAST);
 		req_exec_cpg_mcast.pid = cpd->pid;
-		req_exec_cpg_mcast.msglen = req_lib_cpg_mcast->msglen;
+		req_exec_cpg_mcast.msglen = msglen;
 		api->ipc_source_set (&req_exec_cpg_mcast.source, conn);
 		memcpy(&req_exec_cpg_mcast.group_name, &cpd->group_name,
 			sizeof(mar_cpg_name_t));
@@ -2093,7 +3107,7 @@ static void message_handler_req_lib_cpg_zc_execute (
 		req_exec_cpg_iovec[0].iov_base = (char *)&req_exec_cpg_mcast;
 		req_exec_cpg_iovec[0].iov_len = sizeof(req_exec_cpg_mcast);
 		req_exec_cpg_iovec[1].iov_base = (char *)header + sizeof(struct req_lib_cpg_mcast);
-		req_exec_cpg_iovec[1].iov_len = req_exec_cpg_mcast.msglen;
+		req_exec_cpg_iovec[1].iov_len = msglen;
 
 		result = api->totem_mcast (req_exec_cpg_iovec, 2, TOTEM_AGREED);
 		if (result == 0) {
@@ -2117,6 +3131,7 @@ static void message_handler_req_lib_cpg_membership (void *conn,
 		(struct req_lib_cpg_membership_get *)message;
 	struct res_lib_cpg_membership_get res_lib_cpg_membership_get;
 	struct qb_list_head *iter;
+	struct group_info *gi;
 	int member_count = 0;
 
 	res_lib_cpg_membership_get.header.id = MESSAGE_RES_CPG_MEMBERSHIP;
@@ -2124,9 +3139,10 @@ static void message_handler_req_lib_cpg_membership (void *conn,
 	res_lib_cpg_membership_get.header.size =
 		sizeof (struct res_lib_cpg_membership_get);
 
-	qb_list_for_each(iter, &process_info_list_head) {
-		struct process_info *pi = qb_list_entry (iter, struct process_info, list);
-		if (mar_name_compare (&pi->group, &req_lib_cpg_membership_get->group_name) == 0) {
+	gi = group_info_find (&req_lib_cpg_membership_get->group_name);
+	if (gi != NULL) {
+		qb_list_for_each(iter, &gi->members_list_head) {
+			struct process_info *pi = qb_list_entry (iter, struct process_info, group_list);
 			res_lib_cpg_membership_get.member_list[member_count].nodeid = pi->nodeid;
 			res_lib_cpg_membership_get.member_list[member_count].pid = pi->pid;
 			member_count += 1;
@@ -2242,6 +3258,8 @@ static void message_handler_req_lib_cpg_iteration_initialize (
 
 		memcpy (new_pi, pi, sizeof (struct process_info));
 		qb_list_init (&new_pi->list);
+		qb_list_init (&new_pi->group_list);
+		new_pi->group_info = NULL;
 
 		if (req_lib_cpg_iterationinitialize->iteration_type == CPG_ITERATION_NAME_ONLY) {
 			/*
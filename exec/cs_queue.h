@@ -41,6 +41,15 @@
 #include <errno.h>
 #include "assert.h"
 
+/*
+ * Locking modes
+ *
+ * CS_QUEUE_LOCKING_NONE     - queue is only ever touched by one thread
+ * CS_QUEUE_LOCKING_MUTEX    - every operation is serialized by a mutex
+ */
+#define CS_QUEUE_LOCKING_NONE		0
+#define CS_QUEUE_LOCKING_MUTEX		1
+
 struct cs_queue {
 	int head;
 	int tail;
@@ -51,24 +60,47 @@ struct cs_queue {
 	int size_per_item;
 	int iterator;
 	pthread_mutex_t mutex;
-	int threaded_mode_enabled;
+	int locking;
 };
 
-static inline int cs_queue_init (struct cs_queue *cs_queue, int cs_queue_items, int size_per_item, int threaded_mode_enabled) {
+static inline void cs_queue_lock (struct cs_queue *cs_queue)
+{
+	if (cs_queue->locking == CS_QUEUE_LOCKING_MUTEX) {
+		pthread_mutex_lock (&cs_queue->mutex);
+	}
+}
+
+static inline void cs_queue_unlock (struct cs_queue *cs_queue)
+{
+	if (cs_queue->locking == CS_QUEUE_LOCKING_MUTEX) {
+		pthread_mutex_unlock (&cs_queue->mutex);
+	}
+}
+
+static inline char *cs_queue_slot (struct cs_queue *cs_queue, int position)
+{
+	char *cs_queue_item;
+
+	cs_queue_item = cs_queue->items;
+	cs_queue_item += (position % cs_queue->size) * cs_queue->size_per_item;
+	return (cs_queue_item);
+}
+
+static inline int cs_queue_init (struct cs_queue *cs_queue, int cs_queue_items, int size_per_item, int locking) {
 	cs_queue->head = 0;
 	cs_queue->tail = cs_queue_items - 1;
 	cs_queue->used = 0;
 	cs_queue->usedhw = 0;
 	cs_queue->size = cs_queue_items;
 	cs_queue->size_per_item = size_per_item;
-	cs_queue->threaded_mode_enabled = threaded_mode_enabled;
+	cs_queue->locking = locking;
 
 	cs_queue->items = malloc (cs_queue_items * size_per_item);
 	if (cs_queue->items == 0) {
 		return (-ENOMEM);
 	}
 	memset (cs_queue->items, 0, cs_queue_items * size_per_item);
-	if (cs_queue->threaded_mode_enabled) {
+	if (cs_queue->locking == CS_QUEUE_LOCKING_MUTEX) {
 		pthread_mutex_init (&cs_queue->mutex, NULL);
 	}
 	return (0);
@@ -76,23 +108,19 @@ static inline int cs_queue_init (struct cs_queue *cs_queue, int cs_queue_items,
 
 static inline int cs_queue_reinit (struct cs_queue *cs_queue)
 {
-	if (cs_queue->threaded_mode_enabled) {
-		pthread_mutex_lock (&cs_queue->mutex);
-	}
+	cs_queue_lock (cs_queue);
 	cs_queue->head = 0;
 	cs_queue->tail = cs_queue->size - 1;
 	cs_queue->used = 0;
 	cs_queue->usedhw = 0;
 
 	memset (cs_queue->items, 0, cs_queue->size * cs_queue->size_per_item);
-	if (cs_queue->threaded_mode_enabled) {
-		pthread_mutex_unlock (&cs_queue->mutex);
-	}
+	cs_queue_unlock (cs_queue);
 	return (0);
 }
 
 static inline void cs_queue_free (struct cs_queue *cs_queue) {
-	if (cs_queue->threaded_mode_enabled) {
+	if (cs_queue->locking == CS_QUEUE_LOCKING_MUTEX) {
 		pthread_mutex_destroy (&cs_queue->mutex);
 	}
 	free (cs_queue->items);
@@ -101,37 +129,50 @@ static inline void cs_queue_free (struct cs_queue *cs_queue) {
 static inline int cs_queue_is_full (struct cs_queue *cs_queue) {
 	int full;
 
-	if (cs_queue->threaded_mode_enabled) {
-		pthread_mutex_lock (&cs_queue->mutex);
-	}
+	cs_queue_lock (cs_queue);
 	full = ((cs_queue->size - 1) == cs_queue->used);
-	if (cs_queue->threaded_mode_enabled) {
-		pthread_mutex_unlock (&cs_queue->mutex);
-	}
+	cs_queue_unlock (cs_queue);
 	return (full);
 }
 
 static inline int cs_queue_is_empty (struct cs_queue *cs_queue) {
 	int empty;
 
-	if (cs_queue->threaded_mode_enabled) {
-		pthread_mutex_lock (&cs_queue->mutex);
-	}
+	cs_queue_lock (cs_queue);
 	empty = (cs_queue->used == 0);
-	if (cs_queue->threaded_mode_enabled) {
-		pthread_mutex_unlock (&cs_queue->mutex);
-	}
+	cs_queue_unlock (cs_queue);
 	return (empty);
 }
 
+/*
+ * Add count items stored back to back at items.  The caller must have made
+ * sure there is room for them.
+ */
+static inline void cs_queue_items_add (struct cs_queue *cs_queue, void *items, int count)
+{
+	char *item = items;
+	int i;
+
+	cs_queue_lock (cs_queue);
+	assert (cs_queue->used + count <= cs_queue->size - 1);
+	for (i = 0; i < count; i++) {
+		memcpy (cs_queue_slot (cs_queue, cs_queue->head),
+			item + i * cs_queue->size_per_item, cs_queue->size_per_item);
+		cs_queue->head = (cs_queue->head + 1) % cs_queue->size;
+	}
+	cs_queue->used += count;
+	if (cs_queue->used > cs_queue->usedhw) {
+		cs_queue->usedhw = cs_queue->used;
+	}
+	cs_queue_unlock (cs_queue);
+}
+
 static inline void cs_queue_item_add (struct cs_queue *cs_queue, void *item)
 {
 	char *cs_queue_item;
 	int cs_queue_position;
 
-	if (cs_queue->threaded_mode_enabled) {
-		pthread_mutex_lock (&cs_queue->mutex);
-	}
+	cs_queue_lock (cs_queue);
 	cs_queue_position = cs_queue->head;
 	cs_queue_item = cs_queue->items;
 	cs_queue_item += cs_queue_position * cs_queue->size_per_item;
@@ -144,68 +185,65 @@ static inline void cs_queue_item_add (struct cs_queue *cs_queue, void *item)
 	if (cs_queue->used > cs_queue->usedhw) {
 		cs_queue->usedhw = cs_queue->used;
 	}
-	if (cs_queue->threaded_mode_enabled) {
-		pthread_mutex_unlock (&cs_queue->mutex);
-	}
+	cs_queue_unlock (cs_queue);
 }
 
-static inline void *cs_queue_item_get (struct cs_queue *cs_queue)
+/*
+ * Number of items the consumer can take in one go, at most max
+ */
+static inline int cs_queue_items_ready (struct cs_queue *cs_queue, int max)
 {
-	char *cs_queue_item;
-	int cs_queue_position;
+	int ready;
 
-	if (cs_queue->threaded_mode_enabled) {
-		pthread_mutex_lock (&cs_queue->mutex);
-	}
-	cs_queue_position = (cs_queue->tail + 1) % cs_queue->size;
-	cs_queue_item = cs_queue->items;
-	cs_queue_item += cs_queue_position * cs_queue->size_per_item;
-	if (cs_queue->threaded_mode_enabled) {
-		pthread_mutex_unlock (&cs_queue->mutex);
-	}
-	return ((void *)cs_queue_item);
+	cs_queue_lock (cs_queue);
+	ready = cs_queue->used < max ? cs_queue->used : max;
+	cs_queue_unlock (cs_queue);
+	return (ready);
 }
 
-static inline void cs_queue_item_remove (struct cs_queue *cs_queue) {
-	if (cs_queue->threaded_mode_enabled) {
-		pthread_mutex_lock (&cs_queue->mutex);
-	}
-	cs_queue->tail = (cs_queue->tail + 1) % cs_queue->size;
+/*
+ * Item n places after the oldest one, n must be below cs_queue_items_ready
+ */
+static inline void *cs_queue_item_get_nth (struct cs_queue *cs_queue, int n)
+{
+	char *cs_queue_item;
 
-	assert (cs_queue->tail != cs_queue->head);
+	cs_queue_lock (cs_queue);
+	cs_queue_item = cs_queue_slot (cs_queue, cs_queue->tail + 1 + n);
+	cs_queue_unlock (cs_queue);
+	return ((void *)cs_queue_item);
+}
 
-	cs_queue->used--;
-	assert (cs_queue->used >= 0);
-	if (cs_queue->threaded_mode_enabled) {
-		pthread_mutex_unlock (&cs_queue->mutex);
-	}
+static inline void *cs_queue_item_get (struct cs_queue *cs_queue)
+{
+	return (cs_queue_item_get_nth (cs_queue, 0));
 }
 
 static inline void cs_queue_items_remove (struct cs_queue *cs_queue, int rel_count)
 {
-	if (cs_queue->threaded_mode_enabled) {
-		pthread_mutex_lock (&cs_queue->mutex);
+	if (rel_count <= 0) {
+		return;
 	}
+
+	cs_queue_lock (cs_queue);
 	cs_queue->tail = (cs_queue->tail + rel_count) % cs_queue->size;
 
 	assert (cs_queue->tail != cs_queue->head);
 
 	cs_queue->used -= rel_count;
-	if (cs_queue->threaded_mode_enabled) {
-		pthread_mutex_unlock (&cs_queue->mutex);
-	}
+	assert (cs_queue->used >= 0);
+	cs_queue_unlock (cs_queue);
 }
 
+static inline void cs_queue_item_remove (struct cs_queue *cs_queue) {
+	cs_queue_items_remove (cs_queue, 1);
+}
 
 static inline void cs_queue_item_iterator_init (struct cs_queue *cs_queue)
 {
-	if (cs_queue->threaded_mode_enabled) {
-		pthread_mutex_lock (&cs_queue->mutex);
-	}
+	cs_queue_lock (cs_queue);
 	cs_queue->iterator = (cs_queue->tail + 1) % cs_queue->size;
-	if (cs_queue->threaded_mode_enabled) {
-		pthread_mutex_unlock (&cs_queue->mutex);
-	}
+	cs_queue_unlock (cs_queue);
 }
 
 static inline void *cs_queue_item_iterator_get (struct cs_queue *cs_queue)
@@ -213,21 +251,15 @@ static inline void *cs_queue_item_iterator_get (struct cs_queue *cs_queue)
 	char *cs_queue_item;
 	int cs_queue_position;
 
-	if (cs_queue->threaded_mode_enabled) {
-		pthread_mutex_lock (&cs_queue->mutex);
-	}
+	cs_queue_lock (cs_queue);
 	cs_queue_position = (cs_queue->iterator) % cs_queue->size;
 	if (cs_queue->iterator == cs_queue->head) {
-		if (cs_queue->threaded_mode_enabled) {
-			pthread_mutex_unlock (&cs_queue->mutex);
-		}
+		cs_queue_unlock (cs_queue);
 		return (0);
 	}
 	cs_queue_item = cs_queue->items;
 	cs_queue_item += cs_queue_position * cs_queue->size_per_item;
-	if (cs_queue->threaded_mode_enabled) {
-		pthread_mutex_unlock (&cs_queue->mutex);
-	}
+	cs_queue_unlock (cs_queue);
 	return ((void *)cs_queue_item);
 }
 
@@ -235,40 +267,28 @@ static inline int cs_queue_item_iterator_next (struct cs_queue *cs_queue)
 {
 	int next_res;
 
-	if (cs_queue->threaded_mode_enabled) {
-		pthread_mutex_lock (&cs_queue->mutex);
-	}
+	cs_queue_lock (cs_queue);
 	cs_queue->iterator = (cs_queue->iterator + 1) % cs_queue->size;
 
 	next_res = cs_queue->iterator == cs_queue->head;
-	if (cs_queue->threaded_mode_enabled) {
-		pthread_mutex_unlock (&cs_queue->mutex);
-	}
+	cs_queue_unlock (cs_queue);
 	return (next_res);
 }
 
 static inline void cs_queue_avail (struct cs_queue *cs_queue, int *avail)
 {
-	if (cs_queue->threaded_mode_enabled) {
-		pthread_mutex_lock (&cs_queue->mutex);
-	}
+	cs_queue_lock (cs_queue);
 	*avail = cs_queue->size - cs_queue->used - 2;
 	assert (*avail >= 0);
-	if (cs_queue->threaded_mode_enabled) {
-		pthread_mutex_unlock (&cs_queue->mutex);
-	}
+	cs_queue_unlock (cs_queue);
 }
 
 static inline int cs_queue_used (struct cs_queue *cs_queue) {
 	int used;
 
-	if (cs_queue->threaded_mode_enabled) {
-		pthread_mutex_lock (&cs_queue->mutex);
-	}
+	cs_queue_lock (cs_queue);
 	used = cs_queue->used;
-	if (cs_queue->threaded_mode_enabled) {
-		pthread_mutex_unlock (&cs_queue->mutex);
-	}
+	cs_queue_unlock (cs_queue);
 
 	return (used);
 }
@@ -276,15 +296,11 @@ static inline int cs_queue_used (struct cs_queue *cs_queue) {
 static inline int cs_queue_usedhw (struct cs_queue *cs_queue) {
 	int usedhw;
 
-	if (cs_queue->threaded_mode_enabled) {
-		pthread_mutex_lock (&cs_queue->mutex);
-	}
+	cs_queue_lock (cs_queue);
 
 	usedhw = cs_queue->usedhw;
 
-	if (cs_queue->threaded_mode_enabled) {
-		pthread_mutex_unlock (&cs_queue->mutex);
-	}
+	cs_queue_unlock (cs_queue);
 
 	return (usedhw);
 }
@@ -38,6 +38,7 @@
 #include <stdio.h>
 #include <errno.h>
 #include <assert.h>
+#include <inttypes.h>
 #include <sys/uio.h>
 #include <string.h>
 
@@ -80,12 +81,44 @@ struct cs_ipcs_mapper {
 	char name[CS_IPCS_MAPPER_SERV_NAME];
 };
 
-struct outq_item {
-	void *msg;
-	size_t mlen;
+/*
+ * Events which can't be sent because the client's ring is full are copied
+ * into a per connection queue of chunks.  Each chunk holds as many
+ * messages as fit, every message prefixed by its length, and is sent from
+ * the head while new messages are appended at the tail.  One emptied chunk
+ * is kept per connection for reuse.
+ */
+#define OUTQ_CHUNK_SIZE		(64 * 1024)
+
+#define OUTQ_RECORD_SIZE(mlen)	\
+	((sizeof (size_t) + (mlen) + sizeof (size_t) - 1) & ~(sizeof (size_t) - 1))
+
+struct outq_chunk {
 	struct qb_list_head list;
+	size_t size;
+	size_t head;
+	size_t tail;
+	char data[];
 };
 
+/*
+ * What to do when a connection's queue would exceed qb.ipc_outq_max_size
+ */
+enum outq_policy {
+	OUTQ_POLICY_DISCONNECT,
+	OUTQ_POLICY_DROP_OLDEST,
+	OUTQ_POLICY_BACKPRESSURE,
+};
+
+/*
+ * Connection under backpressure whose queue still grows to this many times
+ * qb.ipc_outq_max_size is disconnected
+ */
+#define OUTQ_BACKPRESSURE_DISCONNECT_FACTOR	4
+
+static uint64_t outq_max_size; /* 0 means unlimited */
+static enum outq_policy outq_policy = OUTQ_POLICY_DISCONNECT;
+
 static struct cs_ipcs_mapper ipcs_mapper[SERVICES_COUNT_MAX];
 
 static int32_t cs_ipcs_job_add(enum qb_loop_priority p,	void *data, qb_loop_job_dispatch_fn fn);
@@ -95,6 +128,7 @@ static int32_t cs_ipcs_dispatch_mod(enum qb_loop_priority p, int32_t fd, int32_t
 	void *data, qb_ipcs_dispatch_fn_t fn);
 static int32_t cs_ipcs_dispatch_del(int32_t fd);
 static void outq_flush (void *data);
+static void cs_ipcs_check_for_flow_control(void);
 
 
 static struct qb_ipcs_poll_handlers corosync_poll_funcs = {
@@ -170,6 +204,38 @@ int32_t cs_ipcs_service_destroy(int32_t service_id)
 	return 0;
 }
 
+/*
+ * Connection context is allocated when the connection is accepted,
+ * because credentials of the client are only known at that time
+ */
+static int32_t cs_ipcs_conn_context_create (qb_ipcs_connection_t *c, uid_t euid, gid_t egid)
+{
+	int32_t service = qb_ipcs_service_id_get(c);
+	struct cs_ipcs_conn_context *context;
+	size_t size = sizeof(struct cs_ipcs_conn_context);
+
+	size += corosync_service[service]->private_data_size;
+	context = calloc(1, size);
+	if (context == NULL) {
+		return -ENOMEM;
+	}
+
+	qb_list_init(&context->outq_head);
+	context->outq_spare = NULL;
+	context->outq_backpressure = QB_FALSE;
+	context->queuing = QB_FALSE;
+	context->queued = 0;
+	context->queued_bytes = 0;
+	context->queue_dropped = 0;
+	context->sent = 0;
+	context->euid = euid;
+	context->egid = egid;
+
+	qb_ipcs_context_set(c, context);
+
+	return 0;
+}
+
 static int32_t cs_ipcs_connection_accept (qb_ipcs_connection_t *c, uid_t euid, gid_t egid)
 {
 	int32_t service = qb_ipcs_service_id_get(c);
@@ -191,24 +257,24 @@ static int32_t cs_ipcs_connection_accept (qb_ipcs_connection_t *c, uid_t euid, g
 	}
 
 	if (euid == 0 || egid == 0) {
-		return 0;
+		return cs_ipcs_conn_context_create(c, euid, egid);
 	}
 
 	snprintf(key_name, ICMAP_KEYNAME_MAXLEN, "uidgid.uid.%u", euid);
 	if (icmap_get_uint8(key_name, &u8) == CS_OK && u8 == 1)
-		return 0;
+		return cs_ipcs_conn_context_create(c, euid, egid);
 
 	snprintf(key_name, ICMAP_KEYNAME_MAXLEN, "uidgid.config.uid.%u", euid);
 	if (icmap_get_uint8(key_name, &u8) == CS_OK && u8 == 1)
-		return 0;
+		return cs_ipcs_conn_context_create(c, euid, egid);
 
 	snprintf(key_name, ICMAP_KEYNAME_MAXLEN, "uidgid.gid.%u", egid);
 	if (icmap_get_uint8(key_name, &u8) == CS_OK && u8 == 1)
-		return 0;
+		return cs_ipcs_conn_context_create(c, euid, egid);
 
 	snprintf(key_name, ICMAP_KEYNAME_MAXLEN, "uidgid.config.gid.%u", egid);
 	if (icmap_get_uint8(key_name, &u8) == CS_OK && u8 == 1)
-		return 0;
+		return cs_ipcs_conn_context_create(c, euid, egid);
 
 	log_printf(LOGSYS_LEVEL_ERROR, "Denied connection attempt from %d:%d", euid, egid);
 
@@ -264,26 +330,17 @@ static void cs_ipcs_connection_created(qb_ipcs_connection_t *c)
 	int32_t service = 0;
 	struct cs_ipcs_conn_context *context;
 	struct qb_ipcs_connection_stats stats;
-	size_t size = sizeof(struct cs_ipcs_conn_context);
 
 	log_printf(LOG_DEBUG, "connection created");
 
 	service = qb_ipcs_service_id_get(c);
 
-	size += corosync_service[service]->private_data_size;
-	context = calloc(1, size);
+	context = qb_ipcs_context_get(c);
 	if (context == NULL) {
 		qb_ipcs_disconnect(c);
 		return;
 	}
 
-	qb_list_init(&context->outq_head);
-	context->queuing = QB_FALSE;
-	context->queued = 0;
-	context->sent = 0;
-
-	qb_ipcs_context_set(c, context);
-
 	if (corosync_service[service]->lib_init_fn(c) != 0) {
 		log_printf(LOG_ERR, "lib_init_fn failed, disconnecting");
 		qb_ipcs_disconnect(c);
@@ -297,6 +354,7 @@ static void cs_ipcs_connection_created(qb_ipcs_connection_t *c)
 	}
 	stats_ipcs_add_connection(service, stats.client_pid, c);
 	global_stats.active++;
+	stats_mark_dirty(STATS_SOURCE_IPCS);
 }
 
 void cs_ipc_refcnt_inc(void *conn)
@@ -309,6 +367,14 @@ void cs_ipc_refcnt_dec(void *conn)
 	qb_ipcs_connection_unref(conn);
 }
 
+void cs_ipc_credentials_get(void *conn, uid_t *euid, gid_t *egid)
+{
+	struct cs_ipcs_conn_context *cnx;
+	cnx = qb_ipcs_context_get(conn);
+	*euid = cnx->euid;
+	*egid = cnx->egid;
+}
+
 void *cs_ipcs_private_data_get(void *conn)
 {
 	struct cs_ipcs_conn_context *cnx;
@@ -316,23 +382,147 @@ void *cs_ipcs_private_data_get(void *conn)
 	return &cnx->data[0];
 }
 
+static void outq_chunk_put (struct cs_ipcs_conn_context *context,
+	struct outq_chunk *chunk)
+{
+	if (context->outq_spare == NULL && chunk->size == OUTQ_CHUNK_SIZE) {
+		context->outq_spare = chunk;
+	} else {
+		free (chunk);
+	}
+}
+
+static struct outq_chunk *outq_chunk_get (struct cs_ipcs_conn_context *context,
+	size_t record_size)
+{
+	struct outq_chunk *chunk;
+	size_t size = OUTQ_CHUNK_SIZE;
+
+	if (record_size <= OUTQ_CHUNK_SIZE && context->outq_spare != NULL) {
+		chunk = context->outq_spare;
+		context->outq_spare = NULL;
+	} else {
+		if (record_size > size) {
+			size = record_size;
+		}
+		chunk = malloc (sizeof (struct outq_chunk) + size);
+		if (chunk == NULL) {
+			return (NULL);
+		}
+		chunk->size = size;
+	}
+	chunk->head = 0;
+	chunk->tail = 0;
+	qb_list_init (&chunk->list);
+	return (chunk);
+}
+
+static int outq_append (struct cs_ipcs_conn_context *context,
+	const struct iovec *iov, uint32_t iov_len, size_t mlen)
+{
+	struct outq_chunk *chunk = NULL;
+	size_t record_size = OUTQ_RECORD_SIZE (mlen);
+	char *write_buf;
+	int32_t i;
+
+	if (!qb_list_empty (&context->outq_head)) {
+		chunk = qb_list_entry (context->outq_head.prev, struct outq_chunk, list);
+		if (chunk->size - chunk->tail < record_size) {
+			chunk = NULL;
+		}
+	}
+	if (chunk == NULL) {
+		chunk = outq_chunk_get (context, record_size);
+		if (chunk == NULL) {
+			return (-1);
+		}
+		qb_list_add_tail (&chunk->list, &context->outq_head);
+	}
+
+	write_buf = &chunk->data[chunk->tail];
+	memcpy (write_buf, &mlen, sizeof (size_t));
+	write_buf += sizeof (size_t);
+	for (i = 0; i < iov_len; i++) {
+		memcpy (write_buf, iov[i].iov_base, iov[i].iov_len);
+		write_buf += iov[i].iov_len;
+	}
+	chunk->tail += record_size;
+	context->queued++;
+	context->queued_bytes += mlen;
+	return (0);
+}
+
+static void *outq_first (struct cs_ipcs_conn_context *context, size_t *mlen)
+{
+	struct outq_chunk *chunk;
+
+	if (qb_list_empty (&context->outq_head)) {
+		return (NULL);
+	}
+	chunk = qb_list_first_entry (&context->outq_head, struct outq_chunk, list);
+	memcpy (mlen, &chunk->data[chunk->head], sizeof (size_t));
+	return (&chunk->data[chunk->head + sizeof (size_t)]);
+}
+
+static void outq_remove_first (struct cs_ipcs_conn_context *context)
+{
+	struct outq_chunk *chunk;
+	size_t mlen;
+
+	chunk = qb_list_first_entry (&context->outq_head, struct outq_chunk, list);
+	memcpy (&mlen, &chunk->data[chunk->head], sizeof (size_t));
+	chunk->head += OUTQ_RECORD_SIZE (mlen);
+	context->queued--;
+	context->queued_bytes -= mlen;
+
+	if (chunk->head == chunk->tail) {
+		qb_list_del (&chunk->list);
+		outq_chunk_put (context, chunk);
+	}
+}
+
+static void outq_free (struct cs_ipcs_conn_context *context)
+{
+	struct qb_list_head *list, *tmp_iter;
+	struct outq_chunk *chunk;
+
+	qb_list_for_each_safe(list, tmp_iter, &(context->outq_head)) {
+		chunk = qb_list_entry (list, struct outq_chunk, list);
+
+		qb_list_del (list);
+		free (chunk);
+	}
+	free (context->outq_spare);
+	context->outq_spare = NULL;
+	context->queued_bytes = 0;
+}
+
+/*
+ * With the backpressure policy requests of a connection over the limit are
+ * refused with CS_ERR_TRY_AGAIN, until its queue has drained to half of
+ * the limit. Other connections are not affected.
+ */
+static void outq_backpressure_set (struct cs_ipcs_conn_context *context,
+	int32_t backpressure)
+{
+	if (context->outq_backpressure == backpressure) {
+		return;
+	}
+	context->outq_backpressure = backpressure;
+	log_printf(LOGSYS_LEVEL_DEBUG, "%s backpressure for %s, %"PRIu64" bytes of events queued",
+		backpressure ? "Starting" : "Stopping", context->proc_name, context->queued_bytes);
+}
+
 static void cs_ipcs_connection_destroyed (qb_ipcs_connection_t *c)
 {
 	struct cs_ipcs_conn_context *context;
-	struct qb_list_head *list, *tmp_iter;
-	struct outq_item *outq_item;
 
 	log_printf(LOG_DEBUG, "%s() ", __func__);
 
 	context = qb_ipcs_context_get(c);
 	if (context) {
-		qb_list_for_each_safe(list, tmp_iter, &(context->outq_head)) {
-			outq_item = qb_list_entry (list, struct outq_item, list);
-
-			qb_list_del (list);
-			free (outq_item->msg);
-			free (outq_item);
-		}
+		outq_backpressure_set (context, QB_FALSE);
+		outq_free (context);
 		free(context);
 	}
 }
@@ -357,6 +547,7 @@ static int32_t cs_ipcs_connection_closed (qb_ipcs_connection_t *c)
 
 	global_stats.active--;
 	global_stats.closed++;
+	stats_mark_dirty(STATS_SOURCE_IPCS);
 	return 0;
 }
 
@@ -365,6 +556,8 @@ int cs_ipcs_response_iov_send (void *conn,
 	unsigned int iov_len)
 {
 	int32_t rc = qb_ipcs_response_sendv(conn, iov, iov_len);
+
+	stats_mark_dirty(STATS_SOURCE_IPCS);
 	if (rc >= 0) {
 		return 0;
 	}
@@ -374,6 +567,8 @@ int cs_ipcs_response_iov_send (void *conn,
 int cs_ipcs_response_send(void *conn, const void *msg, size_t mlen)
 {
 	int32_t rc = qb_ipcs_response_send(conn, msg, mlen);
+
+	stats_mark_dirty(STATS_SOURCE_IPCS);
 	if (rc >= 0) {
 		return 0;
 	}
@@ -383,15 +578,15 @@ int cs_ipcs_response_send(void *conn, const void *msg, size_t mlen)
 static void outq_flush (void *data)
 {
 	qb_ipcs_connection_t *conn = data;
-	struct qb_list_head *list, *tmp_iter;
-	struct outq_item *outq_item;
+	void *msg;
+	size_t mlen;
 	int32_t rc;
 	struct cs_ipcs_conn_context *context = qb_ipcs_context_get(conn);
 
-	qb_list_for_each_safe(list, tmp_iter, &(context->outq_head)) {
-		outq_item = qb_list_entry (list, struct outq_item, list);
+	stats_mark_dirty(STATS_SOURCE_IPCS);
 
-		rc = qb_ipcs_event_send(conn, outq_item->msg, outq_item->mlen);
+	while ((msg = outq_first (context, &mlen)) != NULL) {
+		rc = qb_ipcs_event_send(conn, msg, mlen);
 		if (rc < 0 && rc != -EAGAIN) {
 			errno = -rc;
 			qb_perror(LOG_ERR, "qb_ipcs_event_send");
@@ -399,13 +594,14 @@ static void outq_flush (void *data)
 		} else if (rc == -EAGAIN) {
 			break;
 		}
-		assert(rc == outq_item->mlen);
+		assert(rc == mlen);
 		context->sent++;
-		context->queued--;
 
-		qb_list_del (list);
-		free (outq_item->msg);
-		free (outq_item);
+		outq_remove_first (context);
+	}
+	if (context->outq_backpressure &&
+	    context->queued_bytes <= outq_max_size / 2) {
+		outq_backpressure_set (context, QB_FALSE);
 	}
 	if (qb_list_empty (&context->outq_head)) {
 		context->queuing = QB_FALSE;
@@ -422,11 +618,12 @@ static void msg_send_or_queue(qb_ipcs_connection_t *conn, const struct iovec *io
 {
 	int32_t rc = 0;
 	int32_t i;
+	size_t mlen;
 	int32_t bytes_msg = 0;
-	struct outq_item *outq_item;
-	char *write_buf = 0;
 	struct cs_ipcs_conn_context *context = qb_ipcs_context_get(conn);
 
+	stats_mark_dirty(STATS_SOURCE_IPCS);
+
 	for (i = 0; i < iov_len; i++) {
 		bytes_msg += iov[i].iov_len;
 	}
@@ -448,27 +645,49 @@ static void msg_send_or_queue(qb_ipcs_connection_t *conn, const struct iovec *io
 			return;
 		}
 	}
-	outq_item = malloc (sizeof (struct outq_item));
-	if (outq_item == NULL) {
-		qb_ipcs_disconnect(conn);
-		return;
+
+	if (outq_max_size != 0 && context->queued_bytes + bytes_msg > outq_max_size) {
+		switch (outq_policy) {
+		case OUTQ_POLICY_DISCONNECT:
+			log_printf(LOGSYS_LEVEL_WARNING,
+				"Disconnecting %s, %"PRIu64" bytes of events queued",
+				context->proc_name, context->queued_bytes);
+			qb_ipcs_disconnect(conn);
+			return;
+		case OUTQ_POLICY_DROP_OLDEST:
+			while (outq_first (context, &mlen) != NULL &&
+			    context->queued_bytes + bytes_msg > outq_max_size) {
+				outq_remove_first (context);
+				context->queue_dropped++;
+			}
+			if (bytes_msg > outq_max_size) {
+				context->queue_dropped++;
+				return;
+			}
+			break;
+		case OUTQ_POLICY_BACKPRESSURE:
+			/*
+			 * Events from the cluster keep coming even when the
+			 * requests are held back, so a client which still
+			 * doesn't read them is disconnected as a last resort
+			 */
+			if (context->queued_bytes + bytes_msg >
+			    OUTQ_BACKPRESSURE_DISCONNECT_FACTOR * outq_max_size) {
+				log_printf(LOGSYS_LEVEL_WARNING,
+					"Disconnecting %s, %"PRIu64" bytes of events queued under backpressure",
+					context->proc_name, context->queued_bytes);
+				qb_ipcs_disconnect(conn);
+				return;
+			}
+			outq_backpressure_set (context, QB_TRUE);
+			break;
+		}
 	}
-	outq_item->msg = malloc (bytes_msg);
-	if (outq_item->msg == NULL) {
-		free (outq_item);
+
+	if (outq_append (context, iov, iov_len, bytes_msg) != 0) {
 		qb_ipcs_disconnect(conn);
 		return;
 	}
-
-	write_buf = outq_item->msg;
-	for (i = 0; i < iov_len; i++) {
-		memcpy (write_buf, iov[i].iov_base, iov[i].iov_len);
-		write_buf += iov[i].iov_len;
-	}
-	outq_item->mlen = bytes_msg;
-	qb_list_init (&outq_item->list);
-	qb_list_add_tail (&outq_item->list, &context->outq_head);
-	context->queued++;
 }
 
 int cs_ipcs_dispatch_send(void *conn, const void *msg, size_t mlen)
@@ -500,6 +719,8 @@ static int32_t cs_ipcs_msg_process(qb_ipcs_connection_t *c,
 	int sending_allowed_private_data;
 	struct cs_ipcs_conn_context *cnx;
 
+	stats_mark_dirty(STATS_SOURCE_IPCS);
+
 	send_ok = corosync_sending_allowed (service,
 			request_pt->id,
 			request_pt,
@@ -507,6 +728,14 @@ static int32_t cs_ipcs_msg_process(qb_ipcs_connection_t *c,
 
 	is_async_call = (service == CPG_SERVICE && request_pt->id == 2);
 
+	/*
+	 * Client not reading its events is held back like an overload
+	 */
+	cnx = qb_ipcs_context_get(c);
+	if (send_ok >= 0 && cnx != NULL && cnx->outq_backpressure) {
+		send_ok = -EAGAIN;
+	}
+
 	/*
 	 * This happens when the message contains some kind of invalid
 	 * parameter, such as an invalid size
@@ -516,7 +745,6 @@ static int32_t cs_ipcs_msg_process(qb_ipcs_connection_t *c,
 		response.id = 0;
 		response.error = CS_ERR_INVALID_PARAM;
 
-		cnx = qb_ipcs_context_get(c);
 		if (cnx) {
 			cnx->invalid_request++;
 		}
@@ -531,7 +759,6 @@ static int32_t cs_ipcs_msg_process(qb_ipcs_connection_t *c,
 		}
 		res = -EINVAL;
 	} else if (send_ok < 0) {
-		cnx = qb_ipcs_context_get(c);
 		if (cnx) {
 			cnx->overload++;
 		}
@@ -733,6 +960,7 @@ void cs_ipcs_clear_stats()
 			cnx->invalid_request = 0;
 			cnx->overload = 0;
 			cnx->sent = 0;
+			cnx->queue_dropped = 0;
 
 		}
 	}
@@ -815,10 +1043,38 @@ const char *cs_ipcs_service_init(struct corosync_service_engine *service)
 	return NULL;
 }
 
+static void cs_ipcs_outq_config_read (void)
+{
+	char *str;
+	uint32_t u32;
+
+	if (icmap_get_uint32("qb.ipc_outq_max_size", &u32) == CS_OK) {
+		outq_max_size = u32;
+	}
+
+	if (icmap_get_string("qb.ipc_outq_policy", &str) == CS_OK) {
+		if (strcmp(str, "drop_oldest") == 0) {
+			outq_policy = OUTQ_POLICY_DROP_OLDEST;
+		} else if (strcmp(str, "backpressure") == 0) {
+			outq_policy = OUTQ_POLICY_BACKPRESSURE;
+		} else {
+			outq_policy = OUTQ_POLICY_DISCONNECT;
+		}
+		free(str);
+	}
+
+	if (outq_max_size != 0) {
+		log_printf(LOGSYS_LEVEL_DEBUG, "IPC event queue limited to %"PRIu64" bytes per connection",
+			outq_max_size);
+	}
+}
+
 void cs_ipcs_init(void)
 {
 	api = apidef_get ();
 
+	cs_ipcs_outq_config_read ();
+
 	qb_loop_poll_low_fds_event_set(cs_poll_handle_get(), cs_ipcs_low_fds_event);
 
 	api->quorum_register_callback (cs_ipcs_fc_quorum_changed, NULL);
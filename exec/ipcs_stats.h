@@ -34,11 +34,17 @@
 
 struct cs_ipcs_conn_context {
 	struct qb_list_head outq_head;
+	void *outq_spare;
+	int32_t outq_backpressure;
 	int32_t queuing;
 	uint32_t queued;
+	uint64_t queued_bytes;
+	uint64_t queue_dropped;
 	uint64_t invalid_request;
 	uint64_t overload;
 	uint32_t sent;
+	uid_t euid;
+	gid_t egid;
 	char proc_name[32];
 	char data[1];
 };
@@ -238,6 +238,7 @@ static void corosync_blackbox_write_to_file (void)
 static void unlink_all_completed (void)
 {
 	api->timer_delete (corosync_stats_timer_handle);
+	stats_shm_fini();
 	qb_loop_stop (corosync_poll_handle);
 	icmap_fini();
 }
@@ -543,7 +544,12 @@ static void corosync_totem_stats_updater (void *data)
 		stats->srp->avg_backlog_calc = (total_backlog_calc / token_count);
 	}
 
+	/*
+	 * Totem stats were just updated, knet ones can only be polled
+	 */
+	stats_mark_dirty(STATS_SOURCE_TOTEM | STATS_SOURCE_KNET);
 	stats_trigger_trackers();
+	stats_shm_update();
 
 	api->timer_add_duration (1500 * MILLI_2_NANO_SECONDS, NULL,
 		corosync_totem_stats_updater,
@@ -552,6 +558,9 @@ static void corosync_totem_stats_updater (void *data)
 
 static void corosync_totem_stats_init (void)
 {
+	/* failure is not fatal, stats are still available through cmap */
+	(void)stats_shm_init();
+
 	/* start stats timer */
 	api->timer_add_duration (1500 * MILLI_2_NANO_SECONDS, NULL,
 		corosync_totem_stats_updater,
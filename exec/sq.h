@@ -0,0 +1,626 @@
+/*
+ * Copyright (c) 2003-2004 MontaVista Software, Inc.
+ *
+ * All rights reserved.
+ *
+ * Author: Steven Dake (sdake@redhat.com)
+ *
+ * This software licensed under BSD license, the text of which follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * - Neither the name of the MontaVista Software, Inc. nor the names of its
+ *   contributors may be used to endorse or promote products derived from this
+ *   software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef SQ_H_DEFINED
+#define SQ_H_DEFINED
+
+#include <errno.h>
+#include <string.h>
+
+/**
+ * @brief The sq struct
+ *
+ * items_inuse is a bitmap with one bit per position so occupancy of a
+ * range can be examined a word at a time.
+ *
+ * seqid_max is the highest sequence number given an item or a miss count
+ * since the last reinit, so only the positions from head up to it need to
+ * be cleared when the queue is reset.  The contents of a position are only
+ * meaningful while its in use bit is set.
+ */
+struct sq {
+	unsigned int head;
+	unsigned int size;
+	void *items;
+	unsigned long *items_inuse;
+	unsigned int *items_miss_count;
+	unsigned int size_per_item;
+	unsigned int head_seqid;
+	unsigned int item_count;
+	unsigned int pos_max;
+	unsigned int seqid_max;
+};
+
+/*
+ * Compare a unsigned rollover-safe value to an unsigned rollover-safe value
+ */
+
+/**
+ * ADJUST_ROLLOVER_POINT is the value used to determine when a window should be
+ *	used to calculate a less-then or less-then-equal comparison.
+ */
+#define ADJUST_ROLLOVER_POINT 0x80000000
+
+/**
+ * ADJUST_ROLLOVER_VALUE is the value by which both values in a comparison are
+ *	adjusted if either value in a comparison is greater then
+ *	ADJUST_ROLLOVER_POINT.
+ */
+#define ADJUST_ROLLOVER_VALUE 0x10000
+
+/**
+ * @brief sq_lt_compare
+ * @param a
+ * @param b
+ * @return
+ */
+static inline int sq_lt_compare (unsigned int a, unsigned int b) {
+	if ((a > ADJUST_ROLLOVER_POINT) || (b > ADJUST_ROLLOVER_POINT)) {
+		if ((a - ADJUST_ROLLOVER_VALUE) < (b - ADJUST_ROLLOVER_VALUE)) {
+			return (1);
+		}
+	} else {
+		if (a < b) {
+			return (1);
+		}
+	}
+	return (0);
+}
+
+/**
+ * @brief sq_lte_compare
+ * @param a
+ * @param b
+ * @return
+ */
+static inline int sq_lte_compare (unsigned int a, unsigned int b) {
+	if ((a > ADJUST_ROLLOVER_POINT) || (b > ADJUST_ROLLOVER_POINT)) {
+		if ((a - ADJUST_ROLLOVER_VALUE) <= (b - ADJUST_ROLLOVER_VALUE)) {
+			return (1);
+		}
+	} else {
+		if (a <= b) {
+			return (1);
+		}
+	}
+	return (0);
+}
+
+#define SQ_BITS_PER_WORD (sizeof (unsigned long) * 8)
+
+/**
+ * @brief sq_bitmap_size
+ * @param item_count
+ * @return size in bytes of the occupancy bitmap for item_count items
+ */
+static inline size_t sq_bitmap_size (unsigned int item_count)
+{
+	return (((item_count + SQ_BITS_PER_WORD - 1) / SQ_BITS_PER_WORD) *
+		sizeof (unsigned long));
+}
+
+/**
+ * @brief sq_bit_test
+ * @param sq
+ * @param sq_position
+ * @return
+ */
+static inline int sq_bit_test (const struct sq *sq, unsigned int sq_position)
+{
+	return ((sq->items_inuse[sq_position / SQ_BITS_PER_WORD] >>
+		(sq_position % SQ_BITS_PER_WORD)) & 1);
+}
+
+/**
+ * @brief sq_bits_clear clears count bits from sq_position, without wrapping
+ * @param sq
+ * @param sq_position
+ * @param count
+ */
+static inline void sq_bits_clear (
+	struct sq *sq,
+	unsigned int sq_position,
+	unsigned int count)
+{
+	unsigned int bit;
+	unsigned int n;
+
+	while (count > 0) {
+		bit = sq_position % SQ_BITS_PER_WORD;
+		n = SQ_BITS_PER_WORD - bit;
+		if (n > count) {
+			n = count;
+		}
+		if (n == SQ_BITS_PER_WORD) {
+			sq->items_inuse[sq_position / SQ_BITS_PER_WORD] = 0;
+		} else {
+			sq->items_inuse[sq_position / SQ_BITS_PER_WORD] &=
+				~(((1UL << n) - 1) << bit);
+		}
+		sq_position += n;
+		count -= n;
+	}
+}
+
+/**
+ * @brief sq_bits_scan
+ * @param sq
+ * @param sq_position
+ * @param count must not be larger than the size of the queue
+ * @param inuse
+ * @return number of consecutive positions starting at sq_position, at most
+ *	count, whose in use state equals inuse
+ */
+static inline unsigned int sq_bits_scan (
+	const struct sq *sq,
+	unsigned int sq_position,
+	unsigned int count,
+	int inuse)
+{
+	unsigned long word;
+	unsigned long mask;
+	unsigned int scanned = 0;
+	unsigned int bit;
+	unsigned int n;
+
+	while (scanned < count) {
+		bit = sq_position % SQ_BITS_PER_WORD;
+		word = sq->items_inuse[sq_position / SQ_BITS_PER_WORD] >> bit;
+		if (inuse == 0) {
+			word = ~word;
+		}
+
+		n = SQ_BITS_PER_WORD - bit;
+		if (n > sq->size - sq_position) {
+			n = sq->size - sq_position;
+		}
+		if (n > count - scanned) {
+			n = count - scanned;
+		}
+		mask = (n == SQ_BITS_PER_WORD) ? ~0UL : ((1UL << n) - 1);
+
+		/*
+		 * Set bits are positions which end the run
+		 */
+		word = ~word & mask;
+		if (word) {
+			return (scanned + __builtin_ctzl (word));
+		}
+		scanned += n;
+		sq_position = (sq_position + n) % sq->size;
+	}
+	return (count);
+}
+
+/**
+ * @brief sq_range_clear clears in use state and miss counts of count
+ *	positions from sq_position, wrapping at the end of the queue
+ * @param sq
+ * @param sq_position
+ * @param count
+ */
+static inline void sq_range_clear (
+	struct sq *sq,
+	unsigned int sq_position,
+	unsigned int count)
+{
+	unsigned int n;
+
+	if (count > sq->size) {
+		count = sq->size;
+	}
+	n = sq->size - sq_position;
+	if (n > count) {
+		n = count;
+	}
+	sq_bits_clear (sq, sq_position, n);
+	memset (&sq->items_miss_count[sq_position], 0, n * sizeof (unsigned int));
+	sq_bits_clear (sq, 0, count - n);
+	memset (sq->items_miss_count, 0, (count - n) * sizeof (unsigned int));
+}
+
+/**
+ * @brief sq_seqid_touch
+ * @param sq
+ * @param seqid
+ */
+static inline void sq_seqid_touch (struct sq *sq, unsigned int seqid)
+{
+	if (sq_lt_compare (sq->seqid_max, seqid)) {
+		sq->seqid_max = seqid;
+	}
+}
+
+/**
+ * @brief sq_init
+ * @param sq
+ * @param item_count
+ * @param size_per_item
+ * @param head_seqid
+ * @return
+ */
+static inline int sq_init (
+	struct sq *sq,
+	int item_count,
+	int size_per_item,
+	int head_seqid)
+{
+	sq->head = 0;
+	sq->size = item_count;
+	sq->size_per_item = size_per_item;
+	sq->head_seqid = head_seqid;
+	sq->item_count = item_count;
+	sq->pos_max = 0;
+	sq->seqid_max = head_seqid - 1;
+
+	sq->items = malloc (item_count * size_per_item);
+	if (sq->items == NULL) {
+		return (-ENOMEM);
+	}
+	memset (sq->items, 0, item_count * size_per_item);
+
+	if ((sq->items_inuse = malloc (sq_bitmap_size (item_count)))
+	    == NULL) {
+		return (-ENOMEM);
+	}
+	if ((sq->items_miss_count = malloc (item_count * sizeof (unsigned int)))
+	    == NULL) {
+		return (-ENOMEM);
+	}
+	memset (sq->items_inuse, 0, sq_bitmap_size (item_count));
+	memset (sq->items_miss_count, 0, item_count * sizeof (unsigned int));
+	return (0);
+}
+
+/**
+ * @brief sq_reinit clears only the positions used since the last reinit
+ * @param sq
+ * @param head_seqid
+ */
+static inline void sq_reinit (struct sq *sq, unsigned int head_seqid)
+{
+	unsigned int used;
+
+	/*
+	 * Nothing is known to be clean if seqid_max fell behind head_seqid,
+	 * so clear the whole queue then
+	 */
+	if (sq_lt_compare (sq->seqid_max, sq->head_seqid - 1)) {
+		used = sq->size;
+	} else {
+		used = sq->seqid_max - sq->head_seqid + 1;
+		if (used > sq->size) {
+			used = sq->size;
+		}
+	}
+	sq_range_clear (sq, sq->head, used);
+
+	sq->head = 0;
+	sq->head_seqid = head_seqid;
+	sq->pos_max = 0;
+	sq->seqid_max = head_seqid - 1;
+}
+
+/**
+ * @brief sq_assert
+ * @param sq
+ * @param pos
+ */
+static inline void sq_assert (const struct sq *sq, unsigned int pos)
+{
+	unsigned int i;
+
+//	printf ("Instrument[%d] Asserting from %d to %d\n",
+//		pos, sq->pos_max, sq->size);
+	if (sq->pos_max + 1 < sq->size) {
+		i = sq->pos_max + 1;
+		assert (sq_bits_scan (sq, i, sq->size - i, 0) == sq->size - i);
+	}
+}
+
+/**
+ * @brief sq_swap exchanges the contents of two queues of the same geometry
+ *	without copying any items
+ * @param sq_a
+ * @param sq_b
+ */
+static inline void sq_swap (struct sq *sq_a, struct sq *sq_b)
+{
+	struct sq sq_tmp;
+
+	assert (sq_a->item_count == sq_b->item_count);
+	assert (sq_a->size_per_item == sq_b->size_per_item);
+
+	sq_tmp = *sq_a;
+	*sq_a = *sq_b;
+	*sq_b = sq_tmp;
+}
+
+/**
+ * @brief sq_free
+ * @param sq
+ */
+static inline void sq_free (struct sq *sq) {
+	free (sq->items);
+	free (sq->items_inuse);
+	free (sq->items_miss_count);
+}
+
+/**
+ * @brief sq_item_add
+ * @param sq
+ * @param item
+ * @param seqid
+ * @return
+ */
+static inline void *sq_item_add (
+	struct sq *sq,
+	void *item,
+	unsigned int seqid)
+{
+	char *sq_item;
+	unsigned int sq_position;
+
+	sq_position = (sq->head + seqid - sq->head_seqid) % sq->size;
+	if (sq_position > sq->pos_max) {
+		sq->pos_max = sq_position;
+	}
+	sq_seqid_touch (sq, seqid);
+
+	sq_item = sq->items;
+	sq_item += sq_position * sq->size_per_item;
+	assert(sq_bit_test (sq, sq_position) == 0);
+	memcpy (sq_item, item, sq->size_per_item);
+	sq->items_inuse[sq_position / SQ_BITS_PER_WORD] |=
+		1UL << (sq_position % SQ_BITS_PER_WORD);
+	sq->items_miss_count[sq_position] = 0;
+
+	return (sq_item);
+}
+
+/**
+ * @brief sq_item_inuse
+ * @param sq
+ * @param seq_id
+ * @return
+ */
+static inline unsigned int sq_item_inuse (
+	const struct sq *sq,
+	unsigned int seq_id) {
+
+	unsigned int sq_position;
+
+	/*
+	 * We need to say that the seqid is in use if it shouldn't
+	 * be here in the first place.
+	 * To keep old messages from being inserted.
+	 */
+#ifdef COMPILE_OUT
+	if (seq_id < sq->head_seqid) {
+		fprintf(stderr, "sq_item_inuse: seqid %d, head %d\n",
+						seq_id, sq->head_seqid);
+		return 1;
+	}
+#endif
+	sq_position = (sq->head - sq->head_seqid + seq_id) % sq->size;
+	return (sq_bit_test (sq, sq_position));
+}
+
+/**
+ * @brief sq_item_miss_count
+ * @param sq
+ * @param seq_id
+ * @return
+ */
+static inline unsigned int sq_item_miss_count (
+	struct sq *sq,
+	unsigned int seq_id)
+{
+	unsigned int sq_position;
+
+	sq_seqid_touch (sq, seq_id);
+	sq_position = (sq->head - sq->head_seqid + seq_id) % sq->size;
+	sq->items_miss_count[sq_position]++;
+	return (sq->items_miss_count[sq_position]);
+}
+
+/**
+ * @brief sq_size_get
+ * @param sq
+ * @return
+ */
+static inline unsigned int sq_size_get (
+	const struct sq *sq)
+{
+	return sq->size;
+}
+
+/**
+ * @brief sq_in_range
+ * @param sq
+ * @param seq_id
+ * @return
+ */
+static inline unsigned int sq_in_range (
+	const struct sq *sq,
+	unsigned int seq_id)
+{
+	int res = 1;
+
+	if (sq->head_seqid > ADJUST_ROLLOVER_POINT) {
+		if (seq_id - ADJUST_ROLLOVER_VALUE <
+			sq->head_seqid - ADJUST_ROLLOVER_VALUE) {
+
+			res = 0;
+		}
+		if ((seq_id - ADJUST_ROLLOVER_VALUE) >=
+			((sq->head_seqid - ADJUST_ROLLOVER_VALUE) + sq->size)) {
+
+			res = 0;
+		}
+	} else {
+		if (seq_id < sq->head_seqid) {
+			res = 0;
+		}
+		if ((seq_id) >= ((sq->head_seqid) + sq->size)) {
+			res = 0;
+		}
+	}
+	return (res);
+
+}
+
+/**
+ * @brief sq_item_get
+ * @param sq
+ * @param seq_id
+ * @param sq_item_out
+ * @return
+ */
+static inline unsigned int sq_item_get (
+	const struct sq *sq,
+	unsigned int seq_id,
+	void **sq_item_out)
+{
+	char *sq_item;
+	unsigned int sq_position;
+
+	if (seq_id > ADJUST_ROLLOVER_POINT) {
+		assert ((seq_id - ADJUST_ROLLOVER_POINT) <
+			((sq->head_seqid - ADJUST_ROLLOVER_POINT) + sq->size));
+
+		sq_position = ((sq->head - ADJUST_ROLLOVER_VALUE) -
+			(sq->head_seqid - ADJUST_ROLLOVER_VALUE) + seq_id) % sq->size;
+	} else {
+		assert (seq_id < (sq->head_seqid + sq->size));
+		sq_position = (sq->head - sq->head_seqid + seq_id) % sq->size;
+	}
+//printf ("seqid %x head %x head %x pos %x\n", seq_id, sq->head, sq->head_seqid, sq_position);
+//	sq_position = (sq->head - sq->head_seqid + seq_id) % sq->size;
+//printf ("sq_position = %x\n", sq_position);
+//printf ("ITEMGET %d %d %d %d\n", sq_position, sq->head, sq->head_seqid, seq_id);
+	if (sq_bit_test (sq, sq_position) == 0) {
+		return (ENOENT);
+	}
+	sq_item = sq->items;
+	sq_item += sq_position * sq->size_per_item;
+	*sq_item_out = sq_item;
+	return (0);
+}
+
+/**
+ * @brief sq_items_release
+ * @param sq
+ * @param seqid
+ */
+static inline void sq_items_release (struct sq *sq, unsigned int seqid)
+{
+	unsigned int oldhead;
+
+	oldhead = sq->head;
+
+	sq->head = (sq->head + seqid - sq->head_seqid + 1) % sq->size;
+	if ((oldhead + seqid - sq->head_seqid + 1) > sq->size) {
+//		printf ("releasing %d for %d\n", oldhead, sq->size - oldhead);
+//		printf ("releasing %d for %d\n", 0, sq->head);
+		sq_bits_clear (sq, oldhead, sq->size - oldhead);
+		sq_bits_clear (sq, 0, sq->head);
+		memset (&sq->items_miss_count[oldhead], 0,
+			(sq->size - oldhead) * sizeof (unsigned int));
+		memset (sq->items_miss_count, 0, sq->head * sizeof (unsigned int));
+	} else {
+//		printf ("releasing %d for %d\n", oldhead, seqid - sq->head_seqid + 1);
+		sq_bits_clear (sq, oldhead, seqid - sq->head_seqid + 1);
+		memset (&sq->items_miss_count[oldhead], 0,
+			(seqid - sq->head_seqid + 1) * sizeof (unsigned int));
+	}
+	sq_seqid_touch (sq, seqid);
+	sq->head_seqid = seqid + 1;
+}
+
+/**
+ * @brief sq_range_limit
+ * @param sq
+ * @param seq_id must be in range
+ * @param count
+ * @return count reduced so seq_id .. seq_id + count - 1 stays in range
+ */
+static inline unsigned int sq_range_limit (
+	const struct sq *sq,
+	unsigned int seq_id,
+	unsigned int count)
+{
+	unsigned int remaining;
+
+	remaining = sq->head_seqid + sq->size - seq_id;
+	if (count > remaining) {
+		count = remaining;
+	}
+	return (count);
+}
+
+/**
+ * @brief sq_item_first_missing
+ * @param sq
+ * @param seq_id must be in range
+ * @param count
+ * @return offset from seq_id of the first missing item within count items,
+ *	or the number of items examined if none is missing
+ */
+static inline unsigned int sq_item_first_missing (
+	const struct sq *sq,
+	unsigned int seq_id,
+	unsigned int count)
+{
+	return (sq_bits_scan (sq, (sq->head - sq->head_seqid + seq_id) % sq->size,
+		sq_range_limit (sq, seq_id, count), 1));
+}
+
+/**
+ * @brief sq_item_first_inuse
+ * @param sq
+ * @param seq_id must be in range
+ * @param count
+ * @return offset from seq_id of the first present item within count items,
+ *	or the number of items examined if none is present
+ */
+static inline unsigned int sq_item_first_inuse (
+	const struct sq *sq,
+	unsigned int seq_id,
+	unsigned int count)
+{
+	return (sq_bits_scan (sq, (sq->head - sq->head_seqid + seq_id) % sq->size,
+		sq_range_limit (sq, seq_id, count), 0));
+}
+
+#endif /* SQ_H_DEFINED */
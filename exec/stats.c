@@ -36,7 +36,10 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdint.h>
 #include <stddef.h>
 #include <unistd.h>
@@ -45,11 +48,13 @@
 #include <qb/qblist.h>
 #include <qb/qbipcs.h>
 #include <qb/qbipc_common.h>
+#include <qb/qbutil.h>
 
 #include <corosync/corodefs.h>
 #include <corosync/coroapi.h>
 #include <corosync/logsys.h>
 #include <corosync/icmap.h>
+#include <corosync/ipc_cmap.h>
 #include <corosync/totem/totemstats.h>
 
 #include "util.h"
@@ -71,6 +76,8 @@ struct cs_stats_conv {
 struct cs_stats_conv cs_pg_stats[] = {
 	{ STAT_PG, "msg_queue_avail",         offsetof(totempg_stats_t, msg_queue_avail),         ICMAP_VALUETYPE_UINT32},
 	{ STAT_PG, "msg_reserved",            offsetof(totempg_stats_t, msg_reserved),            ICMAP_VALUETYPE_UINT32},
+	{ STAT_PG, "assemblies_active",       offsetof(totempg_stats_t, assemblies_active),       ICMAP_VALUETYPE_UINT32},
+	{ STAT_PG, "assemblies_active_hw",    offsetof(totempg_stats_t, assemblies_active_hw),    ICMAP_VALUETYPE_UINT32},
 };
 struct cs_stats_conv cs_srp_stats[] = {
 	{ STAT_SRP, "orf_token_tx",           offsetof(totemsrp_stats_t, orf_token_tx),           ICMAP_VALUETYPE_UINT64},
@@ -102,6 +109,10 @@ struct cs_stats_conv cs_srp_stats[] = {
 	{ STAT_SRP, "mtt_rx_token",           offsetof(totemsrp_stats_t, mtt_rx_token),           ICMAP_VALUETYPE_UINT32},
 	{ STAT_SRP, "avg_token_workload",     offsetof(totemsrp_stats_t, avg_token_workload),     ICMAP_VALUETYPE_UINT32},
 	{ STAT_SRP, "avg_backlog_calc",       offsetof(totemsrp_stats_t, avg_backlog_calc),       ICMAP_VALUETYPE_UINT32},
+	{ STAT_SRP, "buffer_pool_hits",       offsetof(totemsrp_stats_t, buffer_pool_hits),       ICMAP_VALUETYPE_UINT64},
+	{ STAT_SRP, "buffer_pool_misses",     offsetof(totemsrp_stats_t, buffer_pool_misses),     ICMAP_VALUETYPE_UINT64},
+	{ STAT_SRP, "buffer_pool_in_use_hw",  offsetof(totemsrp_stats_t, buffer_pool_in_use_hw),  ICMAP_VALUETYPE_UINT32},
+	{ STAT_SRP, "fcc_transmits_limit",    offsetof(totemsrp_stats_t, fcc_transmits_limit),    ICMAP_VALUETYPE_UINT32},
 };
 
 struct cs_stats_conv cs_knet_stats[] = {
@@ -173,6 +184,8 @@ struct cs_stats_conv cs_knet_handle_stats[] = {
 struct cs_stats_conv cs_ipcs_conn_stats[] = {
 	{ STAT_IPCSC, "queueing",        offsetof(struct ipcs_conn_stats, cnx.queuing),          ICMAP_VALUETYPE_INT32},
 	{ STAT_IPCSC, "queued",          offsetof(struct ipcs_conn_stats, cnx.queued),           ICMAP_VALUETYPE_UINT32},
+	{ STAT_IPCSC, "queued_bytes",    offsetof(struct ipcs_conn_stats, cnx.queued_bytes),     ICMAP_VALUETYPE_UINT64},
+	{ STAT_IPCSC, "queue_dropped",   offsetof(struct ipcs_conn_stats, cnx.queue_dropped),    ICMAP_VALUETYPE_UINT64},
 	{ STAT_IPCSC, "invalid_request", offsetof(struct ipcs_conn_stats, cnx.invalid_request),  ICMAP_VALUETYPE_UINT64},
 	{ STAT_IPCSC, "overload",        offsetof(struct ipcs_conn_stats, cnx.overload),         ICMAP_VALUETYPE_UINT64},
 	{ STAT_IPCSC, "sent",            offsetof(struct ipcs_conn_stats, cnx.sent),             ICMAP_VALUETYPE_UINT32},
@@ -210,12 +223,65 @@ struct cs_stats_tracker
 	void *user_data;
 	int32_t events;
 	icmap_notify_fn_t notify_fn;
-	uint64_t old_value;
+	struct qb_list_head watch_list_head;
 	struct qb_list_head list;
 };
 QB_LIST_DECLARE (stats_tracker_list_head);
+
+/* Group of stats fetched at once (pg, srp, one knet link, one ipc connection, ...) */
+struct stats_source
+{
+	int type;
+	char prefix[ICMAP_KEYNAME_MAXLEN];
+	struct cs_stats_conv *conv;
+	size_t conv_count;
+	knet_node_id_t nodeid;
+	uint8_t link_no;
+	int service_id;
+	uint32_t pid;
+	void *conn_ptr;
+	size_t data_size;
+	void *data;
+	void *prev_data;
+	int data_valid;
+	struct qb_list_head watch_list_head;
+	struct qb_list_head list;
+};
+QB_LIST_DECLARE (stats_source_list_head);
+
+/* Tracker interest in modification of (one or more) keys of a source */
+struct stats_watch
+{
+	struct cs_stats_tracker *tracker;
+	struct stats_source *source;
+	/* Watched stat or NULL for all stats of source matching tracker prefix */
+	struct cs_stats_conv *conv;
+	/* Source data last reported to tracker */
+	void *old_data;
+	int old_data_valid;
+	int dirty;
+	uint64_t last_notify;
+	struct qb_list_head source_list;
+	struct qb_list_head tracker_list;
+};
+
 static const struct corosync_api_v1 *api;
 
+/* qb.stats_notify_interval in nanoseconds, kept up to date by icmap track */
+static uint64_t stats_notify_interval;
+
+/* STATS_SOURCE_* kinds marked by producers since trackers were triggered */
+static unsigned int stats_dirty_sources;
+
+static struct stats_source *stats_source_find(const char *prefix);
+static struct stats_source *stats_source_create(int type,
+						const char *prefix,
+						struct cs_stats_conv *conv,
+						size_t conv_count,
+						size_t data_size);
+static void stats_source_register(struct stats_source *source);
+static void stats_source_del(const char *prefix);
+
 static void stats_map_set_value(struct cs_stats_conv *conv,
 				void *stat_array,
 				void *value,
@@ -257,13 +323,43 @@ static void stats_rm_entry(const char *key)
 	}
 }
 
+static void stats_notify_interval_read(void)
+{
+	uint32_t interval_ms;
+
+	if (icmap_get_uint32("qb.stats_notify_interval", &interval_ms) != CS_OK) {
+		interval_ms = 0;
+	}
+	stats_notify_interval = (uint64_t)interval_ms * QB_TIME_NS_IN_MSEC;
+}
+
+static void stats_notify_interval_changed(
+	int32_t event,
+	const char *key_name,
+	struct icmap_notify_value new_val,
+	struct icmap_notify_value old_val,
+	void *user_data)
+{
+
+	stats_notify_interval_read();
+}
+
 cs_error_t stats_map_init(const struct corosync_api_v1 *corosync_api)
 {
 	int i;
 	char param[ICMAP_KEYNAME_MAXLEN];
+	struct stats_source *source;
+	icmap_track_t icmap_track = NULL;
 
 	api = corosync_api;
 
+	stats_notify_interval_read();
+	icmap_track_add("qb.stats_notify_interval",
+			ICMAP_TRACK_ADD | ICMAP_TRACK_DELETE | ICMAP_TRACK_MODIFY,
+			stats_notify_interval_changed,
+			NULL,
+			&icmap_track);
+
 	stats_map = qb_trie_create();
 	if (!stats_map) {
 		return CS_ERR_INIT;
@@ -283,22 +379,62 @@ cs_error_t stats_map_init(const struct corosync_api_v1 *corosync_api)
 		stats_add_entry(param, &cs_ipcs_global_stats[i]);
 	}
 
+	source = stats_source_create(STAT_PG, "stats.pg.", cs_pg_stats, NUM_PG_STATS,
+	    sizeof(totempg_stats_t));
+	if (source) {
+		stats_source_register(source);
+	}
+	source = stats_source_create(STAT_SRP, "stats.srp.", cs_srp_stats, NUM_SRP_STATS,
+	    sizeof(totemsrp_stats_t));
+	if (source) {
+		stats_source_register(source);
+	}
+	source = stats_source_create(STAT_IPCSG, "stats.ipcs.", cs_ipcs_global_stats, NUM_IPCSG_STATS,
+	    sizeof(struct ipcs_global_stats));
+	if (source) {
+		stats_source_register(source);
+	}
+
 	/* KNET and IPCS stats are added when appropriate */
 	return CS_OK;
 }
 
-cs_error_t stats_map_get(const char *key_name,
-			 void *value,
-			 size_t *value_len,
-			 icmap_value_types_t *type)
+/*
+ * Stats fetched from knet or ipc_glue for one key are kept here, so
+ * consecutive keys of the same link/connection (stats snapshot walks
+ * them in order) don't fetch them again.
+ */
+struct stats_get_cache {
+	int knet_link_valid;
+	int knet_nodeid;
+	int knet_link_no;
+	struct knet_link_status link_status;
+	int knet_handle_valid;
+	struct knet_handle_stats knet_handle_stats;
+	int ipcs_conn_valid;
+	int ipcs_service_id;
+	uint32_t ipcs_pid;
+	void *ipcs_conn_ptr;
+	struct ipcs_conn_stats ipcs_conn_stats;
+};
+
+static void stats_get_cache_init(struct stats_get_cache *cache)
+{
+	cache->knet_link_valid = 0;
+	cache->knet_handle_valid = 0;
+	cache->ipcs_conn_valid = 0;
+}
+
+static cs_error_t stats_item_get(const char *key_name,
+				 struct stats_item *item,
+				 void *value,
+				 size_t *value_len,
+				 icmap_value_types_t *type,
+				 struct stats_get_cache *cache)
 {
 	struct cs_stats_conv *statinfo;
-	struct stats_item *item;
 	totempg_stats_t *pg_stats;
-	struct knet_link_status link_status;
-	struct ipcs_conn_stats ipcs_conn_stats;
 	struct ipcs_global_stats ipcs_global_stats;
-	struct knet_handle_stats knet_handle_stats;
 	int res;
 	int nodeid;
 	int link_no;
@@ -306,11 +442,6 @@ cs_error_t stats_map_get(const char *key_name,
 	uint32_t pid;
 	void *conn_ptr;
 
-	item = qb_map_get(stats_map, key_name);
-	if (!item) {
-		return CS_ERR_NOT_EXIST;
-	}
-
 	statinfo = item->cs_conv;
 	switch (statinfo->type) {
 		case STAT_PG:
@@ -322,11 +453,14 @@ cs_error_t stats_map_get(const char *key_name,
 			stats_map_set_value(statinfo, pg_stats->srp, value, value_len, type);
 			break;
 		case STAT_KNET_HANDLE:
-			res = totemknet_handle_get_stats(&knet_handle_stats);
-			if (res) {
-				return res;
+			if (!cache->knet_handle_valid) {
+				res = totemknet_handle_get_stats(&cache->knet_handle_stats);
+				if (res) {
+					return res;
+				}
+				cache->knet_handle_valid = 1;
 			}
-			stats_map_set_value(statinfo, &knet_handle_stats, value, value_len, type);
+			stats_map_set_value(statinfo, &cache->knet_handle_stats, value, value_len, type);
 			break;
 		case STAT_KNET:
 			if (sscanf(key_name, "stats.knet.node%d.link%d", &nodeid, &link_no) != 2) {
@@ -339,22 +473,37 @@ cs_error_t stats_map_get(const char *key_name,
 				return CS_ERR_NOT_EXIST;
 			}
 
-			/* Always get the latest stats */
-			res = totemknet_link_get_status((knet_node_id_t)nodeid, (uint8_t)link_no, &link_status);
-			if (res != CS_OK) {
-				return CS_ERR_LIBRARY;
+			/* Always get the latest stats (cache is valid only for one lookup or snapshot) */
+			if (!cache->knet_link_valid ||
+			    cache->knet_nodeid != nodeid || cache->knet_link_no != link_no) {
+				cache->knet_link_valid = 0;
+				res = totemknet_link_get_status((knet_node_id_t)nodeid, (uint8_t)link_no, &cache->link_status);
+				if (res != CS_OK) {
+					return CS_ERR_LIBRARY;
+				}
+				cache->knet_link_valid = 1;
+				cache->knet_nodeid = nodeid;
+				cache->knet_link_no = link_no;
 			}
-			stats_map_set_value(statinfo, &link_status, value, value_len, type);
+			stats_map_set_value(statinfo, &cache->link_status, value, value_len, type);
 			break;
 		case STAT_IPCSC:
 			if (sscanf(key_name, "stats.ipcs.service%d.%d.%p", &service_id, &pid, &conn_ptr) != 3) {
 				return CS_ERR_NOT_EXIST;
 			}
-			res = cs_ipcs_get_conn_stats(service_id, pid, conn_ptr, &ipcs_conn_stats);
-			if (res != CS_OK) {
-				return res;
+			if (!cache->ipcs_conn_valid || cache->ipcs_service_id != service_id ||
+			    cache->ipcs_pid != pid || cache->ipcs_conn_ptr != conn_ptr) {
+				cache->ipcs_conn_valid = 0;
+				res = cs_ipcs_get_conn_stats(service_id, pid, conn_ptr, &cache->ipcs_conn_stats);
+				if (res != CS_OK) {
+					return res;
+				}
+				cache->ipcs_conn_valid = 1;
+				cache->ipcs_service_id = service_id;
+				cache->ipcs_pid = pid;
+				cache->ipcs_conn_ptr = conn_ptr;
 			}
-			stats_map_set_value(statinfo, &ipcs_conn_stats, value, value_len, type);
+			stats_map_set_value(statinfo, &cache->ipcs_conn_stats, value, value_len, type);
 			break;
 		case STAT_IPCSG:
 			cs_ipcs_get_global_stats(&ipcs_global_stats);
@@ -366,6 +515,24 @@ cs_error_t stats_map_get(const char *key_name,
 	return CS_OK;
 }
 
+cs_error_t stats_map_get(const char *key_name,
+			 void *value,
+			 size_t *value_len,
+			 icmap_value_types_t *type)
+{
+	struct stats_item *item;
+	struct stats_get_cache cache;
+
+	item = qb_map_get(stats_map, key_name);
+	if (!item) {
+		return CS_ERR_NOT_EXIST;
+	}
+
+	stats_get_cache_init(&cache);
+
+	return (stats_item_get(key_name, item, value, value_len, type, &cache));
+}
+
 #define STATS_CLEAR       "stats.clear."
 #define STATS_CLEAR_KNET  "stats.clear.knet"
 #define STATS_CLEAR_IPC   "stats.clear.ipc"
@@ -381,19 +548,23 @@ cs_error_t stats_map_set(const char *key_name,
 
 	if (strncmp(key_name, STATS_CLEAR_KNET, strlen(STATS_CLEAR_KNET)) == 0) {
 		totempg_stats_clear(TOTEMPG_STATS_CLEAR_TRANSPORT);
+		stats_mark_dirty(STATS_SOURCE_KNET);
 		cleared = 1;
 	}
 	if (strncmp(key_name, STATS_CLEAR_IPC, strlen(STATS_CLEAR_IPC)) == 0) {
 		cs_ipcs_clear_stats();
+		stats_mark_dirty(STATS_SOURCE_IPCS);
 		cleared = 1;
 	}
 	if (strncmp(key_name, STATS_CLEAR_TOTEM, strlen(STATS_CLEAR_TOTEM)) == 0) {
 		totempg_stats_clear(TOTEMPG_STATS_CLEAR_TOTEM);
+		stats_mark_dirty(STATS_SOURCE_TOTEM);
 		cleared = 1;
 	}
 	if (strncmp(key_name, STATS_CLEAR_ALL, strlen(STATS_CLEAR_ALL)) == 0) {
 		totempg_stats_clear(TOTEMPG_STATS_CLEAR_TRANSPORT | TOTEMPG_STATS_CLEAR_TOTEM);
 		cs_ipcs_clear_stats();
+		stats_mark_dirty(STATS_SOURCE_TOTEM | STATS_SOURCE_KNET | STATS_SOURCE_IPCS);
 		cleared = 1;
 	}
 	if (!cleared) {
@@ -448,38 +619,365 @@ void stats_map_iter_finalize(icmap_iter_t iter)
 }
 
 
-void stats_trigger_trackers()
+/*
+ * Trackers of value changes are not polled key by key. Every group of stats
+ * fetched at once (pg, srp, one knet link, one ipc connection, ...) is
+ * a source and trackers watch sources. Producers of stats mark the kind of
+ * sources they may have changed (stats_mark_dirty) and each updater tick
+ * fetches only watched sources of marked kinds. Watches are evaluated only
+ * if the fetched source changed (or if notification was postponed by
+ * qb.stats_notify_interval).
+ */
+static struct stats_source *stats_source_create(int type,
+						const char *prefix,
+						struct cs_stats_conv *conv,
+						size_t conv_count,
+						size_t data_size)
+{
+	struct stats_source *source;
+
+	if (stats_source_find(prefix) != NULL) {
+		return (NULL);
+	}
+
+	source = malloc(sizeof(*source));
+	if (source == NULL) {
+		return (NULL);
+	}
+	memset(source, 0, sizeof(*source));
+
+	source->data = malloc(data_size);
+	source->prev_data = malloc(data_size);
+	if (source->data == NULL || source->prev_data == NULL) {
+		free(source->data);
+		free(source->prev_data);
+		free(source);
+		return (NULL);
+	}
+
+	source->type = type;
+	snprintf(source->prefix, sizeof(source->prefix), "%s", prefix);
+	source->conv = conv;
+	source->conv_count = conv_count;
+	source->data_size = data_size;
+	qb_list_init(&source->watch_list_head);
+	qb_list_init(&source->list);
+
+	return (source);
+}
+
+static struct stats_source *stats_source_find(const char *prefix)
+{
+	struct stats_source *source;
+	struct qb_list_head *iter;
+
+	qb_list_for_each(iter, &stats_source_list_head) {
+		source = qb_list_entry(iter, struct stats_source, list);
+		if (strcmp(source->prefix, prefix) == 0) {
+			return (source);
+		}
+	}
+
+	return (NULL);
+}
+
+static unsigned int stats_source_kind(const struct stats_source *source)
+{
+
+	switch (source->type) {
+		case STAT_PG:
+		case STAT_SRP:
+			return (STATS_SOURCE_TOTEM);
+		case STAT_KNET_HANDLE:
+		case STAT_KNET:
+			return (STATS_SOURCE_KNET);
+		case STAT_IPCSC:
+		case STAT_IPCSG:
+			return (STATS_SOURCE_IPCS);
+	}
+
+	return (0);
+}
+
+void stats_mark_dirty(unsigned int sources)
+{
+
+	stats_dirty_sources |= sources;
+}
+
+static int stats_source_fetch(struct stats_source *source, void *data)
+{
+	totempg_stats_t *pg_stats;
+
+	switch (source->type) {
+		case STAT_PG:
+			pg_stats = api->totem_get_stats();
+			memcpy(data, pg_stats, source->data_size);
+			break;
+		case STAT_SRP:
+			pg_stats = api->totem_get_stats();
+			memcpy(data, pg_stats->srp, source->data_size);
+			break;
+		case STAT_KNET_HANDLE:
+			if (totemknet_handle_get_stats(data) != 0) {
+				return (-1);
+			}
+			break;
+		case STAT_KNET:
+			if (totemknet_link_get_status(source->nodeid, source->link_no, data) != CS_OK) {
+				return (-1);
+			}
+			break;
+		case STAT_IPCSC:
+			if (cs_ipcs_get_conn_stats(source->service_id, source->pid, source->conn_ptr,
+			    data) != CS_OK) {
+				return (-1);
+			}
+			break;
+		case STAT_IPCSG:
+			cs_ipcs_get_global_stats(data);
+			break;
+		default:
+			return (-1);
+	}
+
+	return (0);
+}
+
+static void stats_watch_create(struct cs_stats_tracker *tracker,
+			       struct stats_source *source,
+			       struct cs_stats_conv *conv)
+{
+	struct stats_watch *watch;
+
+	watch = malloc(sizeof(*watch));
+	if (watch == NULL) {
+		log_printf(LOGSYS_LEVEL_ERROR, "Can't alloc watch of %s for tracker %s",
+		    source->prefix, tracker->key_name);
+		return ;
+	}
+
+	watch->old_data = malloc(source->data_size);
+	if (watch->old_data == NULL) {
+		log_printf(LOGSYS_LEVEL_ERROR, "Can't alloc watch of %s for tracker %s",
+		    source->prefix, tracker->key_name);
+		free(watch);
+		return ;
+	}
+
+	watch->tracker = tracker;
+	watch->source = source;
+	watch->conv = conv;
+	watch->old_data_valid = (stats_source_fetch(source, watch->old_data) == 0);
+	watch->dirty = 1;
+	watch->last_notify = 0;
+	qb_list_add(&watch->source_list, &source->watch_list_head);
+	qb_list_add(&watch->tracker_list, &tracker->watch_list_head);
+}
+
+static void stats_watch_free(struct stats_watch *watch)
+{
+
+	qb_list_del(&watch->source_list);
+	qb_list_del(&watch->tracker_list);
+	free(watch->old_data);
+	free(watch);
+}
+
+/*
+ * Create watch of source if tracker is interested in modification of
+ * any of its keys
+ */
+static void stats_tracker_watch_source(struct cs_stats_tracker *tracker,
+				       struct stats_source *source)
+{
+	char key_name[ICMAP_KEYNAME_MAXLEN];
+	const char *tracked_key;
+	size_t prefix_len;
+	int i;
+
+	if (!(tracker->events & ICMAP_TRACK_MODIFY)) {
+		return ;
+	}
+
+	tracked_key = (tracker->key_name != NULL ? tracker->key_name : "");
+	prefix_len = strlen(source->prefix);
+
+	if (tracker->events & ICMAP_TRACK_PREFIX) {
+		for (i = 0; i < source->conv_count; i++) {
+			snprintf(key_name, sizeof(key_name), "%s%s", source->prefix, source->conv[i].name);
+			if (strncmp(key_name, tracked_key, strlen(tracked_key)) == 0) {
+				stats_watch_create(tracker, source, NULL);
+				return ;
+			}
+		}
+	} else {
+		if (strncmp(tracked_key, source->prefix, prefix_len) != 0) {
+			return ;
+		}
+
+		for (i = 0; i < source->conv_count; i++) {
+			if (strcmp(tracked_key + prefix_len, source->conv[i].name) == 0) {
+				stats_watch_create(tracker, source, &source->conv[i]);
+				return ;
+			}
+		}
+	}
+}
+
+static void stats_source_register(struct stats_source *source)
 {
 	struct cs_stats_tracker *tracker;
 	struct qb_list_head *iter;
-	cs_error_t res;
-	size_t value_len;
-	icmap_value_types_t type;
-	uint64_t value;
+
+	qb_list_add_tail(&source->list, &stats_source_list_head);
+
+	qb_list_for_each(iter, &stats_tracker_list_head) {
+		tracker = qb_list_entry(iter, struct cs_stats_tracker, list);
+		stats_tracker_watch_source(tracker, source);
+	}
+}
+
+static void stats_source_del(const char *prefix)
+{
+	struct stats_source *source;
+	struct stats_watch *watch;
+	struct qb_list_head *iter;
+	struct qb_list_head *tmp_iter;
+
+	source = stats_source_find(prefix);
+	if (source == NULL) {
+		return ;
+	}
+
+	qb_list_for_each_safe(iter, tmp_iter, &source->watch_list_head) {
+		watch = qb_list_entry(iter, struct stats_watch, source_list);
+		stats_watch_free(watch);
+	}
+
+	qb_list_del(&source->list);
+	free(source->data);
+	free(source->prev_data);
+	free(source);
+}
+
+/*
+ * Compare values last reported to tracker with current ones and notify
+ * about every changed key
+ */
+static void stats_watch_notify(struct stats_watch *watch, uint64_t now)
+{
+	struct stats_source *source = watch->source;
+	struct cs_stats_tracker *tracker = watch->tracker;
+	struct cs_stats_conv *conv;
+	char key_name[ICMAP_KEYNAME_MAXLEN];
+	const char *tracked_key;
 	struct icmap_notify_value new_val;
 	struct icmap_notify_value old_val;
+	int i;
 
-	qb_list_for_each(iter, &stats_tracker_list_head) {
+	tracked_key = (tracker->key_name != NULL ? tracker->key_name : "");
 
-		tracker = qb_list_entry(iter, struct cs_stats_tracker, list);
-		if (tracker->events & ICMAP_TRACK_PREFIX || !tracker->key_name ) {
+	for (i = 0; i < source->conv_count; i++) {
+		conv = &source->conv[i];
+		if (watch->conv != NULL && watch->conv != conv) {
+			continue;
+		}
+
+		snprintf(key_name, sizeof(key_name), "%s%s", source->prefix, conv->name);
+		if (watch->conv == NULL && strncmp(key_name, tracked_key, strlen(tracked_key)) != 0) {
 			continue;
 		}
 
-		res = stats_map_get(tracker->key_name,
-				    &value, &value_len, &type);
+		stats_map_set_value(conv, source->data, NULL, &new_val.len, &new_val.type);
+		stats_map_set_value(conv, watch->old_data, NULL, &old_val.len, &old_val.type);
+		new_val.data = (char *)source->data + conv->offset;
+		old_val.data = (char *)watch->old_data + conv->offset;
+
+		if (new_val.len == old_val.len && memcmp(new_val.data, old_val.data, new_val.len) == 0) {
+			continue;
+		}
 
-		/* Check if it has changed */
-		if ((res == CS_OK) && (memcmp(&value, &tracker->old_value, value_len) != 0)) {
+		tracker->notify_fn(ICMAP_TRACK_MODIFY, key_name,
+				   new_val, old_val, tracker->user_data);
+	}
 
-			old_val.type = new_val.type = type;
-			old_val.len = new_val.len = value_len;
-			old_val.data = new_val.data = &value;
+	memcpy(watch->old_data, source->data, source->data_size);
+	watch->dirty = 0;
+	watch->last_notify = now;
+}
+
+void stats_trigger_trackers()
+{
+	struct stats_source *source;
+	struct stats_watch *watch;
+	struct qb_list_head *iter;
+	struct qb_list_head *witer;
+	struct qb_list_head *tmp_witer;
+	uint64_t now;
+	unsigned int dirty_sources;
+	void *tmp_data;
+	int changed;
 
-			tracker->notify_fn(ICMAP_TRACK_MODIFY, tracker->key_name,
-					   old_val, new_val, tracker->user_data);
+	dirty_sources = stats_dirty_sources;
+	stats_dirty_sources = 0;
+	now = api->timer_time_get();
 
-			memcpy(&tracker->old_value, &value, value_len);
+	qb_list_for_each(iter, &stats_source_list_head) {
+		source = qb_list_entry(iter, struct stats_source, list);
+
+		if (qb_list_empty(&source->watch_list_head)) {
+			continue;
+		}
+
+		if (stats_source_kind(source) & dirty_sources) {
+			/*
+			 * Fetch into older buffer, so prev_data holds previous fetch afterwards
+			 */
+			if (stats_source_fetch(source, source->prev_data) != 0) {
+				source->data_valid = 0;
+				continue;
+			}
+			tmp_data = source->data;
+			source->data = source->prev_data;
+			source->prev_data = tmp_data;
+
+			changed = (!source->data_valid ||
+			    memcmp(source->data, source->prev_data, source->data_size) != 0);
+			source->data_valid = 1;
+		} else {
+			/*
+			 * Not touched by producer, only postponed notifications
+			 * of last fetched data may be due
+			 */
+			if (!source->data_valid) {
+				continue;
+			}
+			changed = 0;
+		}
+
+		qb_list_for_each_safe(witer, tmp_witer, &source->watch_list_head) {
+			watch = qb_list_entry(witer, struct stats_watch, source_list);
+
+			if (!watch->old_data_valid) {
+				/*
+				 * Source was not available when watch was created
+				 */
+				memcpy(watch->old_data, source->data, source->data_size);
+				watch->old_data_valid = 1;
+				continue;
+			}
+
+			if (!changed && !watch->dirty) {
+				continue;
+			}
+
+			if (now - watch->last_notify < stats_notify_interval) {
+				watch->dirty = 1;
+				continue;
+			}
+
+			stats_watch_notify(watch, now);
 		}
 	}
 }
@@ -524,14 +1022,16 @@ cs_error_t stats_map_track_add(const char *key_name,
 			       icmap_track_t *icmap_track)
 {
 	struct cs_stats_tracker *tracker;
-	size_t value_len;
-	icmap_value_types_t type;
+	struct stats_source *source;
+	struct qb_list_head *iter;
 	cs_error_t err;
 
-	/* We can track adding or deleting a key under a prefix */
+	/*
+	 * We can track adding or deleting a key under a prefix (only both together)
+	 * and modification of keys under a prefix
+	 */
 	if ((track_type & ICMAP_TRACK_PREFIX) &&
-	    (!(track_type & ICMAP_TRACK_DELETE) ||
-	     !(track_type & ICMAP_TRACK_ADD))) {
+	    (!(track_type & ICMAP_TRACK_DELETE) != !(track_type & ICMAP_TRACK_ADD))) {
 		return CS_ERR_NOT_SUPPORTED;
 	}
 
@@ -542,20 +1042,16 @@ cs_error_t stats_map_track_add(const char *key_name,
 
 	tracker->notify_fn = notify_fn;
 	tracker->user_data = user_data;
+	tracker->events = track_type;
+	qb_list_init(&tracker->watch_list_head);
 	if (key_name) {
 		tracker->key_name = strdup(key_name);
 		if (!tracker->key_name) {
 			free(tracker);
 			return CS_ERR_NO_MEMORY;
 		}
-		/* Get initial value */
-		if (stats_map_get(tracker->key_name,
-				  &tracker->old_value, &value_len, &type) == CS_OK) {
-			tracker->old_value = 0ULL;
-		}
 	} else {
 		tracker->key_name = NULL;
-		tracker->old_value = 0ULL;
 	}
 
 	/* Add/delete trackers can use the qb_map tracking */
@@ -571,11 +1067,16 @@ cs_error_t stats_map_track_add(const char *key_name,
 			free(tracker);
 			return (qb_to_cs_error(err));
 		}
-		tracker->events = track_type;
 	}
 
 	qb_list_add (&tracker->list, &stats_tracker_list_head);
 
+	/* Modification is tracked by watching sources of stats */
+	qb_list_for_each(iter, &stats_source_list_head) {
+		source = qb_list_entry(iter, struct stats_source, list);
+		stats_tracker_watch_source(tracker, source);
+	}
+
 	*icmap_track = (icmap_track_t)tracker;
 	return CS_OK;
 }
@@ -583,6 +1084,9 @@ cs_error_t stats_map_track_add(const char *key_name,
 cs_error_t stats_map_track_delete(icmap_track_t icmap_track)
 {
 	struct cs_stats_tracker *tracker = (struct cs_stats_tracker *)icmap_track;
+	struct stats_watch *watch;
+	struct qb_list_head *iter;
+	struct qb_list_head *tmp_iter;
 	int err;
 
 	if ((tracker->events & ICMAP_TRACK_ADD) ||
@@ -595,6 +1099,11 @@ cs_error_t stats_map_track_delete(icmap_track_t icmap_track)
 		}
 	}
 
+	qb_list_for_each_safe(iter, tmp_iter, &tracker->watch_list_head) {
+		watch = qb_list_entry(iter, struct stats_watch, tracker_list);
+		stats_watch_free(watch);
+	}
+
 	qb_list_del(&tracker->list);
 	free(tracker->key_name);
 	free(tracker);
@@ -614,11 +1123,21 @@ void stats_knet_add_member(knet_node_id_t nodeid, uint8_t link_no)
 {
 	int i;
 	char param[ICMAP_KEYNAME_MAXLEN];
+	struct stats_source *source;
 
 	for (i = 0; i<NUM_KNET_STATS; i++) {
 		sprintf(param, "stats.knet.node%d.link%d.%s", nodeid, link_no, cs_knet_stats[i].name);
 		stats_add_entry(param, &cs_knet_stats[i]);
 	}
+
+	sprintf(param, "stats.knet.node%d.link%d.", nodeid, link_no);
+	source = stats_source_create(STAT_KNET, param, cs_knet_stats, NUM_KNET_STATS,
+	    sizeof(struct knet_link_status));
+	if (source) {
+		source->nodeid = nodeid;
+		source->link_no = link_no;
+		stats_source_register(source);
+	}
 }
 void stats_knet_del_member(knet_node_id_t nodeid, uint8_t link_no)
 {
@@ -629,6 +1148,9 @@ void stats_knet_del_member(knet_node_id_t nodeid, uint8_t link_no)
 		sprintf(param, "stats.knet.node%d.link%d.%s", nodeid, link_no, cs_knet_stats[i].name);
 		stats_rm_entry(param);
 	}
+
+	sprintf(param, "stats.knet.node%d.link%d.", nodeid, link_no);
+	stats_source_del(param);
 }
 
 /* This is separated out from  stats_map_init() because we don't know whether
@@ -637,11 +1159,18 @@ void stats_knet_add_handle(void)
 {
 	int i;
 	char param[ICMAP_KEYNAME_MAXLEN];
+	struct stats_source *source;
 
 	for (i = 0; i<NUM_KNET_HANDLE_STATS; i++) {
 		sprintf(param, "stats.knet.handle.%s", cs_knet_handle_stats[i].name);
 		stats_add_entry(param, &cs_knet_handle_stats[i]);
 	}
+
+	source = stats_source_create(STAT_KNET_HANDLE, "stats.knet.handle.", cs_knet_handle_stats,
+	    NUM_KNET_HANDLE_STATS, sizeof(struct knet_handle_stats));
+	if (source) {
+		stats_source_register(source);
+	}
 }
 
 /* Called from ipc_glue to add/remove keys from our map */
@@ -649,11 +1178,22 @@ void stats_ipcs_add_connection(int service_id, uint32_t pid, void *ptr)
 {
 	int i;
 	char param[ICMAP_KEYNAME_MAXLEN];
+	struct stats_source *source;
 
 	for (i = 0; i<NUM_IPCSC_STATS; i++) {
 		sprintf(param, "stats.ipcs.service%d.%d.%p.%s", service_id, pid, ptr, cs_ipcs_conn_stats[i].name);
 		stats_add_entry(param, &cs_ipcs_conn_stats[i]);
 	}
+
+	sprintf(param, "stats.ipcs.service%d.%d.%p.", service_id, pid, ptr);
+	source = stats_source_create(STAT_IPCSC, param, cs_ipcs_conn_stats, NUM_IPCSC_STATS,
+	    sizeof(struct ipcs_conn_stats));
+	if (source) {
+		source->service_id = service_id;
+		source->pid = pid;
+		source->conn_ptr = ptr;
+		stats_source_register(source);
+	}
 }
 void stats_ipcs_del_connection(int service_id, uint32_t pid, void *ptr)
 {
@@ -664,4 +1204,270 @@ void stats_ipcs_del_connection(int service_id, uint32_t pid, void *ptr)
 		sprintf(param, "stats.ipcs.service%d.%d.%p.%s", service_id, pid, ptr, cs_ipcs_conn_stats[i].name);
 		stats_rm_entry(param);
 	}
+
+	sprintf(param, "stats.ipcs.service%d.%d.%p.", service_id, pid, ptr);
+	stats_source_del(param);
+}
+
+/*
+ * Stats snapshot in shared memory. Whole stats map is serialized into
+ * staging buffer first and then copied into shared memory under seqlock,
+ * so readers (cmap_stats_snapshot_read) never see half updated data and
+ * don't have to talk to corosync at all. Only published when enabled by
+ * qb.stats_snapshot.
+ */
+
+/*
+ * Longest stats value, procname of IPC connection is the only string
+ */
+#define STATS_SHM_VALUE_MAX	64
+
+static int stats_shm_fd = -1;
+static struct cmap_stats_shm_header *stats_shm;
+static size_t stats_shm_size;
+static char stats_shm_path[PATH_MAX];
+static char *stats_shm_staging;
+static size_t stats_shm_staging_size;
+
+static void stats_shm_mark_closed(const char *path)
+{
+	struct cmap_stats_shm_header *hdr;
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+	if (fd == -1) {
+		return ;
+	}
+
+	/*
+	 * Only touch snapshot file created by corosync itself
+	 */
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_uid != geteuid() ||
+	    st.st_size < sizeof(*hdr)) {
+		close(fd);
+		return ;
+	}
+
+	hdr = mmap(NULL, sizeof(*hdr), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (hdr != MAP_FAILED) {
+		__atomic_store_n(&hdr->closed, 1, __ATOMIC_RELEASE);
+		munmap(hdr, sizeof(*hdr));
+	}
+	close(fd);
+}
+
+static int stats_shm_map(size_t size)
+{
+	void *addr;
+
+	if (ftruncate(stats_shm_fd, size) == -1) {
+		return (-1);
+	}
+
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, stats_shm_fd, 0);
+	if (addr == MAP_FAILED) {
+		return (-1);
+	}
+
+	if (stats_shm != NULL) {
+		munmap(stats_shm, stats_shm_size);
+	}
+	stats_shm = addr;
+	stats_shm_size = size;
+
+	return (0);
+}
+
+int stats_shm_init(void)
+{
+	const char *dirs[] = { "/dev/shm", LOCALSTATEDIR "/run" };
+	char *str;
+	int enabled = 0;
+	int i;
+
+	if (icmap_get_string("qb.stats_snapshot", &str) == CS_OK) {
+		enabled = (strcmp(str, "yes") == 0);
+		free(str);
+	}
+	if (!enabled) {
+		return (0);
+	}
+
+	for (i = 0; i < sizeof(dirs) / sizeof(dirs[0]); i++) {
+		snprintf(stats_shm_path, sizeof(stats_shm_path), "%s/%s", dirs[i], CMAP_STATS_SHM_FILE);
+
+		/*
+		 * Readers of snapshot left by previous instance have to reopen
+		 */
+		stats_shm_mark_closed(stats_shm_path);
+		unlink(stats_shm_path);
+
+		stats_shm_fd = open(stats_shm_path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, S_IRUSR | S_IWUSR);
+		if (stats_shm_fd != -1) {
+			break;
+		}
+	}
+
+	if (stats_shm_fd == -1) {
+		LOGSYS_PERROR(errno, LOGSYS_LEVEL_WARNING, "Can't create stats snapshot file");
+		return (-1);
+	}
+
+	if (stats_shm_map(CMAP_STATS_SHM_MIN_SIZE) == -1) {
+		LOGSYS_PERROR(errno, LOGSYS_LEVEL_WARNING, "Can't map stats snapshot file %s",
+		    stats_shm_path);
+		close(stats_shm_fd);
+		stats_shm_fd = -1;
+		unlink(stats_shm_path);
+		return (-1);
+	}
+
+	memset(stats_shm, 0, sizeof(*stats_shm));
+	stats_shm->magic = CMAP_STATS_SHM_MAGIC;
+	stats_shm->version = CMAP_STATS_SHM_VERSION;
+	stats_shm->map_size = stats_shm_size;
+
+	log_printf(LOGSYS_LEVEL_DEBUG, "Stats snapshot published in %s", stats_shm_path);
+
+	return (0);
+}
+
+/*
+ * Make sure staging buffer has at least size bytes. Returns -1 if
+ * snapshot would exceed CMAP_STATS_SHM_MAX_SIZE.
+ */
+static int stats_shm_staging_reserve(size_t size)
+{
+	size_t new_size;
+	char *new_staging;
+
+	if (size <= stats_shm_staging_size) {
+		return (0);
+	}
+
+	if (size > CMAP_STATS_SHM_MAX_SIZE - sizeof(*stats_shm)) {
+		return (-1);
+	}
+
+	new_size = (stats_shm_staging_size == 0 ? CMAP_STATS_SHM_MIN_SIZE : stats_shm_staging_size);
+	while (new_size < size) {
+		new_size *= 2;
+	}
+
+	new_staging = realloc(stats_shm_staging, new_size);
+	if (new_staging == NULL) {
+		return (-1);
+	}
+	stats_shm_staging = new_staging;
+	stats_shm_staging_size = new_size;
+
+	return (0);
+}
+
+void stats_shm_update(void)
+{
+	qb_map_iter_t *iter;
+	const char *key_name;
+	struct stats_item *item;
+	struct stats_get_cache cache;
+	struct cmap_iter_batch_item *batch_item;
+	size_t data_size;
+	size_t key_len;
+	size_t value_len;
+	size_t item_size;
+	size_t map_size;
+	icmap_value_types_t type;
+	uint32_t entries;
+	uint32_t truncated;
+	uint64_t seq;
+	char value[STATS_SHM_VALUE_MAX];
+
+	if (stats_shm == NULL) {
+		return ;
+	}
+
+	stats_get_cache_init(&cache);
+	data_size = 0;
+	entries = 0;
+	truncated = 0;
+
+	iter = qb_map_pref_iter_create(stats_map, NULL);
+	if (iter == NULL) {
+		return ;
+	}
+
+	while ((key_name = qb_map_iter_next(iter, (void **)&item)) != NULL) {
+		if (stats_item_get(key_name, item, value, &value_len, &type, &cache) != CS_OK) {
+			continue ;
+		}
+
+		key_len = strlen(key_name);
+		item_size = CMAP_ITER_BATCH_ITEM_SIZE(key_len, value_len);
+
+		if (stats_shm_staging_reserve(data_size + item_size) == -1) {
+			truncated = 1;
+			break;
+		}
+
+		batch_item = (struct cmap_iter_batch_item *)(stats_shm_staging + data_size);
+		memset(batch_item, 0, item_size);
+		memcpy(batch_item->data, key_name, key_len);
+		memcpy(batch_item->data + CMAP_ITER_BATCH_ALIGN(key_len + 1), value, value_len);
+
+		batch_item->item_size = item_size;
+		batch_item->key_len = key_len;
+		batch_item->value_len = value_len;
+		batch_item->type = type;
+
+		data_size += item_size;
+		entries++;
+	}
+	qb_map_iter_free(iter);
+
+	if (sizeof(*stats_shm) + data_size > stats_shm_size) {
+		map_size = stats_shm_size;
+		while (map_size < sizeof(*stats_shm) + data_size) {
+			map_size *= 2;
+		}
+
+		if (stats_shm_map(map_size) == -1) {
+			LOGSYS_PERROR(errno, LOGSYS_LEVEL_WARNING, "Can't grow stats snapshot file %s",
+			    stats_shm_path);
+			return ;
+		}
+	}
+
+	seq = stats_shm->seq;
+	__atomic_store_n(&stats_shm->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	memcpy(stats_shm->data, stats_shm_staging, data_size);
+	stats_shm->map_size = stats_shm_size;
+	stats_shm->data_size = data_size;
+	stats_shm->entries = entries;
+	stats_shm->truncated = truncated;
+	stats_shm->timestamp = api->timer_time_get();
+	stats_shm->generation++;
+
+	__atomic_store_n(&stats_shm->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+void stats_shm_fini(void)
+{
+
+	if (stats_shm == NULL) {
+		return ;
+	}
+
+	__atomic_store_n(&stats_shm->closed, 1, __ATOMIC_RELEASE);
+	munmap(stats_shm, stats_shm_size);
+	stats_shm = NULL;
+	close(stats_shm_fd);
+	stats_shm_fd = -1;
+	unlink(stats_shm_path);
+
+	free(stats_shm_staging);
+	stats_shm_staging = NULL;
+	stats_shm_staging_size = 0;
 }
@@ -63,8 +63,22 @@ cs_error_t stats_map_track_add(const char *key_name,
 cs_error_t stats_map_track_delete(icmap_track_t icmap_track);
 void *stats_map_track_get_user_data(icmap_track_t icmap_track);
 
+/*
+ * Kinds of stats sources, producers mark the ones they may have changed
+ * and only those are checked for trackers on next stats update
+ */
+#define STATS_SOURCE_TOTEM	(1 << 0)
+#define STATS_SOURCE_KNET	(1 << 1)
+#define STATS_SOURCE_IPCS	(1 << 2)
+
+void stats_mark_dirty(unsigned int sources);
+
 void stats_trigger_trackers(void);
 
+int stats_shm_init(void);
+void stats_shm_update(void);
+void stats_shm_fini(void);
+
 
 void stats_ipcs_add_connection(int service_id, uint32_t pid, void *ptr);
 void stats_ipcs_del_connection(int service_id, uint32_t pid, void *ptr);
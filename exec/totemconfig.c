@@ -124,6 +124,8 @@ static void *totem_get_param_by_name(struct totem_config *totem_config, const ch
 		return &totem_config->window_size;
 	if (strcmp(param_name, "totem.max_messages") == 0)
 		return &totem_config->max_messages;
+	if (strcmp(param_name, "totem.fcc_target_rotation") == 0)
+		return &totem_config->fcc_target_rotation;
 	if (strcmp(param_name, "totem.miss_count_const") == 0)
 		return &totem_config->miss_count_const;
 	if (strcmp(param_name, "totem.knet_pmtud_interval") == 0)
@@ -263,6 +265,8 @@ static void totem_volatile_config_read (struct totem_config *totem_config, const
 
 	totem_volatile_config_set_uint32_value(totem_config, "totem.max_messages", deleted_key, MAX_MESSAGES, 0);
 
+	totem_volatile_config_set_uint32_value(totem_config, "totem.fcc_target_rotation", deleted_key, 0, 1);
+
 	totem_volatile_config_set_uint32_value(totem_config, "totem.miss_count_const", deleted_key, MISS_COUNT_CONST, 0);
 	totem_volatile_config_set_uint32_value(totem_config, "totem.knet_pmtud_interval", deleted_key, KNET_PMTUD_INTERVAL, 0);
 
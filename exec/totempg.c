@@ -67,18 +67,15 @@
 /*
  * ASSEMBLY AND UNPACKING ALGORITHM:
  *
- * copy incoming packet into assembly data buffer indexed by current
- * location of end of fragment
+ * if first packed message is a continuation of a fragmented message
+ *	append it to the assembly data buffer and deliver from there
+ * deliver all other complete messages directly from the incoming packet
+ * if last packed message is fragmented
+ *	copy it to the assembly data buffer (appending if it is also the first)
  *
- * if not fragmented
- *	deliver all messages in assembly data buffer
- * else
- * if msg_count > 1 and fragmented
- *	deliver all messages except last message in assembly data buffer
- *	copy last fragmented section to start of assembly data buffer
- * else
- * if msg_count = 1 and fragmented
- *	do nothing
+ * The assembly data buffer only ever holds the pieces of one message that
+ * spans several packets, and is sized on demand.  Messages contained in a
+ * single packet are delivered without being copied.
  *
  */
 
@@ -197,9 +194,33 @@ enum throw_away_mode {
 	THROW_AWAY_ACTIVE
 };
 
+/*
+ * Assembly data buffers larger than this are released once the
+ * fragmented message they held has been delivered
+ */
+#define ASSEMBLY_DATA_KEEP_SIZE		FRAME_SIZE_MAX
+
+#define ASSEMBLY_DATA_SIZE_MAX		(MESSAGE_SIZE_MAX + FRAME_SIZE_MAX)
+
+/*
+ * Assemblies in use are found through an open addressed hash table keyed
+ * by sender nodeid and view, so lookup does not depend on the number of
+ * processors sending.  The table is sized to stay under a quarter full with
+ * every processor assembling in both the regular and transitional views.
+ */
+#define ASSEMBLY_TABLE_BITS		12
+#define ASSEMBLY_TABLE_SIZE		(1 << ASSEMBLY_TABLE_BITS)
+#define ASSEMBLY_TABLE_MASK		(ASSEMBLY_TABLE_SIZE - 1)
+
+#if ASSEMBLY_TABLE_SIZE < (8 * PROCESSOR_COUNT_MAX)
+#error ASSEMBLY_TABLE_SIZE is too small for PROCESSOR_COUNT_MAX
+#endif
+
 struct assembly {
 	unsigned int nodeid;
-	unsigned char data[MESSAGE_SIZE_MAX+KNET_MAX_PACKET_SIZE];
+	int trans;
+	unsigned char *data;
+	unsigned int data_size;
 	int index;
 	unsigned char last_frag_num;
 	enum throw_away_mode throw_away_mode;
@@ -211,15 +232,13 @@ static void assembly_deref (struct assembly *assembly);
 static int callback_token_received_fn (enum totem_callback_token_type type,
 	const void *data);
 
-QB_LIST_DECLARE(assembly_list_inuse);
+static struct assembly *assembly_table[ASSEMBLY_TABLE_SIZE];
 
 /*
  * Free list is used both for transitional and operational assemblies
  */
 QB_LIST_DECLARE(assembly_list_free);
 
-QB_LIST_DECLARE(assembly_list_inuse_trans);
-
 QB_LIST_DECLARE(totempg_groups_list);
 
 /*
@@ -288,92 +307,172 @@ static void totempg_waiting_trans_ack_cb (int waiting_trans_ack)
 	totempg_waiting_transack = waiting_trans_ack;
 }
 
-static struct assembly *assembly_ref (unsigned int nodeid)
+static inline unsigned int assembly_table_hash (unsigned int nodeid, int trans)
 {
-	struct assembly *assembly;
-	struct qb_list_head *list;
-	struct qb_list_head *active_assembly_list_inuse;
+	return ((((nodeid << 1) | trans) * 2654435761U) >>
+		(32 - ASSEMBLY_TABLE_BITS));
+}
 
-	if (totempg_waiting_transack) {
-		active_assembly_list_inuse = &assembly_list_inuse_trans;
-	} else {
-		active_assembly_list_inuse = &assembly_list_inuse;
+static unsigned int assembly_table_find (unsigned int nodeid, int trans)
+{
+	unsigned int slot;
+
+	slot = assembly_table_hash (nodeid, trans);
+	while (assembly_table[slot] != NULL &&
+	    (assembly_table[slot]->nodeid != nodeid ||
+	    assembly_table[slot]->trans != trans)) {
+		slot = (slot + 1) & ASSEMBLY_TABLE_MASK;
 	}
+	return (slot);
+}
+
+static void assembly_table_remove (struct assembly *assembly)
+{
+	unsigned int hole;
+	unsigned int slot;
+	unsigned int home;
+
+	hole = assembly_table_find (assembly->nodeid, assembly->trans);
+	assert (assembly_table[hole] == assembly);
+	assembly_table[hole] = NULL;
 
 	/*
-	 * Search inuse list for node id and return assembly buffer if found
+	 * Shift back any following entry of the probe run which could no
+	 * longer be reached past the hole
 	 */
-	qb_list_for_each(list, active_assembly_list_inuse) {
-		assembly = qb_list_entry (list, struct assembly, list);
-
-		if (nodeid == assembly->nodeid) {
-			return (assembly);
+	slot = hole;
+	for (;;) {
+		slot = (slot + 1) & ASSEMBLY_TABLE_MASK;
+		if (assembly_table[slot] == NULL) {
+			break;
+		}
+		home = assembly_table_hash (assembly_table[slot]->nodeid,
+			assembly_table[slot]->trans);
+		if (((slot - home) & ASSEMBLY_TABLE_MASK) >=
+		    ((slot - hole) & ASSEMBLY_TABLE_MASK)) {
+			assembly_table[hole] = assembly_table[slot];
+			assembly_table[slot] = NULL;
+			hole = slot;
 		}
 	}
 
+	totempg_stats.assemblies_active--;
+}
+
+static struct assembly *assembly_ref (unsigned int nodeid)
+{
+	struct assembly *assembly;
+	unsigned int slot;
+	int trans;
+
+	trans = (totempg_waiting_transack != 0);
+
+	/*
+	 * Search table for node id and return assembly buffer if found
+	 */
+	slot = assembly_table_find (nodeid, trans);
+	if (assembly_table[slot] != NULL) {
+		return (assembly_table[slot]);
+	}
+	assert (totempg_stats.assemblies_active < ASSEMBLY_TABLE_SIZE / 2);
+
 	/*
-	 * Nothing found in inuse list get one from free list if available
+	 * Nothing found in table get one from free list if available
 	 */
 	if (qb_list_empty (&assembly_list_free) == 0) {
 		assembly = qb_list_first_entry (&assembly_list_free, struct assembly, list);
 		qb_list_del (&assembly->list);
-		qb_list_add (&assembly->list, active_assembly_list_inuse);
-		assembly->nodeid = nodeid;
-		assembly->index = 0;
-		assembly->last_frag_num = 0;
-		assembly->throw_away_mode = THROW_AWAY_INACTIVE;
-		return (assembly);
+	} else {
+		/*
+		 * Nothing available in free list, so allocate a new one
+		 */
+		assembly = malloc (sizeof (struct assembly));
+		/*
+		 * TODO handle memory allocation failure here
+		 */
+		assert (assembly);
+		assembly->data = NULL;
+		assembly->data_size = 0;
+		qb_list_init (&assembly->list);
 	}
-
-	/*
-	 * Nothing available in inuse or free list, so allocate a new one
-	 */
-	assembly = malloc (sizeof (struct assembly));
-	/*
-	 * TODO handle memory allocation failure here
-	 */
-	assert (assembly);
 	assembly->nodeid = nodeid;
-	assembly->data[0] = 0;
+	assembly->trans = trans;
 	assembly->index = 0;
 	assembly->last_frag_num = 0;
 	assembly->throw_away_mode = THROW_AWAY_INACTIVE;
-	qb_list_init (&assembly->list);
-	qb_list_add (&assembly->list, active_assembly_list_inuse);
+	assembly_table[slot] = assembly;
+
+	totempg_stats.assemblies_active++;
+	if (totempg_stats.assemblies_active > totempg_stats.assemblies_active_hw) {
+		totempg_stats.assemblies_active_hw = totempg_stats.assemblies_active;
+	}
 
 	return (assembly);
 }
 
+static void assembly_data_release (struct assembly *assembly)
+{
+	if (assembly->data_size > ASSEMBLY_DATA_KEEP_SIZE) {
+		free (assembly->data);
+		assembly->data = NULL;
+		assembly->data_size = 0;
+	}
+}
+
+/*
+ * Make sure the assembly data buffer can hold size bytes
+ */
+static int assembly_data_reserve (
+	struct assembly *assembly,
+	unsigned int size)
+{
+	unsigned int new_size;
+	unsigned char *new_data;
+
+	if (size <= assembly->data_size) {
+		return (0);
+	}
+
+	if (size > ASSEMBLY_DATA_SIZE_MAX) {
+		return (-1);
+	}
+
+	new_size = assembly->data_size ? assembly->data_size : FRAME_SIZE_MAX;
+	while (new_size < size) {
+		new_size *= 2;
+	}
+	if (new_size > ASSEMBLY_DATA_SIZE_MAX) {
+		new_size = ASSEMBLY_DATA_SIZE_MAX;
+	}
+
+	new_data = realloc (assembly->data, new_size);
+	if (new_data == NULL) {
+		return (-1);
+	}
+	assembly->data = new_data;
+	assembly->data_size = new_size;
+
+	return (0);
+}
+
 static void assembly_deref (struct assembly *assembly)
 {
-	qb_list_del (&assembly->list);
+	assembly_data_release (assembly);
+	assembly_table_remove (assembly);
 	qb_list_add (&assembly->list, &assembly_list_free);
 }
 
 static void assembly_deref_from_normal_and_trans (int nodeid)
 {
-	int j;
-	struct qb_list_head *list, *tmp_iter;
-	struct qb_list_head *active_assembly_list_inuse;
-	struct assembly *assembly;
-
-	for (j = 0; j < 2; j++) {
-		if (j == 0) {
-			active_assembly_list_inuse = &assembly_list_inuse;
-		} else {
-			active_assembly_list_inuse = &assembly_list_inuse_trans;
-		}
+	int trans;
+	unsigned int slot;
 
-		qb_list_for_each_safe(list, tmp_iter, active_assembly_list_inuse) {
-			assembly = qb_list_entry (list, struct assembly, list);
-
-			if (nodeid == assembly->nodeid) {
-				qb_list_del (&assembly->list);
-				qb_list_add (&assembly->list, &assembly_list_free);
-			}
+	for (trans = 0; trans < 2; trans++) {
+		slot = assembly_table_find (nodeid, trans);
+		if (assembly_table[slot] != NULL) {
+			assembly_deref (assembly_table[slot]);
 		}
 	}
-
 }
 
 static inline void app_confchg_fn (
@@ -587,65 +686,86 @@ static void totempg_confchg_fn (
 		ring_id);
 }
 
+/*
+ * Deliver one packed message to the application.  Messages that need
+ * endian conversion are converted in the assembly data buffer so that
+ * the frame still held in the totemsrp sort queue is never modified.
+ */
+static void assembly_app_deliver (
+	struct assembly *assembly,
+	unsigned int nodeid,
+	const unsigned char *msg,
+	unsigned int msg_len,
+	int endian_conversion_required)
+{
+	if (endian_conversion_required && msg != assembly->data) {
+		if (assembly_data_reserve (assembly, msg_len) == -1) {
+			log_printf (LOG_WARNING,
+				"Unable to allocate %u bytes to convert message from node %u, dropping it",
+				msg_len, nodeid);
+			return;
+		}
+		memcpy (assembly->data, msg, msg_len);
+		msg = assembly->data;
+	}
+
+	app_deliver_fn (nodeid, (void *)msg, msg_len, endian_conversion_required);
+}
+
 static void totempg_deliver_fn (
 	unsigned int nodeid,
 	const void *msg,
 	unsigned int msg_len,
 	int endian_conversion_required)
 {
-	struct totempg_mcast *mcast;
+	const struct totempg_mcast *mcast;
 	unsigned short *msg_lens;
 	int i;
 	struct assembly *assembly;
 	char header[FRAME_SIZE_MAX];
+	int packed_count;
 	int msg_count;
 	int continuation;
 	int start;
-	const char *data;
+	const unsigned char *data;
 	int datasize;
-	struct iovec iov_delv;
+	unsigned int offset;
 
 	assembly = assembly_ref (nodeid);
 	assert (assembly);
 
 	/*
-	 * Assemble the header into one block of data and
-	 * assemble the packet contents into one block of data to simplify delivery
+	 * Copy the header out so the lengths can be endian converted
+	 * without touching the frame
 	 */
-
-	mcast = (struct totempg_mcast *)msg;
+	mcast = (const struct totempg_mcast *)msg;
+	packed_count = mcast->msg_count;
 	if (endian_conversion_required) {
-		mcast->msg_count = swab16 (mcast->msg_count);
+		packed_count = swab16 (mcast->msg_count);
 	}
 
-	msg_count = mcast->msg_count;
 	datasize = sizeof (struct totempg_mcast) +
-		msg_count * sizeof (unsigned short);
+		packed_count * sizeof (unsigned short);
+	assert (datasize <= msg_len);
 
 	memcpy (header, msg, datasize);
-	data = msg;
+	data = (const unsigned char *)msg + datasize;
 
 	msg_lens = (unsigned short *) (header + sizeof (struct totempg_mcast));
 	if (endian_conversion_required) {
-		for (i = 0; i < mcast->msg_count; i++) {
+		for (i = 0; i < packed_count; i++) {
 			msg_lens[i] = swab16 (msg_lens[i]);
 		}
 	}
 
-	assert((assembly->index+msg_len) < sizeof(assembly->data));
-	memcpy (&assembly->data[assembly->index], &data[datasize],
-		msg_len - datasize);
-
 	/*
 	 * If the last message in the buffer is a fragment, then we
 	 * can't deliver it.  We'll first deliver the full messages
-	 * then adjust the assembly buffer so we can add the rest of the
-	 * fragment when it arrives.
+	 * then keep the trailing fragment in the assembly buffer until
+	 * the rest of it arrives.
 	 */
-	msg_count = mcast->fragmented ? mcast->msg_count - 1 : mcast->msg_count;
+	msg_count = mcast->fragmented ? packed_count - 1 : packed_count;
 	continuation = mcast->continuation;
-	iov_delv.iov_base = (void *)&assembly->data[0];
-	iov_delv.iov_len = assembly->index + msg_lens[0];
 
 	/*
 	 * Make sure that if this message is a continuation, that it
@@ -660,32 +780,54 @@ static void totempg_deliver_fn (
 	start = 0;
 
 	if (assembly->throw_away_mode == THROW_AWAY_ACTIVE) {
-		 /* Throw away the first msg block */
-		if (mcast->fragmented == 0 || mcast->fragmented == 1) {
+		/*
+		 * Throw away the first msg block. Throw away mode is only left
+		 * when a trailing fragment follows it and is stored below,
+		 * otherwise the next continuation would be assembled without
+		 * its first part.
+		 */
+		if (mcast->fragmented == 0 || (mcast->fragmented == 1 && msg_count >= 1)) {
 			assembly->throw_away_mode = THROW_AWAY_INACTIVE;
-
-			assembly->index += msg_lens[0];
-			iov_delv.iov_base = (void *)&assembly->data[assembly->index];
-			iov_delv.iov_len = msg_lens[1];
+			assembly->last_frag_num = mcast->fragmented;
+			assembly->index = 0;
 			start = 1;
 		}
 	} else
 	if (assembly->throw_away_mode == THROW_AWAY_INACTIVE) {
 		if (continuation == assembly->last_frag_num) {
 			assembly->last_frag_num = mcast->fragmented;
-			for  (i = start; i < msg_count; i++) {
-				app_deliver_fn(nodeid, iov_delv.iov_base, iov_delv.iov_len,
-					endian_conversion_required);
-				assembly->index += msg_lens[i];
-				iov_delv.iov_base = (void *)&assembly->data[assembly->index];
-				if (i < (msg_count - 1)) {
-					iov_delv.iov_len = msg_lens[i + 1];
+			offset = 0;
+			for  (i = 0; i < msg_count; i++) {
+				if (i == 0 && assembly->index > 0) {
+					/*
+					 * Last piece of a fragmented message, linearize
+					 * it behind the pieces already assembled
+					 */
+					if (assembly_data_reserve (assembly,
+						assembly->index + msg_lens[0]) == -1) {
+
+						log_printf (LOG_WARNING,
+							"Unable to allocate %u bytes to assemble message from node %u, dropping it",
+							assembly->index + msg_lens[0], nodeid);
+					} else {
+						memcpy (&assembly->data[assembly->index],
+							data, msg_lens[0]);
+						assembly_app_deliver (assembly, nodeid, assembly->data,
+							assembly->index + msg_lens[0],
+							endian_conversion_required);
+					}
+					assembly->index = 0;
+				} else {
+					assembly_app_deliver (assembly, nodeid, &data[offset],
+						msg_lens[i], endian_conversion_required);
 				}
+				offset += msg_lens[i];
 			}
 		} else {
 			log_printf (LOG_DEBUG, "fragmented continuation %u is not equal to assembly last_frag_num %u",
 					continuation, assembly->last_frag_num);
 			assembly->throw_away_mode = THROW_AWAY_ACTIVE;
+			assembly->index = 0;
 		}
 	}
 
@@ -696,18 +838,32 @@ static void totempg_deliver_fn (
 		assembly->last_frag_num = 0;
 		assembly->index = 0;
 		assembly_deref (assembly);
-	} else {
+	} else
+	if (assembly->throw_away_mode == THROW_AWAY_INACTIVE && msg_count >= start) {
 		/*
-		 * Message is fragmented, keep around assembly list
+		 * Message is fragmented, keep around assembly list and
+		 * store the trailing fragment.  When leaving throw away mode
+		 * the first msg block is discarded, so a lone fragment
+		 * isn't kept either.
 		 */
-		if (mcast->msg_count > 1) {
-			memmove (&assembly->data[0],
-				&assembly->data[assembly->index],
-				msg_lens[msg_count]);
+		offset = 0;
+		for (i = 0; i < msg_count; i++) {
+			offset += msg_lens[i];
+		}
+
+		if (assembly_data_reserve (assembly,
+			assembly->index + msg_lens[msg_count]) == -1) {
 
+			log_printf (LOG_WARNING,
+				"Unable to allocate %u bytes to assemble message from node %u, dropping it",
+				assembly->index + msg_lens[msg_count], nodeid);
 			assembly->index = 0;
+			assembly->throw_away_mode = THROW_AWAY_ACTIVE;
+		} else {
+			memcpy (&assembly->data[assembly->index], &data[offset],
+				msg_lens[msg_count]);
+			assembly->index += msg_lens[msg_count];
 		}
-		assembly->index += msg_lens[msg_count];
 	}
 }
 
@@ -846,7 +1002,7 @@ static int mcast_msg (
 {
 	int res = 0;
 	struct totempg_mcast mcast;
-	struct iovec iovecs[3];
+	struct iovec iovecs[4];
 	struct iovec iovec[64];
 	int i;
 	int dest, src;
@@ -920,19 +1076,11 @@ static int mcast_msg (
 
 		/*
 		 * If it just fits or is too big, then send out what fits.
+		 * The part of the iovec that goes out is passed to totemsrp
+		 * by reference, so it is only copied once, into the frame.
 		 */
 		} else {
-			unsigned char *data_ptr;
-
 			copy_len = min(copy_len, max_packet_size - fragment_size);
-			if( copy_len == max_packet_size )
-				data_ptr = (unsigned char *)iovec[i].iov_base + copy_base;
-			else {
-				data_ptr = fragmentation_data;
-			}
-
-			memcpy (&fragmentation_data[fragment_size],
-				(unsigned char *)iovec[i].iov_base + copy_base, copy_len);
 			mcast_packed_msg_lens[mcast_packed_msg_count] += copy_len;
 
 			/*
@@ -962,10 +1110,12 @@ static int mcast_msg (
 			iovecs[1].iov_base = (void *)mcast_packed_msg_lens;
 			iovecs[1].iov_len = mcast_packed_msg_count *
 				sizeof(unsigned short);
-			iovecs[2].iov_base = (void *)data_ptr;
-			iovecs[2].iov_len = fragment_size + copy_len;
+			iovecs[2].iov_base = (void *)fragmentation_data;
+			iovecs[2].iov_len = fragment_size;
+			iovecs[3].iov_base = (unsigned char *)iovec[i].iov_base + copy_base;
+			iovecs[3].iov_len = copy_len;
 			assert (totemsrp_avail(totemsrp_context) > 0);
-			res = totemsrp_mcast (totemsrp_context, iovecs, 3, guarantee);
+			res = totemsrp_mcast (totemsrp_context, iovecs, 4, guarantee);
 			if (res == -1) {
 				goto error_exit;
 			}
@@ -1537,6 +1687,7 @@ extern void totempg_stats_clear (int flags)
 	if (flags & TOTEMPG_STATS_CLEAR_TOTEM) {
 		totempg_stats.msg_reserved = 0;
 		totempg_stats.msg_queue_avail = 0;
+		totempg_stats.assemblies_active_hw = totempg_stats.assemblies_active;
 	}
 	return totemsrp_stats_clear (totemsrp_context, flags);
 }
@@ -81,7 +81,6 @@
 #include <qb/qbloop.h>
 
 #include <corosync/swab.h>
-#include <corosync/sq.h>
 
 #define LOGSYS_UTILS_ONLY 1
 #include <corosync/logsys.h>
@@ -90,6 +89,7 @@
 #include "totemnet.h"
 
 #include "cs_queue.h"
+#include "sq.h"
 
 #define LOCALHOST_IP				inet_addr("127.0.0.1")
 #define QUEUE_RTR_ITEMS_SIZE_MAX		16384 /* allow 16384 retransmit items */
@@ -98,6 +98,7 @@
 #define MAXIOVS					5
 #define RETRANSMIT_ENTRIES_MAX			30
 #define TOKEN_SIZE_MAX				64000 /* bytes */
+#define BUFFER_POOL_WINDOW_FACTOR		2 /* keep up to 2 windows of free buffers */
 #define LEAVE_DUMMY_NODEID                      0
 
 /*
@@ -506,6 +507,12 @@ struct totemsrp_instance {
 
 	unsigned int my_cbl;
 
+	uint64_t fcc_token_timestamp;
+
+	unsigned int fcc_rotation_avg;
+
+	unsigned int fcc_transmits_limit;
+
 	uint64_t pause_timestamp;
 
 	struct memb_commit_token *commit_token;
@@ -522,6 +529,17 @@ struct totemsrp_instance {
 
 	int 	flushing;
 
+	/*
+	 * Free message buffers kept for reuse by totemsrp_buffer_alloc
+	 */
+	void **buffer_pool;
+
+	unsigned int buffer_pool_entries;
+
+	unsigned int buffers_in_use;
+
+	pthread_mutex_t buffer_pool_mutex;
+
 	void * token_recv_event_handle;
 	void * token_sent_event_handle;
 	char commit_token_storage[40000];
@@ -660,6 +678,9 @@ static void timer_function_token_hold_retransmit_timeout (void *data);
 static void timer_function_merge_detect_timeout (void *data);
 static void *totemsrp_buffer_alloc (struct totemsrp_instance *instance);
 static void totemsrp_buffer_release (struct totemsrp_instance *instance, void *ptr);
+static int totemsrp_buffer_pool_init (struct totemsrp_instance *instance);
+static void totemsrp_buffer_pool_free (struct totemsrp_instance *instance);
+static void sort_queue_buffers_release (struct totemsrp_instance *instance, struct sq *sort_queue);
 static const char* gsfrom_to_msg(enum gather_state_from gsfrom);
 
 void main_deliver_fn (
@@ -903,12 +924,18 @@ int totemsrp_initialize (
 		"window size per rotation (%d messages) maximum messages per rotation (%d messages)",
 		totem_config->window_size, totem_config->max_messages);
 
+	if (totem_config->fcc_target_rotation) {
+		log_printf (instance->totemsrp_log_level_debug,
+			"adaptive flow control target rotation (%d ms)",
+			totem_config->fcc_target_rotation);
+	}
+
 	log_printf (instance->totemsrp_log_level_debug,
 		"missed count const (%d messages)",
 		totem_config->miss_count_const);
 
 	log_printf (instance->totemsrp_log_level_debug,
-		"send threads (%d threads)", totem_config->threads);
+		"receive threads (%d threads)", totem_config->threads);
 
 	log_printf (instance->totemsrp_log_level_debug,
 		"heartbeat_failures_allowed (%d)", totem_config->heartbeat_failures_allowed);
@@ -917,7 +944,7 @@ int totemsrp_initialize (
 
 
 	cs_queue_init (&instance->retrans_message_queue, RETRANS_MESSAGE_QUEUE_SIZE_MAX,
-		sizeof (struct message_item), instance->threaded_mode_enabled);
+		sizeof (struct message_item), CS_QUEUE_LOCKING_NONE);
 
 	sq_init (&instance->regular_sort_queue,
 		QUEUE_RTR_ITEMS_SIZE_MAX, sizeof (struct sort_queue_item), 0);
@@ -983,11 +1010,15 @@ int totemsrp_initialize (
 	 */
 	cs_queue_init (&instance->new_message_queue,
 		MESSAGE_QUEUE_MAX,
-		sizeof (struct message_item), instance->threaded_mode_enabled);
+		sizeof (struct message_item), CS_QUEUE_LOCKING_NONE);
 
 	cs_queue_init (&instance->new_message_queue_trans,
 		MESSAGE_QUEUE_MAX,
-		sizeof (struct message_item), instance->threaded_mode_enabled);
+		sizeof (struct message_item), CS_QUEUE_LOCKING_NONE);
+
+	if (totemsrp_buffer_pool_init (instance) != 0) {
+		goto error_exit;
+	}
 
 	totemsrp_callback_token_create (instance,
 		&instance->token_recv_event_handle,
@@ -1014,6 +1045,7 @@ void totemsrp_finalize (
 	struct totemsrp_instance *instance = (struct totemsrp_instance *)srp_context;
 
 	memb_leave_message_send (instance);
+	totemsrp_buffer_pool_free (instance);
 	totemnet_finalize (instance->totemnet_context);
 	cs_queue_free (&instance->new_message_queue);
 	cs_queue_free (&instance->new_message_queue_trans);
@@ -1454,16 +1486,137 @@ static void my_leave_memb_set(
 }
 
 
+/*
+ * Message buffers are recycled through a per instance free list instead of
+ * going back to the allocator for every message.  window_size buffers are
+ * allocated up front and up to BUFFER_POOL_WINDOW_FACTOR windows worth of
+ * free buffers are kept.  totemsrp_mcast may allocate from another thread
+ * in threaded mode so the pool is locked then.
+ */
+static int totemsrp_buffer_pool_init (struct totemsrp_instance *instance)
+{
+	void *buffer;
+	unsigned int i;
+
+	instance->buffer_pool = malloc (QUEUE_RTR_ITEMS_SIZE_MAX * sizeof (void *));
+	if (instance->buffer_pool == NULL) {
+		return (-1);
+	}
+	instance->buffer_pool_entries = 0;
+	instance->buffers_in_use = 0;
+	pthread_mutex_init (&instance->buffer_pool_mutex, NULL);
+
+	for (i = 0; i < instance->totem_config->window_size &&
+		i < QUEUE_RTR_ITEMS_SIZE_MAX; i++) {
+
+		buffer = totemnet_buffer_alloc (instance->totemnet_context);
+		if (buffer == NULL) {
+			break;
+		}
+		instance->buffer_pool[instance->buffer_pool_entries++] = buffer;
+	}
+	return (0);
+}
+
+static void totemsrp_buffer_pool_free (struct totemsrp_instance *instance)
+{
+	while (instance->buffer_pool_entries > 0) {
+		totemnet_buffer_release (instance->totemnet_context,
+			instance->buffer_pool[--instance->buffer_pool_entries]);
+	}
+	free (instance->buffer_pool);
+	pthread_mutex_destroy (&instance->buffer_pool_mutex);
+}
+
 static void *totemsrp_buffer_alloc (struct totemsrp_instance *instance)
 {
+	void *buffer = NULL;
+
 	assert (instance != NULL);
-	return totemnet_buffer_alloc (instance->totemnet_context);
+	if (instance->threaded_mode_enabled) {
+		pthread_mutex_lock (&instance->buffer_pool_mutex);
+	}
+	if (instance->buffer_pool_entries > 0) {
+		buffer = instance->buffer_pool[--instance->buffer_pool_entries];
+		instance->stats.buffer_pool_hits++;
+	} else {
+		instance->stats.buffer_pool_misses++;
+	}
+	if (instance->threaded_mode_enabled) {
+		pthread_mutex_unlock (&instance->buffer_pool_mutex);
+	}
+
+	if (buffer == NULL) {
+		buffer = totemnet_buffer_alloc (instance->totemnet_context);
+		if (buffer == NULL) {
+			return (NULL);
+		}
+	}
+
+	if (instance->threaded_mode_enabled) {
+		pthread_mutex_lock (&instance->buffer_pool_mutex);
+	}
+	instance->buffers_in_use++;
+	if (instance->buffers_in_use > instance->stats.buffer_pool_in_use_hw) {
+		instance->stats.buffer_pool_in_use_hw = instance->buffers_in_use;
+	}
+	if (instance->threaded_mode_enabled) {
+		pthread_mutex_unlock (&instance->buffer_pool_mutex);
+	}
+	return (buffer);
 }
 
 static void totemsrp_buffer_release (struct totemsrp_instance *instance, void *ptr)
 {
+	unsigned int pool_max;
+
 	assert (instance != NULL);
-	totemnet_buffer_release (instance->totemnet_context, ptr);
+	pool_max = instance->totem_config->window_size * BUFFER_POOL_WINDOW_FACTOR;
+	if (pool_max > QUEUE_RTR_ITEMS_SIZE_MAX) {
+		pool_max = QUEUE_RTR_ITEMS_SIZE_MAX;
+	}
+
+	if (instance->threaded_mode_enabled) {
+		pthread_mutex_lock (&instance->buffer_pool_mutex);
+	}
+	instance->buffers_in_use--;
+	if (instance->buffer_pool_entries < pool_max) {
+		instance->buffer_pool[instance->buffer_pool_entries++] = ptr;
+		ptr = NULL;
+	}
+	if (instance->threaded_mode_enabled) {
+		pthread_mutex_unlock (&instance->buffer_pool_mutex);
+	}
+
+	if (ptr != NULL) {
+		totemnet_buffer_release (instance->totemnet_context, ptr);
+	}
+}
+
+/*
+ * Release the buffers of every message still held by a sort queue
+ */
+static void sort_queue_buffers_release (
+	struct totemsrp_instance *instance,
+	struct sq *sort_queue)
+{
+	struct sort_queue_item *sort_queue_item;
+	unsigned int seq;
+	unsigned int end;
+	void *ptr;
+
+	seq = sort_queue->head_seqid;
+	end = sort_queue->head_seqid + sq_size_get (sort_queue);
+	while (seq != end) {
+		seq += sq_item_first_inuse (sort_queue, seq, end - seq);
+		if (seq == end) {
+			break;
+		}
+		sq_item_get (sort_queue, seq, &ptr);
+		sort_queue_item = ptr;
+		totemsrp_buffer_release (instance, sort_queue_item->mcast);
+		seq++;
+	}
 }
 
 static void reset_token_retransmit_timeout (struct totemsrp_instance *instance)
@@ -1794,11 +1947,9 @@ static void deliver_messages_from_recovery_to_regular (struct totemsrp_instance
 			 * Message is a recovery message encapsulated
 			 * in a new ring message
 			 */
-			regular_message_item.mcast =
-				(struct mcast *)(((char *)recovery_message_item->mcast) + sizeof (struct mcast));
+			mcast = (struct mcast *)(((char *)recovery_message_item->mcast) + sizeof (struct mcast));
 			regular_message_item.msg_len =
 			recovery_message_item->msg_len - sizeof (struct mcast);
-			mcast = regular_message_item.mcast;
 		} else {
 			/*
 			 * TODO this case shouldn't happen
@@ -1820,6 +1971,15 @@ static void deliver_messages_from_recovery_to_regular (struct totemsrp_instance
 
 			res = sq_item_inuse (&instance->regular_sort_queue, mcast->seq);
 			if (res == 0) {
+				/*
+				 * The regular sort queue owns its buffers, so
+				 * take a copy rather than pointing into the
+				 * recovery message
+				 */
+				regular_message_item.mcast = totemsrp_buffer_alloc (instance);
+				assert (regular_message_item.mcast);
+				memcpy (regular_message_item.mcast, mcast,
+					regular_message_item.msg_len);
 				sq_item_add (&instance->regular_sort_queue,
 					&regular_message_item, mcast->seq);
 				if (sq_lt_compare (instance->old_ring_state_high_seq_received, mcast->seq)) {
@@ -1923,10 +2083,12 @@ static void memb_state_operational_enter (struct totemsrp_instance *instance)
 
 	/*
 	 * The recovery sort queue now becomes the regular
-	 * sort queue.  It is necessary to copy the state
-	 * into the regular sort queue.
+	 * sort queue.  The old regular sort queue is emptied and
+	 * handed back as the next recovery sort queue.
 	 */
-	sq_copy (&instance->regular_sort_queue, &instance->recovery_sort_queue);
+	sort_queue_buffers_release (instance, &instance->regular_sort_queue);
+	sq_reinit (&instance->regular_sort_queue, SEQNO_START_MSG);
+	sq_swap (&instance->regular_sort_queue, &instance->recovery_sort_queue);
 	instance->my_last_aru = SEQNO_START_MSG;
 
 	/* When making my_proc_list smaller, ensure that the
@@ -1982,7 +2144,7 @@ static void memb_state_operational_enter (struct totemsrp_instance *instance)
 			struct sort_queue_item *regular_message;
 
 			regular_message = ptr;
-			free (regular_message->mcast);
+			totemsrp_buffer_release (instance, regular_message->mcast);
 		}
 	}
 	sq_items_release (&instance->regular_sort_queue, instance->my_high_delivered);
@@ -2185,6 +2347,7 @@ static void memb_state_commit_enter (
 	instance->my_trc = 0;
 	instance->my_pbl = 0;
 	instance->my_cbl = 0;
+	instance->fcc_token_timestamp = 0;
 	/*
 	 * commit token sent after callback that token target has been set
 	 */
@@ -2213,7 +2376,18 @@ static void memb_state_recovery_enter (
 
 	instance->my_high_ring_delivered = 0;
 
+	/*
+	 * Drop anything left over from a recovery that didn't complete
+	 */
+	sort_queue_buffers_release (instance, &instance->recovery_sort_queue);
 	sq_reinit (&instance->recovery_sort_queue, SEQNO_START_MSG);
+	while (cs_queue_is_empty (&instance->retrans_message_queue) == 0) {
+		struct message_item *message_item;
+
+		message_item = cs_queue_item_get (&instance->retrans_message_queue);
+		totemsrp_buffer_release (instance, message_item->mcast);
+		cs_queue_item_remove (&instance->retrans_message_queue);
+	}
 	cs_queue_reinit (&instance->retrans_message_queue);
 
 	low_ring_aru = instance->old_ring_state_high_seq_received;
@@ -2338,7 +2512,6 @@ static void memb_state_recovery_enter (
 		sort_queue_item = ptr;
 		messages_originated++;
 		memset (&message_item, 0, sizeof (struct message_item));
-	// TODO	 LEAK
 		message_item.mcast = totemsrp_buffer_alloc (instance);
 		assert (message_item.mcast);
 		message_item.mcast->header.magic = TOTEM_MH_MAGIC;
@@ -2564,15 +2737,19 @@ static void messages_free (
 	for (i = 1; i <= range; i++) {
 		void *ptr;
 
+		i += sq_item_first_inuse (&instance->regular_sort_queue,
+			instance->last_released + i, range - i + 1);
+		if (i > range) {
+			break;
+		}
 		res = sq_item_get (&instance->regular_sort_queue,
 			instance->last_released + i, &ptr);
-		if (res == 0) {
-			regular_message = ptr;
-			totemsrp_buffer_release (instance, regular_message->mcast);
-		}
-		sq_items_release (&instance->regular_sort_queue,
-			instance->last_released + i);
-
+		assert (res == 0);
+		regular_message = ptr;
+		totemsrp_buffer_release (instance, regular_message->mcast);
+	}
+	if (range) {
+		sq_items_release (&instance->regular_sort_queue, release_to);
 		log_release = 1;
 	}
 	instance->last_released += range;
@@ -2586,11 +2763,8 @@ static void messages_free (
 static void update_aru (
 	struct totemsrp_instance *instance)
 {
-	unsigned int i;
-	int res;
 	struct sq *sort_queue;
 	unsigned int range;
-	unsigned int my_aru_saved = 0;
 
 	if (instance->memb_state == MEMB_STATE_RECOVERY) {
 		sort_queue = &instance->recovery_sort_queue;
@@ -2600,20 +2774,11 @@ static void update_aru (
 
 	range = instance->my_high_seq_received - instance->my_aru;
 
-	my_aru_saved = instance->my_aru;
-	for (i = 1; i <= range; i++) {
-
-		void *ptr;
-
-		res = sq_item_get (sort_queue, my_aru_saved + i, &ptr);
-		/*
-		 * If hole, stop updating aru
-		 */
-		if (res != 0) {
-			break;
-		}
-	}
-	instance->my_aru += i - 1;
+	/*
+	 * Advance aru up to the first hole
+	 */
+	instance->my_aru += sq_item_first_missing (sort_queue,
+		instance->my_aru + 1, range);
 }
 
 /*
@@ -2645,11 +2810,15 @@ static int orf_token_mcast (
 		sort_queue = &instance->regular_sort_queue;
 	}
 
+	/*
+	 * Find out how many messages the token allows once, and remove the
+	 * sent ones from the queue together after they are multicast
+	 */
+	fcc_mcasts_allowed = cs_queue_items_ready (mcast_queue, fcc_mcasts_allowed);
+
 	for (fcc_mcast_current = 0; fcc_mcast_current < fcc_mcasts_allowed; fcc_mcast_current++) {
-		if (cs_queue_is_empty (mcast_queue)) {
-			break;
-		}
-		message_item = (struct message_item *)cs_queue_item_get (mcast_queue);
+		message_item = (struct message_item *)cs_queue_item_get_nth (mcast_queue,
+			fcc_mcast_current);
 
 		message_item->mcast->seq = ++token->seq;
 		message_item->mcast->this_seqno = instance->global_seqno++;
@@ -2675,17 +2844,17 @@ static int orf_token_mcast (
 			message_item->mcast,
 			message_item->msg_len);
 
-		/*
-		 * Delete item from pending queue
-		 */
-		cs_queue_item_remove (mcast_queue);
-
 		/*
 		 * If messages mcasted, deliver any new messages to totempg
 		 */
 		instance->my_high_seq_received = token->seq;
 	}
 
+	/*
+	 * Delete sent items from pending queue
+	 */
+	cs_queue_items_remove (mcast_queue, fcc_mcast_current);
+
 	update_aru (instance);
 
 	/*
@@ -2788,42 +2957,45 @@ static int orf_token_rtr (
 		}
 
 		/*
-		 * Find if a message is missing from this processor
+		 * Skip to the next message missing from this processor
 		 */
-		res = sq_item_inuse (sort_queue, instance->my_aru + i);
-		if (res == 0) {
-			/*
-			 * Determine how many times we have missed receiving
-			 * this sequence number.  sq_item_miss_count increments
-			 * a counter for the sequence number.  The miss count
-			 * will be returned and compared.  This allows time for
-			 * delayed multicast messages to be received before
-			 * declaring the message is missing and requesting a
-			 * retransmit.
-			 */
-			res = sq_item_miss_count (sort_queue, instance->my_aru + i);
-			if (res < instance->totem_config->miss_count_const) {
-				continue;
-			}
+		i += sq_item_first_missing (sort_queue, instance->my_aru + i,
+			range - i + 1);
+		if (i > range || sq_in_range (sort_queue, instance->my_aru + i) == 0) {
+			break;
+		}
+
+		/*
+		 * Determine how many times we have missed receiving
+		 * this sequence number.  sq_item_miss_count increments
+		 * a counter for the sequence number.  The miss count
+		 * will be returned and compared.  This allows time for
+		 * delayed multicast messages to be received before
+		 * declaring the message is missing and requesting a
+		 * retransmit.
+		 */
+		res = sq_item_miss_count (sort_queue, instance->my_aru + i);
+		if (res < instance->totem_config->miss_count_const) {
+			continue;
+		}
 
+		/*
+		 * Determine if missing message is already in retransmit list
+		 */
+		found = 0;
+		for (j = 0; j < orf_token->rtr_list_entries; j++) {
+			if (instance->my_aru + i == rtr_list[j].seq) {
+				found = 1;
+			}
+		}
+		if (found == 0) {
 			/*
-			 * Determine if missing message is already in retransmit list
+			 * Missing message not found in current retransmit list so add it
 			 */
-			found = 0;
-			for (j = 0; j < orf_token->rtr_list_entries; j++) {
-				if (instance->my_aru + i == rtr_list[j].seq) {
-					found = 1;
-				}
-			}
-			if (found == 0) {
-				/*
-				 * Missing message not found in current retransmit list so add it
-				 */
-				memcpy (&rtr_list[orf_token->rtr_list_entries].ring_id,
-					&instance->my_ring_id, sizeof (struct memb_ring_id));
-				rtr_list[orf_token->rtr_list_entries].seq = instance->my_aru + i;
-				orf_token->rtr_list_entries++;
-			}
+			memcpy (&rtr_list[orf_token->rtr_list_entries].ring_id,
+				&instance->my_ring_id, sizeof (struct memb_ring_id));
+			rtr_list[orf_token->rtr_list_entries].seq = instance->my_aru + i;
+			orf_token->rtr_list_entries++;
 		}
 	}
 	return (instance->fcc_remcast_current);
@@ -3457,6 +3629,59 @@ static void token_callbacks_execute (
 /*
  * Flow control functions
  */
+
+/*
+ * Adaptive limit on the messages sent per token visit, used when
+ * totem.fcc_target_rotation is set.  The token rotation time is measured
+ * between consecutive visits and smoothed.  While the ring carries a
+ * backlog the limit grows by one message per rotation as long as the
+ * rotation stays under the target and no retransmits are requested, and
+ * is cut by a quarter otherwise.  Idle rotations are not taken into
+ * account since they are stretched by token hold rather than by load.
+ */
+static unsigned int fcc_adaptive_limit (
+	struct totemsrp_instance *instance,
+	struct orf_token *token)
+{
+	unsigned long long now;
+	unsigned int rotation;
+	unsigned int target;
+	unsigned int max_messages = instance->totem_config->max_messages;
+
+	if (instance->fcc_transmits_limit == 0 ||
+	    instance->fcc_transmits_limit > max_messages) {
+		instance->fcc_transmits_limit = max_messages;
+	}
+
+	now = qb_util_nano_current_get ();
+	if (instance->fcc_token_timestamp != 0 &&
+	    (token->backlog != 0 || instance->my_cbl != 0)) {
+		rotation = (now - instance->fcc_token_timestamp) / QB_TIME_NS_IN_USEC;
+		if (instance->fcc_rotation_avg == 0) {
+			instance->fcc_rotation_avg = rotation;
+		} else {
+			instance->fcc_rotation_avg =
+				(instance->fcc_rotation_avg * 7 + rotation) / 8;
+		}
+
+		target = instance->totem_config->fcc_target_rotation * 1000;
+		if (token->rtr_list_entries > 0 ||
+		    instance->fcc_rotation_avg > target) {
+			instance->fcc_transmits_limit -= instance->fcc_transmits_limit / 4;
+			if (instance->fcc_transmits_limit == 0) {
+				instance->fcc_transmits_limit = 1;
+			}
+		} else
+		if (instance->fcc_transmits_limit < max_messages) {
+			instance->fcc_transmits_limit++;
+		}
+	}
+	instance->fcc_token_timestamp = now;
+	instance->stats.fcc_transmits_limit = instance->fcc_transmits_limit;
+
+	return (instance->fcc_transmits_limit);
+}
+
 static unsigned int backlog_get (struct totemsrp_instance *instance)
 {
 	unsigned int backlog = 0;
@@ -3496,6 +3721,14 @@ static int fcc_calculate (
 
 	instance->my_cbl = backlog_get (instance);
 
+	if (instance->totem_config->fcc_target_rotation) {
+		unsigned int limit = fcc_adaptive_limit (instance, token);
+
+		if (transmits_allowed > limit) {
+			transmits_allowed = limit;
+		}
+	}
+
 	/*
 	 * Only do backlog calculation if there is a backlog otherwise
 	 * we would result in div by zero
@@ -4052,7 +4285,6 @@ static int message_handler_mcast (
 		/*
 		 * Allocate new multicast memory block
 		 */
-// TODO LEAK
 		sort_queue_item.mcast = totemsrp_buffer_alloc (instance);
 		if (sort_queue_item.mcast == NULL) {
 			return (-1); /* error here is corrected by the algorithm */
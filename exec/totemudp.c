@@ -63,6 +63,7 @@
 #include <corosync/swab.h>
 #include <qb/qbdefs.h>
 #include <qb/qbloop.h>
+#include <qb/qbutil.h>
 #define LOGSYS_UTILS_ONLY 1
 #include <corosync/logsys.h>
 #include "totemudp.h"
@@ -77,6 +78,31 @@
 #define NETIF_STATE_REPORT_UP		1
 #define NETIF_STATE_REPORT_DOWN		2
 
+/*
+ * Number of datagrams drained per wakeup and multicasts sent per syscall
+ * when the batched receive and send paths are available
+ */
+#define UDP_RECV_BATCH_MAX	16
+#define UDP_SEND_BATCH_MAX	TRANSMITS_ALLOWED
+#define UDP_SEND_BATCH_DATA_SIZE	FRAME_SIZE_MAX
+
+/*
+ * Own multicasts waiting for local delivery are stored as records of
+ * length followed by the frame. Ring has room for twice max_messages
+ * frames of net_mtu, enough for a full token hold plus membership
+ * messages sent before the loop job runs, but at least for one frame of
+ * FRAME_SIZE_MAX. It is resized when max_messages changes on reload.
+ */
+#define LOCAL_MCAST_LOOP_ALIGN(len)	(((len) + 7) & ~7)
+#define LOCAL_MCAST_LOOP_RECORD_SIZE(len)	\
+	LOCAL_MCAST_LOOP_ALIGN(sizeof (unsigned int) + (len))
+
+/*
+ * Number of frames received by receive thread which can wait for the main
+ * loop. Must be power of 2.
+ */
+#define RECV_THREAD_RING_SIZE	64
+
 #define BIND_STATE_UNBOUND	0
 #define BIND_STATE_REGULAR	1
 #define BIND_STATE_LOOPBACK	2
@@ -90,13 +116,12 @@ struct totemudp_socket {
 	int mcast_recv;
 	int mcast_send;
 	int token;
-	/*
-	 * Socket used for local multicast delivery. We don't rely on multicast
-	 * loop and rather this UNIX DGRAM socket is used. Socket is created by
-	 * socketpair call and they are used in same way as pipe (so [0] is read
-	 * end and [1] is write end)
-	 */
-	int local_mcast_loop[2];
+};
+
+struct totemudp_recv_slot {
+	unsigned int len;
+	struct sockaddr_storage from;
+	char buf[FRAME_SIZE_MAX];
 };
 
 struct totemudp_instance {
@@ -159,8 +184,124 @@ struct totemudp_instance {
 
 	struct iovec totemudp_iov_recv_flush;
 
+#ifdef HAVE_RECVMMSG
+	/*
+	 * UDP datagrams can't be larger than FRAME_SIZE_MAX so batch slots
+	 * don't need the full UDP_RECEIVE_FRAME_SIZE_MAX
+	 */
+	char recv_batch_buffer[UDP_RECV_BATCH_MAX][FRAME_SIZE_MAX];
+
+	struct iovec recv_batch_iov[UDP_RECV_BATCH_MAX];
+
+	struct mmsghdr recv_batch_msg[UDP_RECV_BATCH_MAX];
+
+	struct sockaddr_storage recv_batch_from[UDP_RECV_BATCH_MAX];
+
+	int recv_batch_count;
+
+	int recv_batch_next;
+#endif
+
+#ifdef HAVE_SENDMMSG
+	/*
+	 * Multicasts queued by mcast_noflush_send until the next flush.
+	 * Messages are copied, because totemsrp may free its buffers before
+	 * the flush (e.g. when entering operational state).
+	 */
+	struct iovec send_batch_iov[UDP_SEND_BATCH_MAX];
+
+	struct mmsghdr send_batch_msg[UDP_SEND_BATCH_MAX];
+
+	int send_batch_count;
+
+	char send_batch_data[UDP_SEND_BATCH_DATA_SIZE];
+
+	size_t send_batch_data_len;
+#endif
+
 	struct totemudp_socket totemudp_sockets;
 
+	/*
+	 * Own multicasts waiting for local delivery. We don't rely on multicast
+	 * loop, sent frames are copied here and delivered in send order from
+	 * a loop job. Offsets only grow, position in the buffer is
+	 * offset % local_mcast_loop_size. A record which doesn't fit before
+	 * the end of the buffer starts at its beginning and the rest is marked
+	 * by zero length. Records between head and next are being delivered,
+	 * between next and tail are waiting.
+	 */
+	char *local_mcast_loop_buffer;
+
+	size_t local_mcast_loop_size;
+
+	size_t local_mcast_loop_head;
+
+	size_t local_mcast_loop_next;
+
+	size_t local_mcast_loop_tail;
+
+	int local_mcast_loop_depth;
+
+	int local_mcast_loop_job_queued;
+
+	/* Size to resize the loop to once delivery finishes, 0 if none */
+	size_t local_mcast_loop_resize;
+
+	unsigned int local_mcast_loop_dropped;
+
+	uint64_t local_mcast_loop_drop_logged;
+
+	struct sockaddr_storage local_mcast_loop_from;
+
+	/*
+	 * When totem threads is set, multicast socket is read and frame
+	 * headers are checked by receive thread. Frames are passed to the main
+	 * loop in order through a single producer, single consumer ring and
+	 * the main loop is woken up by notify pipe. recv_ring_tail is written
+	 * only by the thread, recv_ring_head and recv_ring_next only by the
+	 * main loop. Slots between head and next are being delivered.
+	 * Flushes pause the thread (recv_thread_pause and recv_thread_paused
+	 * are protected by recv_thread_mutex) and read the socket from the
+	 * main loop. Stop pipe wakes the thread up for both stop and pause.
+	 */
+	int recv_thread_running;
+
+	pthread_t recv_thread;
+
+	int recv_thread_fd;
+
+	int recv_thread_notify_pipe[2];
+
+	int recv_thread_stop_pipe[2];
+
+	int recv_thread_stop;
+
+	int recv_thread_notify_pending;
+
+	int recv_thread_waiting;
+
+	int recv_thread_pause;
+
+	int recv_thread_paused;
+
+	int recv_thread_pause_depth;
+
+	unsigned int recv_thread_dropped;
+
+	pthread_mutex_t recv_thread_mutex;
+
+	pthread_cond_t recv_thread_cond;
+
+	struct totemudp_recv_slot *recv_ring;
+
+	unsigned int recv_ring_head;
+
+	unsigned int recv_ring_next;
+
+	unsigned int recv_ring_tail;
+
+	int recv_ring_depth;
+
 	struct totem_ip_address mcast_address;
 
 	int stats_sent;
@@ -205,10 +346,17 @@ static int totemudp_build_sockets (
 	struct totemudp_socket *sockets,
 	struct totem_ip_address *bound_to);
 
+static void recv_thread_stop (
+	struct totemudp_instance *instance);
+
 static struct totem_ip_address localhost;
 
 static void totemudp_instance_initialize (struct totemudp_instance *instance)
 {
+#ifdef HAVE_RECVMMSG
+	int i;
+
+#endif
 	memset (instance, 0, sizeof (struct totemudp_instance));
 
 	instance->netif_state_report = NETIF_STATE_REPORT_UP | NETIF_STATE_REPORT_DOWN;
@@ -220,6 +368,15 @@ static void totemudp_instance_initialize (struct totemudp_instance *instance)
 
 	instance->totemudp_iov_recv_flush.iov_len = UDP_RECEIVE_FRAME_SIZE_MAX; //sizeof (instance->iov_buffer);
 
+#ifdef HAVE_RECVMMSG
+	for (i = 0; i < UDP_RECV_BATCH_MAX; i++) {
+		instance->recv_batch_iov[i].iov_base = instance->recv_batch_buffer[i];
+		instance->recv_batch_msg[i].msg_hdr.msg_name = &instance->recv_batch_from[i];
+		instance->recv_batch_msg[i].msg_hdr.msg_iov = &instance->recv_batch_iov[i];
+		instance->recv_batch_msg[i].msg_hdr.msg_iovlen = 1;
+	}
+#endif
+
 	/*
 	 * There is always atleast 1 processor
 	 */
@@ -310,6 +467,196 @@ static inline void ucast_sendmsg (
 	}
 }
 
+/*
+ * Size of local mcast loop for given configuration
+ */
+static size_t local_mcast_loop_size_get (const struct totem_config *totem_config)
+{
+	size_t size;
+
+	size = 2 * totem_config->max_messages *
+		LOCAL_MCAST_LOOP_RECORD_SIZE(totem_config->net_mtu);
+	if (size < LOCAL_MCAST_LOOP_RECORD_SIZE(FRAME_SIZE_MAX)) {
+		size = LOCAL_MCAST_LOOP_RECORD_SIZE(FRAME_SIZE_MAX);
+	}
+
+	return (size);
+}
+
+/*
+ * Move waiting records to a new buffer of given size. While records are
+ * being delivered the buffer can't move, so it's done when the outermost
+ * delivery finishes. Records which don't fit are dropped, totemsrp
+ * recovers them.
+ */
+static int local_mcast_loop_resize (
+	struct totemudp_instance *instance,
+	size_t size)
+{
+	char *buffer;
+	size_t pos;
+	size_t tail = 0;
+	unsigned int len;
+	unsigned int dropped = 0;
+
+	if (instance->local_mcast_loop_depth > 0) {
+		instance->local_mcast_loop_resize = size;
+		return (0);
+	}
+	instance->local_mcast_loop_resize = 0;
+
+	if (size == instance->local_mcast_loop_size) {
+		return (0);
+	}
+
+	buffer = malloc (size);
+	if (buffer == NULL) {
+		return (-1);
+	}
+
+	while (instance->local_mcast_loop_next != instance->local_mcast_loop_tail) {
+		pos = instance->local_mcast_loop_next % instance->local_mcast_loop_size;
+		memcpy (&len, instance->local_mcast_loop_buffer + pos, sizeof (len));
+		if (len == 0) {
+			instance->local_mcast_loop_next += instance->local_mcast_loop_size - pos;
+			continue;
+		}
+		instance->local_mcast_loop_next += LOCAL_MCAST_LOOP_RECORD_SIZE(len);
+
+		if (tail + LOCAL_MCAST_LOOP_RECORD_SIZE(len) > size) {
+			dropped++;
+			continue;
+		}
+		memcpy (buffer + tail, instance->local_mcast_loop_buffer + pos,
+			LOCAL_MCAST_LOOP_RECORD_SIZE(len));
+		tail += LOCAL_MCAST_LOOP_RECORD_SIZE(len);
+	}
+
+	free (instance->local_mcast_loop_buffer);
+	instance->local_mcast_loop_buffer = buffer;
+	instance->local_mcast_loop_size = size;
+	instance->local_mcast_loop_head = instance->local_mcast_loop_next = 0;
+	instance->local_mcast_loop_tail = tail;
+
+	if (dropped) {
+		log_printf (instance->totemudp_log_level_warning,
+			"local mcast loop resized to %zu bytes, dropped %u messages",
+			size, dropped);
+	}
+
+	return (0);
+}
+
+/*
+ * Deliver own multicasts waiting in local loop. Delivering a message may
+ * send new multicasts or call totemudp_recv_flush, so slots are only
+ * released when the outermost call finishes.
+ */
+static void local_mcast_loop_deliver_pending (
+	struct totemudp_instance *instance)
+{
+	size_t pos;
+	unsigned int len;
+
+	instance->local_mcast_loop_depth++;
+	while (instance->local_mcast_loop_next != instance->local_mcast_loop_tail) {
+		pos = instance->local_mcast_loop_next % instance->local_mcast_loop_size;
+		memcpy (&len, instance->local_mcast_loop_buffer + pos, sizeof (len));
+		if (len == 0) {
+			instance->local_mcast_loop_next += instance->local_mcast_loop_size - pos;
+			continue;
+		}
+		instance->local_mcast_loop_next += LOCAL_MCAST_LOOP_RECORD_SIZE(len);
+
+		instance->stats_recv += len;
+		instance->totemudp_deliver_fn (
+			instance->context,
+			instance->local_mcast_loop_buffer + pos + sizeof (len),
+			len,
+			&instance->local_mcast_loop_from);
+	}
+	instance->local_mcast_loop_depth--;
+
+	if (instance->local_mcast_loop_depth == 0) {
+		instance->local_mcast_loop_head = instance->local_mcast_loop_next;
+		if (instance->local_mcast_loop_resize != 0 &&
+		    local_mcast_loop_resize (instance, instance->local_mcast_loop_resize) != 0) {
+			log_printf (instance->totemudp_log_level_error,
+				"Can't resize local mcast loop, keeping %zu bytes",
+				instance->local_mcast_loop_size);
+		}
+	}
+}
+
+static void local_mcast_loop_job_fn (void *data)
+{
+	struct totemudp_instance *instance = (struct totemudp_instance *)data;
+
+	instance->local_mcast_loop_job_queued = 0;
+	local_mcast_loop_deliver_pending (instance);
+}
+
+/*
+ * Queue own multicast for local delivery on next loop iteration
+ * A message dropped here is recovered by totemsrp
+ */
+static void local_mcast_loop_queue (
+	struct totemudp_instance *instance,
+	const void *msg,
+	unsigned int msg_len)
+{
+	size_t pos;
+	size_t record_size;
+	size_t wrap = 0;
+	uint64_t now;
+
+	record_size = LOCAL_MCAST_LOOP_RECORD_SIZE(msg_len);
+	pos = instance->local_mcast_loop_tail % instance->local_mcast_loop_size;
+	/*
+	 * Empty loop starts again at the beginning of the buffer, so any
+	 * record up to the size of the loop fits
+	 */
+	if (instance->local_mcast_loop_head == instance->local_mcast_loop_tail && pos != 0) {
+		instance->local_mcast_loop_tail += instance->local_mcast_loop_size - pos;
+		instance->local_mcast_loop_head = instance->local_mcast_loop_tail;
+		instance->local_mcast_loop_next = instance->local_mcast_loop_tail;
+		pos = 0;
+	}
+	if (pos + record_size > instance->local_mcast_loop_size) {
+		wrap = instance->local_mcast_loop_size - pos;
+	}
+
+	if (msg_len == 0 ||
+	    instance->local_mcast_loop_tail + wrap + record_size - instance->local_mcast_loop_head >
+	    instance->local_mcast_loop_size) {
+		instance->local_mcast_loop_dropped++;
+		now = qb_util_nano_current_get ();
+		if (now - instance->local_mcast_loop_drop_logged >= QB_TIME_NS_IN_SEC) {
+			log_printf (instance->totemudp_log_level_warning,
+				"local mcast loop is full, dropped %u messages",
+				instance->local_mcast_loop_dropped);
+			instance->local_mcast_loop_dropped = 0;
+			instance->local_mcast_loop_drop_logged = now;
+		}
+		return;
+	}
+
+	if (wrap > 0) {
+		memset (instance->local_mcast_loop_buffer + pos, 0, sizeof (unsigned int));
+		instance->local_mcast_loop_tail += wrap;
+		pos = 0;
+	}
+	memcpy (instance->local_mcast_loop_buffer + pos, &msg_len, sizeof (msg_len));
+	memcpy (instance->local_mcast_loop_buffer + pos + sizeof (msg_len), msg, msg_len);
+	instance->local_mcast_loop_tail += record_size;
+
+	if (!instance->local_mcast_loop_job_queued &&
+	    qb_loop_job_add (instance->totemudp_poll_handle, QB_LOOP_MED,
+	    instance, local_mcast_loop_job_fn) == 0) {
+		instance->local_mcast_loop_job_queued = 1;
+	}
+}
+
 static inline void mcast_sendmsg (
 	struct totemudp_instance *instance,
 	const void *msg,
@@ -364,21 +711,84 @@ static inline void mcast_sendmsg (
 		instance->stats->continuous_sendmsg_failures = 0;
 	}
 
+	local_mcast_loop_queue (instance, msg, msg_len);
+}
+
+#ifdef HAVE_SENDMMSG
+/*
+ * Send all queued multicasts with one sendmmsg per socket
+ */
+static void mcast_sendmmsg_flush (
+	struct totemudp_instance *instance)
+{
+	struct sockaddr_storage sockaddr;
+	int addrlen;
+	int sent;
+	int res;
+	int i;
+
+	if (instance->send_batch_count == 0) {
+		return;
+	}
+
+	totemip_totemip_to_sockaddr_convert(&instance->mcast_address,
+		instance->totem_interface->ip_port, &sockaddr, &addrlen);
+	memset (instance->send_batch_msg, 0,
+		sizeof (struct mmsghdr) * instance->send_batch_count);
+	for (i = 0; i < instance->send_batch_count; i++) {
+		instance->send_batch_msg[i].msg_hdr.msg_name = &sockaddr;
+		instance->send_batch_msg[i].msg_hdr.msg_namelen = addrlen;
+		instance->send_batch_msg[i].msg_hdr.msg_iov = &instance->send_batch_iov[i];
+		instance->send_batch_msg[i].msg_hdr.msg_iovlen = 1;
+	}
+
 	/*
-	 * Transmit multicast message to local unix mcast loop
+	 * Transmit multicast messages
 	 * An error here is recovered by totemsrp
 	 */
-	msg_mcast.msg_name = NULL;
-	msg_mcast.msg_namelen = 0;
+	for (sent = 0; sent < instance->send_batch_count; sent += res) {
+		res = sendmmsg (instance->totemudp_sockets.mcast_send,
+			&instance->send_batch_msg[sent], instance->send_batch_count - sent,
+			MSG_NOSIGNAL);
+		if (res < 0) {
+			LOGSYS_PERROR (errno, instance->totemudp_log_level_debug,
+				"sendmmsg(mcast) failed (non-critical)");
+			instance->stats->continuous_sendmsg_failures++;
+			break;
+		}
+		instance->stats->continuous_sendmsg_failures = 0;
+	}
 
-	res = sendmsg (instance->totemudp_sockets.local_mcast_loop[1], &msg_mcast,
-		MSG_NOSIGNAL);
-	if (res < 0) {
-		LOGSYS_PERROR (errno, instance->totemudp_log_level_debug,
-			"sendmsg(local mcast loop) failed (non-critical)");
+	for (i = 0; i < instance->send_batch_count; i++) {
+		local_mcast_loop_queue (instance, instance->send_batch_iov[i].iov_base,
+			instance->send_batch_iov[i].iov_len);
 	}
+
+	instance->send_batch_count = 0;
+	instance->send_batch_data_len = 0;
 }
 
+static inline void mcast_sendmmsg_queue (
+	struct totemudp_instance *instance,
+	const void *msg,
+	unsigned int msg_len)
+{
+	char *data;
+
+	if (instance->send_batch_count == UDP_SEND_BATCH_MAX ||
+	    instance->send_batch_data_len + msg_len > UDP_SEND_BATCH_DATA_SIZE) {
+		mcast_sendmmsg_flush (instance);
+	}
+
+	data = instance->send_batch_data + instance->send_batch_data_len;
+	memcpy (data, msg, msg_len);
+	instance->send_batch_data_len += msg_len;
+
+	instance->send_batch_iov[instance->send_batch_count].iov_base = data;
+	instance->send_batch_iov[instance->send_batch_count].iov_len = msg_len;
+	instance->send_batch_count++;
+}
+#endif
 
 int totemudp_finalize (
 	void *udp_context)
@@ -387,28 +797,108 @@ int totemudp_finalize (
 	int res = 0;
 
 	if (instance->totemudp_sockets.mcast_recv > 0) {
-	 	qb_loop_poll_del (instance->totemudp_poll_handle,
-			instance->totemudp_sockets.mcast_recv);
+		if (instance->recv_thread_running) {
+			recv_thread_stop (instance);
+		} else {
+		 	qb_loop_poll_del (instance->totemudp_poll_handle,
+				instance->totemudp_sockets.mcast_recv);
+		}
 		close (instance->totemudp_sockets.mcast_recv);
 	}
 	if (instance->totemudp_sockets.mcast_send > 0) {
 		close (instance->totemudp_sockets.mcast_send);
 	}
-	if (instance->totemudp_sockets.local_mcast_loop[0] > 0) {
-		qb_loop_poll_del (instance->totemudp_poll_handle,
-			instance->totemudp_sockets.local_mcast_loop[0]);
-		close (instance->totemudp_sockets.local_mcast_loop[0]);
-		close (instance->totemudp_sockets.local_mcast_loop[1]);
-	}
 	if (instance->totemudp_sockets.token > 0) {
 		qb_loop_poll_del (instance->totemudp_poll_handle,
 			instance->totemudp_sockets.token);
 		close (instance->totemudp_sockets.token);
 	}
+	if (instance->local_mcast_loop_job_queued) {
+		qb_loop_job_del (instance->totemudp_poll_handle, QB_LOOP_MED,
+			instance, local_mcast_loop_job_fn);
+		instance->local_mcast_loop_job_queued = 0;
+	}
+	free (instance->local_mcast_loop_buffer);
+	instance->local_mcast_loop_buffer = NULL;
+	free (instance->recv_ring);
+	instance->recv_ring = NULL;
+
+	pthread_mutex_destroy (&instance->recv_thread_mutex);
+	pthread_cond_destroy (&instance->recv_thread_cond);
 
 	return (res);
 }
 
+#ifdef HAVE_RECVMMSG
+/*
+ * Deliver datagrams received by the last recvmmsg which haven't been
+ * delivered yet.  Position is kept in the instance because delivering a
+ * message may call totemudp_recv_flush, which finishes the batch first.
+ */
+static void net_deliver_batch_pending (
+	struct totemudp_instance *instance)
+{
+	struct mmsghdr *msg;
+	int i;
+
+	while (instance->recv_batch_next < instance->recv_batch_count) {
+		i = instance->recv_batch_next++;
+		msg = &instance->recv_batch_msg[i];
+
+		if (msg->msg_hdr.msg_flags & MSG_TRUNC) {
+			log_printf (instance->totemudp_log_level_error,
+				"Received too big message. This may be because something bad is happening"
+				"on the network (attack?). Dropping packet.");
+			continue;
+		}
+
+		/*
+		 * Handle incoming message
+		 */
+		instance->totemudp_deliver_fn (
+			instance->context,
+			instance->recv_batch_buffer[i],
+			msg->msg_len,
+			&instance->recv_batch_from[i]);
+	}
+}
+
+static int net_deliver_batch_fn (
+	int fd,
+	struct totemudp_instance *instance)
+{
+	int res;
+	int i;
+
+	for (i = 0; i < UDP_RECV_BATCH_MAX; i++) {
+		instance->recv_batch_iov[i].iov_len = FRAME_SIZE_MAX;
+		instance->recv_batch_msg[i].msg_hdr.msg_namelen = sizeof (struct sockaddr_storage);
+		instance->recv_batch_msg[i].msg_hdr.msg_control = 0;
+		instance->recv_batch_msg[i].msg_hdr.msg_controllen = 0;
+		instance->recv_batch_msg[i].msg_hdr.msg_flags = 0;
+	}
+
+	/*
+	 * Receive datagrams
+	 */
+	res = recvmmsg (fd, instance->recv_batch_msg, UDP_RECV_BATCH_MAX,
+		MSG_NOSIGNAL | MSG_DONTWAIT, NULL);
+	if (res == -1) {
+		return (0);
+	}
+	for (i = 0; i < res; i++) {
+		instance->stats_recv += instance->recv_batch_msg[i].msg_len;
+	}
+
+	instance->recv_batch_count = res;
+	instance->recv_batch_next = 0;
+	net_deliver_batch_pending (instance);
+	instance->recv_batch_count = 0;
+
+	return (0);
+}
+#endif
+
 /*
  * Only designed to work with a message with one iov
  */
@@ -425,6 +915,16 @@ static int net_deliver_fn (
 	int bytes_received;
 	int truncated_packet;
 
+#ifdef HAVE_RECVMMSG
+	/*
+	 * Drain multicast sockets in batches.  The token socket and
+	 * totemudp_recv_flush keep reading one datagram at a time.
+	 */
+	if (instance->flushing == 0 && fd != instance->totemudp_sockets.token) {
+		return (net_deliver_batch_fn (fd, instance));
+	}
+#endif
+
 	if (instance->flushing == 1) {
 		iovec = &instance->totemudp_iov_recv_flush;
 	} else {
@@ -501,6 +1001,422 @@ static int net_deliver_fn (
 	return (0);
 }
 
+/*
+ * Same checks as totemsrp does, so invalid frames don't reach the main loop
+ */
+static int recv_thread_frame_valid (
+	const void *msg,
+	unsigned int msg_len)
+{
+	const struct totem_message_header *message_header = msg;
+
+	if (msg_len < sizeof (struct totem_message_header)) {
+		return (0);
+	}
+
+	if (message_header->magic != TOTEM_MH_MAGIC &&
+	    message_header->magic != swab16(TOTEM_MH_MAGIC)) {
+		return (0);
+	}
+
+	if (message_header->version != TOTEM_MH_VERSION) {
+		return (0);
+	}
+
+	return (1);
+}
+
+/*
+ * Wait until main loop frees a slot of ring or thread is stopped
+ */
+static void recv_thread_wait_for_slot (
+	struct totemudp_instance *instance,
+	unsigned int tail)
+{
+
+	pthread_mutex_lock (&instance->recv_thread_mutex);
+	__atomic_store_n (&instance->recv_thread_waiting, 1, __ATOMIC_SEQ_CST);
+	while (tail - __atomic_load_n (&instance->recv_ring_head, __ATOMIC_SEQ_CST) == RECV_THREAD_RING_SIZE &&
+	    !instance->recv_thread_pause &&
+	    !__atomic_load_n (&instance->recv_thread_stop, __ATOMIC_SEQ_CST)) {
+		pthread_cond_wait (&instance->recv_thread_cond, &instance->recv_thread_mutex);
+	}
+	__atomic_store_n (&instance->recv_thread_waiting, 0, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock (&instance->recv_thread_mutex);
+}
+
+/*
+ * Tell the main loop the socket is not read anymore and wait until it
+ * lets the thread continue
+ */
+static void recv_thread_pause_wait (
+	struct totemudp_instance *instance)
+{
+
+	pthread_mutex_lock (&instance->recv_thread_mutex);
+	instance->recv_thread_paused = 1;
+	pthread_cond_broadcast (&instance->recv_thread_cond);
+	while (instance->recv_thread_pause &&
+	    !__atomic_load_n (&instance->recv_thread_stop, __ATOMIC_SEQ_CST)) {
+		pthread_cond_wait (&instance->recv_thread_cond, &instance->recv_thread_mutex);
+	}
+	instance->recv_thread_paused = 0;
+	pthread_mutex_unlock (&instance->recv_thread_mutex);
+}
+
+static void *recv_thread_fn (void *data)
+{
+	struct totemudp_instance *instance = (struct totemudp_instance *)data;
+	struct totemudp_recv_slot *slot;
+	struct pollfd ufds[2];
+	struct msghdr msg_recv;
+	struct iovec iovec;
+	unsigned int tail;
+	ssize_t bytes_received;
+	char notify = 0;
+	char buf[64];
+
+	ufds[0].fd = instance->recv_thread_fd;
+	ufds[0].events = POLLIN;
+	ufds[1].fd = instance->recv_thread_stop_pipe[0];
+	ufds[1].events = POLLIN;
+
+	tail = instance->recv_ring_tail;
+
+	while (!__atomic_load_n (&instance->recv_thread_stop, __ATOMIC_ACQUIRE)) {
+		if (__atomic_load_n (&instance->recv_thread_pause, __ATOMIC_ACQUIRE)) {
+			recv_thread_pause_wait (instance);
+			continue;
+		}
+
+		if (tail - __atomic_load_n (&instance->recv_ring_head, __ATOMIC_ACQUIRE) == RECV_THREAD_RING_SIZE) {
+			recv_thread_wait_for_slot (instance, tail);
+			continue;
+		}
+
+		if (poll (ufds, 2, -1) <= 0) {
+			continue;
+		}
+		if (ufds[1].revents & POLLIN) {
+			while (read (ufds[1].fd, buf, sizeof (buf)) > 0) {
+				;
+			}
+			continue;
+		}
+
+		/*
+		 * Read everything the socket has, as long as there is space
+		 */
+		while (tail - __atomic_load_n (&instance->recv_ring_head, __ATOMIC_ACQUIRE) < RECV_THREAD_RING_SIZE &&
+		    !__atomic_load_n (&instance->recv_thread_pause, __ATOMIC_ACQUIRE)) {
+			slot = &instance->recv_ring[tail % RECV_THREAD_RING_SIZE];
+
+			iovec.iov_base = slot->buf;
+			iovec.iov_len = FRAME_SIZE_MAX;
+			memset (&msg_recv, 0, sizeof (msg_recv));
+			msg_recv.msg_name = &slot->from;
+			msg_recv.msg_namelen = sizeof (struct sockaddr_storage);
+			msg_recv.msg_iov = &iovec;
+			msg_recv.msg_iovlen = 1;
+
+			bytes_received = recvmsg (instance->recv_thread_fd, &msg_recv,
+				MSG_NOSIGNAL | MSG_DONTWAIT);
+			if (bytes_received == -1) {
+				break;
+			}
+
+#ifdef HAVE_MSGHDR_FLAGS
+			if (msg_recv.msg_flags & MSG_TRUNC) {
+				bytes_received = 0;
+			}
+#endif
+			if (!recv_thread_frame_valid (slot->buf, bytes_received)) {
+				__atomic_add_fetch (&instance->recv_thread_dropped, 1, __ATOMIC_RELAXED);
+				continue;
+			}
+			slot->len = bytes_received;
+
+			tail++;
+			__atomic_store_n (&instance->recv_ring_tail, tail, __ATOMIC_SEQ_CST);
+
+			/*
+			 * Only one wake up is needed until main loop handles it
+			 */
+			if (!__atomic_exchange_n (&instance->recv_thread_notify_pending, 1, __ATOMIC_SEQ_CST)) {
+				if (write (instance->recv_thread_notify_pipe[1], &notify, 1) == -1) {
+					__atomic_store_n (&instance->recv_thread_notify_pending, 0, __ATOMIC_SEQ_CST);
+				}
+			}
+		}
+	}
+
+	return (NULL);
+}
+
+/*
+ * Let the thread reuse slots delivered by the main loop
+ */
+static void recv_thread_ring_release (
+	struct totemudp_instance *instance)
+{
+
+	__atomic_store_n (&instance->recv_ring_head, instance->recv_ring_next, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n (&instance->recv_thread_waiting, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock (&instance->recv_thread_mutex);
+		pthread_cond_broadcast (&instance->recv_thread_cond);
+		pthread_mutex_unlock (&instance->recv_thread_mutex);
+	}
+}
+
+/*
+ * Stop receive thread from reading the socket, so the main loop can read
+ * it directly. Calls may nest, thread continues after the outermost
+ * recv_thread_resume.
+ */
+static void recv_thread_pause (
+	struct totemudp_instance *instance)
+{
+	char wake = 0;
+
+	if (instance->recv_thread_pause_depth++ > 0) {
+		return;
+	}
+
+	pthread_mutex_lock (&instance->recv_thread_mutex);
+	__atomic_store_n (&instance->recv_thread_pause, 1, __ATOMIC_SEQ_CST);
+	pthread_cond_broadcast (&instance->recv_thread_cond);
+	if (write (instance->recv_thread_stop_pipe[1], &wake, 1) == -1) {
+		/*
+		 * Pipe is only full if thread wasn't woken up yet
+		 */
+	}
+	while (!instance->recv_thread_paused) {
+		pthread_cond_wait (&instance->recv_thread_cond, &instance->recv_thread_mutex);
+	}
+	pthread_mutex_unlock (&instance->recv_thread_mutex);
+}
+
+static void recv_thread_resume (
+	struct totemudp_instance *instance)
+{
+
+	if (--instance->recv_thread_pause_depth > 0) {
+		return;
+	}
+
+	pthread_mutex_lock (&instance->recv_thread_mutex);
+	__atomic_store_n (&instance->recv_thread_pause, 0, __ATOMIC_SEQ_CST);
+	pthread_cond_broadcast (&instance->recv_thread_cond);
+	pthread_mutex_unlock (&instance->recv_thread_mutex);
+}
+
+/*
+ * Deliver frames received by receive thread. Delivering a message may call
+ * totemudp_recv_flush, so slots are only released when the outermost call
+ * finishes.
+ */
+static void recv_thread_deliver_pending (
+	struct totemudp_instance *instance)
+{
+	struct totemudp_recv_slot *slot;
+	unsigned int dropped;
+	unsigned int tail;
+
+	dropped = __atomic_exchange_n (&instance->recv_thread_dropped, 0, __ATOMIC_RELAXED);
+	if (dropped) {
+		log_printf (instance->totemudp_log_level_security,
+			"Receive thread dropped %u invalid or too big messages", dropped);
+	}
+
+	/*
+	 * Nested discard or deliver moves recv_ring_next forward, possibly
+	 * past the tail read before, so tail is read again for every frame
+	 * and compared as a signed distance
+	 */
+	instance->recv_ring_depth++;
+	while (1) {
+		tail = __atomic_load_n (&instance->recv_ring_tail, __ATOMIC_SEQ_CST);
+		if ((int)(tail - instance->recv_ring_next) <= 0) {
+			break;
+		}
+		slot = &instance->recv_ring[instance->recv_ring_next++ % RECV_THREAD_RING_SIZE];
+
+		instance->stats_recv += slot->len;
+		instance->totemudp_deliver_fn (
+			instance->context,
+			slot->buf,
+			slot->len,
+			&slot->from);
+	}
+	instance->recv_ring_depth--;
+
+	if (instance->recv_ring_depth == 0) {
+		recv_thread_ring_release (instance);
+	}
+}
+
+static int recv_thread_notify_fn (
+	int fd,
+	int revents,
+	void *data)
+{
+	struct totemudp_instance *instance = (struct totemudp_instance *)data;
+	char buf[64];
+
+	while (read (fd, buf, sizeof (buf)) > 0) {
+		;
+	}
+	__atomic_store_n (&instance->recv_thread_notify_pending, 0, __ATOMIC_SEQ_CST);
+
+	recv_thread_deliver_pending (instance);
+
+	return (0);
+}
+
+/*
+ * Drop frames received by receive thread. Returns 1 if there were any.
+ */
+static int recv_thread_discard_pending (
+	struct totemudp_instance *instance)
+{
+	unsigned int tail;
+
+	tail = __atomic_load_n (&instance->recv_ring_tail, __ATOMIC_SEQ_CST);
+	if ((int)(tail - instance->recv_ring_next) <= 0) {
+		return (0);
+	}
+
+	instance->recv_ring_next = tail;
+	if (instance->recv_ring_depth == 0) {
+		recv_thread_ring_release (instance);
+	}
+
+	return (1);
+}
+
+static int recv_thread_pipe_create (
+	struct totemudp_instance *instance,
+	int fds[2])
+{
+	int i;
+
+	if (pipe (fds) == -1) {
+		LOGSYS_PERROR (errno, instance->totemudp_log_level_warning,
+			"pipe() failed");
+		return (-1);
+	}
+
+	for (i = 0; i < 2; i++) {
+		if (fcntl (fds[i], F_SETFL, O_NONBLOCK) == -1 ||
+		    fcntl (fds[i], F_SETFD, FD_CLOEXEC) == -1) {
+			LOGSYS_PERROR (errno, instance->totemudp_log_level_warning,
+				"Could not set non-blocking operation on receive thread pipe");
+			close (fds[0]);
+			close (fds[1]);
+			return (-1);
+		}
+	}
+
+	return (0);
+}
+
+/*
+ * Start receive thread reading fd. Returns -1 if it can't be started, and
+ * the socket has to be read by the main loop.
+ */
+static int recv_thread_start (
+	struct totemudp_instance *instance,
+	int fd)
+{
+	int res;
+
+	if (instance->recv_ring == NULL) {
+		instance->recv_ring = malloc (sizeof (struct totemudp_recv_slot) * RECV_THREAD_RING_SIZE);
+		if (instance->recv_ring == NULL) {
+			log_printf (instance->totemudp_log_level_warning,
+				"Unable to allocate receive thread ring");
+			return (-1);
+		}
+	}
+
+	if (recv_thread_pipe_create (instance, instance->recv_thread_notify_pipe) == -1) {
+		return (-1);
+	}
+	if (recv_thread_pipe_create (instance, instance->recv_thread_stop_pipe) == -1) {
+		goto error_close_notify;
+	}
+
+	instance->recv_thread_fd = fd;
+	instance->recv_thread_stop = 0;
+	instance->recv_thread_notify_pending = 0;
+	instance->recv_thread_waiting = 0;
+	instance->recv_thread_pause = 0;
+	instance->recv_thread_paused = 0;
+	instance->recv_thread_pause_depth = 0;
+	instance->recv_ring_head = instance->recv_ring_next = instance->recv_ring_tail = 0;
+
+	res = pthread_create (&instance->recv_thread, NULL, recv_thread_fn, instance);
+	if (res != 0) {
+		LOGSYS_PERROR (res, instance->totemudp_log_level_warning,
+			"Unable to start receive thread");
+		goto error_close_stop;
+	}
+
+	qb_loop_poll_add (
+		instance->totemudp_poll_handle,
+		QB_LOOP_MED,
+		instance->recv_thread_notify_pipe[0],
+		POLLIN, instance, recv_thread_notify_fn);
+
+	instance->recv_thread_running = 1;
+
+	return (0);
+
+error_close_stop:
+	close (instance->recv_thread_stop_pipe[0]);
+	close (instance->recv_thread_stop_pipe[1]);
+error_close_notify:
+	close (instance->recv_thread_notify_pipe[0]);
+	close (instance->recv_thread_notify_pipe[1]);
+	return (-1);
+}
+
+/*
+ * Stop receive thread before its socket is closed. Frames which were not
+ * delivered yet are dropped, same as those left in a closed socket.
+ */
+static void recv_thread_stop (
+	struct totemudp_instance *instance)
+{
+	char stop = 0;
+
+	if (!instance->recv_thread_running) {
+		return;
+	}
+
+	__atomic_store_n (&instance->recv_thread_stop, 1, __ATOMIC_SEQ_CST);
+	if (write (instance->recv_thread_stop_pipe[1], &stop, 1) == -1) {
+		/*
+		 * Pipe is only full if stop was already written
+		 */
+	}
+	pthread_mutex_lock (&instance->recv_thread_mutex);
+	pthread_cond_broadcast (&instance->recv_thread_cond);
+	pthread_mutex_unlock (&instance->recv_thread_mutex);
+
+	pthread_join (instance->recv_thread, NULL);
+
+	qb_loop_poll_del (instance->totemudp_poll_handle,
+		instance->recv_thread_notify_pipe[0]);
+	close (instance->recv_thread_notify_pipe[0]);
+	close (instance->recv_thread_notify_pipe[1]);
+	close (instance->recv_thread_stop_pipe[0]);
+	close (instance->recv_thread_stop_pipe[1]);
+
+	instance->recv_ring_head = instance->recv_ring_next = instance->recv_ring_tail = 0;
+	instance->recv_thread_running = 0;
+}
+
 static int netif_determine (
 	struct totemudp_instance *instance,
 	struct totem_ip_address *bindnet,
@@ -530,6 +1446,7 @@ static void timer_function_netif_check_timeout (
 	int interface_up;
 	int interface_num;
 	struct totem_ip_address *bind_address;
+	int addrlen;
 
 	/*
 	 * Build sockets for every interface
@@ -563,19 +1480,17 @@ static void timer_function_netif_check_timeout (
 	}
 
 	if (instance->totemudp_sockets.mcast_recv > 0) {
-	 	qb_loop_poll_del (instance->totemudp_poll_handle,
-			instance->totemudp_sockets.mcast_recv);
+		if (instance->recv_thread_running) {
+			recv_thread_stop (instance);
+		} else {
+		 	qb_loop_poll_del (instance->totemudp_poll_handle,
+				instance->totemudp_sockets.mcast_recv);
+		}
 		close (instance->totemudp_sockets.mcast_recv);
 	}
 	if (instance->totemudp_sockets.mcast_send > 0) {
 		close (instance->totemudp_sockets.mcast_send);
 	}
-	if (instance->totemudp_sockets.local_mcast_loop[0] > 0) {
-		qb_loop_poll_del (instance->totemudp_poll_handle,
-			instance->totemudp_sockets.local_mcast_loop[0]);
-		close (instance->totemudp_sockets.local_mcast_loop[0]);
-		close (instance->totemudp_sockets.local_mcast_loop[1]);
-	}
 	if (instance->totemudp_sockets.token > 0) {
 		qb_loop_poll_del (instance->totemudp_poll_handle,
 			instance->totemudp_sockets.token);
@@ -614,17 +1529,14 @@ static void timer_function_netif_check_timeout (
 		&instance->totemudp_sockets,
 		&instance->totem_interface->boundto);
 
-	qb_loop_poll_add (
-		instance->totemudp_poll_handle,
-		QB_LOOP_MED,
-		instance->totemudp_sockets.mcast_recv,
-		POLLIN, instance, net_deliver_fn);
-
-	qb_loop_poll_add (
-		instance->totemudp_poll_handle,
-		QB_LOOP_MED,
-		instance->totemudp_sockets.local_mcast_loop[0],
-		POLLIN, instance, net_deliver_fn);
+	if (instance->totem_config->threads == 0 ||
+	    recv_thread_start (instance, instance->totemudp_sockets.mcast_recv) == -1) {
+		qb_loop_poll_add (
+			instance->totemudp_poll_handle,
+			QB_LOOP_MED,
+			instance->totemudp_sockets.mcast_recv,
+			POLLIN, instance, net_deliver_fn);
+	}
 
 	qb_loop_poll_add (
 		instance->totemudp_poll_handle,
@@ -633,6 +1545,8 @@ static void timer_function_netif_check_timeout (
 		POLLIN, instance, net_deliver_fn);
 
 	totemip_copy (&instance->my_id, &instance->totem_interface->boundto);
+	totemip_totemip_to_sockaddr_convert(&instance->my_id,
+		instance->totem_interface->ip_port, &instance->local_mcast_loop_from, &addrlen);
 
 	/*
 	 * This reports changes in the interface to the user and totemsrp
@@ -704,7 +1618,6 @@ static int totemudp_build_sockets_ip (
 	int res;
 	int flag;
 	uint8_t sflag;
-	int i;
 
 	/*
 	 * Create multicast recv socket
@@ -734,27 +1647,6 @@ static int totemudp_build_sockets_ip (
 		return (-1);
 	}
 
-	/*
-	 * Create local multicast loop socket
-	 */
-	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sockets->local_mcast_loop) == -1) {
-		LOGSYS_PERROR (errno, instance->totemudp_log_level_warning,
-			"socket() failed");
-		return (-1);
-	}
-
-	for (i = 0; i < 2; i++) {
-		totemip_nosigpipe (sockets->local_mcast_loop[i]);
-		res = fcntl (sockets->local_mcast_loop[i], F_SETFL, O_NONBLOCK);
-		if (res == -1) {
-			LOGSYS_PERROR (errno, instance->totemudp_log_level_warning,
-				"Could not set non-blocking operation on multicast socket");
-			return (-1);
-		}
-	}
-
-
-
 	/*
 	 * Setup mcast send socket
 	 */
@@ -879,18 +1771,6 @@ static int totemudp_build_sockets_ip (
 			"Unable to set SO_SNDBUF size on UDP mcast socket");
 		return (-1);
 	}
-	res = setsockopt (sockets->local_mcast_loop[0], SOL_SOCKET, SO_RCVBUF, &recvbuf_size, optlen);
-	if (res == -1) {
-		LOGSYS_PERROR (errno, instance->totemudp_log_level_debug,
-			"Unable to set SO_RCVBUF size on UDP local mcast loop socket");
-		return (-1);
-	}
-	res = setsockopt (sockets->local_mcast_loop[1], SOL_SOCKET, SO_SNDBUF, &sendbuf_size, optlen);
-	if (res == -1) {
-		LOGSYS_PERROR (errno, instance->totemudp_log_level_debug,
-			"Unable to set SO_SNDBUF size on UDP local mcast loop socket");
-		return (-1);
-	}
 
 	res = getsockopt (sockets->mcast_recv, SOL_SOCKET, SO_RCVBUF, &recvbuf_size, &optlen);
 	if (res == 0) {
@@ -904,18 +1784,6 @@ static int totemudp_build_sockets_ip (
 			"Transmit multicast socket send buffer size (%d bytes).", sendbuf_size);
 	}
 
-	res = getsockopt (sockets->local_mcast_loop[0], SOL_SOCKET, SO_RCVBUF, &recvbuf_size, &optlen);
-	if (res == 0) {
-		log_printf (instance->totemudp_log_level_debug,
-			"Local receive multicast loop socket recv buffer size (%d bytes).", recvbuf_size);
-	}
-
-	res = getsockopt (sockets->local_mcast_loop[1], SOL_SOCKET, SO_SNDBUF, &sendbuf_size, &optlen);
-	if (res == 0) {
-		log_printf (instance->totemudp_log_level_debug,
-			"Local transmit multicast loop socket send buffer size (%d bytes).", sendbuf_size);
-	}
-
 
 	/*
 	 * Join group membership on socket
@@ -1166,6 +2034,13 @@ int totemudp_initialize (
 	instance->totem_config = totem_config;
 	instance->stats = stats;
 
+	instance->local_mcast_loop_size = local_mcast_loop_size_get (totem_config);
+	instance->local_mcast_loop_buffer = malloc (instance->local_mcast_loop_size);
+	if (instance->local_mcast_loop_buffer == NULL) {
+		free (instance);
+		return (-1);
+	}
+
 	/*
 	* Configure logging
 	*/
@@ -1191,6 +2066,9 @@ int totemudp_initialize (
 	instance->context = context;
 	instance->totemudp_deliver_fn = deliver_fn;
 
+	pthread_mutex_init (&instance->recv_thread_mutex, NULL);
+	pthread_cond_init (&instance->recv_thread_cond, NULL);
+
 	instance->totemudp_iface_change_fn = iface_change_fn;
 
 	instance->totemudp_target_set_completed = target_set_completed;
@@ -1251,31 +2129,46 @@ int totemudp_recv_flush (void *udp_context)
 	struct pollfd ufd;
 	int nfds;
 	int res = 0;
-	int i;
 	int sock;
 
 	instance->flushing = 1;
 
-	for (i = 0; i < 2; i++) {
-		sock = -1;
-		if (i == 0) {
-		    sock = instance->totemudp_sockets.mcast_recv;
-		}
-		if (i == 1) {
-		    sock = instance->totemudp_sockets.local_mcast_loop[0];
+#ifdef HAVE_RECVMMSG
+	/*
+	 * Datagrams already taken from the kernel go first
+	 */
+	net_deliver_batch_pending (instance);
+#endif
+
+	if (instance->recv_thread_running) {
+		/*
+		 * Frames taken by the thread go first, the rest is read from
+		 * the socket here while the thread is paused
+		 */
+		recv_thread_pause (instance);
+		recv_thread_deliver_pending (instance);
+	}
+
+	sock = instance->totemudp_sockets.mcast_recv;
+	do {
+		ufd.fd = sock;
+		ufd.events = POLLIN;
+		nfds = poll (&ufd, 1, 0);
+		if (nfds == 1 && ufd.revents & POLLIN) {
+		net_deliver_fn (sock, ufd.revents, instance);
 		}
-		assert(sock != -1);
-
-		do {
-			ufd.fd = sock;
-			ufd.events = POLLIN;
-			nfds = poll (&ufd, 1, 0);
-			if (nfds == 1 && ufd.revents & POLLIN) {
-			net_deliver_fn (sock, ufd.revents, instance);
-			}
-		} while (nfds == 1);
+	} while (nfds == 1);
+
+	if (instance->recv_thread_running) {
+		recv_thread_resume (instance);
 	}
 
+	/*
+	 * Own multicasts are delivered after the network ones, as they were
+	 * when they were read from the local loop socket
+	 */
+	local_mcast_loop_deliver_pending (instance);
+
 	instance->flushing = 0;
 
 	return (res);
@@ -1283,6 +2176,11 @@ int totemudp_recv_flush (void *udp_context)
 
 int totemudp_send_flush (void *udp_context)
 {
+#ifdef HAVE_SENDMMSG
+	struct totemudp_instance *instance = (struct totemudp_instance *)udp_context;
+
+	mcast_sendmmsg_flush (instance);
+#endif
 	return 0;
 }
 
@@ -1294,6 +2192,9 @@ int totemudp_token_send (
 	struct totemudp_instance *instance = (struct totemudp_instance *)udp_context;
 	int res = 0;
 
+#ifdef HAVE_SENDMMSG
+	mcast_sendmmsg_flush (instance);
+#endif
 	ucast_sendmsg (instance, &instance->token_target, msg, msg_len);
 
 	return (res);
@@ -1306,6 +2207,9 @@ int totemudp_mcast_flush_send (
 	struct totemudp_instance *instance = (struct totemudp_instance *)udp_context;
 	int res = 0;
 
+#ifdef HAVE_SENDMMSG
+	mcast_sendmmsg_flush (instance);
+#endif
 	mcast_sendmsg (instance, msg, msg_len);
 
 	return (res);
@@ -1319,7 +2223,11 @@ int totemudp_mcast_noflush_send (
 	struct totemudp_instance *instance = (struct totemudp_instance *)udp_context;
 	int res = 0;
 
+#ifdef HAVE_SENDMMSG
+	mcast_sendmmsg_queue (instance, msg, msg_len);
+#else
 	mcast_sendmsg (instance, msg, msg_len);
+#endif
 
 	return (res);
 }
@@ -1389,7 +2297,6 @@ extern int totemudp_recv_mcast_empty (
 	struct pollfd ufd;
 	int nfds;
 	int msg_processed = 0;
-	int i;
 	int sock;
 
 	/*
@@ -1415,29 +2322,49 @@ extern int totemudp_recv_mcast_empty (
 	msg_recv.msg_accrightslen = 0;
 #endif
 
-	for (i = 0; i < 2; i++) {
-		sock = -1;
-		if (i == 0) {
-		    sock = instance->totemudp_sockets.mcast_recv;
+	if (instance->recv_thread_running) {
+		recv_thread_pause (instance);
+		msg_processed = recv_thread_discard_pending (instance);
+	}
+
+	sock = instance->totemudp_sockets.mcast_recv;
+	do {
+		ufd.fd = sock;
+		ufd.events = POLLIN;
+		nfds = poll (&ufd, 1, 0);
+		if (nfds == 1 && ufd.revents & POLLIN) {
+			res = recvmsg (sock, &msg_recv, MSG_NOSIGNAL | MSG_DONTWAIT);
+			if (res != -1) {
+				msg_processed = 1;
+			} else {
+				msg_processed = -1;
+			}
 		}
-		if (i == 1) {
-		    sock = instance->totemudp_sockets.local_mcast_loop[0];
+	} while (nfds == 1);
+
+	if (instance->recv_thread_running) {
+		recv_thread_resume (instance);
+	}
+
+#ifdef HAVE_RECVMMSG
+	/*
+	 * Discard rest of the batch being delivered
+	 */
+	if (instance->recv_batch_next < instance->recv_batch_count) {
+		instance->recv_batch_next = instance->recv_batch_count;
+		msg_processed = 1;
+	}
+#endif
+
+	/*
+	 * Discard own multicasts waiting in local loop too
+	 */
+	if (instance->local_mcast_loop_next != instance->local_mcast_loop_tail) {
+		instance->local_mcast_loop_next = instance->local_mcast_loop_tail;
+		if (instance->local_mcast_loop_depth == 0) {
+			instance->local_mcast_loop_head = instance->local_mcast_loop_next;
 		}
-		assert(sock != -1);
-
-		do {
-			ufd.fd = sock;
-			ufd.events = POLLIN;
-			nfds = poll (&ufd, 1, 0);
-			if (nfds == 1 && ufd.revents & POLLIN) {
-				res = recvmsg (sock, &msg_recv, MSG_NOSIGNAL | MSG_DONTWAIT);
-				if (res != -1) {
-					msg_processed = 1;
-				} else {
-					msg_processed = -1;
-				}
-			}
-		} while (nfds == 1);
+		msg_processed = 1;
 	}
 
 	return (msg_processed);
@@ -1515,6 +2442,18 @@ int totemudp_reconfigure (
 	void *udp_context,
 	struct totem_config *totem_config)
 {
-	/* Not supported */
-	return (-1);
+	struct totemudp_instance *instance = (struct totemudp_instance *)udp_context;
+
+	/*
+	 * Only the local mcast loop follows the configuration, max_messages
+	 * can change on reload
+	 */
+	if (local_mcast_loop_resize (instance, local_mcast_loop_size_get (totem_config)) != 0) {
+		log_printf (instance->totemudp_log_level_error,
+			"Can't resize local mcast loop, keeping %zu bytes",
+			instance->local_mcast_loop_size);
+		return (-1);
+	}
+
+	return (0);
 }
@@ -78,6 +78,14 @@
 #define NETIF_STATE_REPORT_UP		1
 #define NETIF_STATE_REPORT_DOWN		2
 
+/*
+ * Number of datagrams drained per wakeup and multicasts sent per syscall
+ * when the batched receive and send paths are available
+ */
+#define UDP_RECV_BATCH_MAX	16
+#define UDP_SEND_BATCH_MAX	TRANSMITS_ALLOWED
+#define UDP_SEND_BATCH_DATA_SIZE	FRAME_SIZE_MAX
+
 #define BIND_STATE_UNBOUND	0
 #define BIND_STATE_REGULAR	1
 #define BIND_STATE_LOOPBACK	2
@@ -85,6 +93,12 @@
 struct totemudpu_member {
 	struct qb_list_head list;
 	struct totem_ip_address member;
+	/*
+	 * Destination of messages to member, converted once when member is
+	 * added
+	 */
+	struct sockaddr_storage sockaddr;
+	int sockaddr_len;
 	int fd;
 	int active;
 };
@@ -143,6 +157,48 @@ struct totemudpu_instance {
 
 	struct iovec totemudpu_iov_recv;
 
+#ifdef HAVE_RECVMMSG
+	/*
+	 * UDP datagrams can't be larger than FRAME_SIZE_MAX so batch slots
+	 * don't need the full UDP_RECEIVE_FRAME_SIZE_MAX
+	 */
+	char recv_batch_buffer[UDP_RECV_BATCH_MAX][FRAME_SIZE_MAX];
+
+	struct iovec recv_batch_iov[UDP_RECV_BATCH_MAX];
+
+	struct mmsghdr recv_batch_msg[UDP_RECV_BATCH_MAX];
+
+	struct sockaddr_storage recv_batch_from[UDP_RECV_BATCH_MAX];
+
+	/*
+	 * Datagrams of the last recvmmsg and the next one to deliver, kept
+	 * here so totemudpu_recv_mcast_empty can discard the rest of a batch
+	 */
+	int recv_batch_count;
+
+	int recv_batch_next;
+#endif
+
+#ifdef HAVE_SENDMMSG
+	/*
+	 * Multicasts queued by mcast_noflush_send until the next flush.
+	 * Messages are copied, because totemsrp may free its buffers before
+	 * the flush (e.g. when entering operational state).
+	 * send_batch_all is set for messages sent also to inactive members.
+	 */
+	struct iovec send_batch_iov[UDP_SEND_BATCH_MAX];
+
+	struct mmsghdr send_batch_msg[UDP_SEND_BATCH_MAX];
+
+	int send_batch_all[UDP_SEND_BATCH_MAX];
+
+	int send_batch_count;
+
+	char send_batch_data[UDP_SEND_BATCH_DATA_SIZE];
+
+	size_t send_batch_data_len;
+#endif
+
 	struct qb_list_head member_list;
 
 	int stats_sent;
@@ -171,6 +227,10 @@ struct totemudpu_instance {
 
 	struct totem_ip_address token_target;
 
+	struct sockaddr_storage token_target_sockaddr;
+
+	int token_target_sockaddr_len;
+
 	int token_socket;
 
 	qb_loop_timer_handle timer_merge_detect_timeout;
@@ -208,6 +268,10 @@ static struct totem_ip_address localhost;
 
 static void totemudpu_instance_initialize (struct totemudpu_instance *instance)
 {
+#ifdef HAVE_RECVMMSG
+	int i;
+
+#endif
 	memset (instance, 0, sizeof (struct totemudpu_instance));
 
 	instance->netif_state_report = NETIF_STATE_REPORT_UP | NETIF_STATE_REPORT_DOWN;
@@ -216,6 +280,15 @@ static void totemudpu_instance_initialize (struct totemudpu_instance *instance)
 
 	instance->totemudpu_iov_recv.iov_len = UDP_RECEIVE_FRAME_SIZE_MAX; //sizeof (instance->iov_buffer);
 
+#ifdef HAVE_RECVMMSG
+	for (i = 0; i < UDP_RECV_BATCH_MAX; i++) {
+		instance->recv_batch_iov[i].iov_base = instance->recv_batch_buffer[i];
+		instance->recv_batch_msg[i].msg_hdr.msg_name = &instance->recv_batch_from[i];
+		instance->recv_batch_msg[i].msg_hdr.msg_iov = &instance->recv_batch_iov[i];
+		instance->recv_batch_msg[i].msg_hdr.msg_iovlen = 1;
+	}
+#endif
+
 	/*
 	 * There is always atleast 1 processor
 	 */
@@ -253,15 +326,14 @@ int totemudpu_crypto_set (
 
 static inline void ucast_sendmsg (
 	struct totemudpu_instance *instance,
-	struct totem_ip_address *system_to,
+	struct sockaddr_storage *sockaddr,
+	int addrlen,
 	const void *msg,
 	unsigned int msg_len)
 {
 	struct msghdr msg_ucast;
 	int res = 0;
-	struct sockaddr_storage sockaddr;
 	struct iovec iovec;
-	int addrlen;
 
 	iovec.iov_base = (void *)msg;
 	iovec.iov_len = msg_len;
@@ -269,10 +341,8 @@ static inline void ucast_sendmsg (
 	/*
 	 * Build unicast message
 	 */
-	totemip_totemip_to_sockaddr_convert(system_to,
-		instance->totem_interface->ip_port, &sockaddr, &addrlen);
 	memset(&msg_ucast, 0, sizeof(msg_ucast));
-	msg_ucast.msg_name = &sockaddr;
+	msg_ucast.msg_name = sockaddr;
 	msg_ucast.msg_namelen = addrlen;
 	msg_ucast.msg_iov = (void *)&iovec;
 	msg_ucast.msg_iovlen = 1;
@@ -313,18 +383,34 @@ static inline void mcast_sendmsg (
 	struct msghdr msg_mcast;
 	int res = 0;
 	struct iovec iovec;
-	struct sockaddr_storage sockaddr;
-	int addrlen;
 	struct qb_list_head *list;
 	struct totemudpu_member *member;
 
 	iovec.iov_base = (void *)msg;
 	iovec.iov_len = msg_len;
 
-	memset(&msg_mcast, 0, sizeof(msg_mcast));
 	/*
-	 * Build multicast message
+	 * Build multicast message, only destination differs between members
 	 */
+	memset(&msg_mcast, 0, sizeof(msg_mcast));
+	msg_mcast.msg_iov = (void *)&iovec;
+	msg_mcast.msg_iovlen = 1;
+#ifdef HAVE_MSGHDR_CONTROL
+	msg_mcast.msg_control = 0;
+#endif
+#ifdef HAVE_MSGHDR_CONTROLLEN
+	msg_mcast.msg_controllen = 0;
+#endif
+#ifdef HAVE_MSGHDR_FLAGS
+	msg_mcast.msg_flags = 0;
+#endif
+#ifdef HAVE_MSGHDR_ACCRIGHTS
+	msg_mcast.msg_accrights = NULL;
+#endif
+#ifdef HAVE_MSGHDR_ACCRIGHTSLEN
+	msg_mcast.msg_accrightslen = 0;
+#endif
+
 	qb_list_for_each(list, &(instance->member_list)) {
 		member = qb_list_entry (list,
 			struct totemudpu_member,
@@ -337,27 +423,8 @@ static inline void mcast_sendmsg (
 		if (only_active && !member->active && !instance->send_merge_detect_message)
 			continue ;
 
-		totemip_totemip_to_sockaddr_convert(&member->member,
-			instance->totem_interface->ip_port, &sockaddr, &addrlen);
-		msg_mcast.msg_name = &sockaddr;
-		msg_mcast.msg_namelen = addrlen;
-		msg_mcast.msg_iov = (void *)&iovec;
-		msg_mcast.msg_iovlen = 1;
-	#ifdef HAVE_MSGHDR_CONTROL
-		msg_mcast.msg_control = 0;
-	#endif
-	#ifdef HAVE_MSGHDR_CONTROLLEN
-		msg_mcast.msg_controllen = 0;
-	#endif
-	#ifdef HAVE_MSGHDR_FLAGS
-		msg_mcast.msg_flags = 0;
-	#endif
-	#ifdef HAVE_MSGHDR_ACCRIGHTS
-		msg_mcast.msg_accrights = NULL;
-	#endif
-	#ifdef HAVE_MSGHDR_ACCRIGHTSLEN
-		msg_mcast.msg_accrightslen = 0;
-	#endif
+		msg_mcast.msg_name = &member->sockaddr;
+		msg_mcast.msg_namelen = member->sockaddr_len;
 
 		/*
 		 * Transmit multicast message
@@ -378,6 +445,115 @@ static inline void mcast_sendmsg (
 		instance->send_merge_detect_message = 0;
 	}
 }
+#ifdef HAVE_SENDMMSG
+/*
+ * Send all queued multicasts with one sendmmsg per member
+ */
+static void mcast_sendmmsg_flush (
+	struct totemudpu_instance *instance)
+{
+	struct qb_list_head *list;
+	struct totemudpu_member *member;
+	int sent_to_all;
+	int sent;
+	int res;
+	int i;
+
+	if (instance->send_batch_count == 0) {
+		return;
+	}
+
+	memset (instance->send_batch_msg, 0,
+		sizeof (struct mmsghdr) * instance->send_batch_count);
+	sent_to_all = instance->send_merge_detect_message;
+	for (i = 0; i < instance->send_batch_count; i++) {
+		instance->send_batch_msg[i].msg_hdr.msg_iov = &instance->send_batch_iov[i];
+		instance->send_batch_msg[i].msg_hdr.msg_iovlen = 1;
+		sent_to_all |= instance->send_batch_all[i];
+	}
+
+	qb_list_for_each(list, &(instance->member_list)) {
+		member = qb_list_entry (list,
+			struct totemudpu_member,
+			list);
+
+		for (i = 0; i < instance->send_batch_count; i++) {
+			instance->send_batch_msg[i].msg_hdr.msg_name = &member->sockaddr;
+			instance->send_batch_msg[i].msg_hdr.msg_namelen = member->sockaddr_len;
+		}
+
+		/*
+		 * Inactive members only get flush messages and the first
+		 * message when the merge detect timeout has expired, same as
+		 * mcast_sendmsg. They are rare, so each message is sent
+		 * separately.
+		 */
+		if (!member->active) {
+			for (i = 0; i < instance->send_batch_count; i++) {
+				if (!instance->send_batch_all[i] &&
+				    !(i == 0 && instance->send_merge_detect_message)) {
+					continue;
+				}
+				res = sendmsg (member->fd, &instance->send_batch_msg[i].msg_hdr,
+					MSG_NOSIGNAL);
+				if (res < 0) {
+					LOGSYS_PERROR (errno, instance->totemudpu_log_level_debug,
+						"sendmsg(mcast) failed (non-critical)");
+				}
+			}
+			continue;
+		}
+
+		/*
+		 * Transmit multicast messages
+		 * An error here is recovered by totemsrp
+		 */
+		for (sent = 0; sent < instance->send_batch_count; sent += res) {
+			res = sendmmsg (member->fd, &instance->send_batch_msg[sent],
+				instance->send_batch_count - sent, MSG_NOSIGNAL);
+			if (res < 0) {
+				LOGSYS_PERROR (errno, instance->totemudpu_log_level_debug,
+					"sendmmsg(mcast) failed (non-critical)");
+				break;
+			}
+		}
+	}
+
+	if (sent_to_all) {
+		/*
+		 * A message was sent to all nodes
+		 */
+		instance->merge_detect_messages_sent_before_timeout++;
+		instance->send_merge_detect_message = 0;
+	}
+
+	instance->send_batch_count = 0;
+	instance->send_batch_data_len = 0;
+}
+
+static inline void mcast_sendmmsg_queue (
+	struct totemudpu_instance *instance,
+	const void *msg,
+	unsigned int msg_len,
+	int all)
+{
+	char *data;
+
+	if (instance->send_batch_count == UDP_SEND_BATCH_MAX ||
+	    instance->send_batch_data_len + msg_len > UDP_SEND_BATCH_DATA_SIZE) {
+		mcast_sendmmsg_flush (instance);
+	}
+
+	data = instance->send_batch_data + instance->send_batch_data_len;
+	memcpy (data, msg, msg_len);
+	instance->send_batch_data_len += msg_len;
+
+	instance->send_batch_iov[instance->send_batch_count].iov_base = data;
+	instance->send_batch_iov[instance->send_batch_count].iov_len = msg_len;
+	instance->send_batch_all[instance->send_batch_count] = all;
+	instance->send_batch_count++;
+}
+#endif
 
 int totemudpu_finalize (
 	void *udpu_context)
@@ -396,12 +572,73 @@ int totemudpu_finalize (
 	return (res);
 }
 
+#ifdef HAVE_RECVMMSG
+static int net_deliver_batch_fn (
+	int fd,
+	struct totemudpu_instance *instance)
+{
+	struct mmsghdr *msg;
+	int res;
+	int i;
+
+	for (i = 0; i < UDP_RECV_BATCH_MAX; i++) {
+		instance->recv_batch_iov[i].iov_len = FRAME_SIZE_MAX;
+		instance->recv_batch_msg[i].msg_hdr.msg_namelen = sizeof (struct sockaddr_storage);
+		instance->recv_batch_msg[i].msg_hdr.msg_control = 0;
+		instance->recv_batch_msg[i].msg_hdr.msg_controllen = 0;
+		instance->recv_batch_msg[i].msg_hdr.msg_flags = 0;
+	}
+
+	/*
+	 * Receive datagrams
+	 */
+	res = recvmmsg (fd, instance->recv_batch_msg, UDP_RECV_BATCH_MAX,
+		MSG_NOSIGNAL | MSG_DONTWAIT, NULL);
+	if (res == -1) {
+		return (0);
+	}
+	for (i = 0; i < res; i++) {
+		instance->stats_recv += instance->recv_batch_msg[i].msg_len;
+	}
+
+	instance->recv_batch_count = res;
+	instance->recv_batch_next = 0;
+	while (instance->recv_batch_next < instance->recv_batch_count) {
+		i = instance->recv_batch_next++;
+		msg = &instance->recv_batch_msg[i];
+
+		if (msg->msg_hdr.msg_flags & MSG_TRUNC) {
+			log_printf (instance->totemudpu_log_level_error,
+				"Received too big message. This may be because something bad is happening"
+				"on the network (attack?). Dropping packet.");
+			continue;
+		}
+
+		/*
+		 * Handle incoming message
+		 */
+		instance->totemudpu_deliver_fn (
+			instance->context,
+			instance->recv_batch_buffer[i],
+			msg->msg_len,
+			&instance->recv_batch_from[i]);
+	}
+	instance->recv_batch_count = 0;
+
+	return (0);
+}
+#endif
+
 static int net_deliver_fn (
 	int fd,
 	int revents,
 	void *data)
 {
 	struct totemudpu_instance *instance = (struct totemudpu_instance *)data;
+#ifdef HAVE_RECVMMSG
+
+	return (net_deliver_batch_fn (fd, instance));
+#else
 	struct msghdr msg_recv;
 	struct iovec *iovec;
 	struct sockaddr_storage system_from;
@@ -478,6 +715,7 @@ static int net_deliver_fn (
 
 	iovec->iov_len = UDP_RECEIVE_FRAME_SIZE_MAX;
 	return (0);
+#endif
 }
 
 static int netif_determine (
@@ -899,8 +1137,15 @@ int totemudpu_recv_flush (void *udpu_context)
 
 int totemudpu_send_flush (void *udpu_context)
 {
+#ifdef HAVE_SENDMMSG
+	struct totemudpu_instance *instance = (struct totemudpu_instance *)udpu_context;
+#endif
 	int res = 0;
 
+#ifdef HAVE_SENDMMSG
+	mcast_sendmmsg_flush (instance);
+#endif
+
 	return (res);
 }
 
@@ -912,7 +1157,11 @@ int totemudpu_token_send (
 	struct totemudpu_instance *instance = (struct totemudpu_instance *)udpu_context;
 	int res = 0;
 
-	ucast_sendmsg (instance, &instance->token_target, msg, msg_len);
+#ifdef HAVE_SENDMMSG
+	mcast_sendmmsg_flush (instance);
+#endif
+	ucast_sendmsg (instance, &instance->token_target_sockaddr,
+		instance->token_target_sockaddr_len, msg, msg_len);
 
 	return (res);
 }
@@ -924,7 +1173,16 @@ int totemudpu_mcast_flush_send (
 	struct totemudpu_instance *instance = (struct totemudpu_instance *)udpu_context;
 	int res = 0;
 
+#ifdef HAVE_SENDMMSG
+	/*
+	 * Message is sent together with queued messages, in one sendmmsg
+	 * per member
+	 */
+	mcast_sendmmsg_queue (instance, msg, msg_len, 1);
+	mcast_sendmmsg_flush (instance);
+#else
 	mcast_sendmsg (instance, msg, msg_len, 0);
+#endif
 
 	return (res);
 }
@@ -937,7 +1195,11 @@ int totemudpu_mcast_noflush_send (
 	struct totemudpu_instance *instance = (struct totemudpu_instance *)udpu_context;
 	int res = 0;
 
+#ifdef HAVE_SENDMMSG
+	mcast_sendmmsg_queue (instance, msg, msg_len, 0);
+#else
 	mcast_sendmsg (instance, msg, msg_len, 1);
+#endif
 
 	return (res);
 }
@@ -976,6 +1238,9 @@ int totemudpu_token_target_set (
 		if (member->member.nodeid == nodeid) {
 			memcpy (&instance->token_target, &member->member,
 				sizeof (struct totem_ip_address));
+			memcpy (&instance->token_target_sockaddr, &member->sockaddr,
+				sizeof (struct sockaddr_storage));
+			instance->token_target_sockaddr_len = member->sockaddr_len;
 
 			instance->totemudpu_target_set_completed (instance->context);
 			break;
@@ -1032,6 +1297,16 @@ extern int totemudpu_recv_mcast_empty (
 		}
 	} while (nfds == 1);
 
+#ifdef HAVE_RECVMMSG
+	/*
+	 * Discard rest of the batch being delivered too
+	 */
+	if (instance->recv_batch_next < instance->recv_batch_count) {
+		instance->recv_batch_next = instance->recv_batch_count;
+		msg_processed = 1;
+	}
+#endif
+
 	return (msg_processed);
 }
 
@@ -1125,6 +1400,9 @@ int totemudpu_member_add (
 	qb_list_init (&new_member->list);
 	qb_list_add_tail (&new_member->list, &instance->member_list);
 	memcpy (&new_member->member, member, sizeof (struct totem_ip_address));
+	totemip_totemip_to_sockaddr_convert(&new_member->member,
+		instance->totem_interface->ip_port, &new_member->sockaddr,
+		&new_member->sockaddr_len);
 	new_member->fd = totemudpu_create_sending_socket(udpu_context, member);
 	new_member->active = 1;
 
@@ -216,6 +216,26 @@ static struct memb_ring_id quorum_ringid;
 static struct cluster_node cluster_nodes[PROCESSOR_COUNT_MAX+2];
 static int cluster_nodes_entries = 0;
 
+/*
+ * nodeid index of cluster_members_list (open addressing, linear probing)
+ */
+#define NODE_INDEX_SIZE ((PROCESSOR_COUNT_MAX+2) * 2)
+
+static struct cluster_node *node_index[NODE_INDEX_SIZE];
+
+/*
+ * running totals of NODESTATE_MEMBER nodes in cluster_members_list, kept
+ * up to date by node_state_set/node_votes_set/node_expected_votes_set.
+ * Limits only follow growth; when the node holding a limit goes away they
+ * are marked stale and recalculated on next use.
+ */
+static unsigned int members_total_votes = 0;
+static unsigned int members_count = 0;
+static unsigned int members_highest_expected = 0;
+static int members_lowest_node_id = 0;
+static int members_highest_node_id = 0;
+static int members_limits_stale = 0;
+
 /*
  * votequorum tracking
  */
@@ -454,6 +474,164 @@ static void node_add_ordered(struct cluster_node *newnode)
 	LEAVE();
 }
 
+static void node_index_add(struct cluster_node *node)
+{
+	unsigned int i;
+
+	i = (unsigned int)node->node_id % NODE_INDEX_SIZE;
+	while (node_index[i] != NULL) {
+		i = (i + 1) % NODE_INDEX_SIZE;
+	}
+	node_index[i] = node;
+}
+
+/*
+ * Entries following the removed one are moved back into the hole when
+ * their probe sequence passes it, so lookups never need tombstones
+ */
+static void node_index_del(struct cluster_node *node)
+{
+	unsigned int i, j, home;
+
+	i = (unsigned int)node->node_id % NODE_INDEX_SIZE;
+	while (node_index[i] != node) {
+		if (node_index[i] == NULL) {
+			return;
+		}
+		i = (i + 1) % NODE_INDEX_SIZE;
+	}
+	node_index[i] = NULL;
+
+	j = i;
+	while (1) {
+		j = (j + 1) % NODE_INDEX_SIZE;
+		if (node_index[j] == NULL) {
+			break;
+		}
+		home = (unsigned int)node_index[j]->node_id % NODE_INDEX_SIZE;
+		if ((i <= j) ? ((home <= i) || (home > j)) : ((home <= i) && (home > j))) {
+			node_index[i] = node_index[j];
+			node_index[j] = NULL;
+			i = j;
+		}
+	}
+}
+
+static struct cluster_node *node_index_find(unsigned int nodeid)
+{
+	unsigned int i;
+
+	i = nodeid % NODE_INDEX_SIZE;
+	while (node_index[i] != NULL) {
+		if ((unsigned int)node_index[i]->node_id == nodeid) {
+			return node_index[i];
+		}
+		i = (i + 1) % NODE_INDEX_SIZE;
+	}
+
+	return NULL;
+}
+
+static int node_is_counted(const struct cluster_node *node)
+{
+	return ((node->node_id != VOTEQUORUM_QDEVICE_NODEID) &&
+		(node->state == NODESTATE_MEMBER));
+}
+
+static void members_totals_add(const struct cluster_node *node)
+{
+	if (!node_is_counted(node)) {
+		return;
+	}
+
+	members_total_votes += node->votes;
+	members_count++;
+
+	if (members_count == 1) {
+		members_highest_expected = node->expected_votes;
+		members_lowest_node_id = node->node_id;
+		members_highest_node_id = node->node_id;
+		members_limits_stale = 0;
+	} else if (!members_limits_stale) {
+		members_highest_expected = max(members_highest_expected, node->expected_votes);
+		if (node->node_id < members_lowest_node_id) {
+			members_lowest_node_id = node->node_id;
+		}
+		if (node->node_id > members_highest_node_id) {
+			members_highest_node_id = node->node_id;
+		}
+	}
+}
+
+static void members_totals_del(const struct cluster_node *node)
+{
+	if (!node_is_counted(node)) {
+		return;
+	}
+
+	members_total_votes -= node->votes;
+	members_count--;
+
+	if ((node->expected_votes == members_highest_expected) ||
+	    (node->node_id == members_lowest_node_id) ||
+	    (node->node_id == members_highest_node_id)) {
+		members_limits_stale = 1;
+	}
+}
+
+static void members_limits_update(void)
+{
+	struct cluster_node *node;
+	struct qb_list_head *tmp;
+	int first = 1;
+
+	if (!members_limits_stale) {
+		return;
+	}
+
+	members_highest_expected = 0;
+	members_lowest_node_id = 0;
+	members_highest_node_id = 0;
+
+	qb_list_for_each(tmp, &cluster_members_list) {
+		node = qb_list_entry(tmp, struct cluster_node, list);
+		if (!node_is_counted(node)) {
+			continue;
+		}
+		members_highest_expected = max(members_highest_expected, node->expected_votes);
+		if ((first) || (node->node_id < members_lowest_node_id)) {
+			members_lowest_node_id = node->node_id;
+		}
+		if ((first) || (node->node_id > members_highest_node_id)) {
+			members_highest_node_id = node->node_id;
+		}
+		first = 0;
+	}
+
+	members_limits_stale = 0;
+}
+
+static void node_state_set(struct cluster_node *node, nodestate_t state)
+{
+	members_totals_del(node);
+	node->state = state;
+	members_totals_add(node);
+}
+
+static void node_votes_set(struct cluster_node *node, uint32_t votes)
+{
+	members_totals_del(node);
+	node->votes = votes;
+	members_totals_add(node);
+}
+
+static void node_expected_votes_set(struct cluster_node *node, uint32_t expected_votes)
+{
+	members_totals_del(node);
+	node->expected_votes = expected_votes;
+	members_totals_add(node);
+}
+
 static struct cluster_node *allocate_node(unsigned int nodeid)
 {
 	struct cluster_node *cl = NULL;
@@ -479,12 +657,14 @@ static struct cluster_node *allocate_node(unsigned int nodeid)
 			goto out;
 		}
 		qb_list_del(tmp);
+		node_index_del(cl);
 	}
 
 	memset(cl, 0, sizeof(struct cluster_node));
 	cl->node_id = nodeid;
 	if (nodeid != VOTEQUORUM_QDEVICE_NODEID) {
 		node_add_ordered(cl);
+		node_index_add(cl);
 	}
 
 out:
@@ -496,7 +676,6 @@ out:
 static struct cluster_node *find_node_by_nodeid(unsigned int nodeid)
 {
 	struct cluster_node *node;
-	struct qb_list_head *tmp;
 
 	ENTER();
 
@@ -510,33 +689,22 @@ static struct cluster_node *find_node_by_nodeid(unsigned int nodeid)
 		return qdevice;
 	}
 
-	qb_list_for_each(tmp, &cluster_members_list) {
-		node = qb_list_entry(tmp, struct cluster_node, list);
-		if (node->node_id == nodeid) {
-			LEAVE();
-			return node;
-		}
-	}
+	node = node_index_find(nodeid);
 
 	LEAVE();
-	return NULL;
+	return node;
 }
 
 static void get_lowest_node_id(void)
 {
-	struct cluster_node *node = NULL;
-	struct qb_list_head *tmp;
-
 	ENTER();
 
-	lowest_node_id = us->node_id;
+	members_limits_update();
 
-	qb_list_for_each(tmp, &cluster_members_list) {
-		node = qb_list_entry(tmp, struct cluster_node, list);
-		if ((node->state == NODESTATE_MEMBER) &&
-		    (node->node_id < lowest_node_id)) {
-			lowest_node_id = node->node_id;
-		}
+	lowest_node_id = us->node_id;
+	if ((members_count) &&
+	    (members_lowest_node_id < lowest_node_id)) {
+		lowest_node_id = members_lowest_node_id;
 	}
 	log_printf(LOGSYS_LEVEL_DEBUG, "lowest node id: %d us: %d", lowest_node_id, us->node_id);
 	icmap_set_uint32("runtime.votequorum.lowest_node_id", lowest_node_id);
@@ -546,19 +714,14 @@ static void get_lowest_node_id(void)
 
 static void get_highest_node_id(void)
 {
-	struct cluster_node *node = NULL;
-	struct qb_list_head *tmp;
-
 	ENTER();
 
-	highest_node_id = us->node_id;
+	members_limits_update();
 
-	qb_list_for_each(tmp, &cluster_members_list) {
-		node = qb_list_entry(tmp, struct cluster_node, list);
-		if ((node->state == NODESTATE_MEMBER) &&
-		    (node->node_id > highest_node_id)) {
-			highest_node_id = node->node_id;
-		}
+	highest_node_id = us->node_id;
+	if ((members_count) &&
+	    (members_highest_node_id > highest_node_id)) {
+		highest_node_id = members_highest_node_id;
 	}
 	log_printf(LOGSYS_LEVEL_DEBUG, "highest node id: %d us: %d", highest_node_id, us->node_id);
 	icmap_set_uint32("runtime.votequorum.highest_node_id", highest_node_id);
@@ -569,17 +732,14 @@ static void get_highest_node_id(void)
 static int check_low_node_id_partition(void)
 {
 	struct cluster_node *node = NULL;
-	struct qb_list_head *tmp;
 	int found = 0;
 
 	ENTER();
 
-	qb_list_for_each(tmp, &cluster_members_list) {
-		node = qb_list_entry(tmp, struct cluster_node, list);
-		if ((node->state == NODESTATE_MEMBER) &&
-		    (node->node_id == lowest_node_id)) {
-				found = 1;
-		}
+	node = find_node_by_nodeid(lowest_node_id);
+	if ((node) &&
+	    (node->state == NODESTATE_MEMBER)) {
+		found = 1;
 	}
 
 	LEAVE();
@@ -589,17 +749,14 @@ static int check_low_node_id_partition(void)
 static int check_high_node_id_partition(void)
 {
 	struct cluster_node *node = NULL;
-	struct qb_list_head *tmp;
 	int found = 0;
 
 	ENTER();
 
-	qb_list_for_each(tmp, &cluster_members_list) {
-		node = qb_list_entry(tmp, struct cluster_node, list);
-		if ((node->state == NODESTATE_MEMBER) &&
-		    (node->node_id == highest_node_id)) {
-				found = 1;
-		}
+	node = find_node_by_nodeid(highest_node_id);
+	if ((node) &&
+	    (node->state == NODESTATE_MEMBER)) {
+		found = 1;
 	}
 
 	LEAVE();
@@ -904,12 +1061,10 @@ static void update_ev_tracking_barrier(uint32_t ev_t_barrier)
 
 static int calculate_quorum(int allow_decrease, unsigned int max_expected, unsigned int *ret_total_votes)
 {
-	struct qb_list_head *nodelist;
-	struct cluster_node *node;
-	unsigned int total_votes = 0;
-	unsigned int highest_expected = 0;
+	unsigned int total_votes;
+	unsigned int highest_expected;
 	unsigned int newquorum, q1, q2;
-	unsigned int total_nodes = 0;
+	unsigned int total_nodes;
 
 	ENTER();
 
@@ -917,18 +1072,14 @@ static int calculate_quorum(int allow_decrease, unsigned int max_expected, unsig
 		max_expected = max(ev_barrier, max_expected);
 	}
 
-	qb_list_for_each(nodelist, &cluster_members_list) {
-		node = qb_list_entry(nodelist, struct cluster_node, list);
+	members_limits_update();
 
-		log_printf(LOGSYS_LEVEL_DEBUG, "node %u state=%d, votes=%u, expected=%u",
-			   node->node_id, node->state, node->votes, node->expected_votes);
+	highest_expected = members_highest_expected;
+	total_votes = members_total_votes;
+	total_nodes = members_count;
 
-		if (node->state == NODESTATE_MEMBER) {
-			highest_expected = max(highest_expected, node->expected_votes);
-			total_votes += node->votes;
-			total_nodes++;
-		}
-	}
+	log_printf(LOGSYS_LEVEL_DEBUG, "members=%u, votes=%u, highest expected=%u",
+		   total_nodes, total_votes, highest_expected);
 
 	if (us->flags & NODE_FLAGS_QDEVICE_CAST_VOTE) {
 		log_printf(LOGSYS_LEVEL_DEBUG, "node 0 state=1, votes=%u", qdevice->votes);
@@ -985,7 +1136,7 @@ static void update_node_expected_votes(int new_expected_votes)
 			node = qb_list_entry(nodelist, struct cluster_node, list);
 
 			if (node->state == NODESTATE_MEMBER) {
-				node->expected_votes = new_expected_votes;
+				node_expected_votes_set(node, new_expected_votes);
 			}
 		}
 	}
@@ -1074,21 +1225,11 @@ static void are_we_quorate(unsigned int total_votes)
 
 static void get_total_votes(unsigned int *totalvotes, unsigned int *current_members)
 {
-	unsigned int total_votes = 0;
-	unsigned int cluster_members = 0;
-	struct qb_list_head *nodelist;
-	struct cluster_node *node;
+	unsigned int total_votes = members_total_votes;
+	unsigned int cluster_members = members_count;
 
 	ENTER();
 
-	qb_list_for_each(nodelist, &cluster_members_list) {
-		node = qb_list_entry(nodelist, struct cluster_node, list);
-		if (node->state == NODESTATE_MEMBER) {
-			cluster_members++;
-			total_votes += node->votes;
-		}
-	}
-
 	if (qdevice->votes) {
 		total_votes += qdevice->votes;
 		cluster_members++;
@@ -1121,7 +1262,7 @@ static void recalculate_quorum(int allow_decrease, int by_current_nodes)
 	 */
 	log_printf(LOGSYS_LEVEL_DEBUG, "total_votes=%d, expected_votes=%d", total_votes, us->expected_votes);
 	if (total_votes > us->expected_votes) {
-		us->expected_votes = total_votes;
+		node_expected_votes_set(us, total_votes);
 		votequorum_exec_send_expectedvotes_notification();
 	}
 
@@ -1507,15 +1648,16 @@ static char *votequorum_readconfig(int runtime)
 	}
 
 	if (have_nodelist) {
-		us->votes = node_votes;
-		us->expected_votes = node_expected_votes;
+		node_votes_set(us, node_votes);
+		node_expected_votes_set(us, node_expected_votes);
 	} else {
-		us->votes = 1;
-		icmap_get_uint32("quorum.votes", &us->votes);
+		node_votes = 1;
+		icmap_get_uint32("quorum.votes", &node_votes);
+		node_votes_set(us, node_votes);
 	}
 
 	if (expected_votes) {
-		us->expected_votes = expected_votes;
+		node_expected_votes_set(us, expected_votes);
 	}
 
 	/*
@@ -2096,11 +2238,11 @@ static void message_handler_req_exec_votequorum_nodeinfo (
 
 	/* Update node state */
 	node->flags = req_exec_quorum_nodeinfo->flags;
-	node->votes = req_exec_quorum_nodeinfo->votes;
-	node->state = NODESTATE_MEMBER;
+	node_votes_set(node, req_exec_quorum_nodeinfo->votes);
+	node_state_set(node, NODESTATE_MEMBER);
 
 	if (node->flags & NODE_FLAGS_LEAVING) {
-		node->state = NODESTATE_LEAVING;
+		node_state_set(node, NODESTATE_LEAVING);
 		allow_downgrade = 1;
 		by_node = 1;
 	}
@@ -2108,13 +2250,13 @@ static void message_handler_req_exec_votequorum_nodeinfo (
 	if ((!cluster_is_quorate) &&
 	    (node->flags & NODE_FLAGS_QUORATE)) {
 		allow_downgrade = 1;
-		us->expected_votes = req_exec_quorum_nodeinfo->expected_votes;
+		node_expected_votes_set(us, req_exec_quorum_nodeinfo->expected_votes);
 	}
 
 	if (node->flags & NODE_FLAGS_QUORATE || (ev_tracking)) {
-		node->expected_votes = req_exec_quorum_nodeinfo->expected_votes;
+		node_expected_votes_set(node, req_exec_quorum_nodeinfo->expected_votes);
 	} else {
-		node->expected_votes = us->expected_votes;
+		node_expected_votes_set(node, us->expected_votes);
 	}
 
 	if ((last_man_standing) && (node->votes > 1)) {
@@ -2178,7 +2320,7 @@ static void message_handler_req_exec_votequorum_reconfigure (
 		votequorum_exec_send_expectedvotes_notification();
 		update_ev_barrier(req_exec_quorum_reconfigure->value);
 		if (ev_tracking) {
-		    us->expected_votes = max(us->expected_votes, ev_tracking_barrier);
+		    node_expected_votes_set(us, max(us->expected_votes, ev_tracking_barrier));
 		}
 		recalculate_quorum(1, 0);  /* Allow decrease */
 		break;
@@ -2189,7 +2331,7 @@ static void message_handler_req_exec_votequorum_reconfigure (
 			LEAVE();
 			return;
 		}
-		node->votes = req_exec_quorum_reconfigure->value;
+		node_votes_set(node, req_exec_quorum_reconfigure->value);
 		recalculate_quorum(1, 0);  /* Allow decrease */
 		break;
 
@@ -2255,6 +2397,10 @@ static char *votequorum_exec_init_fn (struct corosync_api_v1 *api)
 	qdevice = NULL;
 	us = NULL;
 	memset(cluster_nodes, 0, sizeof(cluster_nodes));
+	memset(node_index, 0, sizeof(node_index));
+	members_total_votes = 0;
+	members_count = 0;
+	members_limits_stale = 0;
 
 	/*
 	 * Allocate a cluster_node for qdevice
@@ -2278,8 +2424,8 @@ static char *votequorum_exec_init_fn (struct corosync_api_v1 *api)
 
 	icmap_set_uint32("runtime.votequorum.this_node_id", us->node_id);
 
-	us->state = NODESTATE_MEMBER;
-	us->votes = 1;
+	node_state_set(us, NODESTATE_MEMBER);
+	node_votes_set(us, 1);
 	us->flags |= NODE_FLAGS_FIRST;
 
 	error = votequorum_readconfig(VOTEQUORUM_READCONFIG_STARTUP);
@@ -2362,7 +2508,7 @@ static void votequorum_sync_init (
 			left_nodes = 1;
 			node = find_node_by_nodeid(quorum_members[i]);
 			if (node) {
-				node->state = NODESTATE_DEAD;
+				node_state_set(node, NODESTATE_DEAD);
 			}
 		}
 	}
@@ -2553,18 +2699,9 @@ static void message_handler_req_lib_votequorum_getinfo (void *conn, const void *
 
 	node = find_node_by_nodeid(nodeid);
 	if (node) {
-		struct cluster_node *iternode;
-		struct qb_list_head *nodelist;
-
-		qb_list_for_each(nodelist, &cluster_members_list) {
-			iternode = qb_list_entry(nodelist, struct cluster_node, list);
-
-			if (iternode->state == NODESTATE_MEMBER) {
-				highest_expected =
-					max(highest_expected, iternode->expected_votes);
-				total_votes += iternode->votes;
-			}
-		}
+		members_limits_update();
+		highest_expected = members_highest_expected;
+		total_votes = members_total_votes;
 
 		if (node->flags & NODE_FLAGS_QDEVICE_CAST_VOTE) {
 			total_votes += qdevice->votes;
@@ -2706,13 +2843,13 @@ static void message_handler_req_lib_votequorum_setvotes (void *conn, const void
 	 * Check votes is valid
 	 */
 	saved_votes = node->votes;
-	node->votes = req_lib_votequorum_setvotes->votes;
+	node_votes_set(node, req_lib_votequorum_setvotes->votes);
 
 	newquorum = calculate_quorum(1, 0, &total_votes);
 
 	if (newquorum < total_votes / 2 ||
 	    newquorum > total_votes) {
-		node->votes = saved_votes;
+		node_votes_set(node, saved_votes);
 		error = CS_ERR_INVALID_PARAM;
 		goto error_exit;
 	}
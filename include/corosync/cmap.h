@@ -63,6 +63,11 @@ typedef uint64_t cmap_iter_handle_t;
  */
 typedef uint64_t cmap_track_handle_t;
 
+/*
+ * Handle for stats snapshot
+ */
+typedef uint64_t cmap_stats_snapshot_handle_t;
+
 /*
  * Maximum length of key in cmap
  */
@@ -135,6 +140,29 @@ typedef void (*cmap_notify_fn_t) (
 	struct cmap_notify_value old_value,
 	void *user_data);
 
+/**
+ * Prototype for function called by cmap_iter_next_batch for every returned key.
+ * value is valid only for duration of the call and it is 8 bytes aligned.
+ */
+typedef void (*cmap_iter_batch_fn_t) (
+	cmap_handle_t cmap_handle,
+	const char *key_name,
+	const void *value,
+	size_t value_len,
+	cmap_value_types_t type,
+	void *user_data);
+
+/**
+ * Prototype for function called by cmap_stats_snapshot_read for every key in snapshot.
+ * value is valid only for duration of the call and it is 8 bytes aligned.
+ */
+typedef void (*cmap_stats_snapshot_fn_t) (
+	const char *key_name,
+	const void *value,
+	size_t value_len,
+	cmap_value_types_t type,
+	void *user_data);
+
 /**
  * Create a new cmap connection
  *
@@ -330,6 +358,28 @@ extern cs_error_t cmap_iter_next(
 		size_t *value_len,
 		cmap_value_types_t *type);
 
+/**
+ * @brief Return as many next items (including values) of iterator as fits into one IPC response.
+ *
+ * Compared to cmap_iter_next + cmap_get pair, whole batch is transferred in one round trip.
+ * batch_fn is called (in iterator order) for every returned item. cmap_iter_next_batch
+ * and cmap_iter_next can be mixed on one iterator.
+ *
+ * @param handle cmap handle
+ * @param iter_handle handle of iteration returned by cmap_iter_init
+ * @param batch_fn function called for every returned item
+ * @param user_data given pointer is unchanged passed to batch_fn
+ * @param entries optional, number of returned items
+ * @return CS_ERR_NO_SECTIONS if there are no more sections to iterate, CS_ERR_TOO_BIG
+ * if next item alone doesn't fit into response (it is still returned by cmap_iter_next)
+ */
+extern cs_error_t cmap_iter_next_batch(
+		cmap_handle_t handle,
+		cmap_iter_handle_t iter_handle,
+		cmap_iter_batch_fn_t batch_fn,
+		void *user_data,
+		size_t *entries);
+
 /**
  * @brief Finalize iterator
  * @param handle
@@ -367,6 +417,42 @@ extern cs_error_t cmap_track_add(
  */
 extern cs_error_t cmap_track_delete(cmap_handle_t handle, cmap_track_handle_t track_handle);
 
+/**
+ * @brief Open stats snapshot published by corosync in shared memory.
+ *
+ * Snapshot contains all stats.* keys (as available in CMAP_MAP_STATS map) and
+ * it's refreshed by corosync every 1.5 seconds. Reading it needs no IPC and
+ * no cmap connection.
+ *
+ * @param snapshot_handle handle used for reading of snapshot
+ * @return CS_ERR_NOT_EXIST if corosync is not running (or doesn't publish snapshot)
+ */
+extern cs_error_t cmap_stats_snapshot_open(cmap_stats_snapshot_handle_t *snapshot_handle);
+
+/**
+ * @brief Read consistent copy of stats snapshot.
+ *
+ * snapshot_fn is called for every key in snapshot.
+ *
+ * @param snapshot_handle handle returned by cmap_stats_snapshot_open
+ * @param snapshot_fn function called for every key
+ * @param user_data given pointer is unchanged passed to snapshot_fn
+ * @param timestamp optional, time (in nanoseconds since epoch) when snapshot was published
+ * @return CS_ERR_LIBRARY if corosync exited (snapshot has to be reopened),
+ * CS_ERR_TRY_AGAIN if consistent copy couldn't be made
+ */
+extern cs_error_t cmap_stats_snapshot_read(
+	cmap_stats_snapshot_handle_t snapshot_handle,
+	cmap_stats_snapshot_fn_t snapshot_fn,
+	void *user_data,
+	uint64_t *timestamp);
+
+/**
+ * @brief Close stats snapshot
+ * @param snapshot_handle handle returned by cmap_stats_snapshot_open
+ */
+extern cs_error_t cmap_stats_snapshot_close(cmap_stats_snapshot_handle_t snapshot_handle);
+
 /** @} */
 
 #ifdef __cplusplus
@@ -37,6 +37,7 @@
 #include <config.h>
 
 #include <stdio.h>
+#include <sys/types.h>
 #ifdef HAVE_SYS_UIO_H
 #include <sys/uio.h>
 #endif
@@ -453,6 +454,8 @@ struct corosync_api_v1 {
 		qb_loop_t * handle,
 		int fd);
 
+	void (*ipc_credentials_get) (void *conn, uid_t *euid, gid_t *egid);
+
 };
 
 #define SERVICE_ID_MAKE(a,b) ( ((a)<<16) | (b) )
@@ -101,8 +101,19 @@ typedef enum {
  */
 typedef enum {
 	CPG_MODEL_V1 = 1,
+	CPG_MODEL_V2 = 2,
 } cpg_model_t;
 
+/**
+ * @brief The cpg_partial_type_t enum
+ */
+typedef enum {
+	CPG_PARTIAL_FIRST = 1,
+	CPG_PARTIAL_CONTINUED = 2,
+	CPG_PARTIAL_LAST = 3,
+	CPG_PARTIAL_ABORTED = 4,
+} cpg_partial_type_t;
+
 /**
  * @brief The cpg_address struct
  */
@@ -174,6 +185,47 @@ typedef void (*cpg_totem_confchg_fn_t) (
 	uint32_t member_list_entries,
 	const uint32_t *member_list);
 
+/**
+ * @brief The cpg_partial_deliver_fn_t callback
+ *
+ * Called for each piece of a message too large for a single dispatch.
+ * frag_offset is where frag belongs within the message of msg_len bytes.
+ * CPG_PARTIAL_ABORTED, with a NULL frag, reports that the sender left or
+ * gave up before the message was complete.
+ */
+typedef void (*cpg_partial_deliver_fn_t) (
+	cpg_handle_t handle,
+	const struct cpg_name *group_name,
+	uint32_t nodeid,
+	uint32_t pid,
+	cpg_partial_type_t type,
+	void *frag,
+	size_t frag_len,
+	size_t frag_offset,
+	size_t msg_len);
+
+/**
+ * @brief One message delivered by cpg_deliver_batch_fn_t
+ */
+struct cpg_deliver_batch_item {
+	struct cpg_name group_name;
+	uint32_t nodeid;
+	uint32_t pid;
+	void *msg;
+	size_t msg_len;
+};
+
+/**
+ * @brief The cpg_deliver_batch_fn_t callback
+ *
+ * Called with all messages available when cpg_dispatch is called, in
+ * delivery order. Messages are only valid until the callback returns.
+ */
+typedef void (*cpg_deliver_batch_fn_t) (
+	cpg_handle_t handle,
+	const struct cpg_deliver_batch_item *items,
+	size_t item_count);
+
 /**
  * @brief The cpg_callbacks_t struct
  */
@@ -202,6 +254,25 @@ typedef struct {
 	unsigned int flags;
 } cpg_model_v1_data_t;
 
+/**
+ * Messages of at least 4096 bytes are delivered (read only) from shared
+ * memory pool instead of being copied to every local process
+ */
+#define CPG_MODEL_V2_DELIVER_ZERO_COPY 0x02
+
+/**
+ * @brief The cpg_model_v2_data_t struct
+ */
+typedef struct {
+	cpg_model_t model;
+	cpg_deliver_fn_t cpg_deliver_fn;
+	cpg_confchg_fn_t cpg_confchg_fn;
+	cpg_totem_confchg_fn_t cpg_totem_confchg_fn;
+	unsigned int flags;
+	cpg_partial_deliver_fn_t cpg_partial_deliver_fn;
+	cpg_deliver_batch_fn_t cpg_deliver_batch_fn;
+} cpg_model_v2_data_t;
+
 
 /** @} */
 
@@ -330,6 +401,26 @@ cs_error_t cpg_mcast_joined (
 	const struct iovec *iovec,
 	unsigned int iov_len);
 
+/**
+ * @brief Multicast more messages to groups joined with cpg_join at once.
+ *
+ * Messages are delivered exactly as if every one of them was sent by
+ * cpg_mcast_joined, but many small messages are carried in one IPC request.
+ *
+ * @param handle
+ * @param guarantee
+ * @param msgs Array of messages, one iovec entry per message
+ * @param msg_count Number of messages in msgs
+ * @param msgs_sent Number of messages (from the beginning of msgs) sent,
+ *                  set also on error. May be NULL.
+ */
+cs_error_t cpg_mcast_joined_batch (
+	cpg_handle_t handle,
+	cpg_guarantee_t guarantee,
+	const struct iovec *msgs,
+	unsigned int msg_count,
+	unsigned int *msgs_sent);
+
 /**
  * @brief Get membership information from cpg
  * @param handle
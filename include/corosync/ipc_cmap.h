@@ -53,6 +53,7 @@ enum req_cmap_types {
 	MESSAGE_REQ_CMAP_TRACK_ADD = 7,
 	MESSAGE_REQ_CMAP_TRACK_DELETE = 8,
 	MESSAGE_REQ_CMAP_SET_CURRENT_MAP = 9,
+	MESSAGE_REQ_CMAP_ITER_NEXT_BATCH = 10,
 };
 
 /**
@@ -70,8 +71,19 @@ enum res_cmap_types {
 	MESSAGE_RES_CMAP_TRACK_DELETE = 8,
 	MESSAGE_RES_CMAP_NOTIFY_CALLBACK = 9,
 	MESSAGE_RES_CMAP_SET_CURRENT_MAP = 10,
+	MESSAGE_RES_CMAP_ITER_NEXT_BATCH = 11,
 };
 
+/*
+ * Upper bound of res_lib_cmap_iter_next_batch size accepted by server
+ */
+#define CMAP_ITER_BATCH_MAX_SIZE	(8192 * 128)
+
+/*
+ * Items in res_lib_cmap_iter_next_batch are 8 bytes aligned
+ */
+#define CMAP_ITER_BATCH_ALIGN(len)	(((len) + 7) & ~((size_t)7))
+
 enum {
 	CMAP_SETMAP_DEFAULT        = 0,
 	CMAP_SETMAP_STATS          = 1,
@@ -179,6 +191,43 @@ struct res_lib_cmap_iter_next {
 	mar_uint8_t type __attribute__((aligned(8)));
 };
 
+/**
+ * @brief The req_lib_cmap_iter_next_batch struct
+ */
+struct req_lib_cmap_iter_next_batch {
+	struct qb_ipc_request_header header __attribute__((aligned(8)));
+	mar_uint64_t iter_handle __attribute__((aligned(8)));
+	mar_size_t max_size __attribute__((aligned(8)));
+};
+
+/**
+ * @brief One key of res_lib_cmap_iter_next_batch
+ *
+ * data contains NUL terminated key name padded to 8 bytes followed
+ * by value_len bytes of value. item_size is size of whole item including
+ * padding, so next item starts item_size bytes after this one.
+ */
+struct cmap_iter_batch_item {
+	mar_uint32_t item_size __attribute__((aligned(8)));
+	mar_uint32_t key_len __attribute__((aligned(8)));
+	mar_size_t value_len __attribute__((aligned(8)));
+	mar_uint8_t type __attribute__((aligned(8)));
+	mar_uint8_t data[] __attribute__((aligned(8)));
+};
+
+#define CMAP_ITER_BATCH_ITEM_SIZE(key_len, value_len) \
+	(sizeof(struct cmap_iter_batch_item) + \
+	CMAP_ITER_BATCH_ALIGN((key_len) + 1) + CMAP_ITER_BATCH_ALIGN(value_len))
+
+/**
+ * @brief The res_lib_cmap_iter_next_batch struct
+ */
+struct res_lib_cmap_iter_next_batch {
+	struct qb_ipc_response_header header __attribute__((aligned(8)));
+	mar_uint32_t entries __attribute__((aligned(8)));
+	mar_uint8_t items[] __attribute__((aligned(8)));
+};
+
 /**
  * @brief The req_lib_cmap_iter_finalize struct
  */
@@ -259,5 +308,37 @@ struct req_lib_cmap_set_current_map {
 	mar_int32_t map __attribute__((aligned(8)));
 };
 
+/*
+ * Stats snapshot published by corosync into shared memory file
+ * (in /dev/shm or LOCALSTATEDIR/run) every stats update tick.
+ */
+#define CMAP_STATS_SHM_FILE		"corosync-stats"
+#define CMAP_STATS_SHM_MAGIC		0x434d5353
+#define CMAP_STATS_SHM_VERSION		1
+#define CMAP_STATS_SHM_MIN_SIZE		(64 * 1024)
+#define CMAP_STATS_SHM_MAX_SIZE		(16 * 1024 * 1024)
+
+/**
+ * @brief Header of stats snapshot shared memory
+ *
+ * Header is followed by data_size bytes of items in cmap_iter_batch_item
+ * format. seq is seqlock sequence number, odd while corosync is updating
+ * the snapshot, so reader has to copy data and check that seq was even
+ * and didn't change. File may grow, map_size is current size of file.
+ * closed is set when corosync exits (or when new instance starts).
+ */
+struct cmap_stats_shm_header {
+	mar_uint32_t magic __attribute__((aligned(8)));
+	mar_uint32_t version __attribute__((aligned(8)));
+	mar_uint64_t seq __attribute__((aligned(8)));
+	mar_uint32_t closed __attribute__((aligned(8)));
+	mar_uint32_t truncated __attribute__((aligned(8)));
+	mar_uint64_t map_size __attribute__((aligned(8)));
+	mar_uint64_t generation __attribute__((aligned(8)));
+	mar_uint64_t timestamp __attribute__((aligned(8)));
+	mar_uint32_t entries __attribute__((aligned(8)));
+	mar_uint64_t data_size __attribute__((aligned(8)));
+	mar_uint8_t data[] __attribute__((aligned(8)));
+};
 
 #endif /* IPC_CMAP_H_DEFINED */
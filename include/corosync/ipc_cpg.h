@@ -59,6 +59,8 @@ enum req_cpg_types {
 	MESSAGE_REQ_CPG_ZC_FREE = 10,
 	MESSAGE_REQ_CPG_ZC_EXECUTE = 11,
 	MESSAGE_REQ_CPG_PARTIAL_MCAST = 12,
+	MESSAGE_REQ_CPG_MCAST_BATCH = 13,
+	MESSAGE_REQ_CPG_ZC_DELIVER_ENABLE = 14,
 };
 
 /**
@@ -84,6 +86,9 @@ enum res_cpg_types {
 	MESSAGE_RES_CPG_ZC_EXECUTE = 16,
 	MESSAGE_RES_CPG_PARTIAL_DELIVER_CALLBACK = 17,
 	MESSAGE_RES_CPG_PARTIAL_SEND = 18,
+	MESSAGE_RES_CPG_MCAST_BATCH = 19,
+	MESSAGE_RES_CPG_ZC_DELIVER_ENABLE = 20,
+	MESSAGE_RES_CPG_ZC_DELIVER_CALLBACK = 21,
 };
 
 /**
@@ -104,6 +109,7 @@ enum lib_cpg_partial_types {
 	LIBCPG_PARTIAL_FIRST = 1,
 	LIBCPG_PARTIAL_CONTINUED = 2,
 	LIBCPG_PARTIAL_LAST = 3,
+	LIBCPG_PARTIAL_ABORTED = 4,
 };
 
 /**
@@ -296,6 +302,7 @@ struct res_lib_cpg_local_get {
  */
 struct res_lib_cpg_partial_send {
 	struct qb_ipc_response_header header __attribute__((aligned(8)));
+	mar_uint64_t offset __attribute__((aligned(8)));
 };
 
 /**
@@ -317,9 +324,47 @@ struct req_lib_cpg_partial_mcast {
 	mar_uint32_t msglen __attribute__((aligned(8)));
 	mar_uint32_t fraglen __attribute__((aligned(8)));
 	mar_uint32_t type __attribute__((aligned(8)));
+	mar_uint64_t offset __attribute__((aligned(8)));
 	mar_uint8_t message[] __attribute__((aligned(8)));
 };
 
+/**
+ * Messages in req_lib_cpg_mcast_batch are aligned to 8 bytes
+ */
+#define CPG_MCAST_BATCH_ALIGN(len)	(((len) + 7) & ~7)
+
+/**
+ * @brief One message of req_lib_cpg_mcast_batch
+ */
+struct req_lib_cpg_mcast_batch_item {
+	mar_uint32_t msglen __attribute__((aligned(8)));
+	mar_uint8_t message[] __attribute__((aligned(8)));
+};
+
+/**
+ * Size of batch item (including padding) carrying message of given length
+ */
+#define CPG_MCAST_BATCH_ITEM_SIZE(msglen) \
+	(sizeof(struct req_lib_cpg_mcast_batch_item) + CPG_MCAST_BATCH_ALIGN(msglen))
+
+/**
+ * @brief The req_lib_cpg_mcast_batch struct
+ */
+struct req_lib_cpg_mcast_batch {
+	struct qb_ipc_request_header header __attribute__((aligned(8)));
+	mar_uint32_t guarantee __attribute__((aligned(8)));
+	mar_uint32_t msg_count __attribute__((aligned(8)));
+	mar_uint8_t items[] __attribute__((aligned(8)));
+};
+
+/**
+ * @brief The res_lib_cpg_mcast_batch struct
+ */
+struct res_lib_cpg_mcast_batch {
+	struct qb_ipc_response_header header __attribute__((aligned(8)));
+	mar_uint32_t msgs_sent __attribute__((aligned(8)));
+};
+
 /**
  * @brief The res_lib_cpg_mcast struct
  */
@@ -339,6 +384,19 @@ struct res_lib_cpg_deliver_callback {
 	mar_uint8_t message[] __attribute__((aligned(8)));
 };
 
+/**
+ * Message from another node stored in zero copy delivery pool
+ */
+struct res_lib_cpg_zc_deliver_callback {
+	struct qb_ipc_response_header header __attribute__((aligned(8)));
+	mar_cpg_name_t group_name __attribute__((aligned(8)));
+	mar_uint32_t msglen __attribute__((aligned(8)));
+	mar_uint32_t nodeid __attribute__((aligned(8)));
+	mar_uint32_t pid __attribute__((aligned(8)));
+	mar_uint64_t offset __attribute__((aligned(8)));
+	mar_uint64_t seq __attribute__((aligned(8)));
+};
+
 /**
  * @brief The res_lib_cpg_partial_deliver_callback struct
  */
@@ -492,6 +550,38 @@ typedef struct {
 	uint64_t server_address __attribute__((aligned(8)));
 } mar_req_coroipcc_zc_execute_t __attribute__((aligned(8)));
 
+/**
+ * @brief The req_lib_cpg_zc_deliver_enable struct
+ *
+ * path_to_file is the control file (struct cpg_zc_deliver_control) created
+ * by the library. Pool is shared with other connections of the same owner
+ * of the control file joined to the same group.
+ */
+struct req_lib_cpg_zc_deliver_enable {
+	struct qb_ipc_request_header header __attribute__((aligned(8)));
+	char path_to_file[CPG_ZC_PATH_LEN] __attribute__((aligned(8)));
+};
+
+/**
+ * @brief The res_lib_cpg_zc_deliver_enable struct
+ */
+struct res_lib_cpg_zc_deliver_enable {
+	struct qb_ipc_response_header header __attribute__((aligned(8)));
+	char path_to_file[CPG_ZC_PATH_LEN] __attribute__((aligned(8)));
+	mar_uint64_t pool_size __attribute__((aligned(8)));
+};
+
+/**
+ * @brief Control file of zero copy delivery, written by library
+ *
+ * Server sends descriptors only after ready is set. Messages of descriptors
+ * with seq up to released_seq are no longer used by library.
+ */
+struct cpg_zc_deliver_control {
+	mar_uint64_t ready __attribute__((aligned(8)));
+	mar_uint64_t released_seq __attribute__((aligned(8)));
+};
+
 /**
  * @brief coroipcs_zc_header struct
  */
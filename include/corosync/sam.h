@@ -220,7 +220,7 @@ cs_error_t sam_data_restore (
  * @retval CS_ERR_BAD_HANDLE if you call this function before sam_init or
  *         after sam_finalize
  * @retval CS_ERR_NO_MEMORY if data is too large and malloc/realloc was not
- *         succesfull
+ *         succesfull or shared region could not be enlarged
  * @retval CS_ERR_LIBRARY if some internal error appeared (communication with parent
  *         process)
  */
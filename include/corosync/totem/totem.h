@@ -209,6 +209,8 @@ struct totem_config {
 
 	unsigned int max_messages;
 
+	unsigned int fcc_target_rotation;
+
 	const char *vsf_type;
 
 	unsigned int broadcast_use;
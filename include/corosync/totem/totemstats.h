@@ -82,6 +82,10 @@ typedef struct {
 	uint32_t mtt_rx_token;
 	uint32_t avg_token_workload;
 	uint32_t avg_backlog_calc;
+	uint64_t buffer_pool_hits;
+	uint64_t buffer_pool_misses;
+	uint32_t buffer_pool_in_use_hw;
+	uint32_t fcc_transmits_limit;
 
 	int earliest_token;
 	int latest_token;
@@ -95,6 +99,8 @@ typedef struct {
 	totemsrp_stats_t *srp;
 	uint32_t msg_reserved;
 	uint32_t msg_queue_avail;
+	uint32_t assemblies_active;
+	uint32_t assemblies_active_hw;
 } totempg_stats_t;
 
 
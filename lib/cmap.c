@@ -40,6 +40,11 @@
 #include <pthread.h>
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <limits.h>
 #include <errno.h>
 
 #include <corosync/corotypes.h>
@@ -66,10 +71,25 @@ struct cmap_track_inst {
 	cmap_track_handle_t track_handle;
 };
 
+struct cmap_stats_snapshot_inst {
+	int fd;
+	const struct cmap_stats_shm_header *shm;
+	size_t shm_size;
+	char *buf;
+	size_t buf_size;
+};
+
+/*
+ * How many times to retry copying of stats snapshot racing with corosync update
+ */
+#define CMAP_STATS_SNAPSHOT_READ_RETRIES	64
+
 static void cmap_inst_free (void *inst);
+static void cmap_stats_snapshot_inst_free (void *inst);
 
 DECLARE_HDB_DATABASE(cmap_handle_t_db, cmap_inst_free);
 DECLARE_HDB_DATABASE(cmap_track_handle_t_db,NULL);
+DECLARE_HDB_DATABASE(cmap_stats_snapshot_handle_t_db, cmap_stats_snapshot_inst_free);
 
 /*
  * Function prototypes
@@ -933,6 +953,103 @@ cs_error_t cmap_iter_next(
 	return (error);
 }
 
+cs_error_t cmap_iter_next_batch(
+		cmap_handle_t handle,
+		cmap_iter_handle_t iter_handle,
+		cmap_iter_batch_fn_t batch_fn,
+		void *user_data,
+		size_t *entries)
+{
+	cs_error_t error;
+	struct iovec iov;
+	struct cmap_inst *cmap_inst;
+	struct req_lib_cmap_iter_next_batch req_lib_cmap_iter_next_batch;
+	struct res_lib_cmap_iter_next_batch *res_lib_cmap_iter_next_batch;
+	const struct cmap_iter_batch_item *item;
+	size_t pos;
+	size_t res_size;
+	uint32_t i;
+
+	if (batch_fn == NULL) {
+		return (CS_ERR_INVALID_PARAM);
+	}
+
+	if (entries != NULL) {
+		*entries = 0;
+	}
+
+	error = hdb_error_to_cs(hdb_handle_get (&cmap_handle_t_db, handle, (void *)&cmap_inst));
+	if (error != CS_OK) {
+		return (error);
+	}
+
+	res_lib_cmap_iter_next_batch = malloc(IPC_RESPONSE_SIZE);
+	if (res_lib_cmap_iter_next_batch == NULL) {
+		(void)hdb_handle_put (&cmap_handle_t_db, handle);
+		return (CS_ERR_NO_MEMORY);
+	}
+
+	memset(&req_lib_cmap_iter_next_batch, 0, sizeof(req_lib_cmap_iter_next_batch));
+	req_lib_cmap_iter_next_batch.header.size = sizeof(req_lib_cmap_iter_next_batch);
+	req_lib_cmap_iter_next_batch.header.id = MESSAGE_REQ_CMAP_ITER_NEXT_BATCH;
+	req_lib_cmap_iter_next_batch.iter_handle = iter_handle;
+	req_lib_cmap_iter_next_batch.max_size = IPC_RESPONSE_SIZE;
+
+	iov.iov_base = (char *)&req_lib_cmap_iter_next_batch;
+	iov.iov_len = sizeof(req_lib_cmap_iter_next_batch);
+
+	error = qb_to_cs_error(qb_ipcc_sendv_recv(
+		cmap_inst->c,
+		&iov,
+		1,
+		res_lib_cmap_iter_next_batch,
+		IPC_RESPONSE_SIZE, CS_IPC_TIMEOUT_MS));
+
+	if (error == CS_OK) {
+		error = res_lib_cmap_iter_next_batch->header.error;
+	}
+
+	/*
+	 * Handle is released before calling callbacks so they can use cmap
+	 */
+	(void)hdb_handle_put (&cmap_handle_t_db, handle);
+
+	if (error != CS_OK) {
+		goto free_exit;
+	}
+
+	res_size = res_lib_cmap_iter_next_batch->header.size;
+	pos = sizeof(*res_lib_cmap_iter_next_batch);
+
+	for (i = 0; i < res_lib_cmap_iter_next_batch->entries; i++) {
+		item = (const struct cmap_iter_batch_item *)((const char *)res_lib_cmap_iter_next_batch + pos);
+
+		if (pos + sizeof(*item) > res_size ||
+		    item->key_len > CMAP_KEYNAME_MAXLEN ||
+		    item->value_len > res_size ||
+		    item->item_size < CMAP_ITER_BATCH_ITEM_SIZE(item->key_len, item->value_len) ||
+		    pos + item->item_size > res_size) {
+			error = CS_ERR_MESSAGE_ERROR;
+			goto free_exit;
+		}
+
+		batch_fn(handle, (const char *)item->data,
+		    item->data + CMAP_ITER_BATCH_ALIGN(item->key_len + 1),
+		    item->value_len, item->type, user_data);
+
+		pos += item->item_size;
+
+		if (entries != NULL) {
+			(*entries)++;
+		}
+	}
+
+free_exit:
+	free(res_lib_cmap_iter_next_batch);
+
+	return (error);
+}
+
 cs_error_t cmap_iter_finalize(
 		cmap_handle_t handle,
 		cmap_iter_handle_t iter_handle)
@@ -1115,3 +1232,261 @@ error_put:
 
 	return (error);
 }
+
+static void cmap_stats_snapshot_inst_free (void *inst)
+{
+	struct cmap_stats_snapshot_inst *snapshot_inst = (struct cmap_stats_snapshot_inst *)inst;
+
+	/*
+	 * fd is owned by instance only after successful mapping
+	 */
+	if (snapshot_inst->shm != NULL) {
+		munmap((void *)snapshot_inst->shm, snapshot_inst->shm_size);
+		close(snapshot_inst->fd);
+	}
+	free(snapshot_inst->buf);
+}
+
+static cs_error_t cmap_stats_snapshot_map(struct cmap_stats_snapshot_inst *snapshot_inst, size_t size)
+{
+	void *addr;
+
+	addr = mmap(NULL, size, PROT_READ, MAP_SHARED, snapshot_inst->fd, 0);
+	if (addr == MAP_FAILED) {
+		return (CS_ERR_LIBRARY);
+	}
+
+	if (snapshot_inst->shm != NULL) {
+		munmap((void *)snapshot_inst->shm, snapshot_inst->shm_size);
+	}
+	snapshot_inst->shm = addr;
+	snapshot_inst->shm_size = size;
+
+	return (CS_OK);
+}
+
+cs_error_t cmap_stats_snapshot_open(cmap_stats_snapshot_handle_t *snapshot_handle)
+{
+	cs_error_t error;
+	struct cmap_stats_snapshot_inst *snapshot_inst;
+	const char *dirs[] = { "/dev/shm", LOCALSTATEDIR "/run" };
+	char path[PATH_MAX];
+	struct stat st;
+	int fd;
+	int i;
+
+	if (snapshot_handle == NULL) {
+		return (CS_ERR_INVALID_PARAM);
+	}
+
+	fd = -1;
+	for (i = 0; i < sizeof(dirs) / sizeof(dirs[0]) && fd == -1; i++) {
+		snprintf(path, sizeof(path), "%s/%s", dirs[i], CMAP_STATS_SHM_FILE);
+		fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	}
+
+	if (fd == -1) {
+		return (errno == EACCES ? CS_ERR_ACCESS : CS_ERR_NOT_EXIST);
+	}
+
+	if (fstat(fd, &st) == -1 || st.st_size < sizeof(struct cmap_stats_shm_header)) {
+		close(fd);
+		return (CS_ERR_NOT_EXIST);
+	}
+
+	/*
+	 * Snapshot is published by corosync running as root. File owned by
+	 * anybody else may be planted by other user, so don't trust it.
+	 */
+	if (!S_ISREG(st.st_mode) || st.st_uid != 0) {
+		close(fd);
+		return (CS_ERR_ACCESS);
+	}
+
+	error = hdb_error_to_cs(hdb_handle_create(&cmap_stats_snapshot_handle_t_db,
+	    sizeof(*snapshot_inst), snapshot_handle));
+	if (error != CS_OK) {
+		close(fd);
+		return (error);
+	}
+
+	error = hdb_error_to_cs(hdb_handle_get(&cmap_stats_snapshot_handle_t_db,
+	    *snapshot_handle, (void *)&snapshot_inst));
+	if (error != CS_OK) {
+		close(fd);
+		(void)hdb_handle_destroy(&cmap_stats_snapshot_handle_t_db, *snapshot_handle);
+		return (error);
+	}
+
+	memset(snapshot_inst, 0, sizeof(*snapshot_inst));
+	snapshot_inst->fd = fd;
+
+	error = cmap_stats_snapshot_map(snapshot_inst, st.st_size);
+	if (error != CS_OK) {
+		close(fd);
+		goto error_put_destroy;
+	}
+
+	if (snapshot_inst->shm->magic != CMAP_STATS_SHM_MAGIC ||
+	    snapshot_inst->shm->version != CMAP_STATS_SHM_VERSION) {
+		error = CS_ERR_NOT_SUPPORTED;
+		goto error_put_destroy;
+	}
+
+	(void)hdb_handle_put(&cmap_stats_snapshot_handle_t_db, *snapshot_handle);
+
+	return (CS_OK);
+
+error_put_destroy:
+	(void)hdb_handle_destroy(&cmap_stats_snapshot_handle_t_db, *snapshot_handle);
+	(void)hdb_handle_put(&cmap_stats_snapshot_handle_t_db, *snapshot_handle);
+
+	return (error);
+}
+
+cs_error_t cmap_stats_snapshot_read(
+	cmap_stats_snapshot_handle_t snapshot_handle,
+	cmap_stats_snapshot_fn_t snapshot_fn,
+	void *user_data,
+	uint64_t *timestamp)
+{
+	cs_error_t error;
+	struct cmap_stats_snapshot_inst *snapshot_inst;
+	const struct cmap_stats_shm_header *shm;
+	const struct cmap_iter_batch_item *item;
+	uint64_t seq;
+	uint64_t map_size;
+	uint64_t data_size;
+	uint64_t shm_timestamp;
+	uint32_t entries;
+	size_t pos;
+	char *new_buf;
+	uint32_t i;
+	int retries;
+
+	if (snapshot_fn == NULL) {
+		return (CS_ERR_INVALID_PARAM);
+	}
+
+	error = hdb_error_to_cs(hdb_handle_get(&cmap_stats_snapshot_handle_t_db,
+	    snapshot_handle, (void *)&snapshot_inst));
+	if (error != CS_OK) {
+		return (error);
+	}
+
+	error = CS_ERR_TRY_AGAIN;
+	data_size = 0;
+	entries = 0;
+	shm_timestamp = 0;
+
+	for (retries = 0; retries < CMAP_STATS_SNAPSHOT_READ_RETRIES; retries++) {
+		shm = snapshot_inst->shm;
+
+		if (__atomic_load_n(&shm->closed, __ATOMIC_ACQUIRE)) {
+			error = CS_ERR_LIBRARY;
+			goto error_put;
+		}
+
+		seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			sched_yield();
+			continue ;
+		}
+
+		map_size = shm->map_size;
+		data_size = shm->data_size;
+		entries = shm->entries;
+		shm_timestamp = shm->timestamp;
+
+		if (map_size > snapshot_inst->shm_size && map_size <= CMAP_STATS_SHM_MAX_SIZE) {
+			/*
+			 * Corosync enlarged snapshot file
+			 */
+			error = cmap_stats_snapshot_map(snapshot_inst, map_size);
+			if (error != CS_OK) {
+				goto error_put;
+			}
+			error = CS_ERR_TRY_AGAIN;
+			continue ;
+		}
+
+		if (data_size > snapshot_inst->shm_size - sizeof(*shm)) {
+			/*
+			 * Torn read, seq will not match
+			 */
+			continue ;
+		}
+
+		if (data_size > snapshot_inst->buf_size) {
+			new_buf = realloc(snapshot_inst->buf, data_size);
+			if (new_buf == NULL) {
+				error = CS_ERR_NO_MEMORY;
+				goto error_put;
+			}
+			snapshot_inst->buf = new_buf;
+			snapshot_inst->buf_size = data_size;
+		}
+
+		memcpy(snapshot_inst->buf, shm->data, data_size);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) == seq) {
+			error = CS_OK;
+			break;
+		}
+	}
+
+	if (error != CS_OK) {
+		goto error_put;
+	}
+
+	/*
+	 * Items are now in private copy, so callbacks can take as long as they need
+	 */
+	pos = 0;
+	for (i = 0; i < entries; i++) {
+		item = (const struct cmap_iter_batch_item *)(snapshot_inst->buf + pos);
+
+		if (pos + sizeof(*item) > data_size ||
+		    item->key_len > CMAP_KEYNAME_MAXLEN ||
+		    item->value_len > data_size ||
+		    item->item_size < CMAP_ITER_BATCH_ITEM_SIZE(item->key_len, item->value_len) ||
+		    pos + item->item_size > data_size) {
+			error = CS_ERR_MESSAGE_ERROR;
+			goto error_put;
+		}
+
+		snapshot_fn((const char *)item->data,
+		    item->data + CMAP_ITER_BATCH_ALIGN(item->key_len + 1),
+		    item->value_len, item->type, user_data);
+
+		pos += item->item_size;
+	}
+
+	if (timestamp != NULL) {
+		*timestamp = shm_timestamp;
+	}
+
+error_put:
+	(void)hdb_handle_put(&cmap_stats_snapshot_handle_t_db, snapshot_handle);
+
+	return (error);
+}
+
+cs_error_t cmap_stats_snapshot_close(cmap_stats_snapshot_handle_t snapshot_handle)
+{
+	cs_error_t error;
+	struct cmap_stats_snapshot_inst *snapshot_inst;
+
+	error = hdb_error_to_cs(hdb_handle_get(&cmap_stats_snapshot_handle_t_db,
+	    snapshot_handle, (void *)&snapshot_inst));
+	if (error != CS_OK) {
+		return (error);
+	}
+
+	(void)hdb_handle_destroy(&cmap_stats_snapshot_handle_t_db, snapshot_handle);
+
+	(void)hdb_handle_put(&cmap_stats_snapshot_handle_t_db, snapshot_handle);
+
+	return (CS_OK);
+}
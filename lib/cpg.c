@@ -49,6 +49,7 @@
 #include <sys/mman.h>
 #include <sys/uio.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <limits.h>
 
@@ -75,6 +76,26 @@
  */
 #define MAX_RETRIES 100
 
+/*
+ * Sleep bounds in microseconds while the IPC is flow controlled
+ */
+#define CPG_PARTIAL_RETRY_SLEEP_MIN	1000
+#define CPG_PARTIAL_RETRY_SLEEP_MAX	10000
+
+/*
+ * Maximum number of large message fragments sent without waiting for reply
+ */
+#define CPG_PARTIAL_WINDOW		4
+
+/*
+ * Batched delivery (cpg_deliver_batch_fn) receives events into a buffer
+ * large enough for at least two events of maximum size and hands at most
+ * CPG_DISPATCH_BATCH_MAX messages to one callback
+ */
+#define CPG_DISPATCH_BATCH_BUF_SIZE	(2 * (IPC_DISPATCH_SIZE))
+#define CPG_DISPATCH_BATCH_MAX		1024
+#define CPG_DISPATCH_BATCH_ALIGN(len)	(((len) + 7) & ~7)
+
 /*
  * ZCB files have following umask (umask is same as used in libqb)
  */
@@ -85,8 +106,13 @@ struct cpg_assembly_data
 	struct qb_list_head list;
 	uint32_t nodeid;
 	uint32_t pid;
+	/*
+	 * NULL when the message is streamed to cpg_partial_deliver_fn,
+	 * assembly_buf_ptr is then the offset of the next fragment
+	 */
 	char *assembly_buf;
 	uint32_t assembly_buf_ptr;
+	uint32_t msglen;
 };
 
 struct cpg_inst {
@@ -96,10 +122,37 @@ struct cpg_inst {
 	union {
 		cpg_model_data_t model_data;
 		cpg_model_v1_data_t model_v1_data;
+		cpg_model_v2_data_t model_v2_data;
 	};
 	struct qb_list_head iteration_list_head;
 	uint32_t max_msg_size;
 	struct qb_list_head assembly_list_head;
+	/*
+	 * Large message interrupted by CS_ERR_TRY_AGAIN, resumed when the
+	 * application retries a message of the same length starting with
+	 * the partial_sent bytes hashed to partial_hash
+	 */
+	size_t partial_msg_len;
+	size_t partial_sent;
+	uint64_t partial_hash;
+	/*
+	 * Messages of cpg_mcast_joined_batch are gathered here (allocated
+	 * on first use, max_msg_size long)
+	 */
+	char *batch_buf;
+	/*
+	 * Received events and descriptors of messages for cpg_deliver_batch_fn
+	 */
+	char *dispatch_batch_buf;
+	struct cpg_deliver_batch_item *dispatch_batch_items;
+	/*
+	 * Zero copy delivery pool (mapped read only) and control file
+	 */
+	char *zc_pool;
+	size_t zc_pool_size;
+	struct cpg_zc_deliver_control *zc_ctrl;
+	size_t zc_ctrl_size;
+	uint64_t zc_release_seq;
 };
 static void cpg_inst_free (void *inst);
 
@@ -141,6 +194,13 @@ static void cpg_inst_free (void *inst)
 {
 	struct cpg_inst *cpg_inst = (struct cpg_inst *)inst;
 	qb_ipcc_disconnect(cpg_inst->c);
+	free(cpg_inst->batch_buf);
+	free(cpg_inst->dispatch_batch_buf);
+	free(cpg_inst->dispatch_batch_items);
+	if (cpg_inst->zc_pool != NULL) {
+		munmap(cpg_inst->zc_pool, cpg_inst->zc_pool_size);
+		munmap(cpg_inst->zc_ctrl, cpg_inst->zc_ctrl_size);
+	}
 }
 
 static void cpg_inst_finalize (struct cpg_inst *cpg_inst, hdb_handle_t handle)
@@ -191,7 +251,7 @@ cs_error_t cpg_model_initialize (
 	cs_error_t error;
 	struct cpg_inst *cpg_inst;
 
-	if (model != CPG_MODEL_V1) {
+	if (model != CPG_MODEL_V1 && model != CPG_MODEL_V2) {
 		error = CS_ERR_INVALID_PARAM;
 		goto error_no_destroy;
 	}
@@ -222,11 +282,40 @@ cs_error_t cpg_model_initialize (
 				goto error_destroy;
 			}
 			break;
+		case CPG_MODEL_V2:
+			memcpy (&cpg_inst->model_v2_data, model_data, sizeof (cpg_model_v2_data_t));
+			if ((cpg_inst->model_v2_data.flags & ~(CPG_MODEL_V1_DELIVER_INITIAL_TOTEM_CONF |
+			    CPG_MODEL_V2_DELIVER_ZERO_COPY)) != 0) {
+				error = CS_ERR_INVALID_PARAM;
+
+				goto error_destroy;
+			}
+			break;
+		}
+	}
+
+	cpg_inst->dispatch_batch_buf = NULL;
+	cpg_inst->dispatch_batch_items = NULL;
+	cpg_inst->zc_pool = NULL;
+	cpg_inst->zc_ctrl = NULL;
+	cpg_inst->zc_release_seq = 0;
+	if (model == CPG_MODEL_V2 && model_data != NULL &&
+	    cpg_inst->model_v2_data.cpg_deliver_batch_fn != NULL) {
+		cpg_inst->dispatch_batch_buf = malloc (CPG_DISPATCH_BATCH_BUF_SIZE);
+		cpg_inst->dispatch_batch_items = malloc (CPG_DISPATCH_BATCH_MAX *
+			sizeof (struct cpg_deliver_batch_item));
+		if (cpg_inst->dispatch_batch_buf == NULL || cpg_inst->dispatch_batch_items == NULL) {
+			error = CS_ERR_NO_MEMORY;
+			goto error_put_destroy;
 		}
 	}
 
 	/* Allow space for corosync internal headers */
 	cpg_inst->max_msg_size = IPC_REQUEST_SIZE - 1024;
+	cpg_inst->partial_msg_len = 0;
+	cpg_inst->partial_sent = 0;
+	cpg_inst->partial_hash = 0;
+	cpg_inst->batch_buf = NULL;
 	cpg_inst->model_data.model = model;
 	cpg_inst->context = context;
 
@@ -367,6 +456,96 @@ cs_error_t cpg_context_set (
 	return (CS_OK);
 }
 
+/*
+ * Partial messages are streamed to the application instead of being
+ * assembled when it registered a partial deliver callback
+ */
+static int cpg_partial_streamed (const struct cpg_inst *cpg_inst)
+{
+	return (cpg_inst->model_data.model == CPG_MODEL_V2 &&
+		cpg_inst->model_v2_data.cpg_partial_deliver_fn != NULL);
+}
+
+/*
+ * Tell server that messages in zero copy pool up to zc_release_seq are
+ * no longer used
+ */
+static void cpg_zc_release (struct cpg_inst *cpg_inst)
+{
+
+	if (cpg_inst->zc_release_seq != 0) {
+		__atomic_store_n (&cpg_inst->zc_ctrl->released_seq, cpg_inst->zc_release_seq,
+			__ATOMIC_RELEASE);
+		cpg_inst->zc_release_seq = 0;
+	}
+}
+
+/*
+ * Returns message in zero copy pool or NULL if descriptor is invalid
+ */
+static void *cpg_zc_msg_get (
+	const struct cpg_inst *cpg_inst,
+	const struct res_lib_cpg_zc_deliver_callback *res_cpg_zc_deliver_callback)
+{
+
+	if (cpg_inst->zc_pool == NULL ||
+	    res_cpg_zc_deliver_callback->offset > cpg_inst->zc_pool_size ||
+	    res_cpg_zc_deliver_callback->msglen > cpg_inst->zc_pool_size - res_cpg_zc_deliver_callback->offset) {
+		return (NULL);
+	}
+
+	return (cpg_inst->zc_pool + res_cpg_zc_deliver_callback->offset);
+}
+
+/*
+ * Messages are handed to cpg_deliver_batch_fn instead of cpg_deliver_fn
+ */
+static int cpg_deliver_batched (const struct cpg_inst *cpg_inst)
+{
+	return (cpg_inst->dispatch_batch_items != NULL);
+}
+
+/*
+ * Deliver gathered messages. Returns CS_ERR_BAD_HANDLE when the callback
+ * finalized the handle.
+ */
+static cs_error_t cpg_deliver_batch_flush (
+	cpg_handle_t handle,
+	struct cpg_inst *cpg_inst,
+	unsigned int *batch_count,
+	size_t *batch_used)
+{
+	unsigned int count = *batch_count;
+
+	*batch_count = 0;
+	*batch_used = 0;
+
+	cpg_inst->model_v2_data.cpg_deliver_batch_fn (handle,
+		cpg_inst->dispatch_batch_items, count);
+
+	cpg_zc_release (cpg_inst);
+
+	if (cpg_inst->finalize) {
+		return (CS_ERR_BAD_HANDLE);
+	}
+
+	return (CS_OK);
+}
+
+static cpg_partial_type_t cpg_partial_type_get (uint32_t type)
+{
+	switch (type) {
+	case LIBCPG_PARTIAL_FIRST:
+		return (CPG_PARTIAL_FIRST);
+	case LIBCPG_PARTIAL_LAST:
+		return (CPG_PARTIAL_LAST);
+	case LIBCPG_PARTIAL_ABORTED:
+		return (CPG_PARTIAL_ABORTED);
+	default:
+		return (CPG_PARTIAL_CONTINUED);
+	}
+}
+
 cs_error_t cpg_dispatch (
 	cpg_handle_t handle,
 	cs_dispatch_flags_t dispatch_types)
@@ -377,6 +556,8 @@ cs_error_t cpg_dispatch (
 	struct cpg_inst *cpg_inst;
 	struct res_lib_cpg_confchg_callback *res_cpg_confchg_callback;
 	struct res_lib_cpg_deliver_callback *res_cpg_deliver_callback;
+	struct res_lib_cpg_zc_deliver_callback *res_cpg_zc_deliver_callback;
+	void *msg;
 	struct res_lib_cpg_partial_deliver_callback *res_cpg_partial_deliver_callback;
 	struct res_lib_cpg_totem_confchg_callback *res_cpg_totem_confchg_callback;
 	struct cpg_inst cpg_inst_copy;
@@ -394,6 +575,12 @@ cs_error_t cpg_dispatch (
 	uint32_t totem_member_list[CPG_MEMBERS_MAX];
 	int32_t errno_res;
 	char dispatch_buf[IPC_DISPATCH_SIZE];
+	char *recv_buf;
+	size_t recv_size;
+	int batched;
+	unsigned int batch_count = 0;
+	size_t batch_used = 0;
+	struct cpg_deliver_batch_item *batch_item;
 
 	error = hdb_error_to_cs (hdb_handle_get (&cpg_handle_t_db, handle, (void *)&cpg_inst));
 	if (error != CS_OK) {
@@ -408,14 +595,45 @@ cs_error_t cpg_dispatch (
 		timeout = 0;
 	}
 
-	dispatch_data = (struct qb_ipc_response_header *)dispatch_buf;
+	batched = cpg_deliver_batched (cpg_inst);
+
 	do {
+		/*
+		 * With batched delivery, events are received one after another
+		 * into the batch buffer, without waiting once some message is
+		 * gathered
+		 */
+		if (batched) {
+			recv_buf = cpg_inst->dispatch_batch_buf + batch_used;
+			recv_size = CPG_DISPATCH_BATCH_BUF_SIZE - batch_used;
+		} else {
+			recv_buf = dispatch_buf;
+			recv_size = IPC_DISPATCH_SIZE;
+		}
+		dispatch_data = (struct qb_ipc_response_header *)recv_buf;
+
 		errno_res = qb_ipcc_event_recv (
 			cpg_inst->c,
-			dispatch_buf,
-			IPC_DISPATCH_SIZE,
-			timeout);
+			recv_buf,
+			recv_size,
+			(batch_count > 0 ? 0 : timeout));
 		error = qb_to_cs_error (errno_res);
+		if (error != CS_OK && batch_count > 0) {
+			/*
+			 * No more events right now, deliver what is gathered
+			 */
+			if (cpg_deliver_batch_flush (handle, cpg_inst, &batch_count, &batch_used) != CS_OK) {
+				error = CS_ERR_BAD_HANDLE;
+				goto error_put;
+			}
+			if (error == CS_ERR_TRY_AGAIN) {
+				error = CS_OK;
+				if (dispatch_types == CS_DISPATCH_BLOCKING) {
+					continue;
+				}
+				break;
+			}
+		}
 		if (error == CS_ERR_BAD_HANDLE) {
 			error = CS_OK;
 			goto error_put;
@@ -438,6 +656,65 @@ cs_error_t cpg_dispatch (
 			goto error_put;
 		}
 
+		if (batched && (dispatch_data->id == MESSAGE_RES_CPG_DELIVER_CALLBACK ||
+		    dispatch_data->id == MESSAGE_RES_CPG_ZC_DELIVER_CALLBACK)) {
+			batch_item = &cpg_inst->dispatch_batch_items[batch_count];
+
+			if (dispatch_data->id == MESSAGE_RES_CPG_DELIVER_CALLBACK) {
+				res_cpg_deliver_callback = (struct res_lib_cpg_deliver_callback *)dispatch_data;
+
+				marshall_from_mar_cpg_name_t (
+					&batch_item->group_name,
+					&res_cpg_deliver_callback->group_name);
+				batch_item->nodeid = res_cpg_deliver_callback->nodeid;
+				batch_item->pid = res_cpg_deliver_callback->pid;
+				batch_item->msg = &res_cpg_deliver_callback->message;
+				batch_item->msg_len = res_cpg_deliver_callback->msglen;
+			} else {
+				res_cpg_zc_deliver_callback = (struct res_lib_cpg_zc_deliver_callback *)dispatch_data;
+
+				batch_item->msg = cpg_zc_msg_get (cpg_inst, res_cpg_zc_deliver_callback);
+				if (batch_item->msg == NULL) {
+					error = CS_ERR_LIBRARY;
+					goto error_put;
+				}
+				marshall_from_mar_cpg_name_t (
+					&batch_item->group_name,
+					&res_cpg_zc_deliver_callback->group_name);
+				batch_item->nodeid = res_cpg_zc_deliver_callback->nodeid;
+				batch_item->pid = res_cpg_zc_deliver_callback->pid;
+				batch_item->msg_len = res_cpg_zc_deliver_callback->msglen;
+				cpg_inst->zc_release_seq = res_cpg_zc_deliver_callback->seq;
+			}
+			batch_count++;
+			batch_used += CPG_DISPATCH_BATCH_ALIGN(errno_res);
+
+			if (batch_count < CPG_DISPATCH_BATCH_MAX &&
+			    CPG_DISPATCH_BATCH_BUF_SIZE - batch_used >= IPC_DISPATCH_SIZE) {
+				continue;
+			}
+
+			error = cpg_deliver_batch_flush (handle, cpg_inst, &batch_count, &batch_used);
+			if (error != CS_OK) {
+				goto error_put;
+			}
+
+			if (dispatch_types == CS_DISPATCH_ONE || dispatch_types == CS_DISPATCH_ONE_NONBLOCKING) {
+				cont = 0;
+			}
+			continue;
+		}
+
+		if (batch_count > 0) {
+			/*
+			 * Other events are dispatched in order after gathered messages
+			 */
+			error = cpg_deliver_batch_flush (handle, cpg_inst, &batch_count, &batch_used);
+			if (error != CS_OK) {
+				goto error_put;
+			}
+		}
+
 		/*
 		 * Make copy of callbacks, message data, unlock instance, and call callback
 		 * A risk of this dispatch method is that the callback routines may
@@ -446,8 +723,10 @@ cs_error_t cpg_dispatch (
 		memcpy (&cpg_inst_copy, cpg_inst, sizeof (struct cpg_inst));
 		switch (cpg_inst_copy.model_data.model) {
 		case CPG_MODEL_V1:
+		case CPG_MODEL_V2:
 			/*
-			 * Dispatch incoming message
+			 * Dispatch incoming message.  Model V2 data starts with
+			 * the model V1 fields, so they are shared by both.
 			 */
 			switch (dispatch_data->id) {
 			case MESSAGE_RES_CPG_DELIVER_CALLBACK:
@@ -469,6 +748,32 @@ cs_error_t cpg_dispatch (
 					res_cpg_deliver_callback->msglen);
 				break;
 
+			case MESSAGE_RES_CPG_ZC_DELIVER_CALLBACK:
+				res_cpg_zc_deliver_callback = (struct res_lib_cpg_zc_deliver_callback *)dispatch_data;
+
+				msg = cpg_zc_msg_get (cpg_inst, res_cpg_zc_deliver_callback);
+				if (msg == NULL) {
+					error = CS_ERR_LIBRARY;
+					goto error_put;
+				}
+
+				if (cpg_inst_copy.model_v1_data.cpg_deliver_fn != NULL) {
+					marshall_from_mar_cpg_name_t (
+						&group_name,
+						&res_cpg_zc_deliver_callback->group_name);
+
+					cpg_inst_copy.model_v1_data.cpg_deliver_fn (handle,
+						&group_name,
+						res_cpg_zc_deliver_callback->nodeid,
+						res_cpg_zc_deliver_callback->pid,
+						msg,
+						res_cpg_zc_deliver_callback->msglen);
+				}
+
+				cpg_inst->zc_release_seq = res_cpg_zc_deliver_callback->seq;
+				cpg_zc_release (cpg_inst);
+				break;
+
 			case MESSAGE_RES_CPG_PARTIAL_DELIVER_CALLBACK:
 				res_cpg_partial_deliver_callback = (struct res_lib_cpg_partial_deliver_callback *)dispatch_data;
 
@@ -488,6 +793,29 @@ cs_error_t cpg_dispatch (
 					}
 				}
 
+				if (res_cpg_partial_deliver_callback->type == LIBCPG_PARTIAL_ABORTED) {
+					/*
+					 * Sender gave up on the message, drop what was assembled
+					 */
+					if (assembly_data) {
+						if (assembly_data->assembly_buf == NULL) {
+							cpg_inst_copy.model_v2_data.cpg_partial_deliver_fn (handle,
+								&group_name,
+								assembly_data->nodeid,
+								assembly_data->pid,
+								CPG_PARTIAL_ABORTED,
+								NULL,
+								0,
+								assembly_data->assembly_buf_ptr,
+								assembly_data->msglen);
+						}
+						qb_list_del (&assembly_data->list);
+						free(assembly_data->assembly_buf);
+						free(assembly_data);
+					}
+					break;
+				}
+
 				if (res_cpg_partial_deliver_callback->type == LIBCPG_PARTIAL_FIRST) {
 
 					/*
@@ -506,29 +834,68 @@ cs_error_t cpg_dispatch (
 
 					assembly_data->nodeid = res_cpg_partial_deliver_callback->nodeid;
 					assembly_data->pid = res_cpg_partial_deliver_callback->pid;
-					assembly_data->assembly_buf = malloc(res_cpg_partial_deliver_callback->msglen);
-					if (!assembly_data->assembly_buf) {
-						free(assembly_data);
-						error = CS_ERR_NO_MEMORY;
-						goto error_put;
+					assembly_data->msglen = res_cpg_partial_deliver_callback->msglen;
+					assembly_data->assembly_buf = NULL;
+					if (!cpg_partial_streamed (&cpg_inst_copy)) {
+						assembly_data->assembly_buf = malloc(res_cpg_partial_deliver_callback->msglen);
+						if (!assembly_data->assembly_buf) {
+							free(assembly_data);
+							error = CS_ERR_NO_MEMORY;
+							goto error_put;
+						}
 					}
 					assembly_data->assembly_buf_ptr = 0;
 					qb_list_init (&assembly_data->list);
 
 					qb_list_add (&assembly_data->list, &cpg_inst->assembly_list_head);
 				}
+				if (assembly_data && assembly_data->assembly_buf == NULL) {
+					/*
+					 * Hand the fragment straight to the application
+					 */
+					cpg_inst_copy.model_v2_data.cpg_partial_deliver_fn (handle,
+						&group_name,
+						res_cpg_partial_deliver_callback->nodeid,
+						res_cpg_partial_deliver_callback->pid,
+						cpg_partial_type_get (res_cpg_partial_deliver_callback->type),
+						res_cpg_partial_deliver_callback->message,
+						res_cpg_partial_deliver_callback->fraglen,
+						assembly_data->assembly_buf_ptr,
+						res_cpg_partial_deliver_callback->msglen);
+					assembly_data->assembly_buf_ptr += res_cpg_partial_deliver_callback->fraglen;
+
+					if (res_cpg_partial_deliver_callback->type == LIBCPG_PARTIAL_LAST) {
+						qb_list_del (&assembly_data->list);
+						free(assembly_data);
+					}
+				} else
 				if (assembly_data) {
 					memcpy(assembly_data->assembly_buf + assembly_data->assembly_buf_ptr,
 						res_cpg_partial_deliver_callback->message, res_cpg_partial_deliver_callback->fraglen);
 					assembly_data->assembly_buf_ptr += res_cpg_partial_deliver_callback->fraglen;
 
 					if (res_cpg_partial_deliver_callback->type == LIBCPG_PARTIAL_LAST) {
-						cpg_inst_copy.model_v1_data.cpg_deliver_fn (handle,
-							&group_name,
-							res_cpg_partial_deliver_callback->nodeid,
-							res_cpg_partial_deliver_callback->pid,
-							assembly_data->assembly_buf,
-							res_cpg_partial_deliver_callback->msglen);
+						if (batched) {
+							/*
+							 * Assembled message is delivered as batch of one
+							 */
+							batch_item = &cpg_inst->dispatch_batch_items[0];
+							memcpy (&batch_item->group_name, &group_name, sizeof (group_name));
+							batch_item->nodeid = res_cpg_partial_deliver_callback->nodeid;
+							batch_item->pid = res_cpg_partial_deliver_callback->pid;
+							batch_item->msg = assembly_data->assembly_buf;
+							batch_item->msg_len = res_cpg_partial_deliver_callback->msglen;
+
+							cpg_inst_copy.model_v2_data.cpg_deliver_batch_fn (handle,
+								batch_item, 1);
+						} else {
+							cpg_inst_copy.model_v1_data.cpg_deliver_fn (handle,
+								&group_name,
+								res_cpg_partial_deliver_callback->nodeid,
+								res_cpg_partial_deliver_callback->pid,
+								assembly_data->assembly_buf,
+								res_cpg_partial_deliver_callback->msglen);
+						}
 
 						qb_list_del (&assembly_data->list);
 						free(assembly_data->assembly_buf);
@@ -583,6 +950,17 @@ cs_error_t cpg_dispatch (
 						if (current_assembly_data->nodeid != left_list[i].nodeid || current_assembly_data->pid != left_list[i].pid)
 							continue;
 
+						if (current_assembly_data->assembly_buf == NULL) {
+							cpg_inst_copy.model_v2_data.cpg_partial_deliver_fn (handle,
+								&group_name,
+								current_assembly_data->nodeid,
+								current_assembly_data->pid,
+								CPG_PARTIAL_ABORTED,
+								NULL,
+								0,
+								current_assembly_data->assembly_buf_ptr,
+								current_assembly_data->msglen);
+						}
 						qb_list_del (&current_assembly_data->list);
 						free(current_assembly_data->assembly_buf);
 						free(current_assembly_data);
@@ -612,7 +990,7 @@ cs_error_t cpg_dispatch (
 				goto error_put;
 				break;
 			} /* - switch (dispatch_data->id) */
-			break; /* case CPG_MODEL_V1 */
+			break; /* case CPG_MODEL_V1, CPG_MODEL_V2 */
 		} /* - switch (cpg_inst_copy.model_data.model) */
 
 		if (cpg_inst_copy.finalize || cpg_inst->finalize) {
@@ -637,6 +1015,8 @@ error_put:
 	return (error);
 }
 
+static cs_error_t cpg_zc_deliver_enable (struct cpg_inst *cpg_inst);
+
 cs_error_t cpg_join (
     cpg_handle_t handle,
     const struct cpg_name *group)
@@ -664,6 +1044,7 @@ cs_error_t cpg_join (
 
 	switch (cpg_inst->model_data.model) {
 	case CPG_MODEL_V1:
+	case CPG_MODEL_V2:
 		req_lib_cpg_join.flags = cpg_inst->model_v1_data.flags;
 		break;
 	}
@@ -685,6 +1066,16 @@ cs_error_t cpg_join (
 
 	error = response.header.error;
 
+	if (error == CS_OK && cpg_inst->model_data.model == CPG_MODEL_V2 &&
+	    (cpg_inst->model_v2_data.flags & CPG_MODEL_V2_DELIVER_ZERO_COPY) &&
+	    cpg_inst->zc_pool == NULL) {
+		/*
+		 * Messages are delivered the usual way if zero copy delivery
+		 * can't be enabled
+		 */
+		(void)cpg_zc_deliver_enable (cpg_inst);
+	}
+
 error_exit:
 	hdb_handle_put (&cpg_handle_t_db, handle);
 
@@ -937,6 +1328,96 @@ error_close_unlink:
 	return -1;
 }
 
+/*
+ * Map server's shared pool of large messages. Control page is used to
+ * tell server which messages were already delivered.
+ */
+static cs_error_t cpg_zc_deliver_enable (struct cpg_inst *cpg_inst)
+{
+	char path[PATH_MAX];
+	struct req_lib_cpg_zc_deliver_enable req_lib_cpg_zc_deliver_enable;
+	struct res_lib_cpg_zc_deliver_enable res_lib_cpg_zc_deliver_enable;
+	struct cpg_zc_deliver_control *ctrl;
+	struct iovec iovec;
+	void *ctrl_buf = NULL;
+	void *pool;
+	size_t ctrl_size;
+	long int sysconf_page_size;
+	cs_error_t error;
+	int fd;
+
+	sysconf_page_size = sysconf(_SC_PAGESIZE);
+	if (sysconf_page_size <= 0) {
+		return (CS_ERR_LIBRARY);
+	}
+	ctrl_size = sysconf_page_size;
+
+	if (memory_map (path, "corosync_zcdeliver_ctrl-XXXXXX", &ctrl_buf, ctrl_size) == -1) {
+		return (CS_ERR_NO_RESOURCES);
+	}
+
+	if (strlen(path) >= CPG_ZC_PATH_LEN) {
+		unlink(path);
+		munmap (ctrl_buf, ctrl_size);
+		return (CS_ERR_NAME_TOO_LONG);
+	}
+
+	memset (&req_lib_cpg_zc_deliver_enable, 0, sizeof (req_lib_cpg_zc_deliver_enable));
+	req_lib_cpg_zc_deliver_enable.header.size = sizeof (req_lib_cpg_zc_deliver_enable);
+	req_lib_cpg_zc_deliver_enable.header.id = MESSAGE_REQ_CPG_ZC_DELIVER_ENABLE;
+	strcpy (req_lib_cpg_zc_deliver_enable.path_to_file, path);
+
+	iovec.iov_base = (void *)&req_lib_cpg_zc_deliver_enable;
+	iovec.iov_len = sizeof (req_lib_cpg_zc_deliver_enable);
+
+	error = coroipcc_msg_send_reply_receive (
+		cpg_inst->c,
+		&iovec,
+		1,
+		&res_lib_cpg_zc_deliver_enable,
+		sizeof (res_lib_cpg_zc_deliver_enable));
+
+	/*
+	 * Server keeps its own mapping of control page
+	 */
+	unlink(path);
+
+	if (error == CS_OK) {
+		error = res_lib_cpg_zc_deliver_enable.header.error;
+	}
+	if (error != CS_OK) {
+		goto error_unmap;
+	}
+
+	res_lib_cpg_zc_deliver_enable.path_to_file[CPG_ZC_PATH_LEN - 1] = '\0';
+	fd = open (res_lib_cpg_zc_deliver_enable.path_to_file, O_RDONLY | O_NOFOLLOW);
+	if (fd == -1) {
+		error = CS_ERR_LIBRARY;
+		goto error_unmap;
+	}
+	pool = mmap (NULL, res_lib_cpg_zc_deliver_enable.pool_size, PROT_READ,
+		MAP_SHARED, fd, 0);
+	close (fd);
+	if (pool == MAP_FAILED) {
+		error = CS_ERR_LIBRARY;
+		goto error_unmap;
+	}
+
+	cpg_inst->zc_pool = pool;
+	cpg_inst->zc_pool_size = res_lib_cpg_zc_deliver_enable.pool_size;
+	cpg_inst->zc_ctrl = ctrl = ctrl_buf;
+	cpg_inst->zc_ctrl_size = ctrl_size;
+	cpg_inst->zc_release_seq = 0;
+
+	__atomic_store_n (&ctrl->ready, 1, __ATOMIC_RELEASE);
+
+	return (CS_OK);
+
+error_unmap:
+	munmap (ctrl_buf, ctrl_size);
+	return (error);
+}
+
 cs_error_t cpg_zcb_alloc (
 	cpg_handle_t handle,
 	size_t size,
@@ -1062,7 +1543,10 @@ cs_error_t cpg_zcb_mcast_joined (
 		return (error);
 	}
 
-	if (msg_len > IPC_REQUEST_SIZE) {
+	/*
+	 * Messages bigger than IPC_REQUEST_SIZE are fragmented by server
+	 */
+	if ((uint64_t)msg_len > UINT32_MAX) {
 		error = CS_ERR_TOO_BIG;
 		goto error_exit;
 	}
@@ -1103,6 +1587,76 @@ error_exit:
 	return (error);
 }
 
+/*
+ * 64-bit FNV-1a hash of the first len bytes of the message, used to check
+ * that a retried message starts with the bytes already sent
+ */
+static uint64_t send_fragments_prefix_hash (
+	const struct iovec *iovec,
+	unsigned int iov_len,
+	size_t len)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	const unsigned char *data;
+	size_t data_len;
+	unsigned int i;
+
+	for (i = 0; i < iov_len && len > 0; i++) {
+		data = iovec[i].iov_base;
+		data_len = iovec[i].iov_len < len ? iovec[i].iov_len : len;
+		len -= data_len;
+		while (data_len-- > 0) {
+			hash ^= *data++;
+			hash *= 0x100000001b3ULL;
+		}
+	}
+
+	return (hash);
+}
+
+/*
+ * Receive the reply of the oldest fragment in flight. Replies come in the
+ * order of requests, so the reply must carry offset of that fragment.
+ * A bare response header is sent by the IPC layer when it rejects the
+ * request without passing it to the service.
+ */
+static cs_error_t send_fragments_reply_get (
+	struct cpg_inst *cpg_inst,
+	size_t offset,
+	cs_error_t *reply_error)
+{
+	struct res_lib_cpg_partial_send res_lib_cpg_partial_send;
+	ssize_t res;
+
+	memset (&res_lib_cpg_partial_send, 0, sizeof (res_lib_cpg_partial_send));
+	res = qb_ipcc_recv (cpg_inst->c, &res_lib_cpg_partial_send,
+		sizeof (res_lib_cpg_partial_send), CS_IPC_TIMEOUT_MS);
+	if (res < 0) {
+		return (qb_to_cs_error (res));
+	}
+
+	*reply_error = res_lib_cpg_partial_send.header.error;
+	if (res_lib_cpg_partial_send.header.size != sizeof (res_lib_cpg_partial_send)) {
+		if (*reply_error == CS_OK) {
+			*reply_error = CS_ERR_LIBRARY;
+		}
+	} else if (*reply_error == CS_OK && res_lib_cpg_partial_send.offset != offset) {
+		*reply_error = CS_ERR_LIBRARY;
+	}
+
+	return (CS_OK);
+}
+
+/*
+ * Up to CPG_PARTIAL_WINDOW fragments are sent before waiting for a reply.
+ * The server only accepts a fragment continuing the last accepted one, so
+ * once a fragment is rejected the fragments behind it are rejected too and
+ * the receivers never see a gap.  If the message can't be completed
+ * because of CS_ERR_TRY_AGAIN, the number of bytes the server accepted is
+ * kept, so a retry of a message of the same length starting with the same
+ * bytes continues where this one stopped.  Any other message starts from
+ * the beginning and the server aborts the unfinished one first.
+ */
 static cs_error_t send_fragments (
 	struct cpg_inst *cpg_inst,
 	cpg_guarantee_t guarantee,
@@ -1112,12 +1666,29 @@ static cs_error_t send_fragments (
 {
 	int i;
 	cs_error_t error = CS_OK;
+	cs_error_t reply_error;
 	struct iovec iov[2];
 	struct req_lib_cpg_partial_mcast req_lib_cpg_mcast;
-	struct res_lib_cpg_partial_send res_lib_cpg_partial_send;
-	size_t sent = 0;
-	size_t iov_sent = 0;
+	size_t frag_offset[CPG_PARTIAL_WINDOW];
+	size_t frag_len[CPG_PARTIAL_WINDOW];
+	unsigned int frag_head;
+	unsigned int frags_in_flight;
+	size_t start = 0;
+	size_t sent;
+	size_t acked;
+	size_t iov_sent;
 	int retry_count;
+	useconds_t retry_sleep;
+	ssize_t res;
+
+	if (cpg_inst->partial_msg_len == msg_len &&
+	    send_fragments_prefix_hash (iovec, iov_len, cpg_inst->partial_sent) ==
+	    cpg_inst->partial_hash) {
+		start = cpg_inst->partial_sent;
+	}
+	cpg_inst->partial_msg_len = 0;
+	cpg_inst->partial_sent = 0;
+	cpg_inst->partial_hash = 0;
 
 	req_lib_cpg_mcast.header.id = MESSAGE_REQ_CPG_PARTIAL_MCAST;
 	req_lib_cpg_mcast.guarantee = guarantee;
@@ -1126,73 +1697,138 @@ static cs_error_t send_fragments (
 	iov[0].iov_base = (void *)&req_lib_cpg_mcast;
 	iov[0].iov_len = sizeof (struct req_lib_cpg_partial_mcast);
 
-	i=0;
-	iov_sent = 0 ;
 	qb_ipcc_fc_enable_max_set(cpg_inst->c,  2);
 
-	while (error == CS_OK && sent < msg_len) {
+restart:
+	/*
+	 * Find where a resumed message continues
+	 */
+	i = 0;
+	iov_sent = start;
+	while (i < iov_len && iov_sent >= iovec[i].iov_len) {
+		iov_sent -= iovec[i].iov_len;
+		i++;
+	}
 
-		retry_count = 0;
-		if ( (iovec[i].iov_len - iov_sent) > cpg_inst->max_msg_size) {
-			iov[1].iov_len = cpg_inst->max_msg_size;
-		}
-		else {
-			iov[1].iov_len = iovec[i].iov_len - iov_sent;
-		}
+	sent = acked = start;
+	frag_head = 0;
+	frags_in_flight = 0;
+	retry_count = 0;
+	retry_sleep = CPG_PARTIAL_RETRY_SLEEP_MIN;
 
-		if (sent == 0) {
-			req_lib_cpg_mcast.type = LIBCPG_PARTIAL_FIRST;
-		}
-		else if ((sent + iov[1].iov_len) == msg_len) {
-			req_lib_cpg_mcast.type = LIBCPG_PARTIAL_LAST;
-		}
-		else {
-			req_lib_cpg_mcast.type = LIBCPG_PARTIAL_CONTINUED;
-		}
+	while (error == CS_OK && acked < msg_len) {
+		if (sent < msg_len && frags_in_flight < CPG_PARTIAL_WINDOW) {
+			if ( (iovec[i].iov_len - iov_sent) > cpg_inst->max_msg_size) {
+				iov[1].iov_len = cpg_inst->max_msg_size;
+			}
+			else {
+				iov[1].iov_len = iovec[i].iov_len - iov_sent;
+			}
 
-		req_lib_cpg_mcast.fraglen = iov[1].iov_len;
-		req_lib_cpg_mcast.header.size = sizeof (struct req_lib_cpg_partial_mcast) + iov[1].iov_len;
-		iov[1].iov_base = (char *)iovec[i].iov_base + iov_sent;
+			if (sent == 0) {
+				req_lib_cpg_mcast.type = LIBCPG_PARTIAL_FIRST;
+			}
+			else if ((sent + iov[1].iov_len) == msg_len) {
+				req_lib_cpg_mcast.type = LIBCPG_PARTIAL_LAST;
+			}
+			else {
+				req_lib_cpg_mcast.type = LIBCPG_PARTIAL_CONTINUED;
+			}
 
-	resend:
-		error = coroipcc_msg_send_reply_receive (cpg_inst->c, iov, 2,
-							 &res_lib_cpg_partial_send,
-							 sizeof (res_lib_cpg_partial_send));
+			req_lib_cpg_mcast.fraglen = iov[1].iov_len;
+			req_lib_cpg_mcast.offset = sent;
+			req_lib_cpg_mcast.header.size = sizeof (struct req_lib_cpg_partial_mcast) + iov[1].iov_len;
+			iov[1].iov_base = (char *)iovec[i].iov_base + iov_sent;
+
+			res = qb_ipcc_sendv (cpg_inst->c, iov, 2);
+			if (res >= 0) {
+				frag_offset[(frag_head + frags_in_flight) % CPG_PARTIAL_WINDOW] = sent;
+				frag_len[(frag_head + frags_in_flight) % CPG_PARTIAL_WINDOW] = iov[1].iov_len;
+				frags_in_flight++;
+				retry_count = 0;
+				retry_sleep = CPG_PARTIAL_RETRY_SLEEP_MIN;
+
+				iov_sent += iov[1].iov_len;
+				sent += iov[1].iov_len;
+
+				/* Next iovec */
+				if (iov_sent >= iovec[i].iov_len) {
+					i++;
+					iov_sent = 0;
+				}
+				continue;
+			}
 
-		if (msg_len == 40 * 1024 * 1024 && sent >= msg_len / 2)
-		{
-			// Fake CS_ERR_TRY_AGAIN happening in the middle of message sending
-			// we will use exactly 40MB message to trigger this.
-			error = CS_ERR_TRY_AGAIN;
-			goto error_exit;
-		}
+			error = qb_to_cs_error (res);
+			if (error != CS_ERR_TRY_AGAIN) {
+				break;
+			}
+			error = CS_OK;
 
-		if (error == CS_ERR_TRY_AGAIN) {
-			fprintf(stderr, "sleep. counter=%d\n", retry_count);
-			if (++retry_count > MAX_RETRIES) {
-				goto error_exit;
+			if (frags_in_flight == 0) {
+				/*
+				 * Request was not queued, back off until the
+				 * server drains the request ring
+				 */
+				if (++retry_count > MAX_RETRIES) {
+					error = CS_ERR_TRY_AGAIN;
+					break;
+				}
+				usleep (retry_sleep);
+				if (retry_sleep < CPG_PARTIAL_RETRY_SLEEP_MAX) {
+					retry_sleep *= 2;
+				}
+				continue;
 			}
-			usleep(10000);
-			goto resend;
 		}
 
-		iov_sent += iov[1].iov_len;
-		sent += iov[1].iov_len;
+		error = send_fragments_reply_get (cpg_inst, frag_offset[frag_head], &reply_error);
+		if (error != CS_OK) {
+			goto error_exit;
+		}
+		if (reply_error == CS_OK) {
+			acked += frag_len[frag_head];
+		} else {
+			error = reply_error;
+		}
+		frag_head = (frag_head + 1) % CPG_PARTIAL_WINDOW;
+		frags_in_flight--;
+	}
 
-		/* Next iovec */
-		if (iov_sent >= iovec[i].iov_len) {
-			i++;
-			iov_sent = 0;
+	/*
+	 * Fragments behind a rejected one are rejected by the server too,
+	 * only their replies have to be read
+	 */
+	while (frags_in_flight > 0) {
+		if (send_fragments_reply_get (cpg_inst, frag_offset[frag_head], &reply_error) != CS_OK) {
+			goto error_exit;
 		}
-		error = res_lib_cpg_partial_send.header.error;
+		frag_head = (frag_head + 1) % CPG_PARTIAL_WINDOW;
+		frags_in_flight--;
 	}
+
+	if (error == CS_ERR_MESSAGE_ERROR && start > 0 && acked == start) {
+		/*
+		 * Server no longer knows the interrupted message (something
+		 * else was sent in between), send it again from the beginning
+		 */
+		start = 0;
+		error = CS_OK;
+		goto restart;
+	}
+
+	if (error == CS_ERR_TRY_AGAIN && acked > 0) {
+		cpg_inst->partial_msg_len = msg_len;
+		cpg_inst->partial_sent = acked;
+		cpg_inst->partial_hash = send_fragments_prefix_hash (iovec, iov_len, acked);
+	}
+
 error_exit:
 	qb_ipcc_fc_enable_max_set(cpg_inst->c,  1);
 
 	return error;
 }
 
-
 cs_error_t cpg_mcast_joined (
 	cpg_handle_t handle,
 	cpg_guarantee_t guarantee,
@@ -1241,6 +1877,140 @@ error_exit:
 	return (error);
 }
 
+/*
+ * Send messages gathered in batch_buf as one IPC request. The number of
+ * messages accepted by the server is added to msgs_sent.
+ */
+static cs_error_t send_batch (
+	struct cpg_inst *cpg_inst,
+	cpg_guarantee_t guarantee,
+	unsigned int msg_count,
+	size_t batch_len,
+	unsigned int *msgs_sent)
+{
+	cs_error_t error;
+	struct iovec iov[2];
+	struct req_lib_cpg_mcast_batch req_lib_cpg_mcast_batch;
+	struct res_lib_cpg_mcast_batch res_lib_cpg_mcast_batch;
+
+	req_lib_cpg_mcast_batch.header.size = sizeof (struct req_lib_cpg_mcast_batch) +
+		batch_len;
+	req_lib_cpg_mcast_batch.header.id = MESSAGE_REQ_CPG_MCAST_BATCH;
+	req_lib_cpg_mcast_batch.guarantee = guarantee;
+	req_lib_cpg_mcast_batch.msg_count = msg_count;
+
+	iov[0].iov_base = (void *)&req_lib_cpg_mcast_batch;
+	iov[0].iov_len = sizeof (struct req_lib_cpg_mcast_batch);
+	iov[1].iov_base = cpg_inst->batch_buf;
+	iov[1].iov_len = batch_len;
+
+	memset (&res_lib_cpg_mcast_batch, 0, sizeof (res_lib_cpg_mcast_batch));
+
+	qb_ipcc_fc_enable_max_set(cpg_inst->c,  2);
+	error = coroipcc_msg_send_reply_receive (cpg_inst->c, iov, 2,
+		&res_lib_cpg_mcast_batch, sizeof (res_lib_cpg_mcast_batch));
+	qb_ipcc_fc_enable_max_set(cpg_inst->c,  1);
+
+	if (error != CS_OK) {
+		return (error);
+	}
+
+	/*
+	 * Request refused before reaching cpg (e.g. CS_ERR_TRY_AGAIN from
+	 * ipc) is answered by bare header, no message was sent then
+	 */
+	if (res_lib_cpg_mcast_batch.header.size == sizeof (res_lib_cpg_mcast_batch)) {
+		*msgs_sent += res_lib_cpg_mcast_batch.msgs_sent;
+	}
+
+	return (res_lib_cpg_mcast_batch.header.error);
+}
+
+cs_error_t cpg_mcast_joined_batch (
+	cpg_handle_t handle,
+	cpg_guarantee_t guarantee,
+	const struct iovec *msgs,
+	unsigned int msg_count,
+	unsigned int *msgs_sent)
+{
+	unsigned int i;
+	cs_error_t error;
+	struct cpg_inst *cpg_inst;
+	struct req_lib_cpg_mcast_batch_item *item;
+	unsigned int batch_count = 0;
+	size_t batch_len = 0;
+	size_t item_size;
+	unsigned int sent = 0;
+
+	error = hdb_error_to_cs (hdb_handle_get (&cpg_handle_t_db, handle, (void *)&cpg_inst));
+	if (error != CS_OK) {
+		return (error);
+	}
+
+	if (cpg_inst->batch_buf == NULL) {
+		cpg_inst->batch_buf = malloc (cpg_inst->max_msg_size);
+		if (cpg_inst->batch_buf == NULL) {
+			error = CS_ERR_NO_MEMORY;
+			goto error_exit;
+		}
+	}
+
+	for (i = 0; i < msg_count; i++) {
+		if (msgs[i].iov_len > cpg_inst->max_msg_size ||
+		    CPG_MCAST_BATCH_ITEM_SIZE(msgs[i].iov_len) > cpg_inst->max_msg_size) {
+			/*
+			 * Doesn't fit into batch, send whatever is gathered and
+			 * then the message itself (in fragments)
+			 */
+			if (batch_count > 0) {
+				error = send_batch (cpg_inst, guarantee, batch_count, batch_len, &sent);
+				batch_count = 0;
+				batch_len = 0;
+				if (error != CS_OK) {
+					goto error_exit;
+				}
+			}
+
+			error = cpg_mcast_joined (handle, guarantee, &msgs[i], 1);
+			if (error != CS_OK) {
+				goto error_exit;
+			}
+			sent++;
+			continue;
+		}
+
+		item_size = CPG_MCAST_BATCH_ITEM_SIZE(msgs[i].iov_len);
+		if (batch_len + item_size > cpg_inst->max_msg_size) {
+			error = send_batch (cpg_inst, guarantee, batch_count, batch_len, &sent);
+			batch_count = 0;
+			batch_len = 0;
+			if (error != CS_OK) {
+				goto error_exit;
+			}
+		}
+
+		item = (struct req_lib_cpg_mcast_batch_item *)(cpg_inst->batch_buf + batch_len);
+		memset (item, 0, item_size);
+		item->msglen = msgs[i].iov_len;
+		memcpy (item->message, msgs[i].iov_base, msgs[i].iov_len);
+		batch_len += item_size;
+		batch_count++;
+	}
+
+	if (batch_count > 0) {
+		error = send_batch (cpg_inst, guarantee, batch_count, batch_len, &sent);
+	}
+
+error_exit:
+	if (msgs_sent != NULL) {
+		*msgs_sent = sent;
+	}
+
+	hdb_handle_put (&cpg_handle_t_db, handle);
+
+	return (error);
+}
+
 cs_error_t cpg_iteration_initialize(
 	cpg_handle_t handle,
 	cpg_iteration_type_t iteration_type,
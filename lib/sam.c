@@ -45,7 +45,9 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <poll.h>
 
 #include <corosync/corotypes.h>
@@ -72,6 +74,8 @@
 #define SAM_RP_MASK_C(pol)	(pol & (~SAM_RECOVERY_POLICY_CMAP))
 #define SAM_RP_MASK(pol)	(pol & (~(SAM_RECOVERY_POLICY_QUORUM | SAM_RECOVERY_POLICY_CMAP)))
 
+#define SAM_DATA_REGION_FILE		"corosync_sam_data-XXXXXX"
+
 enum sam_internal_status_t {
 	SAM_INTERNAL_STATUS_NOT_INITIALIZED = 0,
 	SAM_INTERNAL_STATUS_INITIALIZED,
@@ -108,6 +112,21 @@ enum sam_cmap_key_t {
 	SAM_CMAP_KEY_STATE,
 };
 
+struct sam_data_region_buffer {
+	uint64_t offset;
+	uint64_t capacity;
+	uint64_t size;
+};
+
+/*
+ * Header at the beginning of shared checkpoint file
+ */
+struct sam_data_region {
+	uint32_t generation;
+	uint64_t file_size;
+	struct sam_data_region_buffer buffer[2];
+};
+
 static struct {
 	int time_interval;
 	sam_recovery_policy_t recovery_policy;
@@ -128,6 +147,11 @@ static struct {
 	size_t user_data_size;
 	size_t user_data_allocated;
 
+	int data_fd;
+	struct sam_data_region *data_region;
+	size_t data_region_size;
+	size_t data_page_size;
+
 	pthread_mutex_t lock;
 
 	quorum_handle_t quorum_handle;
@@ -272,6 +296,248 @@ static void quorum_notification_fn (
 	sam_internal_data.quorate = quorate;
 }
 
+/*
+ * Checkpoint data are kept in a file mapping shared by parent and all its
+ * children (file descriptor is inherited over fork). There are two buffers
+ * and generation selects the one with valid data. New data are written to
+ * the other buffer and generation is flipped afterwards, so child dying in
+ * the middle of store leaves previous data intact.
+ */
+static cs_error_t sam_data_region_map (size_t file_size)
+{
+	void *addr;
+
+	addr = mmap (NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+	    sam_internal_data.data_fd, 0);
+	if (addr == MAP_FAILED) {
+		return (CS_ERR_NO_MEMORY);
+	}
+#ifdef MADV_NOSYNC
+	madvise (addr, file_size, MADV_NOSYNC);
+#endif
+
+	if (sam_internal_data.data_region != NULL) {
+		munmap (sam_internal_data.data_region, sam_internal_data.data_region_size);
+	}
+
+	sam_internal_data.data_region = addr;
+	sam_internal_data.data_region_size = file_size;
+
+	return (CS_OK);
+}
+
+/*
+ * Grow backing file and write zeros into new part, so later access of
+ * mapping doesn't fail when there is no space left
+ */
+static cs_error_t sam_data_region_extend (size_t old_size, size_t new_size)
+{
+	char *buffer;
+	size_t page_size;
+	size_t pos;
+	ssize_t written;
+
+	page_size = sam_internal_data.data_page_size;
+
+	if (ftruncate (sam_internal_data.data_fd, new_size) == -1) {
+		return (CS_ERR_NO_MEMORY);
+	}
+
+	buffer = malloc (page_size);
+	if (buffer == NULL) {
+		return (CS_ERR_NO_MEMORY);
+	}
+	memset (buffer, 0, page_size);
+
+	for (pos = old_size; pos < new_size; pos += page_size) {
+retry_write:
+		written = pwrite (sam_internal_data.data_fd, buffer, page_size, pos);
+		if (written == -1 && errno == EINTR) {
+			goto retry_write;
+		}
+		if (written != page_size) {
+			free (buffer);
+			return (CS_ERR_NO_MEMORY);
+		}
+	}
+	free (buffer);
+
+	return (CS_OK);
+}
+
+static cs_error_t sam_data_region_create (void)
+{
+	char path[PATH_MAX];
+	long int sysconf_page_size;
+	cs_error_t err;
+	int fd;
+
+	sysconf_page_size = sysconf (_SC_PAGESIZE);
+	if (sysconf_page_size <= 0) {
+		return (CS_ERR_LIBRARY);
+	}
+	sam_internal_data.data_page_size = sysconf_page_size;
+
+	/*
+	 * mkstemp creates the file readable and writable only by owner
+	 */
+	snprintf (path, PATH_MAX, "/dev/shm/%s", SAM_DATA_REGION_FILE);
+	fd = mkstemp (path);
+	if (fd == -1) {
+		snprintf (path, PATH_MAX, LOCALSTATEDIR "/run/%s", SAM_DATA_REGION_FILE);
+		fd = mkstemp (path);
+		if (fd == -1) {
+			return (CS_ERR_LIBRARY);
+		}
+	}
+
+	/*
+	 * Only inherited descriptor is needed
+	 */
+	unlink (path);
+
+	if (fcntl (fd, F_SETFD, FD_CLOEXEC) == -1) {
+		err = CS_ERR_LIBRARY;
+		goto error_close;
+	}
+
+	sam_internal_data.data_fd = fd;
+
+	if ((err = sam_data_region_extend (0, sam_internal_data.data_page_size)) != CS_OK) {
+		goto error_close;
+	}
+
+	if ((err = sam_data_region_map (sam_internal_data.data_page_size)) != CS_OK) {
+		goto error_close;
+	}
+
+	sam_internal_data.data_region->file_size = sam_internal_data.data_page_size;
+
+	return (CS_OK);
+
+error_close:
+	close (fd);
+	sam_internal_data.data_fd = -1;
+
+	return (err);
+}
+
+static void sam_data_region_destroy (void)
+{
+
+	if (sam_internal_data.data_region != NULL) {
+		munmap (sam_internal_data.data_region, sam_internal_data.data_region_size);
+		sam_internal_data.data_region = NULL;
+		sam_internal_data.data_region_size = 0;
+	}
+
+	if (sam_internal_data.data_fd != -1) {
+		close (sam_internal_data.data_fd);
+		sam_internal_data.data_fd = -1;
+	}
+}
+
+/*
+ * Map whole file again if other process (previous child) made it bigger
+ */
+static cs_error_t sam_data_region_sync (void)
+{
+	uint64_t file_size;
+
+	file_size = sam_internal_data.data_region->file_size;
+	if (file_size > sam_internal_data.data_region_size) {
+		return (sam_data_region_map (file_size));
+	}
+
+	return (CS_OK);
+}
+
+static cs_error_t sam_data_region_active_get (struct sam_data_region_buffer **active)
+{
+	struct sam_data_region *region;
+	uint32_t generation;
+	cs_error_t err;
+
+	if ((err = sam_data_region_sync ()) != CS_OK) {
+		return (err);
+	}
+
+	region = sam_internal_data.data_region;
+	generation = __atomic_load_n (&region->generation, __ATOMIC_ACQUIRE);
+	*active = &region->buffer[generation % 2];
+
+	return (CS_OK);
+}
+
+static cs_error_t sam_data_region_store (
+	const void *data,
+	size_t size)
+{
+	struct sam_data_region *region;
+	struct sam_data_region_buffer *active;
+	struct sam_data_region_buffer *buffer;
+	uint32_t generation;
+	uint64_t page_size;
+	uint64_t offset;
+	uint64_t capacity;
+	uint64_t file_size;
+	cs_error_t err;
+
+	if ((err = sam_data_region_sync ()) != CS_OK) {
+		return (err);
+	}
+
+	page_size = sam_internal_data.data_page_size;
+	region = sam_internal_data.data_region;
+	generation = __atomic_load_n (&region->generation, __ATOMIC_ACQUIRE);
+	active = &region->buffer[generation % 2];
+	buffer = &region->buffer[(generation + 1) % 2];
+
+	if (buffer->capacity < size) {
+		/*
+		 * Move buffer to the start of data area if it fits before
+		 * active one, otherwise after it. Old place of the buffer is
+		 * not used anymore.
+		 */
+		capacity = ((size + page_size - 1) / page_size) * page_size;
+		if (page_size + capacity <= active->offset) {
+			offset = page_size;
+		} else {
+			offset = active->offset + active->capacity;
+			if (offset < page_size) {
+				offset = page_size;
+			}
+		}
+
+		file_size = region->file_size;
+		if (offset + capacity > file_size) {
+			if ((err = sam_data_region_extend (file_size, offset + capacity)) != CS_OK) {
+				return (err);
+			}
+			file_size = offset + capacity;
+
+			if ((err = sam_data_region_map (file_size)) != CS_OK) {
+				return (err);
+			}
+			region = sam_internal_data.data_region;
+			buffer = &region->buffer[(generation + 1) % 2];
+			region->file_size = file_size;
+		}
+
+		buffer->offset = offset;
+		buffer->capacity = capacity;
+	}
+
+	if (size > 0) {
+		memcpy ((char *)region + buffer->offset, data, size);
+	}
+	buffer->size = size;
+
+	__atomic_store_n (&region->generation, generation + 1, __ATOMIC_RELEASE);
+
+	return (CS_OK);
+}
+
 cs_error_t sam_initialize (
 	int time_interval,
 	sam_recovery_policy_t recovery_policy)
@@ -327,6 +593,14 @@ cs_error_t sam_initialize (
 	sam_internal_data.user_data_size = 0;
 	sam_internal_data.user_data_allocated = 0;
 
+	/*
+	 * Without shared region, data are sent to parent through pipe
+	 */
+	sam_internal_data.data_fd = -1;
+	sam_internal_data.data_region = NULL;
+	sam_internal_data.data_region_size = 0;
+	(void)sam_data_region_create ();
+
 	pthread_mutex_init (&sam_internal_data.lock, NULL);
 
 	return (CS_OK);
@@ -430,6 +704,9 @@ static cs_error_t sam_read_reply (
 
 cs_error_t sam_data_getsize (size_t *size)
 {
+	struct sam_data_region_buffer *active;
+	cs_error_t err;
+
 	if (size == NULL) {
 		return (CS_ERR_INVALID_PARAM);
 	}
@@ -443,7 +720,16 @@ cs_error_t sam_data_getsize (size_t *size)
 
 	pthread_mutex_lock (&sam_internal_data.lock);
 
-	*size = sam_internal_data.user_data_size;
+	if (sam_internal_data.data_fd != -1) {
+		if ((err = sam_data_region_active_get (&active)) != CS_OK) {
+			pthread_mutex_unlock (&sam_internal_data.lock);
+
+			return (err);
+		}
+		*size = active->size;
+	} else {
+		*size = sam_internal_data.user_data_size;
+	}
 
 	pthread_mutex_unlock (&sam_internal_data.lock);
 
@@ -454,6 +740,9 @@ cs_error_t sam_data_restore (
 	void *data,
 	size_t size)
 {
+	struct sam_data_region_buffer *active;
+	const void *user_data;
+	size_t user_data_size;
 	cs_error_t err;
 
 	err = CS_OK;
@@ -471,19 +760,30 @@ cs_error_t sam_data_restore (
 
 	pthread_mutex_lock (&sam_internal_data.lock);
 
-	if (sam_internal_data.user_data_size == 0) {
+	if (sam_internal_data.data_fd != -1) {
+		if ((err = sam_data_region_active_get (&active)) != CS_OK) {
+			goto error_unlock;
+		}
+		user_data = (char *)sam_internal_data.data_region + active->offset;
+		user_data_size = active->size;
+	} else {
+		user_data = sam_internal_data.user_data;
+		user_data_size = sam_internal_data.user_data_size;
+	}
+
+	if (user_data_size == 0) {
 		err = CS_OK;
 
 		goto error_unlock;
 	}
 
-	if (size < sam_internal_data.user_data_size) {
+	if (size < user_data_size) {
 		err = CS_ERR_INVALID_PARAM;
 
 		goto error_unlock;
 	}
 
-	memcpy (data, sam_internal_data.user_data, sam_internal_data.user_data_size);
+	memcpy (data, user_data, user_data_size);
 
 	pthread_mutex_unlock (&sam_internal_data.lock);
 
@@ -517,6 +817,19 @@ cs_error_t sam_data_store (
 
 	pthread_mutex_lock (&sam_internal_data.lock);
 
+	if (sam_internal_data.data_fd != -1) {
+		/*
+		 * Region is shared with parent, so there is nothing to send
+		 */
+		if ((err = sam_data_region_store (data, size)) != CS_OK) {
+			goto error_unlock;
+		}
+
+		pthread_mutex_unlock (&sam_internal_data.lock);
+
+		return (CS_OK);
+	}
+
 	if (sam_internal_data.am_i_child) {
 		/*
 		 * We are child so we must send data to parent
@@ -712,6 +1025,7 @@ cs_error_t sam_finalize (void)
 	sam_internal_data.internal_status = SAM_INTERNAL_STATUS_FINALIZED;
 
 	free (sam_internal_data.user_data);
+	sam_data_region_destroy ();
 
 exit_error:
 	return (CS_OK);
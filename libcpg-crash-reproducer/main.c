@@ -13,6 +13,14 @@ void on_message_delivered (
 	void *msg,
 	size_t msg_len)
 {
+	// Only the 80MB message (and the 40MB one if it was completed) may be
+	// delivered, an abandoned message must never be mixed into another.
+	if (msg_len == 80 * 1024 * 1024) {
+		printf("80MB message delivered\n");
+		exit(EXIT_SUCCESS);
+	}
+	if (msg_len != 40 * 1024 * 1024)
+		errx(EXIT_FAILURE, "Unexpected message of %zu bytes delivered", msg_len);
 }
 
 void on_configuration_hange (
@@ -42,21 +50,22 @@ int main(void)
 	if (cpg_join(handle, &group_name) != CS_OK)
 		errx(EXIT_FAILURE, "Failed to join group");
 
-	// Broadcast large message, libcpg modification will force CS_ERR_TRY_AGAIN to
-	// occur during this message sending, although it might happen during normal
-	// sending, just not deterministically.
-	printf("Broadcasting large message until CS_ERR_TRY_AGAIN occurs...\n");
+	// Broadcast large message once. If CS_ERR_TRY_AGAIN occurs during this
+	// message sending (it might happen during normal sending, just not
+	// deterministically), the message is abandoned.
+	printf("Broadcasting large message once...\n");
 	size_t msg_40mb_size = 40 * 1024 * 1024; // 40MB
 	struct iovec msg_40mb = {
 		.iov_base = malloc(msg_40mb_size),
 		.iov_len = msg_40mb_size
 	};
 	int mcast_status = cpg_mcast_joined(handle, CPG_TYPE_AGREED, &msg_40mb, 1);
-	if (mcast_status != CS_ERR_TRY_AGAIN)
-		errx(EXIT_FAILURE, "Expected status CS_ERR_TRY_AGAIN, but got %d\n", mcast_status);
+	if (mcast_status != CS_OK && mcast_status != CS_ERR_TRY_AGAIN)
+		errx(EXIT_FAILURE, "Expected status CS_OK or CS_ERR_TRY_AGAIN, but got %d\n", mcast_status);
+	printf("First message status %d\n", mcast_status);
 
-	// After confirming that indeed CS_ERR_TRY_AGAIN occured, send another, even
-	// larger message.
+	// Send another, even larger message. Libcpg starts it from the beginning
+	// and receivers drop the abandoned one first.
 	printf("Broadcasting one more large message...\n");
 	size_t msg_80MB_size = 80 * 1024 * 1024; // 80MB
 	struct iovec msg_80MB = {
@@ -65,8 +74,8 @@ int main(void)
 	};
 	while (cpg_mcast_joined(handle, CPG_TYPE_AGREED, &msg_80MB, 1) != CS_OK);
 
-	// Start dispatching indefinatley. During one of those dispatch calls
-	// assembly_buf will be overflowed, and valgrind will report errors.
+	// Start dispatching until the 80MB message is delivered. Valgrind must
+	// not report errors about assembly_buf.
 	printf("Start dispatching...\n");
 	while (1)
 		cpg_dispatch(handle, CS_DISPATCH_ONE);
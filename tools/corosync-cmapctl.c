@@ -373,6 +373,17 @@ static void print_key(cmap_handle_t handle,
 	printf("\n");
 }
 
+static void print_iter_batch_fn(cmap_handle_t handle,
+		const char *key_name,
+		const void *value,
+		size_t value_len,
+		cmap_value_types_t type,
+		void *user_data)
+{
+
+	print_key(handle, key_name, value_len, value, type);
+}
+
 static void print_iter(cmap_handle_t handle, const char *prefix)
 {
 	cmap_iter_handle_t iter_handle;
@@ -387,8 +398,17 @@ static void print_iter(cmap_handle_t handle, const char *prefix)
 		exit (EXIT_FAILURE);
 	}
 
-	while ((err = cmap_iter_next(handle, iter_handle, key_name, &value_len, &type)) == CS_OK) {
-		print_key(handle, key_name, value_len, NULL, type);
+	while ((err = cmap_iter_next_batch(handle, iter_handle, print_iter_batch_fn, NULL, NULL)) == CS_OK ||
+	    err == CS_ERR_TOO_BIG) {
+		if (err == CS_ERR_TOO_BIG) {
+			/*
+			 * Key doesn't fit into batch, get it one by one
+			 */
+			if (cmap_iter_next(handle, iter_handle, key_name, &value_len, &type) != CS_OK) {
+				break;
+			}
+			print_key(handle, key_name, value_len, NULL, type);
+		}
 	}
 	cmap_iter_finalize(handle, iter_handle);
 }